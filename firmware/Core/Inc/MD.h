@@ -55,6 +55,57 @@
 #define MD_TIME 		PBout(12)
 #define MD_M3 			PBout(13)
 
+#define SRAM_ADDR_BASE		0x100000	//A20 = 1 selects the SRAM window at 0x200000
+
+// 8M flash through an SSF2-style mapper: eight 512K slots, registers at
+// 0xA130F3-0xA130FF. Addresses are in words.
+#ifndef MD_ADDR_A22
+#define MD_ADDR_A22				0			//1: cart wires A22 to PA5, no banking
+#endif
+#define MD_BANK_WORDS			0x40000		//512K bytes per bank
+#define MD_BANK_WINDOW_SLOT		7
+#define MD_BANK_WINDOW			(MD_BANK_WINDOW_SLOT * MD_BANK_WORDS)	//0x380000 bytes
+#define MD_MAPPER_REG(slot)		(0x78 + (slot))	//A1-A7 of 0xA130F1 + 2*slot, slots 1-7
+#define SRAM_SETUP_NOP		2
+#define SRAM_ACCESS_NOP		6
+#define SRAM_RECOVER_NOP	2
+#define SELFTEST_HEADER		0x80		//words read by the self-test, from the "SEGA" at 0x100
+#define SELFTEST_WORDS		16
+#define SELFTEST_SLOW_NOP	120			//the slow read, four times the normal access time
+#define SELFTEST_SETTLE_NOP	500			//for the bus to follow the pull resistors
+#define SELFTEST_ADDR_LINES	21			//A1-A21, the 4M bytes reached without banking
+
+// Bus micro-program ops, operands little endian
+#define PROG_END			0x00		//stop
+#define PROG_ADDR			0x01		//a24: A = a (word address)
+#define PROG_ADD			0x02		//s16: A += s
+#define PROG_WRITE			0x03		//w16: write w at A on /CS
+#define PROG_WRITET			0x04		//b8: write b on /TIME at A1-A7 of A (mapper registers)
+#define PROG_READ			0x05		//n16: read n words from A into the buffer, A += n
+#define PROG_POLL			0x06		//mask16 value16 ms16: read A until (word & mask) == value
+#define PROG_LOOP			0x07		//n16: run up to the matching PROG_NEXT n times
+#define PROG_NEXT			0x08
+#define PROG_DELAY			0x09		//us16
+#define PROG_EMIT			0x0A		//send the buffer and empty it
+#define PROG_OPS			0x0B
+// Run status
+#define PROG_OK				0
+#define PROG_ERR_OPCODE		1
+#define PROG_ERR_TRUNCATED	2			//operands run past the end of the program
+#define PROG_ERR_BUFFER		3			//READ past the end of the buffer
+#define PROG_ERR_TIMEOUT	4			//POLL never matched
+#define PROG_ERR_LOOP		5			//zero count, nested too deep or unbalanced
+#define PROG_ERR_LOAD		6			//upload past PROG_MAX
+// Reply frames: type, status, 16-bit length or op offset
+#define PROG_FRAME_DATA		0xD0
+#define PROG_FRAME_END		0xE0
+#define PROG_FRAME_ALIVE	0xA0			//still running, value = offset of the current op
+#define PROG_ALIVE_MS		1000
+#define PROG_MAX			512
+#define PROG_LOOP_DEPTH		4
+#define PROG_NOP_PER_US		12
+#define PROG_BANK_UNKNOWN	0xFF
+
 
 void Delay_nop(uint32_t nop);
 void read_mode(void);
@@ -70,7 +121,13 @@ void setByte(uint32_t address, uint16_t dat);
 void eraseFLASH(void);
 void checkid(void);
 void checkheadermenu(void);
-uint8_t erase_sector(uint32_t sector_addr);
+void sram_begin(uint8_t writing);
+void sram_end(void);
+void sram_read(uint32_t addr, uint8_t *buf, uint32_t len);
+void sram_write(uint32_t addr, const uint8_t *buf, uint32_t len);
+void sram_fill(uint32_t addr, uint8_t value, uint32_t len);
+uint16_t cart_selftest(char *buf);
+uint8_t bus_program(const uint8_t *code, uint16_t len, uint8_t *buf, uint16_t size);
 
 		
 #endif
@@ -0,0 +1,103 @@
+#ifndef __CHIP_H
+#define __CHIP_H
+
+#include "main.h"
+#include <stdint.h>
+
+// chip feature flags
+#define CHIP_UNLOCK_BYPASS	0x01
+#define CHIP_WRITE_BUFFER	0x02
+#define CHIP_PAGE_READ		0x04
+#define CHIP_ERASE_SUSPEND	0x08
+
+#define CHIP_MAX_REGIONS	4
+#define CHIP_CMD_NOP		10
+#define CHIP_PROGRAM_TIMEOUT_MS	10		//floor for the timeouts derived from chip timings
+#define CHIP_ERASE_TIMEOUT_MS	5000
+#define CHIP_BLANK_MAX_SECTORS	256		//sectors reported by one blank check
+#define CHIP_VERIFY_RETRIES		3
+#define CHIP_RESUME_MS			2		//erase progress between a resume and the next suspend
+
+// chip_poll results
+#define CHIP_BUSY				0
+#define CHIP_READY				1
+#define CHIP_ERROR				2
+
+typedef struct
+	{
+		uint16_t count;				//sectors in this region
+		uint32_t size;				//sector size in words
+	} chip_region_t;
+
+typedef struct
+	{
+		const char *name;
+		uint8_t mfr;				//manufacturer id (word 0x00)
+		uint8_t dev[3];				//device id low bytes (words 0x01, 0x0E, 0x0F), 0 = any
+		uint8_t flags;
+		uint8_t wbuf_words;			//write buffer size, 0 if unsupported
+		uint8_t page_words;			//page size for page-mode reads
+		uint8_t read_nop;			//random access time
+		uint8_t page_nop;			//intra-page access time
+		uint16_t tprog_us;			//typical word program time
+		uint16_t tbuf_us;			//typical write buffer program time
+		uint16_t terase_ms;			//typical sector erase time
+		uint8_t nregions;
+		chip_region_t regions[CHIP_MAX_REGIONS];
+	} flash_chip_t;
+
+// Results of the last CFI query
+typedef struct
+	{
+		uint8_t valid;
+		uint16_t cmdset;			//primary command set, 0x0002 = AMD compatible
+		uint16_t tprog_us;
+		uint16_t tbuf_us;
+		uint16_t terase_ms;
+		uint32_t tchip_ms;
+		uint8_t prog_max;			//max time = typical << n
+		uint8_t buf_max;
+		uint8_t erase_max;
+		uint32_t size_bytes;
+		uint16_t wbuf_bytes;
+		uint8_t erase_suspend;		//0 none, 1 read only, 2 read/write
+		uint8_t page_words;
+		uint8_t boot;				//2 bottom, 3 top, 4/5 uniform
+		uint8_t nregions;
+		chip_region_t regions[CHIP_MAX_REGIONS];
+	} chip_cfi_t;
+
+// Outcome of the last chip_program call
+typedef struct
+	{
+		uint16_t retried;			//words that needed another program pulse
+		uint32_t fail_addr;			//first word that would not verify
+		uint16_t expect;
+		uint16_t got;
+	} chip_result_t;
+
+extern const flash_chip_t *chip;
+extern uint8_t chipid[4];
+extern chip_cfi_t cfi;
+extern chip_result_t chip_result;
+
+const flash_chip_t *chip_detect(void);
+void chip_reset(void);
+uint32_t chip_size(void);
+uint32_t chip_sector_size(uint32_t addr);
+uint8_t chip_cfi_query(void);
+uint32_t chip_program_timeout(void);
+uint32_t chip_erase_timeout(void);
+uint8_t chip_wait_ready(uint32_t addr, uint32_t timeout_ms);
+uint8_t chip_poll(uint32_t addr);
+void chip_erase_start(uint32_t addr);
+uint8_t chip_erase_sector(uint32_t addr);
+void chip_erase_suspend(uint32_t addr);
+void chip_erase_resume(uint32_t addr);
+uint16_t chip_info(char *buf);
+uint8_t chip_program(uint32_t addr, const uint8_t *data, uint32_t words);
+void chip_read(uint32_t addr, uint8_t *buf, uint32_t words);
+void chip_read_pma(uint32_t addr, volatile uint32_t *pma, uint32_t words);
+uint8_t chip_is_blank(uint32_t addr, uint32_t words);
+
+#endif
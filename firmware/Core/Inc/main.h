@@ -60,6 +60,37 @@ void Error_Handler(void);
 
 /* USER CODE BEGIN Private defines */
 void CDC_Transmit(const char* str);
+void CDC_TransmitBlock(uint8_t* buf, uint16_t len);
+void dump_words(uint32_t addr, uint32_t words);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len);
+uint8_t* stream_next(void);
+void rx_resume(uint8_t hold);
+void stream_release(void);
+void stream_end(void);
+uint8_t command_queue(const uint8_t *cmd);
+void command_run(void);
+uint8_t flash_image(uint32_t addw, uint32_t count, uint32_t *done, uint32_t *failadd, uint32_t *retried);
+
+#define STREAM_TIMEOUT_MS	3000
+#define CMDQ_DEPTH		4
+#define CMD_TAG			63	// nonzero: send a completion event with this tag
+
+// command flags
+#define CMD_BLOCK		0x01	// programs the 1K block received before it
+#define CMD_STREAM		0x02	// followed by its data, cmd[8] 1K blocks
+#define CMD_COUNT16		0x04	// stream block count is cmd[8..9]
+
+// reasons OUT packets are NAKed (rxhold bits)
+#define RX_HOLD_STREAM	0x01	// receiveBuffer holds a stream block
+#define RX_HOLD_QUEUE	0x02	// command queue is full
+#define RX_HOLD_BLOCK	0x04	// a queued command still needs receiveBuffer
+
+// 1: ROM dumps are read straight into USB packet memory, 0: through transmitBuffer
+#define DUMP_ZERO_COPY		1
+
+#define FLASH_IMAGE_OK		0
+#define FLASH_IMAGE_FAIL	1
+#define FLASH_IMAGE_TIMEOUT	2
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -4,9 +4,14 @@
 #include <string.h>
 #include "usbd_cdc_if.h"
 #include "MD.h"
+#include "chip.h"
 
 
 	char disbuff[30];
+
+	// Bank currently mapped into the last 512K slot; the mapper comes out
+	// of reset with slot n showing bank n
+	static uint8_t window_bank = MD_BANK_WINDOW_SLOT;
 	
 	
 	void Delay_nop(uint32_t nop)
@@ -24,43 +29,28 @@
 			}
 
 
+	// The data bus is all sixteen pins of GPIOE, so direction changes are
+	// done with two CR writes instead of HAL_GPIO_Init; flash status polling
+	// flips the bus for every read.
 	void read_mode(void)
 			{
-				GPIO_InitTypeDef GPIO_InitStruct;
-				HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2|GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5
-														|GPIO_PIN_6|GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9
-														|GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13
-														|GPIO_PIN_14|GPIO_PIN_15|GPIO_PIN_0|GPIO_PIN_1, GPIO_PIN_RESET);			
-				GPIO_InitStruct.Pin = GPIO_PIN_2|GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5
-														|GPIO_PIN_6|GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9
-														|GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13
-														|GPIO_PIN_14|GPIO_PIN_15|GPIO_PIN_0|GPIO_PIN_1;		
-				GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
-				GPIO_InitStruct.Pull = GPIO_PULLUP;
-				HAL_GPIO_Init(GPIOE, &GPIO_InitStruct);
+				GPIOE->CRL = 0x88888888;	//input, pull-up/down
+				GPIOE->CRH = 0x88888888;
+				GPIOE->ODR = 0xffff;		//pull-up
 			}
 			
 	void write_mode(void)
 			{
-				GPIO_InitTypeDef GPIO_InitStruct;
-				HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2|GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5
-                          |GPIO_PIN_6|GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9
-                          |GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13
-                          |GPIO_PIN_14|GPIO_PIN_15|GPIO_PIN_0|GPIO_PIN_1, GPIO_PIN_RESET);			
-				GPIO_InitStruct.Pin = GPIO_PIN_2|GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5
-                          |GPIO_PIN_6|GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9
-                          |GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13
-                          |GPIO_PIN_14|GPIO_PIN_15|GPIO_PIN_0|GPIO_PIN_1;		
-				GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-				GPIO_InitStruct.Pull = GPIO_PULLUP;
-				GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
-				HAL_GPIO_Init(GPIOE, &GPIO_InitStruct);
+				GPIOE->ODR = 0x0000;
+				GPIOE->CRL = 0x33333333;	//push-pull output, 50MHz
+				GPIOE->CRH = 0x33333333;
 			}
 			
 	void enableSram_MD(uint8_t enableSram) {
 				MD_RESET = 0;//RESET 0	
 				Delay_nop(100);
 				MD_RESET = 1;	//RESET = 1
+				window_bank = MD_BANK_WINDOW_SLOT;	//reset puts the mapper back to its power-on banks
 				MD_TIME = 1;//TIME = 1	
 				Delay_nop(100);
 				write_mode();
@@ -82,8 +72,47 @@
 				read_mode();
 			}		
 	
+	// SSF2 mapper register write: /TIME and /WR low with the register on
+	// A1-A7 (0xA130F3 + 2*slot). The data bus is saved and restored so this
+	// can run in the middle of a read or a program cycle.
+	static void map_bank(uint8_t slot, uint8_t bank)
+			{
+				uint32_t crl = GPIOE->CRL, crh = GPIOE->CRH, odr = GPIOE->ODR;
+				GPIOE->CRL = 0x33333333;
+				GPIOE->CRH = 0x33333333;
+				GPIOE->ODR = bank;
+				GPIO_WriteLow(GPIOA,0);
+				GPIO_WriteHigh(GPIOD,0);
+				GPIO_WriteLow(GPIOD,MD_MAPPER_REG(slot));
+				MD_TIME = 0;
+				MD_WR = 0;
+				Delay_nop(30);
+				MD_WR = 1;
+				MD_TIME = 1;
+				Delay_nop(30);
+				GPIOE->ODR = odr;
+				GPIOE->CRL = crl;
+				GPIOE->CRH = crh;
+			}
+
+	// Word addresses past 4M bytes are reached by banking them into the
+	// last slot, so every command that goes through setAddress covers an
+	// 8M flash without the host knowing about banks. Build with
+	// MD_ADDR_A22 for carts that wire the upper address line instead.
 		void setAddress(uint32_t addr) 
 			{
+#if !MD_ADDR_A22
+				if(addr >= MD_BANK_WINDOW)
+					{
+						uint8_t bank = addr / MD_BANK_WORDS;
+						if(bank != window_bank)
+							{
+								map_bank(MD_BANK_WINDOW_SLOT, bank);
+								window_bank = bank;
+							}
+						addr = MD_BANK_WINDOW + (addr % MD_BANK_WORDS);
+					}
+#endif
 				GPIO_WriteLow(GPIOA,(addr>>16)&0xff);
 				GPIO_WriteHigh(GPIOD,(addr>>8)&0xff);
 				GPIO_WriteLow(GPIOD,addr&0xff);
@@ -126,39 +155,6 @@
 				return data;
 			}
 			
-	uint8_t erase_sector(uint32_t sector_addr) 
-		{
-			write_mode();
-			setByte(0x555, 0xaa);
-			setByte(0x2aa, 0x55);
-			setByte(0x555, 0x80);
-			setByte(0x555, 0xaa);
-			setByte(0x2aa, 0x55);
-			setByte(sector_addr, 0x30);
-			while (1) 
-				{
-					read_mode();
-					uint8_t status1 = getByte(sector_addr);
-					uint8_t status2 = getByte(sector_addr);
-					if ((status1 & 0x40) == (status2 & 0x40)) 
-						{
-							if (status2 & 0x80) 
-								{
-									return 1; 
-								}
-						}
-					if (status2 & 0x20) 
-						{
-							setByte(0x555, 0xaa);
-							setByte(0x2aa, 0x55);
-							setByte(0x555, 0x80);
-							setByte(0x555, 0xaa);
-							setByte(0x2aa, 0x55);
-							setByte(sector_addr, 0x30);
-						}
-			}
-		}
-				
 	void eraseFLASH(void)
 			{
 				CDC_Transmit("-- MD CART ERASE --\r\n");	
@@ -228,77 +224,386 @@
 	void checkid(void)
 			{
 				CDC_Transmit("-- MD CART ID --\r\n");		
-				char chipid[2];
 				char disbuff[50];
-				uint8_t s1,s2;
 				write_mode();
 				HAL_Delay(10);
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				HAL_Delay(1);
-				setByte(0x555, 0xaa);
-				setByte(0x2aa, 0x55);
-				setByte(0x555, 0x90);			
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				read_mode();		
-				s1 = getByte(0x0);
-				s2 = getByte(0x1);
+				chip_detect();
+				sprintf(disbuff,"FLASHID:%X%X\r\n",chipid[0],chipid[1]);
+				CDC_Transmit(disbuff);
+				if(chip->mfr != 0)
+					{
+						sprintf(disbuff,"%s MD FLASH CART\r\n",chip->name);
+						CDC_Transmit(disbuff);
+					}
+				else 
+					{
+						CDC_Transmit("UNKNOWN FLASH CHIP, USING DEFAULT LAYOUT\r\n");
+					}
 				write_mode();
-				HAL_Delay(10);
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				HAL_Delay(1);
-				setByte(0x555, 0xaa);
-				setByte(0x2aa, 0x55);
-				setByte(0x555, 0xf0);	
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
+			}
+
+	// One word read with the data bus in input mode, pulled up or down by
+	// pull, as the GPIO sees it (D15 in bit 15)
+	static uint16_t read_word_pulled(uint32_t addr, uint32_t nop, uint16_t pull)
+			{
+				GPIOE->ODR = pull;
+				setAddress(addr);
+				MD_CS = 0;
+				MD_RD = 0;
+				Delay_nop(nop);
+				uint16_t data = GPIOE->IDR;
+				MD_RD = 1;
+				MD_CS = 1;
+				Delay_nop(50);
+				return data;
+			}
+
+	// Pre-flight check of the cart in a few milliseconds, answered as
+	// SELFTEST:<PASS|FAIL> MS:<n> HEADER:<SEGA|BLANK|OTHER> FLOAT:<mask>
+	// UNSTABLE:<mask> SHORT:<mask> ADDR:<mask> SIZE:<bytes> ID:<id> CHIP:<name>
+	//  FLOAT     data lines nothing drives: the header reads differently
+	//            with the pull-ups and with the pull-downs
+	//  UNSTABLE  data bits that change between normal and slow reads
+	//  SHORT     data lines that do not follow a walking one and a walking
+	//            zero through the pull resistors while the cart is deselected
+	//  ADDR      address lines (bit n = A(n+1)) that alias the header below
+	//            a line that does not, so not a mirror of a small ROM
+	//  SIZE      ROM size from where the header first mirrors, 0 if unknown
+	uint16_t cart_selftest(char *buf)
+			{
+				uint32_t start = HAL_GetTick();
+				uint16_t up[SELFTEST_WORDS], down[SELFTEST_WORDS], slow[SELFTEST_WORDS];
+				uint16_t floating = 0, unstable = 0, shorted = 0;
 				read_mode();
-				HAL_Delay(100);
+				MD_WR = 1;
+				for(uint32_t i = 0;i < SELFTEST_WORDS;i++)
+					{
+						up[i] = read_word_pulled(SELFTEST_HEADER + i, 30, 0xFFFF);
+						slow[i] = read_word_pulled(SELFTEST_HEADER + i, SELFTEST_SLOW_NOP, 0xFFFF);
+						down[i] = read_word_pulled(SELFTEST_HEADER + i, SELFTEST_SLOW_NOP, 0x0000);
+						floating |= slow[i] ^ down[i];
+						unstable |= up[i] ^ slow[i];
+					}
+
+				// Walking one and zero on the pulls alone, nothing selected
+				setAddress(0);
+				for(uint32_t b = 0;b < 16;b++)
+					{
+						uint16_t one = 1 << b;
+						GPIOE->ODR = one;
+						Delay_nop(SELFTEST_SETTLE_NOP);
+						uint16_t diff = GPIOE->IDR ^ one;
+						GPIOE->ODR = (uint16_t)~one;
+						Delay_nop(SELFTEST_SETTLE_NOP);
+						diff |= GPIOE->IDR ^ (uint16_t)~one;
+						if(diff) shorted |= diff | one;
+					}
+
+				const char *header = "OTHER";
+				uint8_t uniform = 1;
+				for(uint32_t i = 1;i < SELFTEST_WORDS;i++)
+					{
+						if(up[i] != up[0]) uniform = 0;
+					}
+				if(uniform && (up[0] == 0xFFFF)) header = "BLANK";
+				else if((up[0] == 0x5345) && (up[1] == 0x4741)) header = "SEGA";
+
+				// Flip one address line at a time under the header. A line
+				// that reads the header back aliases; one that reads only
+				// 0xFFFF is past the end of the ROM
+				uint32_t aliased = 0, responding = 0;
+				for(uint32_t n = 0;!uniform && (floating == 0) && (n < SELFTEST_ADDR_LINES);n++)
+					{
+						uint8_t same = 1, open = 1;
+						for(uint32_t i = 0;i < SELFTEST_WORDS;i++)
+							{
+								uint16_t data = read_word_pulled((SELFTEST_HEADER + i) ^ (1UL << n), 30, 0xFFFF);
+								if(data != slow[i]) same = 0;
+								if(data != 0xFFFF) open = 0;
+							}
+						if(same) aliased |= 1UL << n;
+						else if(!open) responding |= 1UL << n;
+					}
+				uint32_t bad_addr = 0, size = 0;
+				for(uint32_t n = 0;n < SELFTEST_ADDR_LINES;n++)
+					{
+						if((aliased & (1UL << n)) && (responding >> n)) bad_addr |= 1UL << n;
+					}
+				if(!uniform && (floating == 0) && (bad_addr == 0))
+					{
+						for(uint32_t n = 0;n < SELFTEST_ADDR_LINES;n++)
+							{
+								if(!(responding & (1UL << n)))
+									{
+										size = 2UL << n;
+										break;
+									}
+							}
+					}
+
+				chip_detect();
+				uint8_t pass = (floating == 0) && (unstable == 0) && (shorted == 0) && (bad_addr == 0);
+				uint16_t len = sprintf(buf,"SELFTEST:%s MS:%lu HEADER:%s FLOAT:%04X UNSTABLE:%04X SHORT:%04X ADDR:%06lX SIZE:%lu ID:%02X%02X CHIP:%s\r\n",
+							pass ? "PASS" : "FAIL",(unsigned long)(HAL_GetTick() - start),header,floating,unstable,shorted,
+							(unsigned long)bad_addr,(unsigned long)size,chipid[0],chipid[1],(chip->mfr != 0) ? chip->name : "NONE");
 				write_mode();
-				HAL_Delay(10);
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				HAL_Delay(1);
-				setByte(0x555, 0xaa);
-				setByte(0x2aa, 0x55);
-				setByte(0x555, 0x90);			
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				read_mode();		
-				s1 = getByte(0x0);
-				s2 = getByte(0x1);
-				sprintf(chipid,"%X%X",s1,s2);
-				if((s1==0xC2)&(s2==0XCB))
+				return len;
+			}
+			
+	// SRAM access engine: the SRAM enable latch is set once per transfer and
+	// only the low address byte is updated between consecutive bytes.
+	void sram_begin(uint8_t writing)
+			{
+				enableSram_MD(1);
+				MD_WR = 1;
+				MD_RD = 1;
+				MD_CS = 1;
+				if(writing == 1)
 					{
-						sprintf(disbuff,"FLASHID:%X%X\r\n",s1,s2);
-						CDC_Transmit(disbuff);
-						CDC_Transmit("MX29LV640EB MD FLASH CART\r\n");				
+						write_mode();
 					}
-				else 
+			}
+
+	void sram_end(void)
+			{
+				MD_WR = 1;
+				MD_RD = 1;
+				MD_CS = 1;
+				enableSram_MD(0);
+			}
+
+	static void sram_next_address(uint32_t addr)
+			{
+				if((addr & 0xff) == 0)
 					{
-						sprintf(disbuff,"FLASHID:%X%X\r\n",s1,s2);
-						CDC_Transmit(disbuff);
-						CDC_Transmit("NO FIND NGP CARD\r\n");
+						setAddress(addr);
+					}
+				else
+					{
+						GPIO_WriteLow(GPIOD,addr&0xff);
+					}
+			}
+
+	void sram_read(uint32_t addr, uint8_t *buf, uint32_t len)
+			{
+				addr |= SRAM_ADDR_BASE;
+				setAddress(addr);
+				for(uint32_t i = 0;i < len;i++)
+					{
+						sram_next_address(addr + i);
+						MD_CS = 0;
+						MD_RD = 0;
+						Delay_nop(SRAM_ACCESS_NOP);
+						buf[i] = (GPIOE->IDR) & 0xff;
+						MD_RD = 1;
+						MD_CS = 1;
+						Delay_nop(SRAM_RECOVER_NOP);
+					}
+			}
+
+	void sram_write(uint32_t addr, const uint8_t *buf, uint32_t len)
+			{
+				addr |= SRAM_ADDR_BASE;
+				setAddress(addr);
+				for(uint32_t i = 0;i < len;i++)
+					{
+						GPIO_WriteLow(GPIOE,buf[i]);
+						sram_next_address(addr + i);
+						Delay_nop(SRAM_SETUP_NOP);
+						MD_CS = 0;
+						MD_WR = 0;
+						Delay_nop(SRAM_ACCESS_NOP);
+						MD_WR = 1;
+						MD_CS = 1;
+						Delay_nop(SRAM_RECOVER_NOP);
 					}
+			}
+
+	void sram_fill(uint32_t addr, uint8_t value, uint32_t len)
+			{
+				addr |= SRAM_ADDR_BASE;
+				setAddress(addr);
+				GPIO_WriteLow(GPIOE,value);
+				for(uint32_t i = 0;i < len;i++)
+					{
+						sram_next_address(addr + i);
+						Delay_nop(SRAM_SETUP_NOP);
+						MD_CS = 0;
+						MD_WR = 0;
+						Delay_nop(SRAM_ACCESS_NOP);
+						MD_WR = 1;
+						MD_CS = 1;
+						Delay_nop(SRAM_RECOVER_NOP);
+					}
+			}
+
+	// Bus micro-programs. The bytecode (PROG_* in MD.h) runs against one
+	// word address, A, and a buffer that READ fills and EMIT sends, each
+	// EMIT as a PROG_FRAME_DATA header and the data, the run ending with a
+	// PROG_FRAME_END header carrying the status and the failing op's offset.
+	// Data left in the buffer at the end is not sent. A run that goes on
+	// sends a PROG_FRAME_ALIVE every PROG_ALIVE_MS, so the host can tell a
+	// long poll or loop from a flasher that stopped answering.
+	static const uint8_t prog_operands[PROG_OPS] = {0, 3, 2, 2, 1, 2, 6, 2, 0, 2, 0};
+
+	static void prog_frame(uint8_t type, uint8_t status, uint16_t value)
+			{
+				static uint8_t frame[4];
+				frame[0] = type;
+				frame[1] = status;
+				frame[2] = value & 0xFF;
+				frame[3] = value >> 8;
+				CDC_TransmitBlock(frame, 4);
+			}
+
+	uint8_t bus_program(const uint8_t *code, uint16_t len, uint8_t *buf, uint16_t size)
+			{
+				uint32_t addr = 0;
+				uint16_t fill = 0, pc = 0, at = 0;
+				uint16_t loop_pc[PROG_LOOP_DEPTH], loop_left[PROG_LOOP_DEPTH];
+				uint8_t depth = 0, status = PROG_OK;
+				uint32_t alive = HAL_GetTick();
+				read_mode();
+				MD_WR = 1;
+				MD_RD = 1;
+				MD_CS = 1;
+				while((status == PROG_OK) && (pc < len))
+					{
+						if(HAL_GetTick() - alive >= PROG_ALIVE_MS)
+							{
+								prog_frame(PROG_FRAME_ALIVE, 0, pc);
+								alive = HAL_GetTick();
+							}
+						at = pc;
+						uint8_t op = code[pc++];
+						if(op >= PROG_OPS)
+							{
+								status = PROG_ERR_OPCODE;
+								break;
+							}
+						if(pc + prog_operands[op] > len)
+							{
+								status = PROG_ERR_TRUNCATED;
+								break;
+							}
+						const uint8_t *arg = &code[pc];
+						uint16_t v = (prog_operands[op] >= 2) ? (arg[0] | (arg[1] << 8)) : arg[0];
+						pc += prog_operands[op];
+						switch(op)
+							{
+								case PROG_END:
+									pc = len;
+									break;
+								case PROG_ADDR:
+									addr = arg[0] | (arg[1] << 8) | ((uint32_t)arg[2] << 16);
+									break;
+								case PROG_ADD:
+									addr += (int16_t)v;
+									break;
+								case PROG_WRITE:
+								case PROG_WRITET:
+									write_mode();
+									GPIOE->ODR = v;
+									if(op == PROG_WRITE)
+										{
+											setAddress(addr);
+											MD_CS = 0;
+										}
+									else
+										{
+											// /TIME decodes A1-A7 only. Drive them as map_bank
+											// does, with the high lines at 0: going through
+											// setAddress would bank a register address like
+											// 0x509879 with a mapper write of its own first
+											GPIO_WriteLow(GPIOA,0);
+											GPIO_WriteHigh(GPIOD,0);
+											GPIO_WriteLow(GPIOD,addr & 0x7F);
+											MD_TIME = 0;
+										}
+									MD_WR = 0;
+									Delay_nop(30);
+									MD_WR = 1;
+									MD_CS = 1;
+									MD_TIME = 1;
+									Delay_nop(30);
+									read_mode();
+									// a mapper write may have moved the banked window
+									if(op == PROG_WRITET) window_bank = PROG_BANK_UNKNOWN;
+									break;
+								case PROG_READ:
+									if(fill + v*2 > size)
+										{
+											status = PROG_ERR_BUFFER;
+											break;
+										}
+									chip_read(addr, buf + fill, v);
+									read_mode();
+									fill += v*2;
+									addr += v;
+									break;
+								case PROG_POLL:
+									{
+										uint16_t mask = v;
+										uint16_t value = arg[2] | (arg[3] << 8);
+										uint16_t ms = arg[4] | (arg[5] << 8);
+										uint32_t start = HAL_GetTick();
+										while((read_word_pulled(addr, 30, 0xFFFF) & mask) != value)
+											{
+												if(HAL_GetTick() - start >= ms)
+													{
+														status = PROG_ERR_TIMEOUT;
+														break;
+													}
+												if(HAL_GetTick() - alive >= PROG_ALIVE_MS)
+													{
+														prog_frame(PROG_FRAME_ALIVE, 0, at);
+														alive = HAL_GetTick();
+													}
+											}
+									}
+									break;
+								case PROG_LOOP:
+									if((depth == PROG_LOOP_DEPTH) || (v == 0))
+										{
+											status = PROG_ERR_LOOP;
+											break;
+										}
+									loop_pc[depth] = pc;
+									loop_left[depth] = v;
+									depth++;
+									break;
+								case PROG_NEXT:
+									if(depth == 0)
+										{
+											status = PROG_ERR_LOOP;
+										}
+									else if(--loop_left[depth - 1] > 0)
+										{
+											pc = loop_pc[depth - 1];
+										}
+									else
+										{
+											depth--;
+										}
+									break;
+								case PROG_DELAY:
+									Delay_nop(v * PROG_NOP_PER_US);
+									break;
+								case PROG_EMIT:
+									if(fill > 0)
+										{
+											prog_frame(PROG_FRAME_DATA, 0, fill);
+											CDC_TransmitBlock(buf, fill);
+											fill = 0;
+										}
+									break;
+							}
+					}
+				if((status == PROG_OK) && (depth != 0))
+					{
+						status = PROG_ERR_LOOP;
+					}
+				prog_frame(PROG_FRAME_END, status, (status == PROG_OK) ? pc : at);
 				write_mode();
-				HAL_Delay(10);
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
-				HAL_Delay(1);
-				setByte(0x555, 0xaa);
-				setByte(0x2aa, 0x55);
-				setByte(0x555, 0xf0);				
-				MD_RD= 1;
-				MD_CS= 1;
-				MD_WR= 1;
+				return status;
 			}
-			
\ No newline at end of file
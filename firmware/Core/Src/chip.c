@@ -0,0 +1,717 @@
+#include "main.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "MD.h"
+#include "chip.h"
+
+	// Known cart flash parts. Device ids are the low bytes of the autoselect
+	// words 0x01, 0x0E and 0x0F; sector sizes are in words.
+	static const flash_chip_t chip_table[] =
+		{
+			{"MX29LV640EB", 0xC2, {0xCB, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 11, 0, 700,
+				2, {{8, 0x1000}, {127, 0x8000}}},
+			{"MX29LV640ET", 0xC2, {0xC9, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 11, 0, 700,
+				2, {{127, 0x8000}, {8, 0x1000}}},
+			{"MX29LV320EB", 0xC2, {0xA8, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 11, 0, 700,
+				2, {{8, 0x1000}, {63, 0x8000}}},
+			{"MX29LV320ET", 0xC2, {0xA7, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 11, 0, 700,
+				2, {{63, 0x8000}, {8, 0x1000}}},
+			{"MX29LV160DB", 0xC2, {0x49, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 9, 0, 700,
+				4, {{1, 0x2000}, {2, 0x1000}, {1, 0x4000}, {31, 0x8000}}},
+			{"MX29LV160DT", 0xC2, {0xC4, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 9, 0, 700,
+				4, {{31, 0x8000}, {1, 0x4000}, {2, 0x1000}, {1, 0x2000}}},
+			{"MX29GL128F", 0xC2, {0x7E, 0x21, 0x01}, CHIP_UNLOCK_BYPASS|CHIP_WRITE_BUFFER|CHIP_PAGE_READ|CHIP_ERASE_SUSPEND, 32, 8, 30, 6, 10, 90, 500,
+				1, {{128, 0x10000}}},
+			{"MX29GL256F", 0xC2, {0x7E, 0x22, 0x01}, CHIP_UNLOCK_BYPASS|CHIP_WRITE_BUFFER|CHIP_PAGE_READ|CHIP_ERASE_SUSPEND, 32, 8, 30, 6, 10, 90, 500,
+				1, {{256, 0x10000}}},
+			{"S29AL016D/AM29LV160DB", 0x01, {0x49, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 9, 0, 700,
+				4, {{1, 0x2000}, {2, 0x1000}, {1, 0x4000}, {31, 0x8000}}},
+			{"S29GL128P", 0x01, {0x7E, 0x21, 0x01}, CHIP_UNLOCK_BYPASS|CHIP_WRITE_BUFFER|CHIP_PAGE_READ|CHIP_ERASE_SUSPEND, 32, 8, 30, 6, 60, 240, 500,
+				1, {{128, 0x10000}}},
+			{"S29GL256P", 0x01, {0x7E, 0x22, 0x01}, CHIP_UNLOCK_BYPASS|CHIP_WRITE_BUFFER|CHIP_PAGE_READ|CHIP_ERASE_SUSPEND, 32, 8, 30, 6, 60, 240, 500,
+				1, {{256, 0x10000}}},
+			{"M29W160EB", 0x20, {0x49, 0x00, 0x00}, CHIP_UNLOCK_BYPASS|CHIP_ERASE_SUSPEND, 0, 0, 30, 30, 10, 0, 800,
+				4, {{1, 0x2000}, {2, 0x1000}, {1, 0x4000}, {31, 0x8000}}},
+		};
+
+	// Used until a chip has been identified, and for unknown parts: the
+	// original MX29LV640EB layout with plain 4-cycle programming.
+	static const flash_chip_t chip_default =
+		{"UNKNOWN", 0x00, {0x00, 0x00, 0x00}, 0, 0, 0, 30, 30, 11, 0, 700,
+			2, {{8, 0x1000}, {127, 0x8000}}};
+
+	// Parts missing from the table are driven from their CFI geometry
+	static flash_chip_t chip_cfi;
+	static flash_chip_t chip_active;
+
+	// Set while an erase is suspended; unlock bypass is not used then
+	static uint8_t suspended = 0;
+
+	const flash_chip_t *chip = &chip_default;
+	uint8_t chipid[4];
+	chip_cfi_t cfi;
+	chip_result_t chip_result;
+
+	static void bus_write(uint32_t addr, uint16_t data)
+			{
+				GPIOE->ODR = data;
+				setAddress(addr);
+				MD_CS = 0;
+				MD_WR = 0;
+				Delay_nop(CHIP_CMD_NOP);
+				MD_WR = 1;
+				MD_CS = 1;
+				Delay_nop(CHIP_CMD_NOP);
+			}
+
+	static uint8_t bus_read_status(uint32_t addr)
+			{
+				setAddress(addr);
+				MD_CS = 0;
+				MD_RD = 0;
+				Delay_nop(chip->read_nop);
+				uint8_t data = (GPIOE->IDR) & 0xff;
+				MD_RD = 1;
+				MD_CS = 1;
+				return data;
+			}
+
+	static void chip_unlock(void)
+			{
+				bus_write(0x555, 0xaa);
+				bus_write(0x2aa, 0x55);
+			}
+
+	void chip_reset(void)
+			{
+				write_mode();
+				MD_RD = 1;
+				MD_CS = 1;
+				MD_WR = 1;
+				bus_write(0x000, 0xf0);
+			}
+
+	static uint8_t cfi_byte(uint32_t addr)
+			{
+				return getByte(addr);
+			}
+
+	static uint16_t cfi_word(uint32_t addr)
+			{
+				return cfi_byte(addr) | (cfi_byte(addr + 1) << 8);
+			}
+
+	// Reads the CFI query table: erase block regions, typical and maximum
+	// program/erase times and write buffer size.
+	uint8_t chip_cfi_query(void)
+			{
+				memset(&cfi, 0, sizeof(cfi));
+				chip_reset();
+				bus_write(0x55, 0x98);
+				read_mode();
+				if((cfi_byte(0x10) != 'Q') || (cfi_byte(0x11) != 'R') || (cfi_byte(0x12) != 'Y'))
+					{
+						chip_reset();
+						return 0;
+					}
+				cfi.cmdset = cfi_word(0x13);
+				uint16_t ext = cfi_word(0x15);
+				uint8_t n;
+				n = cfi_byte(0x1f); cfi.tprog_us = n ? (1 << n) : 0;
+				n = cfi_byte(0x20); cfi.tbuf_us = n ? (1 << n) : 0;
+				n = cfi_byte(0x21); cfi.terase_ms = n ? (1 << n) : 0;
+				n = cfi_byte(0x22); cfi.tchip_ms = n ? (1UL << n) : 0;
+				cfi.prog_max = cfi_byte(0x23);
+				cfi.buf_max = cfi_byte(0x24);
+				cfi.erase_max = cfi_byte(0x25);
+				n = cfi_byte(0x27); cfi.size_bytes = (n < 32) ? (1UL << n) : 0;
+				n = cfi_byte(0x2a); cfi.wbuf_bytes = (n > 0 && n < 16) ? (1 << n) : 0;
+				cfi.nregions = cfi_byte(0x2c);
+				if(cfi.nregions > CHIP_MAX_REGIONS) cfi.nregions = CHIP_MAX_REGIONS;
+				for(uint8_t r = 0;r < cfi.nregions;r++)
+					{
+						uint16_t y = cfi_word(0x2d + r*4);
+						uint16_t z = cfi_word(0x2f + r*4);
+						cfi.regions[r].count = y + 1;
+						cfi.regions[r].size = z ? ((uint32_t)z * 128) : 64;	//z * 256 bytes, in words
+					}
+				if((ext != 0) && (cfi_byte(ext) == 'P') && (cfi_byte(ext + 1) == 'R') && (cfi_byte(ext + 2) == 'I'))
+					{
+						uint8_t page = cfi_byte(ext + 0x0c);
+						cfi.erase_suspend = cfi_byte(ext + 0x06);
+						cfi.page_words = (page > 0 && page < 4) ? (2 << page) : 0;
+						cfi.boot = cfi_byte(ext + 0x0f);
+					}
+				// early top-boot parts list their regions bottom-up
+				if((cfi.boot == 3) && (cfi.nregions > 1) && (cfi.regions[0].size < cfi.regions[cfi.nregions - 1].size))
+					{
+						for(uint8_t r = 0;r < cfi.nregions / 2;r++)
+							{
+								chip_region_t t = cfi.regions[r];
+								cfi.regions[r] = cfi.regions[cfi.nregions - 1 - r];
+								cfi.regions[cfi.nregions - 1 - r] = t;
+							}
+					}
+				cfi.valid = (cfi.nregions > 0);
+				chip_reset();
+				return cfi.valid;
+			}
+
+	static void chip_from_cfi(flash_chip_t *c)
+			{
+				memset(c, 0, sizeof(*c));
+				c->name = "CFI";
+				c->mfr = chipid[0];
+				c->dev[0] = chipid[1];
+				c->dev[1] = chipid[2];
+				c->dev[2] = chipid[3];
+				c->read_nop = chip_default.read_nop;
+				c->page_nop = chip_default.page_nop;
+				if(cfi.cmdset == 0x0002) c->flags |= CHIP_UNLOCK_BYPASS;
+				if(cfi.wbuf_bytes >= 4 && cfi.tbuf_us != 0)
+					{
+						c->flags |= CHIP_WRITE_BUFFER;
+						c->wbuf_words = (cfi.wbuf_bytes / 2 > 255) ? 128 : cfi.wbuf_bytes / 2;
+					}
+				if(cfi.page_words != 0)
+					{
+						c->flags |= CHIP_PAGE_READ;
+						c->page_words = cfi.page_words;
+						c->page_nop = 6;
+					}
+				if(cfi.erase_suspend == 2) c->flags |= CHIP_ERASE_SUSPEND;
+				c->nregions = cfi.nregions;
+				memcpy(c->regions, cfi.regions, sizeof(c->regions));
+			}
+
+	const flash_chip_t *chip_detect(void)
+			{
+				chip = &chip_default;
+				chip_reset();
+				chip_unlock();
+				bus_write(0x555, 0x90);
+				read_mode();
+				chipid[0] = getByte(0x00);
+				chipid[1] = getByte(0x01);
+				chipid[2] = getByte(0x0e);
+				chipid[3] = getByte(0x0f);
+				chip_reset();
+				chip_cfi_query();
+				const flash_chip_t *found = 0;
+				for(uint32_t i = 0;i < sizeof(chip_table)/sizeof(chip_table[0]);i++)
+					{
+						const flash_chip_t *c = &chip_table[i];
+						if((c->mfr != chipid[0]) || (c->dev[0] != chipid[1])) continue;
+						if((c->dev[1] != 0) && (c->dev[1] != chipid[2])) continue;
+						if((c->dev[2] != 0) && (c->dev[2] != chipid[3])) continue;
+						found = c;
+						break;
+					}
+				if(found != 0)
+					{
+						chip_active = *found;
+					}
+				else if(cfi.valid)
+					{
+						chip_from_cfi(&chip_cfi);
+						chip_active = chip_cfi;
+					}
+				else
+					{
+						return chip;
+					}
+				// measured CFI timings take precedence over datasheet defaults
+				if(cfi.valid)
+					{
+						if(cfi.tprog_us) chip_active.tprog_us = cfi.tprog_us;
+						if(cfi.tbuf_us) chip_active.tbuf_us = cfi.tbuf_us;
+						if(cfi.terase_ms) chip_active.terase_ms = cfi.terase_ms;
+					}
+				chip = &chip_active;
+				return chip;
+			}
+
+	uint32_t chip_program_timeout(void)
+			{
+				uint32_t us = (chip->tbuf_us > chip->tprog_us) ? chip->tbuf_us : chip->tprog_us;
+				uint8_t shift = (cfi.valid && cfi.buf_max) ? cfi.buf_max : 4;
+				uint32_t ms = ((us << shift) / 1000) + 2;
+				return (ms < CHIP_PROGRAM_TIMEOUT_MS) ? CHIP_PROGRAM_TIMEOUT_MS : ms;
+			}
+
+	uint32_t chip_erase_timeout(void)
+			{
+				uint8_t shift = (cfi.valid && cfi.erase_max) ? cfi.erase_max : 3;
+				uint32_t ms = ((uint32_t)chip->terase_ms << shift) + 100;
+				return (ms < CHIP_ERASE_TIMEOUT_MS) ? CHIP_ERASE_TIMEOUT_MS : ms;
+			}
+
+	uint32_t chip_size(void)
+			{
+				uint32_t size = 0;
+				for(uint8_t r = 0;r < chip->nregions;r++)
+					{
+						size += chip->regions[r].count * chip->regions[r].size;
+					}
+				return size;
+			}
+
+	uint32_t chip_sector_size(uint32_t addr)
+			{
+				uint32_t base = 0;
+				for(uint8_t r = 0;r < chip->nregions;r++)
+					{
+						base += chip->regions[r].count * chip->regions[r].size;
+						if(addr < base)
+							{
+								return chip->regions[r].size;
+							}
+					}
+				return chip->regions[chip->nregions - 1].size;
+			}
+
+	// One DQ6 toggle check with the DQ5 exceeded-timing test. A failed
+	// operation is reset so the chip returns to read array mode.
+	uint8_t chip_poll(uint32_t addr)
+			{
+				read_mode();
+				uint8_t s1 = bus_read_status(addr);
+				uint8_t s2 = bus_read_status(addr);
+				if(((s1 ^ s2) & 0x40) == 0)
+					{
+						write_mode();
+						return CHIP_READY;
+					}
+				if(s2 & 0x20)
+					{
+						s1 = bus_read_status(addr);
+						s2 = bus_read_status(addr);
+						if(((s1 ^ s2) & 0x40) == 0)
+							{
+								write_mode();
+								return CHIP_READY;
+							}
+						chip_reset();
+						return CHIP_ERROR;
+					}
+				return CHIP_BUSY;
+			}
+
+	uint8_t chip_wait_ready(uint32_t addr, uint32_t timeout_ms)
+			{
+				uint32_t start = HAL_GetTick();
+				while(1)
+					{
+						uint8_t status = chip_poll(addr);
+						if(status != CHIP_BUSY)
+							{
+								return status == CHIP_READY;
+							}
+						if((HAL_GetTick() - start) > timeout_ms)
+							{
+								chip_reset();
+								return 0;
+							}
+					}
+			}
+
+	static uint16_t bus_read_word(uint32_t addr)
+			{
+				read_mode();
+				setAddress(addr);
+				MD_CS = 0;
+				MD_RD = 0;
+				Delay_nop(chip->read_nop);
+				uint16_t data = GPIOE->IDR;
+				MD_RD = 1;
+				MD_CS = 1;
+				write_mode();
+				return data;
+			}
+
+	// Single-word program, confirmed by reading the word back as soon as
+	// the toggle bits settle
+	static uint8_t program_word(uint32_t addr, uint16_t word)
+			{
+				chip_unlock();
+				bus_write(0x555, 0xa0);
+				bus_write(addr, word);
+				if(chip_wait_ready(addr, chip_program_timeout()) == 0) return 0;
+				return bus_read_word(addr) == word;
+			}
+
+	static uint8_t program_single(uint32_t addr, const uint8_t *data, uint32_t words)
+			{
+				uint8_t ok = 1;
+				for(uint32_t i = 0;i < words;i++)
+					{
+						uint16_t word = (data[i*2] << 8) | data[i*2+1];
+						if(word == 0xffff) continue;
+						if(program_word(addr + i, word) == 0) ok = 0;
+					}
+				return ok;
+			}
+
+	static uint8_t program_bypass(uint32_t addr, const uint8_t *data, uint32_t words)
+			{
+				uint8_t ok = 1;
+				chip_unlock();
+				bus_write(0x555, 0x20);
+				for(uint32_t i = 0;i < words;i++)
+					{
+						uint16_t word = (data[i*2] << 8) | data[i*2+1];
+						if(word == 0xffff) continue;
+						bus_write(0x555, 0xa0);
+						bus_write(addr + i, word);
+						if(chip_wait_ready(addr + i, chip_program_timeout()) == 0)
+							{
+								// leave bypass cleanly after the failure, then re-enter it
+								ok = 0;
+								bus_write(0x000, 0x90);
+								bus_write(0x000, 0x00);
+								chip_reset();
+								chip_unlock();
+								bus_write(0x555, 0x20);
+							}
+					}
+				bus_write(0x000, 0x90);
+				bus_write(0x000, 0x00);
+				return ok;
+			}
+
+	// Word-at-a-time reads with full address setup, as used before the
+	// chip driver existed. Works on every part.
+	static void read_single(uint32_t addr, uint8_t *buf, uint32_t words)
+			{
+				for(uint32_t i = 0;i < words;i++)
+					{
+						setAddress(addr + i);
+						MD_CS = 0;
+						MD_RD = 0;
+						Delay_nop(30);
+						uint16_t data = GPIOE->IDR;
+						buf[i*2] = (data >> 8) & 0xff;
+						buf[i*2+1] = data & 0xff;
+						MD_RD = 1;
+						MD_CS = 1;
+						Delay_nop(50);
+					}
+			}
+
+	// Page-mode reads: CS/RD stay low across a page, the first word pays
+	// the random access time and the rest only change the low address
+	// lines and wait the intra-page access time.
+	static void read_page(uint32_t addr, uint8_t *buf, uint32_t words)
+			{
+				uint32_t mask = chip->page_words - 1;
+				uint32_t i = 0;
+				while(i < words)
+					{
+						uint32_t a = addr + i;
+						setAddress(a);
+						MD_CS = 0;
+						MD_RD = 0;
+						Delay_nop(chip->read_nop);
+						while(1)
+							{
+								uint16_t data = GPIOE->IDR;
+								buf[i*2] = (data >> 8) & 0xff;
+								buf[i*2+1] = data & 0xff;
+								i++;
+								a++;
+								if((i >= words) || ((a & mask) == 0)) break;
+								GPIOD->BSRR = (mask << 16) | (a & mask);
+								Delay_nop(chip->page_nop);
+							}
+						MD_RD = 1;
+						MD_CS = 1;
+						Delay_nop(10);
+					}
+			}
+
+	// Read words into buf as big-endian byte pairs, the order the host
+	// expects in a dump. The caller sets read_mode(). Page mode is only
+	// used once the chip has also answered the CFI query, so a mask ROM
+	// whose data happens to look like a flash ID is still read safely.
+	void chip_read(uint32_t addr, uint8_t *buf, uint32_t words)
+			{
+				MD_WR = 1;
+				if((chip->flags & CHIP_PAGE_READ) && cfi.valid && (chip->page_words > 1))
+					{
+						read_page(addr, buf, words);
+					}
+				else
+					{
+						read_single(addr, buf, words);
+					}
+			}
+
+	// The same reads stored straight into USB packet memory. The F103 PMA is
+	// 16-bit words on a 32-bit stride, so pma[i] holds bytes 2i and 2i+1 of
+	// the packet; the swap puts the high byte first on the wire.
+	static void read_single_pma(uint32_t addr, volatile uint32_t *pma, uint32_t words)
+			{
+				for(uint32_t i = 0;i < words;i++)
+					{
+						setAddress(addr + i);
+						MD_CS = 0;
+						MD_RD = 0;
+						Delay_nop(30);
+						uint16_t data = GPIOE->IDR;
+						pma[i] = (uint16_t)((data >> 8) | (data << 8));
+						MD_RD = 1;
+						MD_CS = 1;
+						Delay_nop(50);
+					}
+			}
+
+	static void read_page_pma(uint32_t addr, volatile uint32_t *pma, uint32_t words)
+			{
+				uint32_t mask = chip->page_words - 1;
+				uint32_t i = 0;
+				while(i < words)
+					{
+						uint32_t a = addr + i;
+						setAddress(a);
+						MD_CS = 0;
+						MD_RD = 0;
+						Delay_nop(chip->read_nop);
+						while(1)
+							{
+								uint16_t data = GPIOE->IDR;
+								pma[i] = (uint16_t)((data >> 8) | (data << 8));
+								i++;
+								a++;
+								if((i >= words) || ((a & mask) == 0)) break;
+								GPIOD->BSRR = (mask << 16) | (a & mask);
+								Delay_nop(chip->page_nop);
+							}
+						MD_RD = 1;
+						MD_CS = 1;
+						Delay_nop(10);
+					}
+			}
+
+	// chip_read into a USB endpoint buffer (see CDC_StreamBuffer)
+	void chip_read_pma(uint32_t addr, volatile uint32_t *pma, uint32_t words)
+			{
+				MD_WR = 1;
+				if((chip->flags & CHIP_PAGE_READ) && cfi.valid && (chip->page_words > 1))
+					{
+						read_page_pma(addr, pma, words);
+					}
+				else
+					{
+						read_single_pma(addr, pma, words);
+					}
+			}
+
+	// Scan words for anything other than 0xFFFF, stopping at the first hit
+	uint8_t chip_is_blank(uint32_t addr, uint32_t words)
+			{
+				uint8_t buf[128];
+				read_mode();
+				while(words > 0)
+					{
+						uint32_t n = (words > 64) ? 64 : words;
+						chip_read(addr, buf, n);
+						for(uint32_t i = 0;i < n*2;i++)
+							{
+								if(buf[i] != 0xff) return 0;
+							}
+						addr += n;
+						words -= n;
+					}
+				return 1;
+			}
+
+	// DQ7 data polling on the last word loaded into the write buffer. DQ1
+	// flags a write-to-buffer abort, DQ5 an exceeded program time; either
+	// needs the abort reset before the chip will take new commands.
+	static uint8_t buffer_wait_ready(uint32_t addr, uint16_t last, uint32_t timeout_ms)
+			{
+				uint32_t start = HAL_GetTick();
+				read_mode();
+				while(1)
+					{
+						uint8_t s = bus_read_status(addr);
+						if(((s ^ last) & 0x80) == 0)
+							{
+								write_mode();
+								return 1;
+							}
+						if((s & 0x22) || ((HAL_GetTick() - start) > timeout_ms))
+							{
+								s = bus_read_status(addr);
+								write_mode();
+								if(((s ^ last) & 0x80) == 0) return 1;
+								chip_unlock();
+								bus_write(0x555, 0xf0);
+								return 0;
+							}
+					}
+			}
+
+	// Write-to-buffer programming. Buffers never cross a write buffer page,
+	// and erased (0xFFFF) words at either end of a page are not loaded.
+	// A page that fails is retried once with single-word programming.
+	static uint8_t program_buffer(uint32_t addr, const uint8_t *data, uint32_t words)
+			{
+				uint8_t ok = 1;
+				uint32_t wbuf = chip->wbuf_words;
+				uint32_t i = 0;
+				while(i < words)
+					{
+						uint32_t n = wbuf - ((addr + i) % wbuf);
+						if(n > words - i) n = words - i;
+						const uint8_t *p = data + i*2;
+						uint32_t first = 0;
+						uint32_t last = n;
+						while((first < n) && (p[first*2] == 0xff) && (p[first*2+1] == 0xff)) first++;
+						while((last > first) && (p[(last-1)*2] == 0xff) && (p[(last-1)*2+1] == 0xff)) last--;
+						if(first < last)
+							{
+								uint32_t sa = addr + i + first;
+								uint16_t word = 0;
+								chip_unlock();
+								bus_write(sa, 0x25);
+								bus_write(sa, last - first - 1);
+								for(uint32_t j = first;j < last;j++)
+									{
+										word = (p[j*2] << 8) | p[j*2+1];
+										bus_write(addr + i + j, word);
+									}
+								bus_write(sa, 0x29);
+								if(buffer_wait_ready(addr + i + last - 1, word, chip_program_timeout()) == 0)
+									{
+										if(program_single(sa, p + first*2, last - first) == 0) ok = 0;
+									}
+							}
+						i += n;
+					}
+				return ok;
+			}
+
+	// Read the chunk back and compare. A word that still has bits to clear
+	// is programmed again, up to CHIP_VERIFY_RETRIES times; a word that
+	// needs a bit set again (not erased) cannot be fixed and fails at once.
+	static uint8_t verify_chunk(uint32_t addr, const uint8_t *data, uint32_t words)
+			{
+				uint8_t buf[128];
+				for(uint32_t i = 0;i < words;i += 64)
+					{
+						uint32_t n = (words - i > 64) ? 64 : words - i;
+						read_mode();
+						chip_read(addr + i, buf, n);
+						for(uint32_t j = 0;j < n;j++)
+							{
+								uint16_t expect = (data[(i+j)*2] << 8) | data[(i+j)*2+1];
+								uint16_t got = (buf[j*2] << 8) | buf[j*2+1];
+								uint8_t tries = 0;
+								while((got != expect) && ((expect & ~got) == 0) && (tries < CHIP_VERIFY_RETRIES))
+									{
+										write_mode();
+										program_word(addr + i + j, expect);
+										got = bus_read_word(addr + i + j);
+										tries++;
+									}
+								if(tries)
+									chip_result.retried++;
+								if(got != expect)
+									{
+										chip_result.fail_addr = addr + i + j;
+										chip_result.expect = expect;
+										chip_result.got = got;
+										write_mode();
+										return 0;
+									}
+							}
+					}
+				write_mode();
+				return 1;
+			}
+
+	// Program words (big-endian byte pairs, as received from the host),
+	// using the fastest algorithm the detected chip supports, then verify
+	// the whole chunk. chip_result holds the retry count and, on failure,
+	// the first word that would not program.
+	uint8_t chip_program(uint32_t addr, const uint8_t *data, uint32_t words)
+			{
+				chip_result.retried = 0;
+				chip_result.fail_addr = 0;
+				write_mode();
+				MD_RD = 1;
+				MD_CS = 1;
+				MD_WR = 1;
+				if((chip->flags & CHIP_WRITE_BUFFER) && (chip->wbuf_words > 1))
+					{
+						program_buffer(addr, data, words);
+					}
+				else if((chip->flags & CHIP_UNLOCK_BYPASS) && !suspended)
+					{
+						program_bypass(addr, data, words);
+					}
+				else
+					{
+						program_single(addr, data, words);
+					}
+				return verify_chunk(addr, data, words);
+			}
+
+	// Start a sector erase and return; completion is checked with chip_poll
+	void chip_erase_start(uint32_t addr)
+			{
+				write_mode();
+				MD_RD = 1;
+				MD_CS = 1;
+				MD_WR = 1;
+				chip_unlock();
+				bus_write(0x555, 0x80);
+				chip_unlock();
+				bus_write(addr, 0x30);
+			}
+
+	uint8_t chip_erase_sector(uint32_t addr)
+			{
+				chip_erase_start(addr);
+				return chip_wait_ready(addr, chip_erase_timeout());
+			}
+
+	// Suspend a running erase so other sectors can be programmed. DQ6 stops
+	// toggling once the chip has suspended (or if the erase already ended).
+	void chip_erase_suspend(uint32_t addr)
+			{
+				write_mode();
+				bus_write(addr, 0xb0);
+				uint32_t start = HAL_GetTick();
+				while((chip_poll(addr) == CHIP_BUSY) && ((HAL_GetTick() - start) < 2))
+					{
+					}
+				write_mode();
+				suspended = 1;
+			}
+
+	void chip_erase_resume(uint32_t addr)
+			{
+				write_mode();
+				bus_write(addr, 0x30);
+				suspended = 0;
+			}
+
+	// One line describing the detected chip, parsed by the host:
+	// CHIP:<name> ID:<ids> SIZE:<bytes> FLAGS:<hex> WBUF:<words> PAGE:<words>
+	// TPROG:<us> TBUF:<us> TERASE:<ms> TMAX:<ms> REGIONS:<count>x<bytes>,...
+	uint16_t chip_info(char *buf)
+			{
+				uint16_t len = sprintf(buf,"CHIP:%s ID:%02X%02X%02X%02X SIZE:%lu FLAGS:%02X WBUF:%u PAGE:%u TPROG:%u TBUF:%u TERASE:%u TMAX:%lu REGIONS:",
+							chip->name,chipid[0],chipid[1],chipid[2],chipid[3],(unsigned long)chip_size()*2,chip->flags,
+							chip->wbuf_words,chip->page_words,chip->tprog_us,chip->tbuf_us,chip->terase_ms,
+							(unsigned long)chip_erase_timeout());
+				for(uint8_t r = 0;r < chip->nregions;r++)
+					{
+						len += sprintf(buf + len,"%s%ux%lu",r ? "," : "",chip->regions[r].count,(unsigned long)chip->regions[r].size*2);
+					}
+				len += sprintf(buf + len,"\r\n");
+				return len;
+			}
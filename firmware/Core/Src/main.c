@@ -25,6 +25,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "MD.h"
+#include "chip.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -49,7 +50,7 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-
+extern USBD_HandleTypeDef hUsbDeviceFS;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -64,13 +65,24 @@ void SystemClock_Config(void);
 	uint8_t cmdbuff[64];
 	uint8_t transmitBuffer[1024];
 	uint32_t datacnt;
-	uint8_t buffcnt;
+	volatile uint8_t buffcnt;
+	volatile uint8_t rxstream = 0;
+	volatile uint32_t rxstream_left = 0;
+	volatile uint8_t rxhold = 0;
+	volatile uint8_t rxstream_gen = 0;	// bumped by the ISR for every stream command
+	// Commands from the USB ISR (producer) to the main loop (consumer). Each
+	// index is only written by its own side, so no locking is needed.
+	uint8_t cmdq[CMDQ_DEPTH][64];
+	uint8_t cmdq_gen[CMDQ_DEPTH];		// rxstream_gen of a queued stream command
+	volatile uint8_t cmdq_head = 0;
+	volatile uint8_t cmdq_tail = 0;
+	uint8_t stream_gen = 0;			// rxstream_gen of the running command
 	uint32_t addj;
 	uint32_t bank = 0;
 	uint32_t endadd;
 	uint16_t usetime = 0;
 	char usetimes[30];
-	char displaybuff[50];		
+	char displaybuff[64];		
 	
 	void CDC_Transmit(const char* str)
 		{
@@ -79,6 +91,212 @@ void SystemClock_Config(void);
 			}
 		}	
 		
+	void CDC_TransmitBlock(uint8_t* buf, uint16_t len)
+		{
+			USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+			while (CDC_Transmit_FS(buf, len) == USBD_BUSY) {
+			}
+			while (hcdc->TxState != 0) {
+			}
+		}
+
+	// Send words of ROM from addr as raw dump data. With DUMP_ZERO_COPY each
+	// 64-byte packet is read straight into the IN endpoint's packet memory
+	// and queued as soon as it fills, the next one filling while it goes out.
+	void dump_words(uint32_t addr, uint32_t words)
+		{
+#if DUMP_ZERO_COPY
+			volatile uint32_t *pma = CDC_StreamBegin();
+			while(words > 0)
+				{
+					uint32_t n = (words > 32) ? 32 : words;
+					chip_read_pma(addr, pma, n);
+					pma = CDC_StreamSend(n*2);
+					addr += n;
+					words -= n;
+				}
+			CDC_StreamEnd();
+#else
+			while(words > 0)
+				{
+					uint32_t n = (words > 512) ? 512 : words;
+					chip_read(addr, transmitBuffer, n);
+					CDC_TransmitBlock(transmitBuffer, n*2);
+					addr += n;
+					words -= n;
+				}
+#endif
+		}
+
+	// CRC-32 (IEEE, reflected), the host's flashmd_crc32. Pass 0 to start.
+	uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len)
+		{
+			static uint32_t table[256];
+			static uint8_t ready = 0;
+			if(!ready)
+				{
+					for(uint32_t i = 0;i < 256;i++)
+						{
+							uint32_t c = i;
+							for(uint8_t k = 0;k < 8;k++)
+								{
+									c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+								}
+							table[i] = c;
+						}
+					ready = 1;
+				}
+			crc = ~crc;
+			for(uint32_t i = 0;i < len;i++)
+				{
+					crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+				}
+			return ~crc;
+		}
+
+	uint8_t* stream_next(void)
+		{
+			uint32_t start = HAL_GetTick();
+			while (buffcnt < 16) {
+				if ((HAL_GetTick() - start) > STREAM_TIMEOUT_MS) {
+					return 0;
+				}
+			}
+			return &receiveBuffer[0][0];
+		}
+
+	// Drop one reason for NAKing OUT packets and re-arm reception once none
+	// are left. While any is set the endpoint is not armed, so the ISR
+	// cannot change rxhold underneath.
+	void rx_resume(uint8_t hold)
+		{
+			if (rxhold & hold) {
+				rxhold &= ~hold;
+				if (rxhold == 0) {
+					USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+				}
+			}
+		}
+
+	void stream_release(void)
+		{
+			buffcnt = 0;
+			rx_resume(RX_HOLD_STREAM);
+		}
+
+	// The ISR ends the stream itself after its last packet, and once the
+	// handler's last stream_release() re-arms reception the ISR may already
+	// have queued the next command, set up a new stream or taken a block for
+	// 0x0B. None of that is touched here. Only a stream of the running
+	// command that was cut short, still streaming or holding an unconsumed
+	// block, has state to drop.
+	void stream_end(void)
+		{
+			uint8_t drop = 0;
+			__disable_irq();
+			if((rxstream_gen == stream_gen) && (rxstream || (rxhold & RX_HOLD_STREAM)))
+				{
+					rxstream = 0;
+					rxstream_left = 0;
+					buffcnt = 0;
+					drop = 1;
+				}
+			__enable_irq();
+			if(drop)
+				{
+					rx_resume(RX_HOLD_STREAM);
+				}
+		}
+
+	// Erase and program count KB from word address addw in one pass. Sectors
+	// are erased in address order and each 1K block is programmed as soon as
+	// its sector is erased. On chips with erase suspend the erase of the next
+	// sector is suspended to program blocks that are ready, so erasing runs
+	// underneath the USB transfer and programming instead of before it.
+	// Returns FLASH_IMAGE_OK, _FAIL (at *failadd) or _TIMEOUT.
+	uint8_t flash_image(uint32_t addw, uint32_t count, uint32_t *done, uint32_t *failadd, uint32_t *retried)
+		{
+			uint32_t end = addw + count*512;
+			uint32_t erase_addr = 0;
+			uint32_t erased;
+			uint8_t erasing = 0;
+			uint32_t erase_ms = 0;
+			uint32_t resumed = 0;
+			uint32_t idle = HAL_GetTick();
+			while(erase_addr + chip_sector_size(erase_addr) <= addw)
+				{
+					erase_addr += chip_sector_size(erase_addr);
+				}
+			erased = erase_addr;
+			*done = 0;
+			*retried = 0;
+			while(*done < count)
+				{
+					if(!erasing && (erase_addr < end))
+						{
+							chip_erase_start(erase_addr);
+							erasing = 1;
+							erase_ms = 0;
+							resumed = HAL_GetTick();
+						}
+					if(erasing)
+						{
+							uint8_t status = chip_poll(erase_addr);
+							if((status == CHIP_BUSY) && (erase_ms + (HAL_GetTick() - resumed) > chip_erase_timeout()))
+								{
+									chip_reset();
+									status = CHIP_ERROR;
+								}
+							if(status == CHIP_ERROR)
+								{
+									*failadd = erase_addr;
+									return FLASH_IMAGE_FAIL;
+								}
+							if(status == CHIP_READY)
+								{
+									erase_addr += chip_sector_size(erase_addr);
+									erased = erase_addr;
+									erasing = 0;
+									idle = HAL_GetTick();
+									continue;
+								}
+						}
+					uint32_t blk = addw + *done*512;
+					if((buffcnt >= 16) && (blk + 512 <= erased))
+						{
+							uint8_t suspend = 0;
+							if(erasing)
+								{
+									if(!(chip->flags & CHIP_ERASE_SUSPEND) || ((HAL_GetTick() - resumed) < CHIP_RESUME_MS)) continue;
+									erase_ms += HAL_GetTick() - resumed;
+									chip_erase_suspend(erase_addr);
+									suspend = 1;
+								}
+							uint8_t ok = chip_program(blk, &receiveBuffer[0][0], 512);
+							stream_release();
+							if(suspend)
+								{
+									chip_erase_resume(erase_addr);
+									resumed = HAL_GetTick();
+								}
+							*retried += chip_result.retried;
+							if(!ok)
+								{
+									*failadd = chip_result.fail_addr;
+									return FLASH_IMAGE_FAIL;
+								}
+							(*done)++;
+							idle = HAL_GetTick();
+							continue;
+						}
+					if(!erasing && ((HAL_GetTick() - idle) > STREAM_TIMEOUT_MS))
+						{
+							return FLASH_IMAGE_TIMEOUT;
+						}
+				}
+			return FLASH_IMAGE_OK;
+		}
+
 	int fputc(int ch, FILE *f)
 		{
 			HAL_UART_Transmit(&huart1, (uint8_t *)&ch, 1, 0xffff);
@@ -113,6 +331,717 @@ void SystemClock_Config(void);
 				cmdbuff[j]=0x00;
 			}
 		}
+
+	// 0x0A: MD CHOOSE SIZE DUMP
+	static void cmd_rom_dump(void)
+		{
+			uint32_t wsize = 0;
+			if(cmdbuff[5] == 0x05){
+			CDC_Transmit("8M ROM DUMP START!!!\r\n");
+			wsize = 8192;
+			}
+			else if(cmdbuff[5] == 0x04){
+			CDC_Transmit("4M ROM DUMP START!!!\r\n");
+			wsize = 4096;
+			}
+			else if(cmdbuff[5] == 0x02){
+			CDC_Transmit("1M ROM DUMP START!!!\r\n");
+			wsize = 1024;
+			}
+			else if(cmdbuff[5] == 0x03){
+			CDC_Transmit("2M ROM DUMP START!!!\r\n");
+			wsize = 2048;
+			}
+			else{
+			CDC_Transmit("512K ROM DUMP START!!!\r\n");
+			wsize = 512;	
+			}
+			read_mode();
+			MD_WR = 1;
+			MD_RD = 1;
+			MD_CS = 1;
+			memclearTX();
+			HAL_Delay(100);				
+			dump_words(0, wsize*512);
+			HAL_Delay(150);
+			CDC_Transmit("DUMPER ROM FINISH!!!\r\n");
+			CDC_Transmit("PUSH SAVE GAME BUTTON!!!\r\n");
+			write_mode();
+		}
+
+	// 0x2A: MD RANGE DUMP
+	static void cmd_range_dump(void)
+		{
+			uint32_t address = cmdbuff[5];
+			address = ( address << 8 ) + cmdbuff[6];
+			address = ( address << 8 ) + cmdbuff[7];
+			uint32_t words = cmdbuff[8];
+			words = ( words << 8 ) + cmdbuff[9];
+			words = ( words << 8 ) + cmdbuff[10];
+			read_mode();
+			MD_WR = 1;
+			MD_RD = 1;
+			MD_CS = 1;
+			// raw data only, no text before or after
+			dump_words(address, words);
+			write_mode();
+		}
+
+	// 0x4A: MD BLOCK CRC, cmd[5..7] word address, cmd[8..10] words. Reads
+	// the range in 1K blocks and answers with each block's CRC-32 over its
+	// bytes as a dump sends them, 4 bytes little endian per block, 16 to a
+	// packet, raw data only
+	static void cmd_block_crc(void)
+		{
+			uint32_t address = cmdbuff[5];
+			address = ( address << 8 ) + cmdbuff[6];
+			address = ( address << 8 ) + cmdbuff[7];
+			uint32_t words = cmdbuff[8];
+			words = ( words << 8 ) + cmdbuff[9];
+			words = ( words << 8 ) + cmdbuff[10];
+			uint32_t n = 0;
+			read_mode();
+			MD_WR = 1;
+			MD_RD = 1;
+			MD_CS = 1;
+			volatile uint32_t *pma = CDC_StreamBegin();
+			while(words > 0)
+				{
+					uint32_t w = (words > 512) ? 512 : words;
+					chip_read(address, transmitBuffer, w);
+					uint32_t crc = crc32_update(0, transmitBuffer, w*2);
+					pma[n*2] = crc & 0xFFFF;
+					pma[n*2 + 1] = crc >> 16;
+					n++;
+					address += w;
+					words -= w;
+					if((n == 16) || (words == 0))
+						{
+							pma = CDC_StreamSend(n*4);
+							n = 0;
+						}
+				}
+			CDC_StreamEnd();
+			write_mode();
+		}
+
+	// 0x1A: MD SRAM CHOOSE SIZE DUMP
+	static void cmd_sram_dump(void)
+		{
+			uint32_t wsize = 0;
+			if(cmdbuff[5] == 0x01){
+			CDC_Transmit("32K RAM DUMP START!!!\r\n");
+			wsize = 32;
+			}
+			else{
+			CDC_Transmit("8K ROM DUMP START!!!\r\n");
+			wsize = 8;	
+			}
+			sram_begin(0);
+			memclearTX();
+			HAL_Delay(100);				
+			for(uint32_t j=0 ;j < wsize ; j++){						
+				sram_read(j*1024, transmitBuffer, 1024);
+				CDC_TransmitBlock(transmitBuffer, 1024);	
+				}
+			HAL_Delay(150);
+			sram_end();
+			CDC_Transmit("DUMPER RAM FINISH!!!\r\n");				
+			//CDC_Transmit("PUSH SAVE BUTTON!!!\r\n");
+			write_mode();
+		}
+
+	// 0x5A: MD SRAM BLOCK CRC, cmd[5] first 1K block, cmd[6] blocks. Answers
+	// with each block's CRC-32 over the bytes a dump sends, 4 bytes little
+	// endian per block, 16 to a packet, raw data only
+	static void cmd_sram_crc(void)
+		{
+			uint32_t block = cmdbuff[5];
+			uint32_t count = cmdbuff[6];
+			uint32_t n = 0;
+			sram_begin(0);
+			volatile uint32_t *pma = CDC_StreamBegin();
+			for(uint32_t j = 0;j < count;j++)
+				{
+					sram_read((block + j)*1024, transmitBuffer, 1024);
+					uint32_t crc = crc32_update(0, transmitBuffer, 1024);
+					pma[n*2] = crc & 0xFFFF;
+					pma[n*2 + 1] = crc >> 16;
+					n++;
+					if((n == 16) || (j == count - 1))
+						{
+							pma = CDC_StreamSend(n*4);
+							n = 0;
+						}
+				}
+			CDC_StreamEnd();
+			sram_end();
+			write_mode();
+		}
+
+	// 0x6A: MD SRAM BLOCK DUMP, cmd[5] first 1K block, cmd[6] blocks; raw
+	// data only, for fetching the blocks 0x5A showed had changed
+	static void cmd_sram_blocks(void)
+		{
+			uint32_t block = cmdbuff[5];
+			uint32_t count = cmdbuff[6];
+			sram_begin(0);
+			for(uint32_t j = 0;j < count;j++)
+				{
+					sram_read((block + j)*1024, transmitBuffer, 1024);
+					CDC_TransmitBlock(transmitBuffer, 1024);
+				}
+			sram_end();
+			write_mode();
+		}
+
+	// 0x0B: MD FLASH WRITE
+	static void cmd_rom_write(void)
+		{
+			uint32_t addj = cmdbuff[5];
+			uint32_t bank = cmdbuff[6];
+			uint32_t addw = bank*64*512+addj*512;
+			uint8_t ok = chip_program(addw, &receiveBuffer[0][0], 512);
+			bank=bank+1;
+			if(!ok)
+				{
+					sprintf(displaybuff,"ADD:0x%X WRITE FAIL AT 0x%X %04X/%04X\r\n",addw,chip_result.fail_addr,chip_result.expect,chip_result.got);
+				}
+			else if(chip_result.retried)
+				{
+					sprintf(displaybuff,"ADD:0x%X WRITE OK RETRIED %u\r\n",addw,chip_result.retried);
+				}
+			else
+				{
+					sprintf(displaybuff,"ADD:0x%X WRITE OK\r\n",addw);
+				}
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x1B: MD FLASH WRITE
+	static void cmd_sram_write(void)
+		{
+			uint32_t addj = cmdbuff[5];
+			uint32_t bank = cmdbuff[6];
+			uint32_t addw = bank*64*1024+addj*1024;
+			sram_begin(1);
+			sram_write(addw, &receiveBuffer[0][0], 1024);
+			sram_end();
+			bank=bank+1;
+			sprintf(displaybuff,"ADD:0x%X WRITE GK\r\n",addw);				
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x3B: MD SRAM STREAM WRITE
+	static void cmd_sram_stream(void)
+		{
+			uint32_t addw = cmdbuff[5];
+			addw = (addw << 8) + cmdbuff[6];
+			addw = (addw << 8) + cmdbuff[7];
+			uint32_t count = cmdbuff[8];
+			uint32_t done = 0;
+			sram_begin(1);
+			for(done = 0;done < count;done++)
+				{
+					uint8_t *block = stream_next();
+					if(block == 0) break;
+					sram_write(addw + done*1024, block, 1024);
+					stream_release();
+				}
+			sram_end();
+			stream_end();
+			if(done == count)
+				{
+					sprintf(displaybuff,"ADD:0x%X %uK SRAM WRITE OK\r\n",addw,done);
+				}
+			else
+				{
+					sprintf(displaybuff,"ADD:0x%X SRAM STREAM TIMEOUT AT %uK\r\n",addw,done);
+				}
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x4B: MD FLASH IMAGE (ERASE + STREAM WRITE)
+	static void cmd_flash_image(void)
+		{
+			uint32_t addw = cmdbuff[5];
+			addw = (addw << 8) + cmdbuff[6];
+			addw = (addw << 8) + cmdbuff[7];
+			uint32_t count = cmdbuff[8];
+			count = (count << 8) + cmdbuff[9];
+			uint32_t done = 0;
+			uint32_t failadd = 0;
+			uint32_t retried = 0;
+			uint8_t result = flash_image(addw, count, &done, &failadd, &retried);
+			stream_end();
+			write_mode();
+			if(result == FLASH_IMAGE_OK)
+				{
+					sprintf(displaybuff,"ADD:0x%X %uK FLASH IMAGE OK RETRIED %u\r\n",addw,done,retried);
+				}
+			else if(result == FLASH_IMAGE_FAIL)
+				{
+					sprintf(displaybuff,"FLASH IMAGE FAIL AT 0x%X\r\n",failadd);
+				}
+			else
+				{
+					sprintf(displaybuff,"FLASH IMAGE TIMEOUT AT %uK\r\n",done);
+				}
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x0C: MD DUMPER CONNECT
+	static void cmd_connect(void)
+		{
+			HAL_Delay(100);
+			CDC_Transmit("FlashMaster MD Dumper is connected\r\n");
+		}
+
+	// 0x0D: MD CHECK HEADER
+	static void cmd_check_header(void)
+		{
+			read_mode();
+			checkid();
+			HAL_Delay(100);
+			//checkheadermenu();
+			write_mode();
+		}
+
+	// 0x0E: MDFLASHERASE
+	static void cmd_full_erase(void)
+		{
+			eraseFLASH();
+			HAL_Delay(100);
+			CDC_Transmit("SRAM ERASE START\r\n");
+			sram_begin(1);
+			sram_fill(0, 0x00, 32768);
+			sram_end();
+			CDC_Transmit("SRAM ERASE FINISH!!!\r\n");
+		}
+
+	// 0x1E: MDCHOOSE SIZE SECTORERASE
+	static void cmd_size_erase(void)
+		{
+			uint32_t address = 0;
+			uint32_t sectoradd = 0;
+			if (cmdbuff[5] == 0x1)
+				{
+					CDC_Transmit("512K ERASEING\r\n");	
+					sectoradd = 0x40000;
+				}
+			else if (cmdbuff[5] == 0x2)
+				{
+					CDC_Transmit("1M ERASEING\r\n");	
+					sectoradd = 0x80000;
+				}
+			else if (cmdbuff[5] == 0x3)
+				{
+					CDC_Transmit("2M ERASEING\r\n");	
+					sectoradd = 0x100000;
+				}
+			else if (cmdbuff[5] == 0x4)
+				{
+					CDC_Transmit("4M ERASEING\r\n");	
+					sectoradd = 0x200000;
+				}
+			else if (cmdbuff[5] == 0x0)
+				{	
+					sectoradd = 1;
+					address = cmdbuff[6];
+					address =(address<<8)+cmdbuff[7];
+					address =(address<<8)+cmdbuff[8];
+					sprintf(displaybuff,"SECTORADD:0x%X ERASEING\r\n",address);
+					CDC_Transmit(displaybuff);
+				}
+			else
+				{
+					CDC_Transmit("512K ERASEING\r\n");	
+					sectoradd = 0x40000;	
+				}
+			if(cmdbuff[5] < 0x5){
+					for(uint32_t i = 0;i < sectoradd ;)
+						{
+							uint32_t sector = chip_sector_size(address);
+							chip_erase_sector(address);
+							Delay_nop(100);
+							CDC_Transmit(".");
+							address = address+sector;
+							i = i+sector;
+						}
+				}
+			else{
+					eraseFLASH();
+				}
+			if (cmdbuff[5] == 0x1)
+				{
+					CDC_Transmit("\r\n512K ERASE OK!\r\n");	
+				}
+			else if (cmdbuff[5] == 0x2)
+				{
+					CDC_Transmit("\r\n1M ERASE OK!\r\n");	
+				}
+			else if (cmdbuff[5] == 0x3)
+				{
+					CDC_Transmit("\r\n2M ERASE OK!\r\n");	
+				}
+			else if (cmdbuff[5] == 0x4)
+				{
+					CDC_Transmit("\r\n4M ERASE OK!\r\n");	
+				}
+			else if (cmdbuff[5] == 0x5)
+				{
+					CDC_Transmit("\r\n8M ERASE OK!\r\n");	
+				}
+			else if (cmdbuff[5] == 0x0)
+				{
+					sprintf(displaybuff,"SECTORADD:0x%X ERASE OK!\r\n",address);
+					CDC_Transmit(displaybuff);
+				}
+			else 
+				{
+					CDC_Transmit("\r\n512K ERASE OK!\r\n");	
+				}
+			write_mode();
+		}
+
+	// 0x2E: MDSECTORERASE
+	static void cmd_sector_erase(void)
+		{
+			write_mode();
+			uint32_t address = cmdbuff[5];
+			address = ( address << 8 ) + cmdbuff[6];
+			address = ( address << 8 ) + cmdbuff[7];
+			if(chip_erase_sector(address))
+				{
+					sprintf(displaybuff,"\r\nSECTORADD:0x%X ERASE OK!\r\n",address);
+				}
+			else
+				{
+					sprintf(displaybuff,"\r\nSECTORADD:0x%X ERASE FAIL!\r\n",address);
+				}
+			CDC_Transmit(displaybuff);	
+		}
+
+	// 0x3D: MD CHIP INFO
+	static void cmd_chip_info(void)
+		{
+			static char infobuff[256];
+			chip_detect();
+			uint16_t len = chip_info(infobuff);
+			CDC_TransmitBlock((uint8_t *)infobuff, len);
+			write_mode();
+		}
+
+	// 0x4D: MD CART SELF TEST, one SELFTEST: line (see cart_selftest)
+	static void cmd_selftest(void)
+		{
+			static char testbuff[192];
+			uint16_t len = cart_selftest(testbuff);
+			CDC_TransmitBlock((uint8_t *)testbuff, len);
+		}
+
+	// 0x6E: MD PROGRAM LOAD, cmd[5..6] offset, cmd[7] bytes (up to 48), the
+	// bytecode from cmd[8]. No reply, so a program goes up in one burst
+	static uint8_t prog_code[PROG_MAX];
+	static uint8_t prog_overflow = 0;
+	static void cmd_prog_load(void)
+		{
+			uint32_t offset = (cmdbuff[5] << 8) | cmdbuff[6];
+			uint32_t count = cmdbuff[7];
+			if((count > 48) || (offset + count > PROG_MAX))
+				{
+					prog_overflow = 1;
+					return;
+				}
+			memcpy(&prog_code[offset], &cmdbuff[8], count);
+		}
+
+	// 0x6F: MD PROGRAM RUN, cmd[5..6] program length; answers with the
+	// frames bus_program sends
+	static void cmd_prog_run(void)
+		{
+			uint32_t len = (cmdbuff[5] << 8) | cmdbuff[6];
+			if(prog_overflow || (len > PROG_MAX))
+				{
+					static uint8_t frame[4] = {PROG_FRAME_END, PROG_ERR_LOAD, 0, 0};
+					prog_overflow = 0;
+					CDC_TransmitBlock(frame, 4);
+					return;
+				}
+			bus_program(prog_code, len, transmitBuffer, sizeof(transmitBuffer));
+		}
+
+	// 0x3A: MD BLANK CHECK
+	static void cmd_blank_check(void)
+		{
+			static char blankbuff[CHIP_BLANK_MAX_SECTORS/4 + 48];
+			uint32_t start = cmdbuff[5];
+			start = ( start << 8 ) + cmdbuff[6];
+			start = ( start << 8 ) + cmdbuff[7];
+			uint32_t words = cmdbuff[8];
+			words = ( words << 8 ) + cmdbuff[9];
+			words = ( words << 8 ) + cmdbuff[10];
+			uint32_t end = start + words;
+			uint32_t address = 0;
+			uint32_t first = 0;
+			uint32_t n = 0;
+			uint8_t nibble = 0;
+			// one hex digit per 4 sectors, first sector in bit 0; a set bit is a sector to erase
+			uint16_t len = 0;
+			while((address < end) && (address < chip_size()) && (n < CHIP_BLANK_MAX_SECTORS))
+				{
+					uint32_t sector = chip_sector_size(address);
+					if(address + sector > start)
+						{
+							if(n == 0) first = address;
+							if(!chip_is_blank(address, sector)) nibble |= 1 << (n & 3);
+							n++;
+							if((n & 3) == 0)
+								{
+									blankbuff[len++] = "0123456789ABCDEF"[nibble];
+									nibble = 0;
+								}
+						}
+					address += sector;
+				}
+			if(n & 3) blankbuff[len++] = "0123456789ABCDEF"[nibble];
+			blankbuff[len] = 0;
+			sprintf(displaybuff,"BLANK ADD:0x%X SECTORS:%u DIRTY:",first,n);
+			CDC_Transmit(displaybuff);
+			CDC_Transmit(blankbuff);
+			CDC_Transmit("\r\n");
+			write_mode();
+		}
+
+	// 0x3E: MD RANGE ERASE
+	static void cmd_range_erase(void)
+		{
+			uint32_t start = cmdbuff[5];
+			start = ( start << 8 ) + cmdbuff[6];
+			start = ( start << 8 ) + cmdbuff[7];
+			uint32_t words = cmdbuff[8];
+			words = ( words << 8 ) + cmdbuff[9];
+			words = ( words << 8 ) + cmdbuff[10];
+			uint32_t end = start + words;
+			uint32_t address = 0;
+			uint8_t ok = 1;
+			chip_detect();
+			// walk the sector map from 0 so unaligned starts erase the sector they fall in
+			while((address < end) && (address < chip_size()))
+				{
+					uint32_t sector = chip_sector_size(address);
+					if(address + sector > start)
+						{
+							if(chip_erase_sector(address) == 0)
+								{
+									ok = 0;
+									break;
+								}
+							CDC_Transmit(".");
+						}
+					address += sector;
+				}
+			if(ok)
+				{
+					sprintf(displaybuff,"\r\nADD:0x%X RANGE ERASE OK\r\n",start);
+				}
+			else
+				{
+					sprintf(displaybuff,"\r\nERASE FAIL AT 0x%X\r\n",address);
+				}
+			CDC_Transmit(displaybuff);
+			write_mode();
+		}
+
+	// 0x0F: MDBUFFCLEAT
+	static void cmd_buffer_clear(void)
+		{
+			buffcnt = 0;
+			bank = 0;
+			HAL_Delay(100);
+			CDC_Transmit("BUFF IS CLEAR\r\n");
+		}
+
+	// 0x7A: BENCH USB IN, cmd[5..8] bytes of generated data (byte n is
+	// n & 0xFF) built in packet memory, so only the link limits it
+	static void cmd_bench_in(void)
+		{
+			uint32_t bytes = cmdbuff[5];
+			bytes = (bytes << 8) + cmdbuff[6];
+			bytes = (bytes << 8) + cmdbuff[7];
+			bytes = (bytes << 8) + cmdbuff[8];
+			uint32_t start = HAL_GetTick();
+			uint32_t sent = 0;
+			volatile uint32_t *pma = CDC_StreamBegin();
+			while(sent < bytes)
+				{
+					uint32_t n = (bytes - sent > 64) ? 64 : bytes - sent;
+					for(uint32_t i = 0;i < (n + 1)/2;i++)
+						{
+							uint8_t b = sent + i*2;
+							pma[i] = (uint16_t)(b | ((uint8_t)(b + 1) << 8));
+						}
+					pma = CDC_StreamSend(n);
+					sent += n;
+				}
+			CDC_StreamEnd();
+			sprintf(displaybuff,"BENCH IN %u BYTES %u MS\r\n",bytes,HAL_GetTick() - start);
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x7B: BENCH USB OUT, cmd[8..9] KB streamed in and discarded
+	static void cmd_bench_out(void)
+		{
+			uint32_t count = cmdbuff[8];
+			count = (count << 8) + cmdbuff[9];
+			uint32_t done = 0;
+			uint32_t start = HAL_GetTick();
+			for(done = 0;done < count;done++)
+				{
+					if(stream_next() == 0) break;
+					stream_release();
+				}
+			stream_end();
+			if(done == count)
+				{
+					sprintf(displaybuff,"BENCH OUT %uK %u MS\r\n",done,HAL_GetTick() - start);
+				}
+			else
+				{
+					sprintf(displaybuff,"BENCH OUT TIMEOUT AT %uK\r\n",done);
+				}
+			CDC_Transmit(displaybuff);
+		}
+
+	// 0x7C: BENCH BUS READ, cmd[5..7] words read from address 0 the way a
+	// dump reads them, but nothing is sent
+	static void cmd_bench_bus(void)
+		{
+			uint32_t words = cmdbuff[5];
+			words = (words << 8) + cmdbuff[6];
+			words = (words << 8) + cmdbuff[7];
+			uint32_t address = 0;
+			read_mode();
+			MD_WR = 1;
+			MD_RD = 1;
+			MD_CS = 1;
+			uint32_t start = HAL_GetTick();
+			while(address < words)
+				{
+					uint32_t n = (words - address > 512) ? 512 : words - address;
+					chip_read(address, transmitBuffer, n);
+					address += n;
+				}
+			uint32_t ms = HAL_GetTick() - start;
+			write_mode();
+			sprintf(displaybuff,"BENCH BUS %u WORDS %u MS\r\n",words,ms);
+			CDC_Transmit(displaybuff);
+		}
+
+	typedef struct
+		{
+			uint8_t opcode;
+			uint8_t flags;
+			void (*run)(void);
+		} command_t;
+
+	static const command_t commands[] =
+		{
+			{0x0A, 0, cmd_rom_dump},
+			{0x2A, 0, cmd_range_dump},
+			{0x4A, 0, cmd_block_crc},
+			{0x1A, 0, cmd_sram_dump},
+			{0x5A, 0, cmd_sram_crc},
+			{0x6A, 0, cmd_sram_blocks},
+			{0x0B, CMD_BLOCK, cmd_rom_write},
+			{0x1B, CMD_BLOCK, cmd_sram_write},
+			{0x3B, CMD_STREAM, cmd_sram_stream},
+			{0x4B, CMD_STREAM|CMD_COUNT16, cmd_flash_image},
+			{0x0C, 0, cmd_connect},
+			{0x0D, 0, cmd_check_header},
+			{0x0E, 0, cmd_full_erase},
+			{0x1E, 0, cmd_size_erase},
+			{0x2E, 0, cmd_sector_erase},
+			{0x3D, 0, cmd_chip_info},
+			{0x4D, 0, cmd_selftest},
+			{0x6E, 0, cmd_prog_load},
+			{0x6F, 0, cmd_prog_run},
+			{0x3A, 0, cmd_blank_check},
+			{0x3E, 0, cmd_range_erase},
+			{0x0F, 0, cmd_buffer_clear},
+			{0x7A, 0, cmd_bench_in},
+			{0x7B, CMD_STREAM|CMD_COUNT16, cmd_bench_out},
+			{0x7C, 0, cmd_bench_bus},
+		};
+
+	static const command_t *command_find(uint8_t opcode)
+		{
+			for(uint32_t i = 0;i < sizeof(commands)/sizeof(commands[0]);i++)
+				{
+					if(commands[i].opcode == opcode) return &commands[i];
+				}
+			return 0;
+		}
+
+	// Called by the USB ISR for each packet with the command magic. Queues
+	// known commands and tells the ISR how to treat the packets after it:
+	// a stream's data blocks follow, and a command that programs the block
+	// already in receiveBuffer holds reception until it has run. A full
+	// queue also holds reception, so commands are never dropped.
+	// Returns 0 for an unknown opcode.
+	uint8_t command_queue(const uint8_t *cmd)
+		{
+			const command_t *c = command_find(cmd[0]);
+			if(c == 0) return 0;
+			uint8_t slot = cmdq_head % CMDQ_DEPTH;
+			memcpy(cmdq[slot], cmd, 64);
+			if(c->flags & CMD_STREAM)
+				{
+					uint32_t blocks = (c->flags & CMD_COUNT16) ? ((cmd[8] << 8) | cmd[9]) : cmd[8];
+					rxstream_left = blocks*16;
+					rxstream = (blocks > 0);
+					buffcnt = 0;
+					cmdq_gen[slot] = ++rxstream_gen;
+				}
+			__DMB();
+			cmdq_head++;
+			if(c->flags & CMD_BLOCK)
+				{
+					rxhold |= RX_HOLD_BLOCK;
+				}
+			if((uint8_t)(cmdq_head - cmdq_tail) >= CMDQ_DEPTH)
+				{
+					rxhold |= RX_HOLD_QUEUE;
+				}
+			return 1;
+		}
+
+	// Run the oldest queued command, if any, from cmdbuff. A nonzero tag
+	// byte asks for a completion event once the command's own reply is out.
+	void command_run(void)
+		{
+			if(cmdq_tail == cmdq_head) return;
+			__DMB();
+			memcpy(cmdbuff, cmdq[cmdq_tail % CMDQ_DEPTH], 64);
+			stream_gen = cmdq_gen[cmdq_tail % CMDQ_DEPTH];
+			__DMB();
+			cmdq_tail++;
+			rx_resume(RX_HOLD_QUEUE);
+			const command_t *c = command_find(cmdbuff[0]);
+			c->run();
+			if(c->flags & CMD_BLOCK)
+				{
+					memclear();
+					buffcnt = 0;
+					rx_resume(RX_HOLD_BLOCK);
+				}
+			if(cmdbuff[CMD_TAG] != 0)
+				{
+					sprintf(displaybuff,"CMD 0x%02X TAG %u DONE\r\n",cmdbuff[0],cmdbuff[CMD_TAG]);
+					CDC_Transmit(displaybuff);
+				}
+			cmdclear();
+		}
 	
 	
 /* USER CODE END 0 */
@@ -163,318 +1092,7 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
-		if (cmdbuff[0] == 0x0A) {//MD CHOOSE SIZE DUMP
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				uint32_t wsize = 0;
-				if(cmdbuff[5] == 0x04){
-				CDC_Transmit("4M ROM DUMP START!!!\r\n");
-				wsize = 4096;
-				}
-				else if(cmdbuff[5] == 0x02){
-				CDC_Transmit("1M ROM DUMP START!!!\r\n");
-				wsize = 1024;
-				}
-				else if(cmdbuff[5] == 0x03){
-				CDC_Transmit("2M ROM DUMP START!!!\r\n");
-				wsize = 2048;
-				}
-				else{
-				CDC_Transmit("512K ROM DUMP START!!!\r\n");
-				wsize = 512;	
-				}
-				read_mode();
-				MD_WR = 1;
-				MD_RD = 1;
-				MD_CS = 1;
-				memclearTX();
-				HAL_Delay(100);				
-				for(uint32_t j=0 ;j < wsize ; j++){						
-					for(uint16_t i = 0;i<512;i++){
-							setAddress(j*512+i);
-							MD_CS = 0;
-							MD_RD = 0;
-							Delay_nop(30);
-							transmitBuffer[i*2] = ((GPIOE->IDR) >>8) & 0xff;
-							transmitBuffer[i*2+1] = (GPIOE->IDR) & 0xff;							
-							MD_RD = 1;
-							MD_CS = 1;
-							Delay_nop(50);							
-						}
-					CDC_Transmit_FS(transmitBuffer, 1024);	
-					}
-				HAL_Delay(150);
-				CDC_Transmit("DUMPER ROM FINISH!!!\r\n");
-			}
-			CDC_Transmit("PUSH SAVE GAME BUTTON!!!\r\n");
-			write_mode();
-			cmdclear();
-			buffcnt = 0;
-			}		
-		if (cmdbuff[0] == 0x1A) {//MD SRAM CHOOSE SIZE DUMP
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				uint32_t wsize = 0;
-				if(cmdbuff[5] == 0x01){
-				CDC_Transmit("32K RAM DUMP START!!!\r\n");
-				wsize = 32;
-				}
-				else{
-				CDC_Transmit("8K ROM DUMP START!!!\r\n");
-				wsize = 8;	
-				}
-				enableSram_MD(1);			
-				MD_WR = 1;//WR=1
-				MD_RD = 1;//RD=1
-				MD_CS = 1;//CS=1
-				memclearTX();
-				HAL_Delay(100);				
-				for(uint32_t j=0 ;j < wsize ; j++){						
-					for(uint16_t i = 0;i<1024;i++){
-							setAddress(j*1024+i);
-							PAout(4) = 1;//A20=1
-							MD_CS = 0;//CS=0
-							MD_RD = 0;//RD=0
-							Delay_nop(30);
-							transmitBuffer[i] = (GPIOE->IDR) & 0xff;							
-							MD_CS = 1;//RD=1
-							MD_CS = 1;//CS=1
-							Delay_nop(50);							
-						}
-					CDC_Transmit_FS(transmitBuffer, 1024);	
-					}
-				HAL_Delay(150);
-				enableSram_MD(0);
-				CDC_Transmit("DUMPER RAM FINISH!!!\r\n");				
-			}
-			//CDC_Transmit("PUSH SAVE BUTTON!!!\r\n");
-			write_mode();
-			cmdclear();
-			buffcnt = 0;
-		}					
-		if (cmdbuff[0] == 0x0B) {//MD FLASH WRITE
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				uint32_t addj = cmdbuff[5];
-				uint32_t bank = cmdbuff[6];
-				uint32_t addw = bank*64*512+addj*512;
-				for(uint16_t i = 0;i<1024;i=i+2)
-					{
-						if((receiveBuffer[i/64][i%64]==0xff)&(receiveBuffer[i/64][i%64+1]==0xff))
-							{
-							}
-						else
-							{	
-								setByte(0x555,0xaa);
-								setByte(0x2aa,0x55);
-								setByte(0x555,0xa0);	
-								GPIO_WriteHigh(GPIOE, receiveBuffer[i/64][i%64]);								
-								GPIO_WriteLow(GPIOE,receiveBuffer[i/64][i%64+1]);
-								setAddress(i/2+addw);		
-								MD_CS = 0;
-								MD_WR = 0;
-								Delay_nop(35);
-								MD_WR = 1;
-								MD_CS = 1;
-								Delay_nop(80);
-							}
-					}	
-				buffcnt = 0;
-				memclear();
-				cmdclear();
-				bank=bank+1;
-				sprintf(displaybuff,"ADD:0x%X WRITE OK\r\n",addw);				
-				CDC_Transmit(displaybuff);
-			}
-		}
-		if (cmdbuff[0] == 0x1B) {//MD FLASH WRITE
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				uint32_t addj = cmdbuff[5];
-				uint32_t bank = cmdbuff[6];
-				uint32_t addw = bank*64*1024+addj*1024;
-				enableSram_MD(1);
-				write_mode();
-				for(uint16_t i = 0;i<1024;i++)
-					{
-						GPIO_WriteLow(GPIOE,receiveBuffer[i/64][i%64]);								
-						setAddress(i+addw);	
-						PAout(4) = 1;//A20=1	
-						Delay_nop(200);			
-						MD_CS = 0;//CS=0
-						MD_WR = 0;//WR=0						
-						Delay_nop(200);
-						MD_WR = 1;//CS=0
-						MD_CS = 1;//WR=0
-						Delay_nop(200);
-					}	
-				enableSram_MD(0);
-				buffcnt = 0;
-				memclear();
-				cmdclear();
-				bank=bank+1;
-				sprintf(displaybuff,"ADD:0x%X WRITE GK\r\n",addw);				
-				CDC_Transmit(displaybuff);
-			}
-		}
-		if (cmdbuff[0] == 0x0C) {//MD DUMPER CONNECT
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-			HAL_Delay(100);
-			CDC_Transmit("FlashMaster MD Dumper is connected\r\n");
-			cmdclear();
-				
-      buffcnt = 0;
-			}
-    }
-		if (cmdbuff[0] == 0x0D) {//MD CHECK HEADER
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-			read_mode();
-			checkid();
-			HAL_Delay(100);
-			//checkheadermenu();
-			write_mode();
-			cmdclear();
-			buffcnt = 0;
-			}
-		}		
-		if (cmdbuff[0] == 0x0E) {//MDFLASHERASE
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				eraseFLASH();
-				HAL_Delay(100);
-				CDC_Transmit("SRAM ERASE START\r\n");
-				enableSram_MD(1);
-				write_mode();
-					for(uint32_t j = 0;j<32768;j++)
-						{
-							GPIO_WriteLow(GPIOE,0x00);								
-							setAddress(j);	
-							PAout(4) = 1;//A20=1	
-							Delay_nop(200);			
-							MD_CS = 0;//CS=0
-							MD_WR = 0;//WR=0						
-							Delay_nop(200);
-							MD_WR = 1;//CS=0
-							MD_CS = 1;//WR=0
-							Delay_nop(200);
-						}	
-				enableSram_MD(0);
-				CDC_Transmit("SRAM ERASE FINISH!!!\r\n");
-				cmdclear();
-				buffcnt = 0;
-			}
-		}
-		if (cmdbuff[0] == 0x1E) {//MDCHOOSE SIZE SECTORERASE
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				uint32_t address = 0;
-				uint32_t sectoradd = 0;
-				if (cmdbuff[5] == 0x1)
-					{
-						CDC_Transmit("512K ERASEING\r\n");	
-						sectoradd = 0x40000;
-					}
-				else if (cmdbuff[5] == 0x2)
-					{
-						CDC_Transmit("1M ERASEING\r\n");	
-						sectoradd = 0x80000;
-					}
-				else if (cmdbuff[5] == 0x3)
-					{
-						CDC_Transmit("2M ERASEING\r\n");	
-						sectoradd = 0x100000;
-					}
-				else if (cmdbuff[5] == 0x4)
-					{
-						CDC_Transmit("4M ERASEING\r\n");	
-						sectoradd = 0x200000;
-					}
-				else if (cmdbuff[5] == 0x0)
-					{	
-						sectoradd = 1;
-						address = cmdbuff[6];
-						address =(address<<8)+cmdbuff[7];
-						address =(address<<8)+cmdbuff[8];
-						sprintf(displaybuff,"SECTORADD:0x%X ERASEING\r\n",address);
-						CDC_Transmit(displaybuff);
-					}
-				else
-					{
-						CDC_Transmit("512K ERASEING\r\n");	
-						sectoradd = 0x40000;	
-					}
-				if(cmdbuff[5] < 0x5){
-						for(uint32_t i = 0;i < sectoradd ;)
-							{
-								erase_sector(address);
-								Delay_nop(100);
-								CDC_Transmit(".");
-								if(address<0x8000)
-									{
-										address = address+0x1000;	
-										i = i+0x1000;	
-									}
-								else
-									{
-										address = address+0x8000;
-										i = i+0x8000;	
-									}		
-							}
-					}
-				else{
-						eraseFLASH();
-					}
-				if (cmdbuff[5] == 0x1)
-					{
-						CDC_Transmit("\r\n512K ERASE OK!\r\n");	
-					}
-				else if (cmdbuff[5] == 0x2)
-					{
-						CDC_Transmit("\r\n1M ERASE OK!\r\n");	
-					}
-				else if (cmdbuff[5] == 0x3)
-					{
-						CDC_Transmit("\r\n2M ERASE OK!\r\n");	
-					}
-				else if (cmdbuff[5] == 0x4)
-					{
-						CDC_Transmit("\r\n4M ERASE OK!\r\n");	
-					}
-				else if (cmdbuff[5] == 0x5)
-					{
-						CDC_Transmit("\r\n8M ERASE OK!\r\n");	
-					}
-				else if (cmdbuff[5] == 0x0)
-					{
-						sprintf(displaybuff,"SECTORADD:0x%X ERASE OK!\r\n",address);
-						CDC_Transmit(displaybuff);
-					}
-				else 
-					{
-						CDC_Transmit("\r\n512K ERASE OK!\r\n");	
-					}
-				write_mode();
-				cmdclear();
-				buffcnt = 0;
-			}
-    }
-		
-		if (cmdbuff[0] == 0x2E) {//MDSECTORERASE
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-				write_mode();
-				uint32_t address = cmdbuff[5];
-				address = ( address << 8 ) + cmdbuff[6];
-				address = ( address << 8 ) + cmdbuff[7];
-				erase_sector(address); 			
-				sprintf(displaybuff,"\r\nSECTORADD:0x%X ERASE OK!\r\n",address);
-				CDC_Transmit(displaybuff);	
-				cmdclear();
-				buffcnt = 0;
-			}
-    }
-		if (cmdbuff[0] == 0x0F) {//MDBUFFCLEAT
-			if((cmdbuff[1] == 0xAA)&&(cmdbuff[2] == 0x55)&&(cmdbuff[3] == 0xAA)&&(cmdbuff[4] == 0xBB)){
-			cmdclear();
-			buffcnt = 0;
-			bank = 0;
-			HAL_Delay(100);
-			CDC_Transmit("BUFF IS CLEAR\r\n");
-			}
-    }	
+		command_run();
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -23,8 +23,10 @@
 
 /* USER CODE BEGIN INCLUDE */
 extern uint8_t receiveBuffer[16][64];
-extern uint8_t buffcnt;
-extern uint8_t cmdbuff[64];
+extern volatile uint8_t buffcnt;
+extern volatile uint8_t rxstream;
+extern volatile uint32_t rxstream_left;
+extern volatile uint8_t rxhold;
 extern uint32_t datacnt;
 char charbuff[50];
 /* USER CODE END INCLUDE */
@@ -66,6 +68,8 @@ char charbuff[50];
   */
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+/* Second EP1 IN buffer for streamed dumps, in PMA left free by usbd_conf.c */
+#define CDC_STREAM_PMA_ALT  0x180U
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -98,6 +102,8 @@ uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
 uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+static uint16_t stream_pma[2];
+static uint8_t stream_fill;
 
 /* USER CODE END PRIVATE_VARIABLES */
 
@@ -263,21 +269,36 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-	if((Buf[1] == 0xAA)&&(Buf[2] == 0x55)&&(Buf[3] == 0xAA)&&(Buf[4] == 0xBB))
+	if((rxstream == 0)&&(Buf[1] == 0xAA)&&(Buf[2] == 0x55)&&(Buf[3] == 0xAA)&&(Buf[4] == 0xBB))
 		{
-			for(uint8_t i=0;i<64;i++)
-				{
-					cmdbuff[i] = Buf[i];
-				}
+			// queued for the main loop; may start a stream or hold reception
+			command_queue(Buf);
 		}
 	else
 		{
-			for(uint8_t i=0;i<64;i++)
+			if(buffcnt < 16)
+				{
+					for(uint8_t i=0;i<64;i++)
+						{
+							receiveBuffer[buffcnt][i] = Buf[i];
+						}
+				}
+			buffcnt++;
+			if(rxstream == 1)
 				{
-					receiveBuffer[buffcnt][i] = Buf[i];
+					// packets after the stream's last one are commands again
+					if(--rxstream_left == 0) rxstream = 0;
+					if(buffcnt >= 16)
+						{
+							// NAK further packets until the main loop has consumed this block
+							rxhold |= RX_HOLD_STREAM;
+						}
 				}
 		}
-	buffcnt++;
+	if(rxhold)
+		{
+			return (USBD_OK);
+		}
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
   USBD_CDC_ReceivePacket(&hUsbDeviceFS);
   return (USBD_OK);
@@ -311,6 +332,55 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
+/* Streamed IN transfers written in place. The caller fills one PMA buffer
+ * while the endpoint sends the other, swapping the endpoint's TX address
+ * between them; it only changes while the endpoint is NAKing. Each packet
+ * completion still reaches USBD_CDC_DataIn, which just clears TxState
+ * since total_length is zeroed first. */
+static volatile uint32_t *stream_buffer(uint16_t pma)
+{
+  return (volatile uint32_t *)(USB_PMAADDR + (uint32_t)pma * PMA_ACCESS);
+}
+
+static void stream_wait_idle(void)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)hUsbDeviceFS.pData;
+  while ((PCD_GET_EP_TX_STATUS(hpcd->Instance, CDC_IN_EP & 0x7FU) == USB_EP_TX_VALID) &&
+         (hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED)) {
+  }
+}
+
+volatile uint32_t *CDC_StreamBegin(void)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)hUsbDeviceFS.pData;
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  while ((hcdc->TxState != 0) && (hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED)) {
+  }
+  hUsbDeviceFS.ep_in[CDC_IN_EP & 0xFU].total_length = 0;
+  stream_pma[0] = hpcd->IN_ep[CDC_IN_EP & 0x7FU].pmaadress;
+  stream_pma[1] = CDC_STREAM_PMA_ALT;
+  stream_fill = 0;
+  return stream_buffer(stream_pma[0]);
+}
+
+volatile uint32_t *CDC_StreamSend(uint16_t len)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)hUsbDeviceFS.pData;
+  stream_wait_idle();
+  PCD_SET_EP_TX_ADDRESS(hpcd->Instance, CDC_IN_EP & 0x7FU, stream_pma[stream_fill]);
+  PCD_SET_EP_TX_CNT(hpcd->Instance, CDC_IN_EP & 0x7FU, len);
+  PCD_SET_EP_TX_STATUS(hpcd->Instance, CDC_IN_EP & 0x7FU, USB_EP_TX_VALID);
+  stream_fill ^= 1;
+  return stream_buffer(stream_pma[stream_fill]);
+}
+
+void CDC_StreamEnd(void)
+{
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef *)hUsbDeviceFS.pData;
+  stream_wait_idle();
+  PCD_SET_EP_TX_ADDRESS(hpcd->Instance, CDC_IN_EP & 0x7FU, stream_pma[0]);
+}
+
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
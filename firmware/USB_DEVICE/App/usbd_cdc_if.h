@@ -109,6 +109,12 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+/* Streamed IN packets built in the endpoint's packet memory: Begin and
+ * Send return the buffer to fill next (16-bit words at a 32-bit stride),
+ * Send queues the filled one, End waits for the last and restores EP1 */
+volatile uint32_t *CDC_StreamBegin(void);
+volatile uint32_t *CDC_StreamSend(uint16_t len);
+void CDC_StreamEnd(void);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
@@ -0,0 +1,521 @@
+/*
+ * FlashMD C++ API
+ * Coroutine layer over the core library (header only, C++20)
+ *
+ * The core is blocking and keeps its USB connection per thread, so every
+ * Device owns a worker thread that holds its connection. Operations are
+ * awaitables: co_await hands the call to the device's worker and resumes
+ * the coroutine on the Loop thread when it returns. One Loop thread can
+ * drive any number of flashers at once, without a thread per operation.
+ *
+ *   flashmd::Loop loop;
+ *   flashmd::Device dev;
+ *   auto dump = [&]() -> flashmd::Task<> {
+ *       flashmd::Session s(loop, dev);
+ *       if (co_await s.open() != FLASHMD_OK) co_return;
+ *       std::vector<uint8_t> header(512);
+ *       co_await s.read(0x100, header);
+ *       co_await s.read_rom("dump.bin");
+ *       co_await s.close();
+ *   };
+ *   loop.spawn(dump());
+ *   loop.run();
+ *
+ * Progress and messages arrive on Session::events(), an async stream
+ * another task can drain with co_await events().next().
+ */
+
+#ifndef FLASHMD_HPP
+#define FLASHMD_HPP
+
+#include <coroutine>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+
+extern "C" {
+#include "flashmd_core.h"
+}
+
+namespace flashmd {
+
+using Result = flashmd_result_t;
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().continuation;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+/* Fire-and-forget coroutine used by Loop::spawn */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} /* namespace detail */
+
+/*
+ * Lazy coroutine task. Starts when awaited (or spawned on a Loop) and
+ * resumes its awaiter when it finishes
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type : detail::PromiseBase {
+        std::optional<T> value;
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (m_handle) m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        m_handle.promise().continuation = awaiter;
+        return m_handle;
+    }
+    T await_resume() {
+        if (m_handle.promise().exception) {
+            std::rethrow_exception(m_handle.promise().exception);
+        }
+        return std::move(*m_handle.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <>
+class Task<void> {
+public:
+    struct promise_type : detail::PromiseBase {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_void() const noexcept {}
+    };
+
+    Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (m_handle) m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        m_handle.promise().continuation = awaiter;
+        return m_handle;
+    }
+    void await_resume() {
+        if (m_handle.promise().exception) {
+            std::rethrow_exception(m_handle.promise().exception);
+        }
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/*
+ * Event loop. Coroutines resume on the thread that calls run()
+ */
+class Loop {
+public:
+    Loop() = default;
+    Loop(const Loop &) = delete;
+    Loop &operator=(const Loop &) = delete;
+
+    /* Queue fn to run on the loop thread. Safe from any thread */
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(std::move(fn));
+        }
+        m_cv.notify_one();
+    }
+
+    /* Start a task on the loop thread */
+    template <typename T>
+    void spawn(Task<T> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks++;
+        }
+        drive(std::move(task));
+    }
+
+    /* Run posted work until every spawned task has finished */
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_tasks > 0 || !m_queue.empty()) {
+            if (m_queue.empty()) {
+                m_cv.wait(lock);
+                continue;
+            }
+            std::function<void()> fn = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    }
+
+    /* co_await loop.schedule() continues on the loop thread */
+    auto schedule() {
+        struct Awaiter {
+            Loop *loop;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { loop->post([h] { h.resume(); }); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{this};
+    }
+
+private:
+    template <typename T>
+    detail::Detached drive(Task<T> task) {
+        co_await schedule();
+        co_await std::move(task);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks--;
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_queue;
+    int m_tasks = 0;
+};
+
+/*
+ * A flasher connection. Its USB state lives on a worker thread owned by
+ * the Device and calls run there one at a time. Move-only; destroying it
+ * closes the connection and joins the worker
+ */
+class Device {
+public:
+    Device() : m_worker(std::make_unique<Worker>()) {}
+    Device(Device &&) noexcept = default;
+    Device &operator=(Device &&) noexcept = default;
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    /* Run fn on the device's worker thread */
+    void submit(std::function<void()> fn) { m_worker->submit(std::move(fn)); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> jobs;
+        bool stopping = false;
+        std::thread thread;
+
+        Worker() { thread = std::thread([this] { loop(); }); }
+        ~Worker() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+
+        void submit(std::function<void()> fn) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(fn));
+            }
+            cv.notify_one();
+        }
+
+        void loop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) break;
+                std::function<void()> fn = std::move(jobs.front());
+                jobs.pop_front();
+                lock.unlock();
+                fn();
+                lock.lock();
+            }
+            if (flashmd_is_open()) {
+                flashmd_close();
+            }
+        }
+    };
+
+    std::unique_ptr<Worker> m_worker;
+};
+
+/* Progress or a message from a running operation */
+struct Event {
+    enum Kind { PROGRESS, MESSAGE };
+    Kind kind = PROGRESS;
+    uint32_t current = 0;
+    uint32_t total = 0;
+    std::string text;
+    bool is_error = false;
+};
+
+/*
+ * Async stream of Events. Workers push from their threads; one task on
+ * the loop awaits next(), which yields nullopt once the stream is closed.
+ * Progress that has not been taken yet is replaced by newer progress
+ */
+class EventStream {
+public:
+    explicit EventStream(Loop &loop) : m_loop(&loop) {}
+    EventStream(const EventStream &) = delete;
+    EventStream &operator=(const EventStream &) = delete;
+
+    void push(Event ev) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (ev.kind == Event::PROGRESS && !m_queue.empty() &&
+            m_queue.back().kind == Event::PROGRESS) {
+            m_queue.back() = std::move(ev);
+        } else {
+            m_queue.push_back(std::move(ev));
+        }
+        wake();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        wake();
+    }
+
+    auto next() {
+        struct Awaiter {
+            EventStream *stream;
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> h) {
+                std::lock_guard<std::mutex> lock(stream->m_mutex);
+                if (!stream->m_queue.empty() || stream->m_closed) return false;
+                stream->m_waiter = h;
+                return true;
+            }
+            std::optional<Event> await_resume() {
+                std::lock_guard<std::mutex> lock(stream->m_mutex);
+                if (stream->m_queue.empty()) return std::nullopt;
+                Event ev = std::move(stream->m_queue.front());
+                stream->m_queue.pop_front();
+                return ev;
+            }
+        };
+        return Awaiter{this};
+    }
+
+private:
+    /* Called with m_mutex held */
+    void wake() {
+        if (m_waiter) {
+            std::coroutine_handle<> h = std::exchange(m_waiter, {});
+            m_loop->post([h] { h.resume(); });
+        }
+    }
+
+    Loop *m_loop;
+    std::mutex m_mutex;
+    std::deque<Event> m_queue;
+    std::coroutine_handle<> m_waiter;
+    bool m_closed = false;
+};
+
+/*
+ * Awaitable operations on a Device, resumed on a Loop. Holds the
+ * flashmd_config_t options and the event stream. Move-only; the Device
+ * must outlive it and stay put while an operation is in flight
+ */
+class Session {
+public:
+    Session(Loop &loop, Device &device)
+        : m_loop(&loop), m_device(&device), m_state(std::make_unique<State>(loop)) {}
+    Session(Session &&) noexcept = default;
+    Session &operator=(Session &&) noexcept = default;
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    /* Options for the following operations (verbose, skip_blank, ...) */
+    flashmd_config_t &config() { return m_state->config; }
+
+    EventStream &events() { return m_state->events; }
+
+    /* Awaitable running fn(config) on the device's worker; yields its Result */
+    template <typename F>
+    auto call(F fn) {
+        struct Awaiter {
+            Session *session;
+            F fn;
+            Result result = FLASHMD_OK;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) {
+                Loop *loop = session->m_loop;
+                State *state = session->m_state.get();
+                session->m_device->submit([this, h, loop, state] {
+                    result = fn(&state->config);
+                    loop->post([h] { h.resume(); });
+                });
+            }
+            Result await_resume() const noexcept { return result; }
+        };
+        return Awaiter{this, std::move(fn)};
+    }
+
+    /* Open the flasher at a USB path from flashmd_list_devices (empty = first) */
+    auto open(std::string path = {}) {
+        return call([path](const flashmd_config_t *) {
+            return flashmd_open_device(path.empty() ? nullptr : path.c_str());
+        });
+    }
+
+    /* Close the connection and the event stream */
+    auto close() {
+        EventStream *events = &m_state->events;
+        return call([events](const flashmd_config_t *) {
+            flashmd_close();
+            events->close();
+            return FLASHMD_OK;
+        });
+    }
+
+    auto chip_info(flashmd_chip_info_t &info) {
+        return call([&info](const flashmd_config_t *c) { return flashmd_get_chip_info(&info, c); });
+    }
+
+    /* Read buf.size() bytes of ROM from byte address addr (both even) */
+    auto read(uint32_t addr, std::span<uint8_t> buf) {
+        return call([addr, buf](const flashmd_config_t *c) {
+            return flashmd_read_range(addr, buf.data(), (uint32_t)buf.size(), c);
+        });
+    }
+
+    auto erase(uint32_t size_kb) {
+        return call([size_kb](const flashmd_config_t *c) { return flashmd_erase(size_kb, c); });
+    }
+
+    auto read_rom(std::string file, uint32_t size_kb = 0) {
+        return call([file, size_kb](const flashmd_config_t *c) {
+            return flashmd_read_rom(file.c_str(), size_kb, c);
+        });
+    }
+
+    auto write_rom(std::string file, uint32_t size_kb = 0) {
+        return call([file, size_kb](const flashmd_config_t *c) {
+            return flashmd_write_rom(file.c_str(), size_kb, c);
+        });
+    }
+
+    auto flash_image(std::string file, uint32_t size_kb = 0) {
+        return call([file, size_kb](const flashmd_config_t *c) {
+            return flashmd_flash_image(file.c_str(), size_kb, c);
+        });
+    }
+
+    auto verify_rom(std::string file, uint32_t size_kb = 0) {
+        return call([file, size_kb](const flashmd_config_t *c) {
+            return flashmd_verify_rom(file.c_str(), size_kb, c);
+        });
+    }
+
+    auto read_sram(std::string file) {
+        return call([file](const flashmd_config_t *c) { return flashmd_read_sram(file.c_str(), c); });
+    }
+
+    auto write_sram(std::string file) {
+        return call([file](const flashmd_config_t *c) { return flashmd_write_sram(file.c_str(), c); });
+    }
+
+private:
+    struct State {
+        flashmd_config_t config;
+        EventStream events;
+
+        explicit State(Loop &loop) : events(loop) {
+            flashmd_config_init(&config);
+            config.progress = onProgress;
+            config.message = onMessage;
+            config.user_data = this;
+        }
+
+        static void onProgress(uint32_t current, uint32_t total, void *userData) {
+            Event ev;
+            ev.kind = Event::PROGRESS;
+            ev.current = current;
+            ev.total = total;
+            static_cast<State *>(userData)->events.push(std::move(ev));
+        }
+
+        static void onMessage(const char *msg, int isError, void *userData) {
+            Event ev;
+            ev.kind = Event::MESSAGE;
+            ev.text = msg;
+            ev.is_error = isError != 0;
+            static_cast<State *>(userData)->events.push(std::move(ev));
+        }
+    };
+
+    Loop *m_loop;
+    Device *m_device;
+    std::unique_ptr<State> m_state;
+};
+
+} /* namespace flashmd */
+
+#endif /* FLASHMD_HPP */
@@ -0,0 +1,255 @@
+/*
+ * FlashMD Content Cache
+ *
+ * Layout under the cache directory:
+ *   objects/<len>-<crc32>-<fnv64>.bin   image contents, named by content
+ *   carts/<identity>.txt                last known image for a cart and
+ *                                       its per-sector hashes
+ */
+
+#include "flashmd_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+    #include <direct.h>
+    #include <process.h>
+    #define mkdir(path, mode) _mkdir(path)
+    #define getpid() _getpid()
+#else
+    #include <unistd.h>
+    #include <pwd.h>
+#endif
+
+#define SAMPLE_HEAD_BYTES   512
+#define SAMPLE_BYTES        256
+#define SAMPLE_COUNT        7
+#define SPOT_CHECK_BYTES    1024
+#define SPOT_CHECK_COUNT    8
+
+/* Cache directory, created on first use */
+int flashmd_cache_dir(char *out, size_t len, const char *sub) {
+    char base[FLASHMD_CACHE_PATH_LEN];
+#ifdef _WIN32
+    const char *local = getenv("LOCALAPPDATA");
+    if (!local) return -1;
+    snprintf(base, sizeof(base), "%s\\flashmd", local);
+    mkdir(base, 0755);
+    snprintf(out, len, "%s\\%s", base, sub);
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    /* Under sudo, keep the cache in the real user's home */
+    if (flashmd_real_uid() >= 0 && flashmd_real_uid() != (int)getuid()) {
+        struct passwd *pw = getpwuid((uid_t)flashmd_real_uid());
+        if (pw) home = pw->pw_dir;
+        xdg = NULL;
+    }
+    if (xdg && xdg[0]) {
+        snprintf(base, sizeof(base), "%s/flashmd", xdg);
+    } else if (home) {
+        char dot[FLASHMD_CACHE_PATH_LEN];
+        snprintf(dot, sizeof(dot), "%s/.cache", home);
+        if (mkdir(dot, 0755) == 0) flashmd_fix_ownership(dot);
+        snprintf(base, sizeof(base), "%s/.cache/flashmd", home);
+    } else {
+        return -1;
+    }
+    if (mkdir(base, 0755) == 0) flashmd_fix_ownership(base);
+    snprintf(out, len, "%s/%s", base, sub);
+#endif
+    if (mkdir(out, 0755) == 0) flashmd_fix_ownership(out);
+    return 0;
+}
+
+static uint64_t fnv1a64(uint64_t h, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+int flashmd_cache_identity(char *key, const flashmd_chip_info_t *info,
+                           const flashmd_config_t *config) {
+    flashmd_manifest_t m;
+    if (flashmd_read_manifest(&m, config) == FLASHMD_OK) {
+        snprintf(key, FLASHMD_CACHE_KEY_LEN, "%s-m%08X-%u", info->id, m.image_crc, m.image_len);
+        return 0;
+    }
+
+    /* Header (vectors, name, checksum) plus ranges spread over the chip */
+    uint8_t buf[SAMPLE_HEAD_BYTES];
+    if (flashmd_read_range(0, buf, SAMPLE_HEAD_BYTES, config) != FLASHMD_OK) return -1;
+    uint32_t crc = flashmd_crc32(0, buf, SAMPLE_HEAD_BYTES);
+    for (uint32_t k = 1; k <= SAMPLE_COUNT; k++) {
+        uint32_t addr = (info->size / (SAMPLE_COUNT + 1) * k) & ~1u;
+        if (flashmd_read_range(addr, buf, SAMPLE_BYTES, config) != FLASHMD_OK) return -1;
+        crc = flashmd_crc32(crc, buf, SAMPLE_BYTES);
+    }
+    snprintf(key, FLASHMD_CACHE_KEY_LEN, "%s-s%08X", info->id, crc);
+    return 0;
+}
+
+int flashmd_cache_lookup(const char *key, flashmd_manifest_t *hashes, char *object) {
+    char dir[FLASHMD_CACHE_PATH_LEN], path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    if (flashmd_cache_dir(dir, sizeof(dir), "carts") != 0) return -1;
+    snprintf(path, sizeof(path), "%s/%s.txt", dir, key);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char name[256];
+    unsigned long long timestamp = 0;
+    unsigned int len = 0, crc = 0, nsectors = 0;
+    memset(hashes, 0, sizeof(*hashes));
+    int ok = fscanf(fp, "object %255s\n", name) == 1 &&
+             fscanf(fp, "image %27[^\n]\n", hashes->name) == 1 &&
+             fscanf(fp, "length %u\n", &len) == 1 &&
+             fscanf(fp, "crc %x\n", &crc) == 1 &&
+             fscanf(fp, "time %llu\n", &timestamp) == 1 &&
+             fscanf(fp, "sectors %u\n", &nsectors) == 1 &&
+             nsectors <= FLASHMD_MANIFEST_MAX_SECTORS;
+    for (unsigned int i = 0; ok && i < nsectors; i++) {
+        unsigned int sector_crc;
+        ok = fscanf(fp, "%x", &sector_crc) == 1;
+        hashes->sector_crc[i] = sector_crc;
+    }
+    fclose(fp);
+    if (!ok) return -1;
+
+    hashes->image_len = len;
+    hashes->image_crc = crc;
+    hashes->timestamp = timestamp;
+    hashes->nsectors = nsectors;
+
+    if (flashmd_cache_dir(dir, sizeof(dir), "objects") != 0) return -1;
+    int n = snprintf(object, FLASHMD_CACHE_PATH_LEN, "%s/%s", dir, name);
+    if (n < 0 || n >= FLASHMD_CACHE_PATH_LEN) return -1;
+
+    struct stat st;
+    if (stat(object, &st) != 0 || (uint32_t)st.st_size != len) return -1;
+    return 0;
+}
+
+int flashmd_cache_spot_check(const char *object, uint32_t len, const flashmd_config_t *config) {
+    FILE *fp = fopen(object, "rb");
+    if (!fp) return -1;
+
+    uint8_t cart[SPOT_CHECK_BYTES], cached[SPOT_CHECK_BYTES];
+    uint32_t span = len & ~(uint32_t)(SPOT_CHECK_BYTES - 1);
+    int result = 0;
+    srand((unsigned int)time(NULL));
+
+    for (int i = 0; i < SPOT_CHECK_COUNT && result == 0; i++) {
+        /* Always the header, then random blocks */
+        uint32_t addr = 0;
+        if (i > 0 && span > SPOT_CHECK_BYTES) {
+            addr = ((uint32_t)rand() % (span / SPOT_CHECK_BYTES)) * SPOT_CHECK_BYTES;
+        }
+        uint32_t n = (len - addr < SPOT_CHECK_BYTES) ? (len - addr) & ~1u : SPOT_CHECK_BYTES;
+        if (n == 0) break;
+        fseek(fp, addr, SEEK_SET);
+        if (fread(cached, 1, n, fp) != n ||
+            flashmd_read_range(addr, cart, n, config) != FLASHMD_OK ||
+            memcmp(cart, cached, n) != 0) {
+            result = -1;
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+int flashmd_cache_store(const char *key, const char *image_file, const flashmd_manifest_t *hashes) {
+    char dir[FLASHMD_CACHE_PATH_LEN], tmp[FLASHMD_CACHE_PATH_LEN + 32];
+    char object[FLASHMD_CACHE_PATH_LEN + 64], name[64];
+    if (flashmd_cache_dir(dir, sizeof(dir), "objects") != 0) return -1;
+
+    FILE *in = fopen(image_file, "rb");
+    if (!in) return -1;
+    snprintf(tmp, sizeof(tmp), "%s/tmp.%d", dir, (int)getpid());
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+
+    uint8_t buffer[4096];
+    uint32_t copied = 0;
+    uint32_t crc = 0;
+    uint64_t fnv = 0xCBF29CE484222325ull;
+    while (copied < hashes->image_len) {
+        size_t want = hashes->image_len - copied;
+        if (want > sizeof(buffer)) want = sizeof(buffer);
+        size_t n = fread(buffer, 1, want, in);
+        if (n == 0) break;
+        crc = flashmd_crc32(crc, buffer, n);
+        fnv = fnv1a64(fnv, buffer, n);
+        if (fwrite(buffer, 1, n, out) != n) break;
+        copied += (uint32_t)n;
+    }
+    fclose(in);
+    if (fclose(out) != 0 || copied != hashes->image_len) {
+        remove(tmp);
+        return -1;
+    }
+
+    /* Content addressed: an identical image is only stored once */
+    snprintf(name, sizeof(name), "%u-%08X-%016llX.bin", copied, crc, (unsigned long long)fnv);
+    snprintf(object, sizeof(object), "%s/%s", dir, name);
+    struct stat st;
+    if (stat(object, &st) == 0) {
+        remove(tmp);
+    } else if (rename(tmp, object) != 0) {
+        remove(tmp);
+        return -1;
+    } else {
+        flashmd_fix_ownership(object);
+    }
+
+    char path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    if (flashmd_cache_dir(dir, sizeof(dir), "carts") != 0) return -1;
+    snprintf(path, sizeof(path), "%s/%s.txt", dir, key);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "object %s\n", name);
+    fprintf(fp, "image %s\n", hashes->name[0] ? hashes->name : "unknown");
+    fprintf(fp, "length %u\n", hashes->image_len);
+    fprintf(fp, "crc %08X\n", hashes->image_crc);
+    fprintf(fp, "time %llu\n", (unsigned long long)hashes->timestamp);
+    fprintf(fp, "sectors %u\n", hashes->nsectors);
+    for (uint32_t i = 0; i < hashes->nsectors; i++) {
+        fprintf(fp, "%08X\n", hashes->sector_crc[i]);
+    }
+    fclose(fp);
+    flashmd_fix_ownership(path);
+    return 0;
+}
+
+int flashmd_cache_copy_out(const char *object, const char *filename) {
+    FILE *in = fopen(object, "rb");
+    if (!in) return -1;
+    FILE *out = fopen(filename, "wb");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    uint8_t buffer[4096];
+    size_t n;
+    int result = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            result = -1;
+            break;
+        }
+    }
+    fclose(in);
+    if (fclose(out) != 0) result = -1;
+    flashmd_fix_ownership(filename);
+    return result;
+}
@@ -0,0 +1,55 @@
+/*
+ * FlashMD Content Cache
+ * Last known image per cart, kept on disk and keyed by cart identity.
+ *
+ * Internal to the core library; frontends enable it with config->cache.
+ */
+
+#ifndef FLASHMD_CACHE_H
+#define FLASHMD_CACHE_H
+
+#include <stdio.h>
+#include "flashmd_core.h"
+
+#define FLASHMD_CACHE_KEY_LEN   64
+#define FLASHMD_CACHE_PATH_LEN  1024
+
+/*
+ * Cart identity: flash ID plus the manifest's image CRC when the cart has
+ * one, otherwise a CRC of a few sampled ROM ranges.
+ * Returns 0 on success.
+ */
+int flashmd_cache_identity(char *key, const flashmd_chip_info_t *info,
+                           const flashmd_config_t *config);
+
+/* Find the last image stored for a cart. Returns 0 if found */
+int flashmd_cache_lookup(const char *key, flashmd_manifest_t *hashes, char *object);
+
+/* Compare a few ranges of a cached image with the cart. Returns 0 if they match */
+int flashmd_cache_spot_check(const char *object, uint32_t len, const flashmd_config_t *config);
+
+/* Store the first hashes->image_len bytes of image_file for a cart. Returns 0 on success */
+int flashmd_cache_store(const char *key, const char *image_file, const flashmd_manifest_t *hashes);
+
+/* Copy a cached image out to filename. Returns 0 on success */
+int flashmd_cache_copy_out(const char *object, const char *filename);
+
+/*
+ * Shared with flashmd_core.c and flashmd_plan.c
+ */
+
+/* Path of a subdirectory of the cache directory, created on first use.
+ * Returns 0 on success */
+int flashmd_cache_dir(char *out, size_t len, const char *sub);
+
+/* Hash an image per chip sector, as stored in a manifest */
+int flashmd_hash_image(FILE *fp, uint32_t len, const flashmd_chip_info_t *info,
+                       const char *filename, flashmd_manifest_t *m);
+
+/* Give a file created while running under sudo back to the real user */
+void flashmd_fix_ownership(const char *path);
+
+/* Real user ID set by flashmd_set_real_ids (-1 if unset) */
+int flashmd_real_uid(void);
+
+#endif /* FLASHMD_CACHE_H */
@@ -4,6 +4,7 @@
  */
 
 #include "flashmd_core.h"
+#include "flashmd_client.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,20 +31,64 @@ static void print_usage(const char *progname) {
     printf("  -s, --size <KB>          Size in kilobytes (for erase, read, write)\n");
     printf("                           Use 0 for auto-detect (read) or full erase\n");
     printf("  -n, --no-trim            Don't trim trailing 0xFF bytes (read only)\n");
-    printf("                           File will be exactly the specified size\n\n");
+    printf("                           File will be exactly the specified size\n");
+    printf("  -b, --skip-blank         Blank check first and erase only non-blank sectors\n");
+    printf("                           (erase, write)\n");
+    printf("  -m, --manifest           Keep an image manifest in the last sector (write)\n");
+    printf("                           Skips images the cart already holds and only\n");
+    printf("                           rewrites changed sectors\n");
+    printf("  -C, --cache              Keep the last image per cart in a local cache\n");
+    printf("                           Reads of a known cart are served from it after a\n");
+    printf("                           spot check; writes diff against it\n");
+    printf("  -D, --dry-run            Print the write plan and its estimated time, then stop\n");
+    printf("                           (write, flash)\n");
+    printf("  -k, --consensus          Hash the dump again on the cart and re-read blocks\n");
+    printf("                           that disagree until they agree (read)\n");
+    printf("  -K, --keep-going         Verify every sector instead of stopping at the\n");
+    printf("                           first one that differs (verify)\n");
+    printf("  --no-selftest            Skip the cart self-test run before each operation\n");
+    printf("  -d, --device <path>      Use the flasher at this USB path (see 'devices')\n");
+    printf("  --direct                 Open the USB device even if flashmd-daemon is running\n\n");
     printf("Commands:\n");
     printf("  -r, --read <file>        Read ROM to file (use -s for size, 0=auto)\n");
     printf("  -w, --write <file>       Write ROM file to flash (use -s to limit size)\n");
     printf("  -e, --erase              Erase flash (use -s for size, 0=full)\n");
+    printf("  -f, --flash <file>       Erase and write ROM file in one pass\n");
+    printf("  -c, --compare <file>     Compare ROM file with the cart manifest\n");
+    printf("  -V, --verify <file>      Read the cart back and compare it with a ROM file\n");
+    printf("  -P, --pack <file> <out>  Pack a ROM for repeated writes on this chip type\n");
+    printf("                           (-w and -V take the pack in place of the ROM)\n");
+    printf("  -B, --backup-sram <file> Back up SRAM, reading only blocks changed since the\n");
+    printf("                           cart's last backup, and keep its save history\n");
+    printf("  -X, --save-version <n> <file>  Write version n of the cart's save to file\n");
+    printf("                           (0 = latest, see 'saves')\n");
+    printf("  -p, --program <file>     Run a bus micro-program on the flasher and dump\n");
+    printf("                           what it emits (see flashmd_prog.h for the ops)\n");
     printf("  connect                  Test connection to device\n");
     printf("  id                       Read flash chip ID\n");
-    printf("  clear                    Clear device buffer\n\n");
+    printf("  info                     Show flash chip geometry and timings\n");
+    printf("  manifest                 Show what the cart manifest says is flashed\n");
+    printf("  selftest                 Check the cart is seated: data and address lines, ID\n");
+    printf("  clear                    Clear device buffer\n");
+    printf("  bench                    Measure USB and cartridge bus speed (-s KB per test)\n");
+    printf("  saves                    List the saved SRAM versions of the cart\n");
+    printf("  devices                  List attached flashers\n\n");
+    printf("When flashmd-daemon is running, jobs are sent to it and no root is needed.\n\n");
     printf("Examples:\n");
     printf("  %s -e -s 1024            Erase 1MB (1024 KB)\n", progname);
     printf("  %s -w original.bin      Write file (uses file size)\n", progname);
     printf("  %s -w original.bin -s 768  Write 768 KB from file\n", progname);
+    printf("  %s -f original.bin      Erase only what the file covers, then write it\n", progname);
+    printf("  %s -w original.bin -b   Erase non-blank sectors, then write\n", progname);
+    printf("  %s -w original.bin -m   Write with a manifest (skips unchanged sectors)\n", progname);
+    printf("  %s -w original.bin -m -D  Show what a write would do and how long it takes\n", progname);
+    printf("  %s -P game.bin game.fmp  Pack once, then -w game.fmp -b for each cart\n", progname);
+    printf("  %s -r dump.bin -C       Read, or copy from the cache if the cart is known\n", progname);
     printf("  %s -r dump.bin -s 768    Read 768 KB to file (trimmed)\n", progname);
     printf("  %s -r dump.bin -s 1024 -n  Read 1MB, no trim (exactly 1MB)\n", progname);
+    printf("  %s -r dump.bin -k       Read a worn cart, re-reading blocks until they agree\n", progname);
+    printf("  %s -B game.srm          Back up the save, fetching only what changed\n", progname);
+    printf("  %s -X 3 old.srm         Get back the third saved version of it\n", progname);
     printf("  %s -r dump.bin -s 0      Auto-detect size (read 4MB and trim)\n", progname);
 }
 
@@ -71,11 +116,24 @@ int main(int argc, char *argv[]) {
     }
 
     /* Parse arguments */
-    int do_read = 0, do_write = 0, do_erase = 0;
+    int do_read = 0, do_write = 0, do_erase = 0, do_flash = 0, do_compare = 0, do_verify = 0, do_pack = 0;
+    int do_backup = 0, do_save_version = 0, do_program = 0;
+    int save_version = 0;
+    const char *pack_file = NULL;
     const char *read_file = NULL;
     const char *write_file = NULL;
     uint32_t size_kb = 0;
     int no_trim = 0;
+    int skip_blank = 0;
+    int manifest = 0;
+    int cache = 0;
+    int dry_run = 0;
+    int consensus = 0;
+    int keep_going = 0;
+    int no_selftest = 0;
+    const char *compare_file = NULL;
+    const char *device = NULL;
+    int direct = 0;
     int verbose = 0;
     const char *legacy_command = NULL;
 
@@ -106,13 +164,106 @@ int main(int argc, char *argv[]) {
             }
             write_file = argv[++i];
         }
+        else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--flash") == 0) {
+            do_flash = 1;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -f requires a filename\n");
+                return 1;
+            }
+            write_file = argv[++i];
+        }
         else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--erase") == 0) {
             do_erase = 1;
         }
         else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--no-trim") == 0) {
             no_trim = 1;
         }
-        else if (strcmp(argv[i], "connect") == 0 || strcmp(argv[i], "id") == 0 || strcmp(argv[i], "clear") == 0) {
+        else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--skip-blank") == 0) {
+            skip_blank = 1;
+        }
+        else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--manifest") == 0) {
+            manifest = 1;
+        }
+        else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--cache") == 0) {
+            cache = 1;
+        }
+        else if (strcmp(argv[i], "-D") == 0 || strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        }
+        else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--consensus") == 0) {
+            consensus = 1;
+        }
+        else if (strcmp(argv[i], "-K") == 0 || strcmp(argv[i], "--keep-going") == 0) {
+            keep_going = 1;
+        }
+        else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--compare") == 0) {
+            do_compare = 1;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -c requires a filename\n");
+                return 1;
+            }
+            compare_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-V") == 0 || strcmp(argv[i], "--verify") == 0) {
+            do_verify = 1;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -V requires a filename\n");
+                return 1;
+            }
+            compare_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "--pack") == 0) {
+            do_pack = 1;
+            if (i + 2 >= argc) {
+                fprintf(stderr, "Error: -P requires a ROM file and a pack file\n");
+                return 1;
+            }
+            write_file = argv[++i];
+            pack_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--backup-sram") == 0) {
+            do_backup = 1;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -B requires a filename\n");
+                return 1;
+            }
+            read_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-X") == 0 || strcmp(argv[i], "--save-version") == 0) {
+            do_save_version = 1;
+            if (i + 2 >= argc) {
+                fprintf(stderr, "Error: -X requires a version number and a filename\n");
+                return 1;
+            }
+            save_version = atoi(argv[++i]);
+            read_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--program") == 0) {
+            do_program = 1;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -p requires a program file\n");
+                return 1;
+            }
+            write_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--device") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: -d requires a USB path\n");
+                return 1;
+            }
+            device = argv[++i];
+        }
+        else if (strcmp(argv[i], "--direct") == 0) {
+            direct = 1;
+        }
+        else if (strcmp(argv[i], "--no-selftest") == 0) {
+            no_selftest = 1;
+        }
+        else if (strcmp(argv[i], "connect") == 0 || strcmp(argv[i], "id") == 0 ||
+                 strcmp(argv[i], "info") == 0 || strcmp(argv[i], "manifest") == 0 ||
+                 strcmp(argv[i], "clear") == 0 || strcmp(argv[i], "devices") == 0 ||
+                 strcmp(argv[i], "bench") == 0 || strcmp(argv[i], "saves") == 0 ||
+                 strcmp(argv[i], "selftest") == 0) {
             if (!legacy_command) {
                 legacy_command = argv[i];
             } else {
@@ -133,28 +284,104 @@ int main(int argc, char *argv[]) {
     flashmd_config_init(&config);
     config.verbose = verbose;
     config.no_trim = no_trim;
+    config.skip_blank = skip_blank;
+    config.manifest = manifest;
+    config.cache = cache;
+    config.dry_run = dry_run;
+    config.consensus = consensus;
+    config.keep_going = keep_going;
+    config.no_selftest = no_selftest;
     /* Use NULL callbacks = default to printf */
 
     /* Check for conflicting commands */
-    if (legacy_command && (do_read || do_write || do_erase)) {
-        fprintf(stderr, "Error: Cannot combine '%s' with -r, -w, or -e\n", legacy_command);
+    if (legacy_command && (do_read || do_write || do_erase || do_flash || do_compare || do_verify || do_pack ||
+                           do_backup || do_save_version || do_program)) {
+        fprintf(stderr, "Error: Cannot combine '%s' with -r, -w, -e, -f, -c, -V, -P, -B, -X, or -p\n", legacy_command);
         print_usage(argv[0]);
         return 1;
     }
 
-    /* Support legacy command format */
-    if (legacy_command) {
-        flashmd_result_t r = flashmd_open();
-        if (r != FLASHMD_OK) {
-            fprintf(stderr, "Could not open USB device: %s\n", flashmd_error_string(r));
+    /* Validate that exactly one action is specified */
+    int action_count = (do_read ? 1 : 0) + (do_write ? 1 : 0) + (do_erase ? 1 : 0) + (do_flash ? 1 : 0) +
+                       (do_compare ? 1 : 0) + (do_verify ? 1 : 0) + (do_pack ? 1 : 0) +
+                       (do_backup ? 1 : 0) + (do_save_version ? 1 : 0) + (do_program ? 1 : 0);
+    if (!legacy_command && action_count == 0) {
+        fprintf(stderr, "Error: No action specified. Use -r, -w, -e, -f, -c, -V, -P, -B, -X, or -p\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (action_count > 1) {
+        fprintf(stderr, "Error: Only one action (-r, -w, -e, -f, -c, -V, -P, -B, -X, or -p) can be specified\n");
+        return 1;
+    }
+
+    /* Daemon job: the same operation under its protocol name */
+    const char *op = legacy_command;
+    const char *file = NULL;
+    if (do_erase) op = "erase";
+    else if (do_read) { op = "read"; file = read_file; }
+    else if (do_write) { op = "write"; file = write_file; }
+    else if (do_flash) { op = "flash"; file = write_file; }
+    else if (do_compare) { op = "compare"; file = compare_file; }
+    else if (do_verify) { op = "verify"; file = compare_file; }
+    else if (do_backup) { op = "backup-sram"; file = read_file; }
+    else if (do_save_version) { op = "save-version"; file = read_file; size_kb = (uint32_t)save_version; }
+    else if (do_program) { op = "program"; file = write_file; }
+
+    /* A pack job would need two files; packing always drives the flasher itself */
+    int daemon_fd = (direct || do_pack) ? -1 : flashmd_client_connect(flashmd_client_socket_path());
+
+    if (strcmp(op, "devices") == 0) {
+        char paths[16][FLASHMD_DEVICE_PATH_LEN];
+        int busy[16] = {0};
+        int n = (daemon_fd >= 0) ? flashmd_client_list(daemon_fd, paths, busy, 16)
+                                 : flashmd_list_devices(paths, 16);
+        flashmd_client_close(daemon_fd);
+        if (n < 0) {
+            fprintf(stderr, "Could not list devices\n");
             return 1;
         }
+        for (int i = 0; i < n; i++) {
+            printf("%s%s\n", paths[i], busy[i] ? " (busy)" : "");
+        }
+        if (n == 0) printf("No flashers found\n");
+        return 0;
+    }
+
+    if (daemon_fd >= 0) {
+        /* The daemon finishes a running job on its own; Ctrl-C just leaves */
+        signal(SIGINT, SIG_DFL);
+        flashmd_result_t result = flashmd_client_run(daemon_fd, op, file, size_kb, device, &config);
+        flashmd_client_close(daemon_fd);
+        if (result != FLASHMD_OK) {
+            fprintf(stderr, "Error: %s\n", flashmd_error_string(result));
+        }
+        return (result == FLASHMD_OK) ? 0 : 1;
+    }
+
+    flashmd_result_t r = flashmd_open_device(device);
+    if (r != FLASHMD_OK) {
+        fprintf(stderr, "Could not open USB device: %s\n", flashmd_error_string(r));
+        return 1;
+    }
 
+    /* Support legacy command format */
+    if (legacy_command) {
         flashmd_result_t result;
         if (strcmp(legacy_command, "connect") == 0) {
             result = flashmd_connect(&config);
         } else if (strcmp(legacy_command, "id") == 0) {
             result = flashmd_check_id(&config);
+        } else if (strcmp(legacy_command, "info") == 0) {
+            result = flashmd_print_chip_info(&config);
+        } else if (strcmp(legacy_command, "manifest") == 0) {
+            result = flashmd_show_manifest(NULL, &config);
+        } else if (strcmp(legacy_command, "bench") == 0) {
+            result = flashmd_bench(size_kb, &config);
+        } else if (strcmp(legacy_command, "selftest") == 0) {
+            result = flashmd_print_selftest(&config);
+        } else if (strcmp(legacy_command, "saves") == 0) {
+            result = flashmd_sram_history(NULL, 0, &config);
         } else {
             result = flashmd_clear_buffer(&config);
         }
@@ -162,24 +389,6 @@ int main(int argc, char *argv[]) {
         return (result == FLASHMD_OK) ? 0 : 1;
     }
 
-    /* Validate that exactly one action is specified */
-    int action_count = (do_read ? 1 : 0) + (do_write ? 1 : 0) + (do_erase ? 1 : 0);
-    if (action_count == 0) {
-        fprintf(stderr, "Error: No action specified. Use -r, -w, or -e\n");
-        print_usage(argv[0]);
-        return 1;
-    }
-    if (action_count > 1) {
-        fprintf(stderr, "Error: Only one action (-r, -w, or -e) can be specified\n");
-        return 1;
-    }
-
-    flashmd_result_t r = flashmd_open();
-    if (r != FLASHMD_OK) {
-        fprintf(stderr, "Could not open USB device: %s\n", flashmd_error_string(r));
-        return 1;
-    }
-
     flashmd_result_t result = FLASHMD_OK;
 
     if (do_erase) {
@@ -201,6 +410,27 @@ int main(int argc, char *argv[]) {
             result = flashmd_write_rom(write_file, size_kb, &config);
         }
     }
+    else if (do_flash) {
+        result = flashmd_flash_image(write_file, size_kb, &config);
+    }
+    else if (do_compare) {
+        result = flashmd_show_manifest(compare_file, &config);
+    }
+    else if (do_verify) {
+        result = flashmd_verify_rom(compare_file, size_kb, &config);
+    }
+    else if (do_pack) {
+        result = flashmd_pack_rom(write_file, size_kb, pack_file, &config);
+    }
+    else if (do_backup) {
+        result = flashmd_backup_sram(read_file, &config);
+    }
+    else if (do_save_version) {
+        result = flashmd_sram_history(read_file, save_version, &config);
+    }
+    else if (do_program) {
+        result = flashmd_run_program_file(write_file, &config);
+    }
 
     flashmd_close();
     return (result == FLASHMD_OK) ? 0 : 1;
@@ -0,0 +1,275 @@
+/*
+ * FlashMD Daemon Client
+ * Thin-client side of the flashmd-daemon protocol
+ */
+
+#include "flashmd_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
+void flashmd_line_escape(char *out, size_t len, const char *in) {
+    size_t o = 0;
+    for (; *in && o + 2 < len; in++) {
+        if (*in == '\\') {
+            out[o++] = '\\';
+            out[o++] = '\\';
+        } else if (*in == '\n') {
+            out[o++] = '\\';
+            out[o++] = 'n';
+        } else if (*in != '\r') {
+            out[o++] = *in;
+        }
+    }
+    out[o] = '\0';
+}
+
+void flashmd_line_unescape(char *s) {
+    char *o = s;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1] == 'n') {
+            *o++ = '\n';
+            s++;
+        } else if (*s == '\\' && s[1] == '\\') {
+            *o++ = '\\';
+            s++;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+}
+
+const char *flashmd_client_socket_path(void) {
+    const char *env = getenv(FLASHMD_SOCKET_ENV);
+    return (env && env[0]) ? env : FLASHMD_DAEMON_SOCKET;
+}
+
+#ifdef _WIN32
+
+/* No daemon on Windows: frontends always drive the device directly */
+int flashmd_client_connect(const char *socket_path) {
+    (void)socket_path;
+    return -1;
+}
+
+void flashmd_client_close(int fd) {
+    (void)fd;
+}
+
+flashmd_result_t flashmd_client_run(int fd, const char *op, const char *filename,
+                                    uint32_t size_kb, const char *device,
+                                    const flashmd_config_t *config) {
+    (void)fd; (void)op; (void)filename; (void)size_kb; (void)device; (void)config;
+    return FLASHMD_ERR_DEVICE_NOT_FOUND;
+}
+
+int flashmd_client_list(int fd, char paths[][FLASHMD_DEVICE_PATH_LEN], int *busy, int max) {
+    (void)fd; (void)paths; (void)busy; (void)max;
+    return -1;
+}
+
+#else
+
+/* Buffered line reader over the socket */
+typedef struct {
+    int fd;
+    char buf[FLASHMD_LINE_MAX * 4];
+    size_t len;
+} line_reader_t;
+
+static int read_line(line_reader_t *lr, char *line, size_t max) {
+    while (1) {
+        char *nl = memchr(lr->buf, '\n', lr->len);
+        if (nl) {
+            size_t n = nl - lr->buf;
+            size_t copy = (n < max - 1) ? n : max - 1;
+            memcpy(line, lr->buf, copy);
+            line[copy] = '\0';
+            lr->len -= n + 1;
+            memmove(lr->buf, nl + 1, lr->len);
+            return (int)copy;
+        }
+        if (lr->len == sizeof(lr->buf)) {
+            lr->len = 0;    /* overlong line, drop it */
+        }
+        ssize_t r = recv(lr->fd, lr->buf + lr->len, sizeof(lr->buf) - lr->len, 0);
+        if (r < 0 && errno == EINTR) {
+            if (flashmd_get_interrupted()) return -1;
+            continue;
+        }
+        if (r <= 0) return -1;
+        lr->len += r;
+    }
+}
+
+static int send_line(int fd, const char *line, int file_fd) {
+    struct iovec iov = {(void *)line, strlen(line)};
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (file_fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+    }
+    return (sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len) ? 0 : -1;
+}
+
+static void client_msg(const flashmd_config_t *config, int is_error, const char *text) {
+    if (config && config->message) {
+        config->message(text, is_error, config->user_data);
+    } else {
+        fprintf(is_error ? stderr : stdout, "%s", text);
+        fflush(is_error ? stderr : stdout);
+    }
+}
+
+int flashmd_client_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void flashmd_client_close(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+/* Which ops read from the file and which dump into it */
+static int op_file_mode(const char *op) {
+    if (strcmp(op, "read") == 0 || strcmp(op, "read-sram") == 0 || strcmp(op, "backup-sram") == 0 ||
+        strcmp(op, "save-version") == 0) {
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    if (strcmp(op, "write") == 0 || strcmp(op, "flash") == 0 || strcmp(op, "verify") == 0 ||
+        strcmp(op, "sync") == 0 || strcmp(op, "compare") == 0 || strcmp(op, "write-sram") == 0 ||
+        strcmp(op, "program") == 0) {
+        return O_RDONLY;
+    }
+    return -1;
+}
+
+flashmd_result_t flashmd_client_run(int fd, const char *op, const char *filename,
+                                    uint32_t size_kb, const char *device,
+                                    const flashmd_config_t *config) {
+    int mode = op_file_mode(op);
+    int file_fd = -1;
+    const char *name = "-";
+    if (mode >= 0) {
+        if (!filename) return FLASHMD_ERR_INVALID_PARAM;
+        file_fd = open(filename, mode, 0644);
+        if (file_fd < 0) {
+            char text[FLASHMD_LINE_MAX];
+            snprintf(text, sizeof(text), "Error opening %s: %s\n", filename, strerror(errno));
+            client_msg(config, 1, text);
+            return FLASHMD_ERR_FILE;
+        }
+        const char *base = strrchr(filename, '/');
+        name = base ? base + 1 : filename;
+    }
+
+    unsigned int flags = 0;
+    if (config) {
+        if (config->verbose) flags |= FLASHMD_JOB_VERBOSE;
+        if (config->no_trim) flags |= FLASHMD_JOB_NO_TRIM;
+        if (config->skip_blank) flags |= FLASHMD_JOB_SKIP_BLANK;
+        if (config->manifest) flags |= FLASHMD_JOB_MANIFEST;
+        if (config->cache) flags |= FLASHMD_JOB_CACHE;
+        if (config->dry_run) flags |= FLASHMD_JOB_DRY_RUN;
+        if (config->consensus) flags |= FLASHMD_JOB_CONSENSUS;
+        if (config->keep_going) flags |= FLASHMD_JOB_KEEP_GOING;
+        if (config->no_selftest) flags |= FLASHMD_JOB_NO_SELFTEST;
+    }
+
+    char line[FLASHMD_LINE_MAX];
+    snprintf(line, sizeof(line), "JOB %s %s %u %u %s\n", op, device ? device : "any",
+             size_kb, flags, name);
+    int sent = send_line(fd, line, file_fd);
+    if (file_fd >= 0) close(file_fd);
+    if (sent < 0) return FLASHMD_ERR_IO;
+
+    line_reader_t lr;
+    lr.fd = fd;
+    lr.len = 0;
+    while (read_line(&lr, line, sizeof(line)) >= 0) {
+        unsigned int id, a, b;
+        int result, is_error, pos = 0;
+        char text[FLASHMD_LINE_MAX + 16], where[FLASHMD_DEVICE_PATH_LEN];
+        if (sscanf(line, "PROGRESS %u %u %u", &id, &a, &b) == 3) {
+            if (config && config->progress) {
+                config->progress(a, b, config->user_data);
+            } else {
+                printf("\rProgress: %u / %u KB", a / 1024, b / 1024);
+                fflush(stdout);
+            }
+        } else if (sscanf(line, "LOG %u %d %n", &id, &is_error, &pos) == 2 && pos > 0) {
+            flashmd_line_unescape(line + pos);
+            client_msg(config, is_error, line + pos);
+        } else if (sscanf(line, "QUEUED %u %u", &id, &a) == 2) {
+            if (a > 0) {
+                snprintf(text, sizeof(text), "Queued behind %u job%s\n", a, (a == 1) ? "" : "s");
+                client_msg(config, 0, text);
+            }
+        } else if (sscanf(line, "START %u %31s", &id, where) == 2) {
+            if (config && config->verbose) {
+                char started[FLASHMD_DEVICE_PATH_LEN + 64];
+                snprintf(started, sizeof(started), "Job %u running on flasher %s\n", id, where);
+                client_msg(config, 0, started);
+            }
+        } else if (sscanf(line, "DONE %u %d", &id, &result) == 2) {
+            return (flashmd_result_t)result;
+        } else if (strncmp(line, "ERROR ", 6) == 0) {
+            snprintf(text, sizeof(text), "Daemon: %s\n", line + 6);
+            client_msg(config, 1, text);
+            return FLASHMD_ERR_INVALID_PARAM;
+        }
+    }
+    return flashmd_get_interrupted() ? FLASHMD_ERR_INTERRUPTED : FLASHMD_ERR_IO;
+}
+
+int flashmd_client_list(int fd, char paths[][FLASHMD_DEVICE_PATH_LEN], int *busy, int max) {
+    if (send_line(fd, "LIST\n", -1) < 0) return -1;
+
+    line_reader_t lr;
+    lr.fd = fd;
+    lr.len = 0;
+    char line[FLASHMD_LINE_MAX];
+    int count = 0;
+    while (read_line(&lr, line, sizeof(line)) >= 0) {
+        char path[FLASHMD_DEVICE_PATH_LEN], state[16];
+        if (strcmp(line, "END") == 0) return count;
+        if (sscanf(line, "DEVICE %31s %15s", path, state) == 2 && count < max) {
+            snprintf(paths[count], FLASHMD_DEVICE_PATH_LEN, "%s", path);
+            if (busy) busy[count] = (strcmp(state, "busy") == 0);
+            count++;
+        }
+    }
+    return -1;
+}
+
+#endif /* _WIN32 */
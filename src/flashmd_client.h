@@ -0,0 +1,80 @@
+/*
+ * FlashMD Daemon Client
+ * Submits jobs to flashmd-daemon over its Unix-domain socket.
+ *
+ * The client opens the ROM/SRAM file itself and passes the descriptor
+ * with the job, so the daemon never touches paths with its own rights
+ * and dumps end up owned by whoever asked for them.
+ *
+ * Wire protocol, one text line per message:
+ *   client: LIST
+ *           JOB <op> <device|any> <size_kb> <flags> <name>   (+ file fd)
+ *   daemon: DEVICE <path> <idle|busy|gone> <job id or ->  ... END
+ *           QUEUED <id> <jobs ahead>
+ *           START <id> <device>
+ *           PROGRESS <id> <current> <total>
+ *           LOG <id> <is_error> <text, \n and \\ escaped>
+ *           DONE <id> <flashmd_result_t>
+ *           ERROR <text>
+ */
+
+#ifndef FLASHMD_CLIENT_H
+#define FLASHMD_CLIENT_H
+
+#include "flashmd_core.h"
+
+#define FLASHMD_DAEMON_SOCKET   "/run/flashmd.sock"
+#define FLASHMD_SOCKET_ENV      "FLASHMD_SOCKET"
+#define FLASHMD_LINE_MAX        1024
+
+/* Job flags, taken from flashmd_config_t */
+#define FLASHMD_JOB_VERBOSE     0x01
+#define FLASHMD_JOB_NO_TRIM     0x02
+#define FLASHMD_JOB_SKIP_BLANK  0x04
+#define FLASHMD_JOB_MANIFEST    0x08
+#define FLASHMD_JOB_CACHE       0x10
+#define FLASHMD_JOB_DRY_RUN     0x20
+#define FLASHMD_JOB_CONSENSUS   0x40
+#define FLASHMD_JOB_KEEP_GOING  0x80
+#define FLASHMD_JOB_NO_SELFTEST 0x100
+
+/*
+ * Job operations: read, write, erase, flash, verify, compare, sync
+ * (write only what differs, keeping a manifest), read-sram, write-sram,
+ * backup-sram, save-version (the size is the version), saves,
+ * connect, id, info, manifest, clear, selftest, program (a bus
+ * micro-program's source)
+ */
+
+/* Socket path: $FLASHMD_SOCKET, else FLASHMD_DAEMON_SOCKET */
+const char *flashmd_client_socket_path(void);
+
+/* Connect to the daemon. Returns a socket fd, or -1 if none is running */
+int flashmd_client_connect(const char *socket_path);
+
+/* Close a daemon connection */
+void flashmd_client_close(int fd);
+
+/*
+ * Run one job and wait for it, passing progress and messages to the
+ * config callbacks. device is a USB path or NULL for any free flasher
+ */
+flashmd_result_t flashmd_client_run(int fd, const char *op, const char *filename,
+                                    uint32_t size_kb, const char *device,
+                                    const flashmd_config_t *config);
+
+/* List the daemon's flashers. busy[i] is 1 while a job runs on paths[i].
+ * Returns the count, or -1 on error */
+int flashmd_client_list(int fd, char paths[][FLASHMD_DEVICE_PATH_LEN], int *busy, int max);
+
+/*
+ * Shared with flashmd_daemon.c
+ */
+
+/* Escape \ and newlines so a message fits on one protocol line */
+void flashmd_line_escape(char *out, size_t len, const char *in);
+
+/* Undo flashmd_line_escape in place */
+void flashmd_line_unescape(char *s);
+
+#endif /* FLASHMD_CLIENT_H */
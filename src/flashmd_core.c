@@ -4,12 +4,18 @@
  */
 
 #include "flashmd_core.h"
+#include "flashmd_cache.h"
+#include "flashmd_plan.h"
+#include "flashmd_pack.h"
+#include "flashmd_sram.h"
+#include "flashmd_prog.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <libusb.h>
 
 /* Platform detection */
@@ -45,6 +51,21 @@
 #define CMD_READ_SRAM     0x1A
 #define CMD_WRITE_SRAM    0x1B
 #define CMD_SECTOR_ERASE  0x1E
+#define CMD_STREAM_SRAM   0x3B
+#define CMD_CHIP_INFO     0x3D
+#define CMD_SELFTEST      0x4D
+#define CMD_RANGE_ERASE   0x3E
+#define CMD_BLANK_CHECK   0x3A
+#define CMD_FLASH_IMAGE   0x4B
+#define CMD_READ_RANGE    0x2A
+#define CMD_BLOCK_CRC     0x4A
+#define CMD_SRAM_CRC      0x5A
+#define CMD_SRAM_BLOCKS   0x6A
+#define CMD_PROG_LOAD     0x6E
+#define CMD_PROG_RUN      0x6F
+#define CMD_BENCH_IN      0x7A
+#define CMD_BENCH_OUT     0x7B
+#define CMD_BENCH_BUS     0x7C
 
 /* Magic bytes for command packets */
 #define MAGIC_1 0xAA
@@ -56,6 +77,11 @@
 #define CMD_PACKET_SIZE   64
 #define DATA_CHUNK_SIZE   1024
 
+/* On-cart manifest, stored at the start of the chip's last sector */
+#define MANIFEST_MAGIC        "FMDMANI1"
+#define MANIFEST_HEADER_SIZE  64
+#define MANIFEST_MAX_BYTES    (MANIFEST_HEADER_SIZE + 4 * FLASHMD_MANIFEST_MAX_SECTORS)
+
 /* Timing configuration */
 #define WRITE_DELAY_US    1000
 #define POLL_INTERVAL_MS  30
@@ -70,9 +96,17 @@ static const char *filtered_messages[] = {
     NULL
 };
 
+/* Per-thread USB state: each thread drives its own device, so a daemon
+ * can run one worker per flasher through the same calls */
+#if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL _Thread_local
+#endif
+
 /* Global state */
-static libusb_context *ctx = NULL;
-static libusb_device_handle *dev_handle = NULL;
+static THREAD_LOCAL libusb_context *ctx = NULL;
+static THREAD_LOCAL libusb_device_handle *dev_handle = NULL;
 static volatile int interrupted = 0;
 #ifndef _WIN32
 static uid_t real_uid = -1;
@@ -228,6 +262,14 @@ void flashmd_set_real_ids(int uid, int gid) {
     real_gid = gid;
 }
 
+void flashmd_fix_ownership(const char *path) {
+    fix_file_ownership(path);
+}
+
+int flashmd_real_uid(void) {
+    return (int)real_uid;
+}
+
 /*
  * Configuration initialization
  */
@@ -235,6 +277,13 @@ void flashmd_config_init(flashmd_config_t *config) {
     if (config) {
         config->verbose = 0;
         config->no_trim = 0;
+        config->skip_blank = 0;
+        config->manifest = 0;
+        config->cache = 0;
+        config->dry_run = 0;
+        config->consensus = 0;
+        config->keep_going = 0;
+        config->no_selftest = 0;
         config->progress = NULL;
         config->message = NULL;
         config->user_data = NULL;
@@ -255,15 +304,19 @@ int flashmd_get_interrupted(void) {
 /*
  * USB Operations
  */
-static int usb_write(const uint8_t *data, int len) {
+static int usb_write_timeout(const uint8_t *data, int len, int timeout_ms) {
     int transferred = 0;
-    int r = libusb_bulk_transfer(dev_handle, EP_OUT, (uint8_t *)data, len, &transferred, TIMEOUT_MS);
+    int r = libusb_bulk_transfer(dev_handle, EP_OUT, (uint8_t *)data, len, &transferred, timeout_ms);
     if (r < 0) {
         return -1;
     }
     return transferred;
 }
 
+static int usb_write(const uint8_t *data, int len) {
+    return usb_write_timeout(data, len, TIMEOUT_MS);
+}
+
 static int usb_read(uint8_t *buf, int max_len, int timeout_ms) {
     int transferred = 0;
     int r = libusb_bulk_transfer(dev_handle, EP_IN, buf, max_len, &transferred, timeout_ms);
@@ -276,13 +329,69 @@ static int usb_read(uint8_t *buf, int max_len, int timeout_ms) {
     return transferred;
 }
 
+/* Physical location of a device, e.g. "3-1.2" (bus 3, hub port 1, port 2) */
+static void device_path(libusb_device *dev, char *path, size_t len) {
+    uint8_t ports[8];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    int pos = snprintf(path, len, "%u", libusb_get_bus_number(dev));
+    for (int i = 0; i < n && pos > 0 && (size_t)pos < len; i++) {
+        pos += snprintf(path + pos, len - pos, "%c%u", (i == 0) ? '-' : '.', ports[i]);
+    }
+}
+
+static int is_flasher(libusb_device *dev) {
+    struct libusb_device_descriptor desc;
+    return libusb_get_device_descriptor(dev, &desc) == 0 &&
+           desc.idVendor == VENDOR_ID && desc.idProduct == PRODUCT_ID;
+}
+
+int flashmd_list_devices(char paths[][FLASHMD_DEVICE_PATH_LEN], int max) {
+    libusb_context *list_ctx = NULL;
+    libusb_device **list;
+    if (libusb_init(&list_ctx) < 0) {
+        return -1;
+    }
+    ssize_t n = libusb_get_device_list(list_ctx, &list);
+    int found = 0;
+    for (ssize_t i = 0; i < n && found < max; i++) {
+        if (is_flasher(list[i])) {
+            device_path(list[i], paths[found++], FLASHMD_DEVICE_PATH_LEN);
+        }
+    }
+    if (n >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(list_ctx);
+    return found;
+}
+
 flashmd_result_t flashmd_open(void) {
+    return flashmd_open_device(NULL);
+}
+
+flashmd_result_t flashmd_open_device(const char *path) {
     int r = libusb_init(&ctx);
     if (r < 0) {
         return FLASHMD_ERR_USB_INIT;
     }
 
-    dev_handle = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
+    if (!path) {
+        dev_handle = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
+    } else {
+        libusb_device **list;
+        ssize_t n = libusb_get_device_list(ctx, &list);
+        for (ssize_t i = 0; i < n && !dev_handle; i++) {
+            char here[FLASHMD_DEVICE_PATH_LEN];
+            if (!is_flasher(list[i])) continue;
+            device_path(list[i], here, sizeof(here));
+            if (strcmp(here, path) == 0 && libusb_open(list[i], &dev_handle) < 0) {
+                dev_handle = NULL;
+            }
+        }
+        if (n >= 0) {
+            libusb_free_device_list(list, 1);
+        }
+    }
     if (!dev_handle) {
         libusb_exit(ctx);
         ctx = NULL;
@@ -324,6 +433,89 @@ int flashmd_is_open(void) {
     return dev_handle != NULL;
 }
 
+/*
+ * Hotplug: libusb events where the platform has them, otherwise a
+ * device count compared once a second. Either way the callback runs
+ * from flashmd_hotplug_poll on the watching thread.
+ */
+#define HOTPLUG_SCAN_MS 1000
+
+static THREAD_LOCAL libusb_context *hotplug_ctx = NULL;
+static THREAD_LOCAL libusb_hotplug_callback_handle hotplug_handle;
+static THREAD_LOCAL int hotplug_native = 0;
+static THREAD_LOCAL int hotplug_count = -1;
+static THREAD_LOCAL int hotplug_since_scan = 0;
+static THREAD_LOCAL flashmd_hotplug_cb hotplug_cb = NULL;
+static THREAD_LOCAL void *hotplug_user_data = NULL;
+
+static int LIBUSB_CALL hotplug_event(libusb_context *c, libusb_device *dev,
+                                     libusb_hotplug_event event, void *user_data) {
+    (void)c;
+    (void)dev;
+    (void)user_data;
+    if (hotplug_cb) {
+        hotplug_cb(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, hotplug_user_data);
+    }
+    return 0;
+}
+
+flashmd_result_t flashmd_hotplug_start(flashmd_hotplug_cb cb, void *user_data) {
+    if (libusb_init(&hotplug_ctx) < 0) {
+        return FLASHMD_ERR_USB_INIT;
+    }
+    hotplug_cb = cb;
+    hotplug_user_data = user_data;
+    hotplug_count = -1;
+    hotplug_since_scan = HOTPLUG_SCAN_MS;
+    hotplug_native = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+        libusb_hotplug_register_callback(hotplug_ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, VENDOR_ID, PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+            hotplug_event, NULL, &hotplug_handle) == LIBUSB_SUCCESS;
+    return FLASHMD_OK;
+}
+
+void flashmd_hotplug_poll(int timeout_ms) {
+    if (!hotplug_ctx) {
+        usleep(timeout_ms * 1000);
+        return;
+    }
+    if (hotplug_native) {
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        libusb_handle_events_timeout_completed(hotplug_ctx, &tv, NULL);
+        return;
+    }
+
+    usleep(timeout_ms * 1000);
+    hotplug_since_scan += timeout_ms;
+    if (hotplug_since_scan < HOTPLUG_SCAN_MS) {
+        return;
+    }
+    hotplug_since_scan = 0;
+    char paths[8][FLASHMD_DEVICE_PATH_LEN];
+    int n = flashmd_list_devices(paths, 8);
+    if (n < 0 || n == hotplug_count) {
+        return;
+    }
+    int arrived = (n > hotplug_count);
+    hotplug_count = n;
+    if (hotplug_cb && (n > 0 || !arrived)) {
+        hotplug_cb(arrived, hotplug_user_data);
+    }
+}
+
+void flashmd_hotplug_stop(void) {
+    if (!hotplug_ctx) {
+        return;
+    }
+    if (hotplug_native) {
+        libusb_hotplug_deregister_callback(hotplug_ctx, hotplug_handle);
+    }
+    libusb_exit(hotplug_ctx);
+    hotplug_ctx = NULL;
+    hotplug_cb = NULL;
+}
+
 /*
  * Command Protocol
  */
@@ -483,10 +675,60 @@ const char *flashmd_error_string(flashmd_result_t result) {
         case FLASHMD_ERR_FILE: return "File error";
         case FLASHMD_ERR_INTERRUPTED: return "Operation interrupted";
         case FLASHMD_ERR_INVALID_PARAM: return "Invalid parameter";
+        case FLASHMD_ERR_NO_MANIFEST: return "No manifest on cart";
+        case FLASHMD_ERR_VERIFY: return "Cart does not match file";
+        case FLASHMD_ERR_CART: return "Cart failed the self-test";
+        case FLASHMD_ERR_PROGRAM: return "Micro-program stopped on an error";
         default: return "Unknown error";
     }
 }
 
+/* CRC-32 (IEEE 802.3, reflected), continued from crc; start with 0 */
+uint32_t flashmd_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    static uint32_t table[256];
+    static int table_ready = 0;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t flashmd_chip_sector_size(const flashmd_chip_info_t *info, uint32_t addr) {
+    uint32_t base = 0;
+    for (int r = 0; r < info->nregions; r++) {
+        base += info->regions[r].count * info->regions[r].size;
+        if (addr < base) {
+            return info->regions[r].size;
+        }
+    }
+    return info->nregions > 0 ? info->regions[info->nregions - 1].size : 0;
+}
+
+uint32_t flashmd_chip_erase_span(const flashmd_chip_info_t *info, uint32_t addr, uint32_t len) {
+    uint32_t pos = 0;
+    uint32_t span = 0;
+    while (pos < addr + len && pos < info->size) {
+        uint32_t sector = flashmd_chip_sector_size(info, pos);
+        if (sector == 0) break;
+        if (pos + sector > addr) {
+            span += sector;
+        }
+        pos += sector;
+    }
+    return span;
+}
+
 /*
  * Device Commands
  */
@@ -521,6 +763,98 @@ flashmd_result_t flashmd_check_id(const flashmd_config_t *config) {
     return FLASHMD_OK;
 }
 
+/*
+ * Parse the firmware's chip info line:
+ * CHIP:<name> ID:<ids> SIZE:<bytes> FLAGS:<hex> WBUF:<n> PAGE:<n>
+ * TPROG:<us> TBUF:<us> TERASE:<ms> TMAX:<ms> REGIONS:<count>x<bytes>,...
+ */
+static int parse_chip_info(const char *line, flashmd_chip_info_t *info) {
+    memset(info, 0, sizeof(*info));
+    const char *p = strstr(line, "CHIP:");
+    if (!p) return -1;
+
+    unsigned int size, flags, wbuf, page, tprog, tbuf, terase, tmax;
+    int consumed = 0;
+    if (sscanf(p, "CHIP:%23s ID:%11s SIZE:%u FLAGS:%x WBUF:%u PAGE:%u TPROG:%u TBUF:%u TERASE:%u TMAX:%u REGIONS:%n",
+               info->name, info->id, &size, &flags, &wbuf, &page, &tprog, &tbuf, &terase, &tmax,
+               &consumed) != 10 || consumed == 0) {
+        return -1;
+    }
+    info->size = size;
+    info->flags = flags;
+    info->wbuf_words = wbuf;
+    info->page_words = page;
+    info->tprog_us = tprog;
+    info->tbuf_us = tbuf;
+    info->terase_ms = terase;
+    info->erase_timeout_ms = tmax;
+
+    p += consumed;
+    while (info->nregions < FLASHMD_CHIP_MAX_REGIONS) {
+        unsigned int count, bytes;
+        int n = 0;
+        if (sscanf(p, "%ux%u%n", &count, &bytes, &n) != 2) break;
+        info->regions[info->nregions].count = count;
+        info->regions[info->nregions].size = bytes;
+        info->nregions++;
+        p += n;
+        if (*p != ',') break;
+        p++;
+    }
+    return info->nregions > 0 ? 0 : -1;
+}
+
+flashmd_result_t flashmd_get_chip_info(flashmd_chip_info_t *info, const flashmd_config_t *config) {
+    if (send_command(CMD_CHIP_INFO, NULL, 0) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+
+    char response[512];
+    if (read_response(response, sizeof(response), 3000) <= 0) {
+        emit_msg(config, 1, "No chip info from device\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    if (parse_chip_info(response, info) < 0) {
+        emit_msg(config, 1, "Unexpected chip info: %s\n", response);
+        return FLASHMD_ERR_IO;
+    }
+    return FLASHMD_OK;
+}
+
+flashmd_result_t flashmd_print_chip_info(const flashmd_config_t *config) {
+    flashmd_chip_info_t info;
+    flashmd_result_t r = flashmd_get_chip_info(&info, config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    emit_msg(config, 0, "Chip:          %s (ID %s)\n", info.name, info.id);
+    emit_msg(config, 0, "Size:          %u KB\n", info.size / 1024);
+    emit_msg(config, 0, "Features:     %s%s%s%s\n",
+             (info.flags & FLASHMD_CHIP_UNLOCK_BYPASS) ? " unlock-bypass" : "",
+             (info.flags & FLASHMD_CHIP_WRITE_BUFFER) ? " write-buffer" : "",
+             (info.flags & FLASHMD_CHIP_PAGE_READ) ? " page-read" : "",
+             (info.flags & FLASHMD_CHIP_ERASE_SUSPEND) ? " erase-suspend" : "");
+    if (info.wbuf_words) {
+        emit_msg(config, 0, "Write buffer:  %u words\n", info.wbuf_words);
+    }
+    if (info.page_words) {
+        emit_msg(config, 0, "Read page:     %u words\n", info.page_words);
+    }
+    emit_msg(config, 0, "Program time:  %u us/word", info.tprog_us);
+    if (info.tbuf_us) {
+        emit_msg(config, 0, ", %u us/buffer", info.tbuf_us);
+    }
+    emit_msg(config, 0, "\n");
+    emit_msg(config, 0, "Erase time:    %u ms/sector (max %u ms)\n", info.terase_ms, info.erase_timeout_ms);
+    emit_msg(config, 0, "Sectors:      ");
+    for (int i = 0; i < info.nregions; i++) {
+        emit_msg(config, 0, " %ux%uK", info.regions[i].count, info.regions[i].size / 1024);
+    }
+    emit_msg(config, 0, "\n");
+    return FLASHMD_OK;
+}
+
 flashmd_result_t flashmd_clear_buffer(const flashmd_config_t *config) {
     emit_msg(config, 0, "Clearing device buffer...\n");
     if (send_command(CMD_CLEAR_BUFFER, NULL, 0) < 0) {
@@ -558,11 +892,475 @@ flashmd_result_t flashmd_device_init(const flashmd_config_t *config) {
     return FLASHMD_OK;
 }
 
+/*
+ * Cart self-test. The firmware answers with one line:
+ * SELFTEST:<PASS|FAIL> MS:<n> HEADER:<kind> FLOAT:<mask> UNSTABLE:<mask>
+ * SHORT:<mask> ADDR:<mask> SIZE:<bytes> ID:<id> CHIP:<name>
+ */
+#define SELFTEST_TIMEOUT_MS 500
+
+flashmd_result_t flashmd_selftest(flashmd_selftest_t *test, const flashmd_config_t *config) {
+    if (send_command(CMD_SELFTEST, NULL, 0) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+    char response[256];
+    if (read_response(response, sizeof(response), SELFTEST_TIMEOUT_MS) <= 0) {
+        return FLASHMD_ERR_TIMEOUT;
+    }
+
+    memset(test, 0, sizeof(*test));
+    const char *p = strstr(response, "SELFTEST:");
+    char verdict[8];
+    unsigned int ms, floating, unstable, shorted, bad_addr, size;
+    if (!p || sscanf(p, "SELFTEST:%7s MS:%u HEADER:%7s FLOAT:%x UNSTABLE:%x SHORT:%x ADDR:%x SIZE:%u ID:%7s CHIP:%23s",
+                     verdict, &ms, test->header, &floating, &unstable, &shorted, &bad_addr, &size,
+                     test->id, test->chip) != 10) {
+        emit_msg(config, 1, "Unexpected self-test reply: %s\n", response);
+        return FLASHMD_ERR_IO;
+    }
+    test->pass = (strcmp(verdict, "PASS") == 0);
+    test->ms = ms;
+    test->floating = floating;
+    test->unstable = unstable;
+    test->shorted = shorted;
+    test->bad_addr = bad_addr;
+    test->size = size;
+    return FLASHMD_OK;
+}
+
+/* "D0 D5 D12" for the set bits of a line mask */
+static void line_list(char *out, size_t len, uint32_t mask, char prefix, int first) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (int n = 0; n < 32 && used < len; n++) {
+        if (mask & (1u << n)) {
+            used += snprintf(out + used, len - used, "%s%c%d", used ? " " : "", prefix, n + first);
+        }
+    }
+}
+
+static void report_selftest(const flashmd_selftest_t *test, const flashmd_config_t *config) {
+    char chip[64], size[48] = "";
+    if (strcmp(test->chip, "NONE") == 0) {
+        snprintf(chip, sizeof(chip), "no known flash chip (ID %s)", test->id);
+    } else {
+        snprintf(chip, sizeof(chip), "%s (ID %s)", test->chip, test->id);
+    }
+    if (test->size) {
+        snprintf(size, sizeof(size), ", mirrors past %u KB", test->size / 1024);
+    }
+    if (test->pass) {
+        emit_msg(config, 0, "Cart self-test passed in %u ms: header %s, %s%s\n",
+                 test->ms, test->header, chip, size);
+        return;
+    }
+
+    char lines[128];
+    emit_msg(config, 1, "Cart self-test FAILED in %u ms (%s)\n", test->ms, chip);
+    if (test->floating == 0xFFFF) {
+        emit_msg(config, 1, "  Nothing drives the data bus: no cart, or it is not seated\n");
+    } else if (test->floating) {
+        line_list(lines, sizeof(lines), test->floating, 'D', 0);
+        emit_msg(config, 1, "  Data lines not driven by the cart: %s\n", lines);
+    }
+    if (test->unstable) {
+        line_list(lines, sizeof(lines), test->unstable, 'D', 0);
+        emit_msg(config, 1, "  Data bits that change with read timing: %s\n", lines);
+    }
+    if (test->shorted) {
+        line_list(lines, sizeof(lines), test->shorted, 'D', 0);
+        emit_msg(config, 1, "  Data lines shorted together or held: %s\n", lines);
+    }
+    if (test->bad_addr) {
+        line_list(lines, sizeof(lines), test->bad_addr, 'A', 1);
+        emit_msg(config, 1, "  Address lines with no effect: %s\n", lines);
+    }
+    emit_msg(config, 1, "Reseat the cart or clean its contacts and try again\n");
+}
+
+flashmd_result_t flashmd_print_selftest(const flashmd_config_t *config) {
+    flashmd_selftest_t test;
+    flashmd_result_t r = flashmd_selftest(&test, config);
+    if (r == FLASHMD_ERR_TIMEOUT) {
+        emit_msg(config, 1, "No self-test reply; the firmware may predate it\n");
+    }
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    report_selftest(&test, config);
+    return test.pass ? FLASHMD_OK : FLASHMD_ERR_CART;
+}
+
+/* Every operation on the cart starts with the self-test, so a badly
+ * seated cart is turned away before a dump of pull-up noise or a write
+ * into nothing. Older firmware without it is let through */
+static flashmd_result_t preflight(const flashmd_config_t *config) {
+    if (config && config->no_selftest) {
+        return FLASHMD_OK;
+    }
+    flashmd_selftest_t test;
+    flashmd_result_t r = flashmd_selftest(&test, config);
+    if (r == FLASHMD_ERR_TIMEOUT) {
+        emit_msg(config, 0, "Cart self-test skipped: no reply from the firmware\n");
+        return FLASHMD_OK;
+    }
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    report_selftest(&test, config);
+    return test.pass ? FLASHMD_OK : FLASHMD_ERR_CART;
+}
+
+static flashmd_result_t operation_init(const flashmd_config_t *config) {
+    flashmd_result_t r = flashmd_device_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    return preflight(config);
+}
+
+/*
+ * Benchmark
+ */
+#define BENCH_DEFAULT_KB  1024
+#define BENCH_MAX_KB      16384     /* The bus test takes a 24-bit word count */
+#define BENCH_PINGS       50
+#define BENCH_XFER_SIZE   16384
+
+typedef struct {
+    uint32_t n;
+    double sum, min, max;
+    double last, dsum;              /* For jitter */
+} bench_stats_t;
+
+static uint64_t now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void stats_add(bench_stats_t *s, double v) {
+    if (s->n == 0 || v < s->min) s->min = v;
+    if (s->n == 0 || v > s->max) s->max = v;
+    if (s->n > 0) s->dsum += (v > s->last) ? v - s->last : s->last - v;
+    s->last = v;
+    s->n++;
+    s->sum += v;
+}
+
+static double stats_mean(const bench_stats_t *s) {
+    return s->n ? s->sum / s->n : 0.0;
+}
+
+/* Mean difference between consecutive samples, as RFC 3550 does it */
+static double stats_jitter(const bench_stats_t *s) {
+    return (s->n > 1) ? s->dsum / (s->n - 1) : 0.0;
+}
+
+static double mb_per_s(uint32_t bytes, double ms) {
+    return (ms > 0) ? (bytes / (1024.0 * 1024.0)) / (ms / 1000.0) : 0.0;
+}
+
+/* Read the "BENCH ..." line that ends a benchmark command */
+static int bench_reply(char *buf, size_t len, int timeout_ms) {
+    int n = read_response(buf, len, timeout_ms);
+    return (n > 0 && strstr(buf, "BENCH")) ? n : -1;
+}
+
+flashmd_result_t flashmd_bench(uint32_t size_kb, const flashmd_config_t *config) {
+    if (size_kb == 0) size_kb = BENCH_DEFAULT_KB;
+    if (size_kb > BENCH_MAX_KB) size_kb = BENCH_MAX_KB;
+    uint32_t bytes = size_kb * 1024;
+    char reply[256];
+
+    uint8_t *buf = malloc(BENCH_XFER_SIZE);
+    if (!buf) return FLASHMD_ERR_IO;
+    emit_msg(config, 0, "Benchmark: %u KB per test\n", size_kb);
+
+    /* Round trip: a one-packet IN command, from sending it to its data */
+    bench_stats_t rt = {0};
+    uint8_t ping[4] = {0, 0, 0, CMD_PACKET_SIZE};
+    for (int i = 0; i < BENCH_PINGS && !interrupted; i++) {
+        uint64_t t0 = now_us();
+        if (send_command(CMD_BENCH_IN, ping, sizeof(ping)) < 0) {
+            free(buf);
+            return FLASHMD_ERR_IO;
+        }
+        int n = usb_read(buf, CMD_PACKET_SIZE, 1000);
+        uint64_t t1 = now_us();
+        if (n != CMD_PACKET_SIZE || bench_reply(reply, sizeof(reply), 1000) < 0) {
+            emit_msg(config, 1, "No answer to the benchmark commands; the firmware may predate them\n");
+            free(buf);
+            return FLASHMD_ERR_TIMEOUT;
+        }
+        stats_add(&rt, (t1 - t0) / 1000.0);
+    }
+    emit_msg(config, 0, "  Round trip:  %.2f ms avg, %.2f min, %.2f max, jitter %.2f ms (%u commands)\n",
+             stats_mean(&rt), rt.min, rt.max, stats_jitter(&rt), rt.n);
+
+    /* USB IN: generated data, checked against the pattern as it arrives */
+    bench_stats_t in = {0};
+    uint32_t received = 0, bad = 0;
+    uint8_t in_params[4] = {bytes >> 24, (bytes >> 16) & 0xFF, (bytes >> 8) & 0xFF, bytes & 0xFF};
+    uint64_t start = now_us();
+    if (send_command(CMD_BENCH_IN, in_params, sizeof(in_params)) < 0) {
+        free(buf);
+        return FLASHMD_ERR_IO;
+    }
+    while (received < bytes && !interrupted) {
+        uint32_t want = (bytes - received < BENCH_XFER_SIZE) ? bytes - received : BENCH_XFER_SIZE;
+        uint64_t t0 = now_us();
+        int n = usb_read(buf, want, 2000);
+        if (n <= 0) {
+            emit_msg(config, 1, "\nUSB IN stalled at %u bytes\n", received);
+            free(buf);
+            return (n < 0) ? FLASHMD_ERR_IO : FLASHMD_ERR_TIMEOUT;
+        }
+        stats_add(&in, (now_us() - t0) / 1000.0);
+        for (int k = 0; k < n; k++) {
+            if (buf[k] != (uint8_t)(received + k)) bad++;
+        }
+        received += n;
+        emit_progress(config, received, bytes);
+    }
+    double in_ms = (now_us() - start) / 1000.0;
+    bench_reply(reply, sizeof(reply), 2000);
+    if (interrupted) {
+        free(buf);
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+    char bad_text[48] = "";
+    if (bad) snprintf(bad_text, sizeof(bad_text), ", %u BAD BYTES", bad);
+    emit_msg(config, bad != 0, "  USB IN:      %.2f MB/s, %.2f ms per %u KB transfer, jitter %.2f ms%s\n",
+             mb_per_s(bytes, in_ms), stats_mean(&in), BENCH_XFER_SIZE / 1024, stats_jitter(&in), bad_text);
+
+    /* USB OUT: the firmware takes each block and drops it */
+    bench_stats_t out = {0};
+    uint32_t sent = 0;
+    uint8_t out_params[5] = {0, 0, 0, (size_kb >> 8) & 0xFF, size_kb & 0xFF};
+    for (uint32_t k = 0; k < BENCH_XFER_SIZE; k++) buf[k] = (uint8_t)k;
+    start = now_us();
+    if (send_command(CMD_BENCH_OUT, out_params, sizeof(out_params)) < 0) {
+        free(buf);
+        return FLASHMD_ERR_IO;
+    }
+    while (sent < bytes && !interrupted) {
+        uint32_t len = (bytes - sent < BENCH_XFER_SIZE) ? bytes - sent : BENCH_XFER_SIZE;
+        uint64_t t0 = now_us();
+        if (usb_write(buf, len) != (int)len) {
+            emit_msg(config, 1, "\nUSB OUT stalled at %u bytes\n", sent);
+            free(buf);
+            return FLASHMD_ERR_IO;
+        }
+        stats_add(&out, (now_us() - t0) / 1000.0);
+        sent += len;
+        emit_progress(config, sent, bytes);
+    }
+    free(buf);
+    if (interrupted) return FLASHMD_ERR_INTERRUPTED;
+    if (bench_reply(reply, sizeof(reply), 5000) < 0 || strstr(reply, "TIMEOUT")) {
+        emit_msg(config, 1, "USB OUT: the firmware did not take all the data\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    double out_ms = (now_us() - start) / 1000.0;
+    emit_msg(config, 0, "  USB OUT:     %.2f MB/s, %.2f ms per %u KB transfer, jitter %.2f ms\n",
+             mb_per_s(bytes, out_ms), stats_mean(&out), BENCH_XFER_SIZE / 1024, stats_jitter(&out));
+
+    /* Bus read: timed on the device, nothing goes over USB */
+    uint32_t words = bytes / 2;
+    uint8_t bus_params[3] = {(words >> 16) & 0xFF, (words >> 8) & 0xFF, words & 0xFF};
+    if (send_command(CMD_BENCH_BUS, bus_params, sizeof(bus_params)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+    unsigned int bus_words = 0, bus_ms = 0;
+    const char *line = (bench_reply(reply, sizeof(reply), 60000) > 0) ? strstr(reply, "BENCH BUS") : NULL;
+    if (!line || sscanf(line, "BENCH BUS %u WORDS %u MS", &bus_words, &bus_ms) != 2) {
+        emit_msg(config, 1, "No answer to the bus read test\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    double bus_rate = mb_per_s(bus_words * 2, bus_ms ? bus_ms : 1);
+    emit_msg(config, 0, "  Bus read:    %.2f MB/s (timed on the device)\n", bus_rate);
+
+    double in_rate = mb_per_s(bytes, in_ms);
+    emit_msg(config, 0, "Dumps are limited by the %s\n",
+             (in_rate < bus_rate) ? "USB link (board, cable or hub)" : "cartridge bus");
+    return FLASHMD_OK;
+}
+
 /*
  * Flash Operations
  */
+
+/*
+ * Erase exactly the sectors covering [addr, addr + len). The firmware
+ * prints one '.' per sector, so each dot advances progress by the size
+ * of the next sector in the map.
+ */
+static flashmd_result_t erase_range(const flashmd_chip_info_t *info, uint32_t addr, uint32_t len,
+                                    const flashmd_config_t *config) {
+    uint32_t span = flashmd_chip_erase_span(info, addr, len);
+    if (span == 0) {
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    emit_msg(config, 0, "Erasing %u KB (%u KB of sectors)...\n", len / 1024, span / 1024);
+
+    uint32_t start_words = addr / 2;
+    uint32_t words = len / 2;
+    uint8_t params[6] = {
+        (start_words >> 16) & 0xFF, (start_words >> 8) & 0xFF, start_words & 0xFF,
+        (words >> 16) & 0xFF, (words >> 8) & 0xFF, words & 0xFF
+    };
+    if (send_command(CMD_RANGE_ERASE, params, sizeof(params)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+
+    /* first covered sector */
+    uint32_t pos = 0;
+    while (pos + flashmd_chip_sector_size(info, pos) <= addr) {
+        pos += flashmd_chip_sector_size(info, pos);
+    }
+
+    char buf[256];
+    size_t acc_len = 0;
+    uint32_t done = 0;
+    int elapsed = 0;
+    int timeout_ms = (int)info->erase_timeout_ms + 2000;
+    emit_progress(config, 0, span);
+
+    while (elapsed < timeout_ms) {
+        if (interrupted) {
+            return FLASHMD_ERR_INTERRUPTED;
+        }
+        uint8_t temp[64];
+        int n = usb_read(temp, sizeof(temp), POLL_INTERVAL_MS);
+        if (n < 0) return FLASHMD_ERR_IO;
+        if (n == 0) {
+            elapsed += POLL_INTERVAL_MS;
+            continue;
+        }
+        elapsed = 0;
+        for (int i = 0; i < n; i++) {
+            if (temp[i] == '.') {
+                uint32_t sector = flashmd_chip_sector_size(info, pos);
+                pos += sector;
+                done += sector;
+                emit_progress(config, done, span);
+            } else if (acc_len < sizeof(buf) - 1) {
+                buf[acc_len++] = (char)temp[i];
+            }
+        }
+        buf[acc_len] = '\0';
+        if (strstr(buf, "RANGE ERASE OK")) {
+            emit_progress(config, span, span);
+            emit_msg(config, 0, "\nErase complete\n");
+            return FLASHMD_OK;
+        }
+        char *fail = strstr(buf, "ERASE FAIL");
+        if (fail && strchr(fail, '\n')) {
+            emit_msg(config, 1, "\n%s", fail);
+            return FLASHMD_ERR_IO;
+        }
+    }
+
+    emit_msg(config, 1, "\nTimeout waiting for erase\n");
+    return FLASHMD_ERR_TIMEOUT;
+}
+
+flashmd_result_t flashmd_blank_check(uint32_t addr, uint32_t len, uint8_t *dirty,
+                                      uint32_t max_sectors, uint32_t *first, uint32_t *count,
+                                      const flashmd_config_t *config) {
+    uint32_t start_words = addr / 2;
+    uint32_t words = (len + 1) / 2;
+    uint8_t params[6] = {
+        (start_words >> 16) & 0xFF, (start_words >> 8) & 0xFF, start_words & 0xFF,
+        (words >> 16) & 0xFF, (words >> 8) & 0xFF, words & 0xFF
+    };
+    if (send_command(CMD_BLANK_CHECK, params, sizeof(params)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+
+    /* BLANK ADD:0x<word addr> SECTORS:<n> DIRTY:<hex, 4 sectors per digit> */
+    char response[512];
+    if (read_response(response, sizeof(response), 30000) <= 0) {
+        emit_msg(config, 1, "No blank check result from device\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    const char *p = strstr(response, "BLANK ADD:");
+    unsigned int first_words, n;
+    int consumed = 0;
+    if (!p || sscanf(p, "BLANK ADD:0x%x SECTORS:%u DIRTY:%n", &first_words, &n, &consumed) != 2 || consumed == 0) {
+        emit_msg(config, 1, "Unexpected blank check result: %s\n", response);
+        return FLASHMD_ERR_IO;
+    }
+    p += consumed;
+
+    if (n > max_sectors) n = max_sectors;
+    for (uint32_t i = 0; i < n; i++) {
+        char c = p[i / 4];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            emit_msg(config, 1, "Truncated blank check result\n");
+            return FLASHMD_ERR_IO;
+        }
+        dirty[i] = (digit >> (i % 4)) & 1;
+    }
+    *first = first_words * 2;
+    *count = n;
+    return FLASHMD_OK;
+}
+
+/*
+ * Erase planner: blank check the covered sectors and erase only the runs
+ * that are not already 0xFF.
+ */
+static flashmd_result_t erase_dirty(const flashmd_chip_info_t *info, uint32_t addr, uint32_t len,
+                                    const flashmd_config_t *config) {
+    uint8_t dirty[256];
+    uint32_t first = 0, count = 0;
+
+    emit_msg(config, 0, "Blank checking %u KB...\n", len / 1024);
+    flashmd_result_t r = flashmd_blank_check(addr, len, dirty, sizeof(dirty), &first, &count, config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    uint32_t blank = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        blank += !dirty[i];
+    }
+    emit_msg(config, 0, "%u of %u sectors already blank\n", blank, count);
+
+    uint32_t pos = first;
+    uint32_t i = 0;
+    while (i < count) {
+        if (!dirty[i]) {
+            pos += flashmd_chip_sector_size(info, pos);
+            i++;
+            continue;
+        }
+        uint32_t run_start = pos;
+        while (i < count && dirty[i]) {
+            pos += flashmd_chip_sector_size(info, pos);
+            i++;
+        }
+        r = erase_range(info, run_start, pos - run_start, config);
+        if (r != FLASHMD_OK) {
+            return r;
+        }
+    }
+    return FLASHMD_OK;
+}
+
 flashmd_result_t flashmd_erase(uint32_t size_kb, const flashmd_config_t *config) {
-    flashmd_result_t r = flashmd_device_init(config);
+    flashmd_result_t r = operation_init(config);
     if (r != FLASHMD_OK) {
         return r;
     }
@@ -576,6 +1374,14 @@ flashmd_result_t flashmd_erase(uint32_t size_kb, const flashmd_config_t *config)
         return FLASHMD_OK;
     }
 
+    flashmd_chip_info_t info;
+    if (flashmd_get_chip_info(&info, config) == FLASHMD_OK) {
+        if (config && config->skip_blank) {
+            return erase_dirty(&info, 0, size_kb * 1024, config);
+        }
+        return erase_range(&info, 0, size_kb * 1024, config);
+    }
+
     uint8_t size_code = (uint8_t)flashmd_kb_to_size(size_kb);
     uint32_t erase_bytes = flashmd_size_to_bytes(size_code);
 
@@ -664,16 +1470,291 @@ end_trim_loop:
     return new_size;
 }
 
-flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
-                                   const flashmd_config_t *config) {
-    uint8_t size_code;
+/*
+ * Consensus dump. The firmware hashes the cart in 1K blocks (0x4A) on a
+ * second bus pass that sends only 4 bytes per block, and blocks whose
+ * hash disagrees with the first pass are read again through ranged reads.
+ * A block is settled once CONSENSUS_VOTES reads agree, or takes the
+ * per-word majority after CONSENSUS_MAX_READS. Settled blocks are hashed
+ * on the cart again until every block holds.
+ */
+#define CONSENSUS_BLOCK         1024
+#define CONSENSUS_BATCH         1024    /* Blocks hashed per 0x4A command */
+#define CONSENSUS_VOTES         3
+#define CONSENSUS_MAX_READS     9
+#define CONSENSUS_ROUNDS        4
+#define CONSENSUS_REPORT_MAX    16      /* Unstable blocks listed without verbose */
+
+static flashmd_result_t read_block_crcs(uint32_t block, uint32_t count, uint32_t *crcs,
+                                        const flashmd_config_t *config) {
+    uint8_t raw[4 * CONSENSUS_BATCH];
+    while (count > 0) {
+        uint32_t n = (count > CONSENSUS_BATCH) ? CONSENSUS_BATCH : count;
+        uint32_t start_words = block * (CONSENSUS_BLOCK / 2);
+        uint32_t words = n * (CONSENSUS_BLOCK / 2);
+        uint8_t params[6] = {
+            (start_words >> 16) & 0xFF, (start_words >> 8) & 0xFF, start_words & 0xFF,
+            (words >> 16) & 0xFF, (words >> 8) & 0xFF, words & 0xFF
+        };
+        if (send_command(CMD_BLOCK_CRC, params, sizeof(params)) < 0) {
+            return FLASHMD_ERR_IO;
+        }
+        if (read_binary(raw, 4 * n, 5000) < 0) {
+            emit_msg(config, 1, "Block hashes from 0x%06X timed out\n", block * CONSENSUS_BLOCK);
+            return FLASHMD_ERR_TIMEOUT;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            const uint8_t *p = raw + 4 * i;
+            crcs[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        crcs += n;
+        block += n;
+        count -= n;
+    }
+    return FLASHMD_OK;
+}
+
+/* Re-read a block until its reads agree, into reads (CONSENSUS_MAX_READS
+ * blocks of scratch); data holds the first pass's copy on entry and the
+ * settled one on return. *unstable counts the words that
+ * differed between reads, *first is the first one's address. Returns
+ * FLASHMD_ERR_VERIFY when no read won and the majority was taken */
+static flashmd_result_t settle_block(uint32_t block, uint8_t *data, uint8_t (*reads)[CONSENSUS_BLOCK],
+                                     uint32_t *unstable, uint32_t *first,
+                                     const flashmd_config_t *config) {
+    uint32_t crcs[CONSENSUS_MAX_READS];
+    uint32_t addr = block * CONSENSUS_BLOCK;
+    uint32_t nreads = 1;
+    int winner = -1;
+
+    *unstable = 0;
+    *first = addr;
+    memcpy(reads[0], data, CONSENSUS_BLOCK);
+    crcs[0] = flashmd_crc32(0, data, CONSENSUS_BLOCK);
+    while (winner < 0 && nreads < CONSENSUS_MAX_READS && !interrupted) {
+        flashmd_result_t r = flashmd_read_range(addr, reads[nreads], CONSENSUS_BLOCK, config);
+        if (r != FLASHMD_OK) {
+            return r;
+        }
+        crcs[nreads] = flashmd_crc32(0, reads[nreads], CONSENSUS_BLOCK);
+        uint32_t agree = 0;
+        for (uint32_t i = 0; i <= nreads; i++) {
+            agree += (crcs[i] == crcs[nreads]);
+        }
+        if (agree >= CONSENSUS_VOTES) {
+            winner = (int)nreads;
+        }
+        nreads++;
+    }
+    if (interrupted) {
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+
+    for (uint32_t w = 0; w < CONSENSUS_BLOCK; w += 2) {
+        if (winner >= 0) {
+            data[w] = reads[winner][w];
+            data[w + 1] = reads[winner][w + 1];
+        } else {
+            uint32_t best = 0, best_votes = 0;
+            for (uint32_t i = 0; i < nreads; i++) {
+                uint32_t votes = 0;
+                for (uint32_t j = 0; j < nreads; j++) {
+                    votes += (memcmp(reads[i] + w, reads[j] + w, 2) == 0);
+                }
+                if (votes > best_votes) {
+                    best = i;
+                    best_votes = votes;
+                }
+            }
+            data[w] = reads[best][w];
+            data[w + 1] = reads[best][w + 1];
+        }
+        for (uint32_t i = 0; i < nreads; i++) {
+            if (memcmp(reads[i] + w, data + w, 2) != 0) {
+                if ((*unstable)++ == 0) {
+                    *first = addr + w;
+                }
+                break;
+            }
+        }
+    }
+    return (winner >= 0) ? FLASHMD_OK : FLASHMD_ERR_VERIFY;
+}
+
+/* Check the first len bytes of a fresh dump against the cart and rewrite
+ * the blocks that did not hold. Returns FLASHMD_ERR_VERIFY if some blocks
+ * still disagree after the last round */
+static flashmd_result_t consensus_dump(const char *filename, uint32_t len,
+                                       const flashmd_config_t *config) {
+    uint32_t blocks = len / CONSENSUS_BLOCK;
+    if (blocks == 0) {
+        return FLASHMD_OK;
+    }
+
+    FILE *fp = fopen(filename, "r+b");
+    if (!fp) {
+        emit_msg(config, 1, "Error reopening %s: %s\n", filename, strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+    uint8_t *image = malloc(blocks * CONSENSUS_BLOCK);
+    uint32_t *crcs = malloc(blocks * sizeof(uint32_t));
+    uint8_t *check = malloc(blocks);        /* Hash on the cart this round */
+    uint8_t *settled = calloc(blocks, 1);   /* Re-read at least once */
+    uint8_t (*reads)[CONSENSUS_BLOCK] = malloc(CONSENSUS_MAX_READS * CONSENSUS_BLOCK);
+    if (!image || !crcs || !check || !settled || !reads ||
+        fread(image, 1, blocks * CONSENSUS_BLOCK, fp) != blocks * CONSENSUS_BLOCK) {
+        free(image);
+        free(crcs);
+        free(check);
+        free(settled);
+        free(reads);
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+
+    emit_msg(config, 0, "Consensus: hashing %u blocks on the cart...\n", blocks);
+    memset(check, 1, blocks);
+    flashmd_result_t r = FLASHMD_OK;
+    uint32_t unstable_blocks = 0, unresolved = 0;
+
+    for (int round = 0; r == FLASHMD_OK; round++) {
+        /* Hash each run of blocks still in question */
+        uint32_t suspects = 0;
+        uint32_t b = 0;
+        while (b < blocks && r == FLASHMD_OK && !interrupted) {
+            if (!check[b]) {
+                b++;
+                continue;
+            }
+            uint32_t end = b;
+            while (end < blocks && check[end] && end - b < CONSENSUS_BATCH) {
+                end++;
+            }
+            r = read_block_crcs(b, end - b, crcs + b, config);
+            for (uint32_t i = b; i < end && r == FLASHMD_OK; i++) {
+                check[i] = (crcs[i] != flashmd_crc32(0, image + i * CONSENSUS_BLOCK, CONSENSUS_BLOCK));
+                suspects += check[i];
+            }
+            if (round == 0) {
+                emit_progress(config, end * CONSENSUS_BLOCK, len);
+            }
+            b = end;
+        }
+        if (interrupted) {
+            r = FLASHMD_ERR_INTERRUPTED;
+        }
+        if (r != FLASHMD_OK || suspects == 0) {
+            break;
+        }
+        if (round == CONSENSUS_ROUNDS) {
+            unresolved = suspects;
+            break;
+        }
+
+        emit_msg(config, 0, "Consensus round %d: %u block%s disagree, reading them again\n",
+                 round + 1, suspects, (suspects == 1) ? "" : "s");
+        for (b = 0; b < blocks && r == FLASHMD_OK; b++) {
+            if (!check[b]) continue;
+            uint32_t words, first;
+            flashmd_result_t s = settle_block(b, image + b * CONSENSUS_BLOCK, reads, &words, &first, config);
+            if (s != FLASHMD_OK && s != FLASHMD_ERR_VERIFY) {
+                r = s;
+                break;
+            }
+            if (!settled[b]) {
+                settled[b] = 1;
+                unstable_blocks++;
+            }
+            if (unstable_blocks <= CONSENSUS_REPORT_MAX || (config && config->verbose)) {
+                emit_msg(config, 0, "  0x%06X: %u unstable word%s, first at 0x%06X%s\n",
+                         b * CONSENSUS_BLOCK, words, (words == 1) ? "" : "s", first,
+                         (s == FLASHMD_ERR_VERIFY) ? " (no clear winner, majority per word)" : "");
+            }
+        }
+    }
+
+    if (r == FLASHMD_OK && unstable_blocks > 0) {
+        if (unstable_blocks > CONSENSUS_REPORT_MAX && !(config && config->verbose)) {
+            emit_msg(config, 0, "  ...and %u more (-v lists them all)\n", unstable_blocks - CONSENSUS_REPORT_MAX);
+        }
+        if (fseek(fp, 0, SEEK_SET) != 0 ||
+            fwrite(image, 1, blocks * CONSENSUS_BLOCK, fp) != blocks * CONSENSUS_BLOCK ||
+            fflush(fp) != 0) {
+            emit_msg(config, 1, "Error rewriting %s\n", filename);
+            r = FLASHMD_ERR_FILE;
+        }
+    }
+    if (r == FLASHMD_OK) {
+        if (unresolved > 0) {
+            emit_msg(config, 1, "Consensus: %u block%s never held still; the dump has the majority of their reads\n",
+                     unresolved, (unresolved == 1) ? "" : "s");
+            r = FLASHMD_ERR_VERIFY;
+        } else if (unstable_blocks > 0) {
+            emit_msg(config, 0, "Consensus: %u unstable block%s read again until the cart agreed\n",
+                     unstable_blocks, (unstable_blocks == 1) ? "" : "s");
+        } else {
+            emit_msg(config, 0, "Consensus: all %u blocks match a second read of the cart\n", blocks);
+        }
+    }
+
+    free(image);
+    free(crcs);
+    free(check);
+    free(settled);
+    free(reads);
+    fclose(fp);
+    return r;
+}
+
+flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
+                                   const flashmd_config_t *config) {
+    uint8_t size_code;
     uint32_t total_bytes, device_bytes;
 
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    /* A cart written with a manifest knows its own image length */
+    flashmd_manifest_t manifest;
+    if (size_kb == 0 && flashmd_read_manifest(&manifest, config) == FLASHMD_OK &&
+        manifest.image_len > 0 && manifest.image_len <= 8*1024*1024) {
+        emit_msg(config, 0, "Cart manifest: %s, %u bytes\n", manifest.name, manifest.image_len);
+        size_kb = (manifest.image_len + 1023) / 1024;
+    }
+
+    flashmd_chip_info_t info;
+    int have_info = (flashmd_get_chip_info(&info, config) == FLASHMD_OK);
+
+    /* Cache: a cart we have seen before is served from disk after a spot check */
+    char cache_key[FLASHMD_CACHE_KEY_LEN] = "";
+    if (config && config->cache && have_info &&
+        flashmd_cache_identity(cache_key, &info, config) == 0 && !config->consensus) {
+        flashmd_manifest_t cached;
+        char object[FLASHMD_CACHE_PATH_LEN];
+        if (flashmd_cache_lookup(cache_key, &cached, object) == 0 &&
+            (size_kb == 0 || (cached.image_len + 1023) / 1024 == size_kb) &&
+            flashmd_cache_spot_check(object, cached.image_len, config) == 0 &&
+            flashmd_cache_copy_out(object, filename) == 0) {
+            emit_msg(config, 0, "ROM read complete: %u bytes served from cache to %s\n",
+                     cached.image_len, filename);
+            return FLASHMD_OK;
+        }
+    }
+
     if (size_kb == 0) {
+        /* A big chip does not mean a mapper: carts wired for 4MB mirror the
+         * last slot above it, so the upper half is only read when asked for */
         size_code = FLASHMD_SIZE_4M;
-        total_bytes = 4*1024*1024;
-        device_bytes = 4*1024*1024;
-        emit_msg(config, 0, "Auto-detecting ROM size by reading 4MB and trimming...\n");
+        total_bytes = flashmd_size_to_bytes(size_code);
+        device_bytes = total_bytes;
+        emit_msg(config, 0, "Auto-detecting ROM size by reading %uMB and trimming...\n",
+                 total_bytes / (1024*1024));
+        if (have_info && info.size > total_bytes) {
+            emit_msg(config, 0, "The chip holds %uMB; use -s %u if the cart has an SSF2-style mapper\n",
+                     info.size / (1024*1024), info.size / 1024);
+        }
     } else {
         size_code = (uint8_t)flashmd_kb_to_size(size_kb);
         device_bytes = flashmd_size_to_bytes(size_code);
@@ -684,11 +1765,6 @@ flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
         emit_msg(config, 0, "Reading %u KB ROM to %s...\n", size_kb, filename);
     }
 
-    flashmd_result_t r = flashmd_device_init(config);
-    if (r != FLASHMD_OK) {
-        return r;
-    }
-
     FILE *fp = fopen(filename, "wb");
     if (!fp) {
         emit_msg(config, 1, "Error opening output file: %s\n", strerror(errno));
@@ -822,6 +1898,16 @@ flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
     fclose(fp);
 
     read_all_responses(config, 2000);
+
+    /* Settle marginal reads before the file is trimmed or cached */
+    flashmd_result_t consensus = FLASHMD_OK;
+    if (config && config->consensus && saved > 0) {
+        consensus = consensus_dump(filename, saved, config);
+        if (consensus != FLASHMD_OK && consensus != FLASHMD_ERR_VERIFY) {
+            return consensus;
+        }
+    }
+
     emit_msg(config, 0, "ROM read complete: %u bytes written to %s\n", saved, filename);
 
     if (saved < total_bytes) {
@@ -835,11 +1921,25 @@ flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
         emit_msg(config, 0, "File size preserved at exactly %u KB (no trimming)\n", size_kb);
     }
 
-    return FLASHMD_OK;
+    if (cache_key[0] && saved >= total_bytes && consensus == FLASHMD_OK) {
+        FILE *img = fopen(filename, "rb");
+        if (img) {
+            fseek(img, 0, SEEK_END);
+            long len = ftell(img);
+            flashmd_manifest_t hashes;
+            if (len > 0 && flashmd_hash_image(img, (uint32_t)len, &info, filename, &hashes) == 0 &&
+                flashmd_cache_store(cache_key, filename, &hashes) == 0) {
+                emit_msg(config, 0, "Stored in cache as %s\n", cache_key);
+            }
+            fclose(img);
+        }
+    }
+
+    return consensus;
 }
 
 flashmd_result_t flashmd_read_sram(const char *filename, const flashmd_config_t *config) {
-    flashmd_result_t r = flashmd_device_init(config);
+    flashmd_result_t r = operation_init(config);
     if (r != FLASHMD_OK) {
         return r;
     }
@@ -896,161 +1996,1215 @@ flashmd_result_t flashmd_read_sram(const char *filename, const flashmd_config_t
     return FLASHMD_OK;
 }
 
-flashmd_result_t flashmd_write_rom(const char *filename, uint32_t size_kb,
-                                    const flashmd_config_t *config) {
-    flashmd_result_t r = flashmd_device_init(config);
+/*
+ * Incremental SRAM backup: the firmware hashes each 1K block of SRAM and
+ * only the blocks that differ from the cart's last backup are read. The
+ * history of versions is kept by flashmd_sram.c.
+ */
+#define SRAM_BLOCK_RETRIES 2
+
+/* What a save backup needs of the session: the flasher answering and a
+ * key for the cart. The full device init waits out seconds of reply
+ * timeouts, which a backup run over many carts would pay for each one */
+static flashmd_result_t sram_session(char *key, const flashmd_config_t *config) {
+    uint8_t stale[512];
+    while (usb_read(stale, sizeof(stale), POLL_INTERVAL_MS) > 0) {
+    }
+    flashmd_result_t r = flashmd_connect(config);
+    if (r == FLASHMD_OK) {
+        r = preflight(config);
+    }
     if (r != FLASHMD_OK) {
         return r;
     }
 
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
-        return FLASHMD_ERR_FILE;
+    flashmd_chip_info_t info;
+    if (flashmd_get_chip_info(&info, config) == FLASHMD_OK &&
+        flashmd_cache_identity(key, &info, config) == 0) {
+        return FLASHMD_OK;
     }
+    /* No flash chip to go by: key the cart by its header */
+    uint8_t header[512];
+    r = flashmd_read_range(0, header, sizeof(header), config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    snprintf(key, FLASHMD_CACHE_KEY_LEN, "rom-h%08X", flashmd_crc32(0, header, sizeof(header)));
+    return FLASHMD_OK;
+}
 
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (file_size <= 0) {
-        emit_msg(config, 1, "Invalid file size\n");
-        fclose(fp);
-        return FLASHMD_ERR_FILE;
+static flashmd_result_t read_sram_crcs(uint32_t *crcs, const flashmd_config_t *config) {
+    uint8_t raw[4 * FLASHMD_SRAM_BLOCKS];
+    uint8_t params[2] = {0, FLASHMD_SRAM_BLOCKS};
+    if (send_command(CMD_SRAM_CRC, params, sizeof(params)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+    if (read_binary(raw, sizeof(raw), 2000) < 0) {
+        emit_msg(config, 1, "No SRAM block hashes from the device; the firmware may predate them\n");
+        return FLASHMD_ERR_TIMEOUT;
     }
+    for (uint32_t i = 0; i < FLASHMD_SRAM_BLOCKS; i++) {
+        const uint8_t *p = raw + 4 * i;
+        crcs[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+    return FLASHMD_OK;
+}
 
-    uint32_t write_size = (size_kb > 0) ? (size_kb * 1024) : (uint32_t)file_size;
-    if (write_size > (uint32_t)file_size) {
-        write_size = (uint32_t)file_size;
+static flashmd_result_t read_sram_blocks(uint32_t block, uint32_t count, uint8_t *buf,
+                                         const flashmd_config_t *config) {
+    uint8_t params[2] = {block, count};
+    if (send_command(CMD_SRAM_BLOCKS, params, sizeof(params)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+    if (read_binary(buf, count * FLASHMD_SRAM_BLOCK, 5000) < 0) {
+        emit_msg(config, 1, "SRAM read of blocks %u-%u timed out\n", block, block + count - 1);
+        return FLASHMD_ERR_TIMEOUT;
     }
+    return FLASHMD_OK;
+}
 
-    emit_msg(config, 0, "Writing %u bytes from %s to flash...\n", write_size, filename);
+static flashmd_result_t write_sram_file(const char *filename, const uint8_t *image,
+                                        const flashmd_config_t *config) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening output file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+    int ok = fwrite(image, 1, FLASHMD_SRAM_SIZE, fp) == FLASHMD_SRAM_SIZE;
+    fflush(fp);
+#ifdef _WIN32
+    _commit(fileno(fp));
+#else
+    fsync(fileno(fp));
+#endif
+    fix_file_ownership_fd(fileno(fp));
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        emit_msg(config, 1, "Error writing %s\n", filename);
+        return FLASHMD_ERR_FILE;
+    }
+    return FLASHMD_OK;
+}
 
-    uint8_t buffer[DATA_CHUNK_SIZE];
-    uint32_t written = 0;
-    uint8_t bank = 0;
-    uint8_t addj = 0;
+flashmd_result_t flashmd_backup_sram(const char *filename, const flashmd_config_t *config) {
+    char key[FLASHMD_CACHE_KEY_LEN];
+    flashmd_result_t r = sram_session(key, config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
 
-    while (written < write_size && !interrupted) {
-        size_t to_read = DATA_CHUNK_SIZE;
-        if (written + to_read > write_size) {
-            to_read = write_size - written;
-            memset(buffer, 0xFF, DATA_CHUNK_SIZE);
-        }
-        if (fread(buffer, 1, to_read, fp) != to_read) {
-            emit_msg(config, 1, "Error reading file\n");
-            fclose(fp);
-            return FLASHMD_ERR_FILE;
-        }
+    uint32_t start_ms = flashmd_now_ms();
+    uint32_t crcs[FLASHMD_SRAM_BLOCKS];
+    r = read_sram_crcs(crcs, config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
 
-        if (usb_write(buffer, DATA_CHUNK_SIZE) < 0) {
-            fclose(fp);
-            return FLASHMD_ERR_IO;
+    /* Per call: daemon workers back up several carts at once */
+    uint8_t *old = malloc(FLASHMD_SRAM_SIZE);
+    uint8_t *image = malloc(FLASHMD_SRAM_SIZE);
+    if (!old || !image) {
+        free(old);
+        free(image);
+        return FLASHMD_ERR_IO;
+    }
+    int have_old = (flashmd_sram_latest(key, old) == 0);
+    uint32_t fetch = 0, nfetch = 0;
+    for (uint32_t b = 0; b < FLASHMD_SRAM_BLOCKS; b++) {
+        if (!have_old || crcs[b] != flashmd_crc32(0, old + b * FLASHMD_SRAM_BLOCK, FLASHMD_SRAM_BLOCK)) {
+            fetch |= 1u << b;
+            nfetch++;
         }
+    }
+    if (have_old) {
+        memcpy(image, old, FLASHMD_SRAM_SIZE);
+        emit_msg(config, 0, "Backing up SRAM: %u of %u blocks changed since the last backup\n",
+                 nfetch, FLASHMD_SRAM_BLOCKS);
+    } else {
+        emit_msg(config, 0, "Backing up SRAM: no earlier backup of this cart, reading all of it\n");
+    }
 
-        usleep(WRITE_DELAY_US);
-
-        uint8_t params[2] = {addj, bank};
-        if (send_command(CMD_WRITE_ROM, params, 2) < 0) {
-            fclose(fp);
-            return FLASHMD_ERR_IO;
+    /* Runs of changed blocks; each block must match its hash */
+    uint32_t done = 0;
+    uint32_t b = 0;
+    while (b < FLASHMD_SRAM_BLOCKS && r == FLASHMD_OK && !interrupted) {
+        if (!(fetch & (1u << b))) {
+            b++;
+            continue;
         }
-
-        char response[256];
-        int n = read_response(response, sizeof(response), 5000);
-        if (n <= 0) {
-            emit_msg(config, 1, "\nNo response at offset %u\n", written);
-            fclose(fp);
-            return FLASHMD_ERR_TIMEOUT;
+        uint32_t end = b;
+        while (end < FLASHMD_SRAM_BLOCKS && (fetch & (1u << end))) {
+            end++;
         }
-
-        written += DATA_CHUNK_SIZE;
-        addj++;
-        if (addj >= 64) {
-            addj = 0;
-            bank++;
+        r = read_sram_blocks(b, end - b, image + b * FLASHMD_SRAM_BLOCK, config);
+        for (uint32_t i = b; i < end && r == FLASHMD_OK; i++) {
+            uint8_t *block = image + i * FLASHMD_SRAM_BLOCK;
+            uint32_t tries = 0;
+            while (r == FLASHMD_OK && flashmd_crc32(0, block, FLASHMD_SRAM_BLOCK) != crcs[i]) {
+                if (++tries > SRAM_BLOCK_RETRIES) {
+                    emit_msg(config, 1, "SRAM block %u does not read back as the cart hashed it\n", i);
+                    r = FLASHMD_ERR_VERIFY;
+                } else {
+                    r = read_sram_blocks(i, 1, block, config);
+                }
+            }
         }
-
-        emit_progress(config, written, write_size);
+        done += end - b;
+        emit_progress(config, done * FLASHMD_SRAM_BLOCK, nfetch * FLASHMD_SRAM_BLOCK);
+        b = end;
     }
-
-    if (interrupted) {
-        fclose(fp);
-        return FLASHMD_ERR_INTERRUPTED;
+    if (r == FLASHMD_OK && interrupted) {
+        r = FLASHMD_ERR_INTERRUPTED;
     }
-
-    emit_msg(config, 0, "\n");
-    fclose(fp);
-
-    send_command(CMD_CLEAR_BUFFER, NULL, 0);
-    read_all_responses(config, 1000);
-
-    emit_msg(config, 0, "ROM write complete: %u bytes written\n", written);
-    return FLASHMD_OK;
+    if (r == FLASHMD_OK) {
+        r = write_sram_file(filename, image, config);
+    }
+    if (r == FLASHMD_OK) {
+        if (flashmd_sram_commit(key, have_old ? old : NULL, image) != 0) {
+            emit_msg(config, 1, "Warning: could not update the save history\n");
+        }
+        int versions = flashmd_sram_versions(key, NULL, 0);
+        if (have_old && nfetch == 0) {
+            emit_msg(config, 0, "SRAM unchanged since the last backup (version %d)\n", versions);
+        } else if (versions > 0) {
+            emit_msg(config, 0, "Saved as version %d of this cart's save\n", versions);
+        }
+        emit_msg(config, 0, "SRAM backup complete: %u KB read in %.2f s, written to %s\n",
+                 nfetch, (flashmd_now_ms() - start_ms) / 1000.0, filename);
+    }
+    free(old);
+    free(image);
+    return r;
 }
 
-flashmd_result_t flashmd_write_sram(const char *filename, const flashmd_config_t *config) {
-    flashmd_result_t r = flashmd_device_init(config);
+flashmd_result_t flashmd_sram_history(const char *filename, int version, const flashmd_config_t *config) {
+    char key[FLASHMD_CACHE_KEY_LEN];
+    flashmd_result_t r = sram_session(key, config);
     if (r != FLASHMD_OK) {
         return r;
     }
 
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        emit_msg(config, 1, "Error opening SRAM file: %s\n", strerror(errno));
+    flashmd_sram_version_t *versions = malloc(sizeof(*versions) * FLASHMD_SRAM_MAX_VERSIONS);
+    if (!versions) {
+        return FLASHMD_ERR_IO;
+    }
+    int count = flashmd_sram_versions(key, versions, FLASHMD_SRAM_MAX_VERSIONS);
+    if (count < 0) {
+        emit_msg(config, 1, "No SRAM backups of this cart (%s)\n", key);
+        free(versions);
         return FLASHMD_ERR_FILE;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (file_size > 32 * 1024) {
-        file_size = 32 * 1024;
-        emit_msg(config, 0, "Warning: File truncated to 32K\n");
+    if (!filename) {
+        emit_msg(config, 0, "Save versions of cart %s:\n", key);
+        for (int i = 0; i < count; i++) {
+            char when[32];
+            time_t t = (time_t)versions[i].timestamp;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+            char what[32];
+            if (versions[i].changed) {
+                uint32_t n = 0;
+                for (uint32_t b = 0; b < FLASHMD_SRAM_BLOCKS; b++) {
+                    n += (versions[i].changed >> b) & 1;
+                }
+                snprintf(what, sizeof(what), "%u block%s changed", n, (n == 1) ? "" : "s");
+            } else {
+                snprintf(what, sizeof(what), "first backup");
+            }
+            emit_msg(config, 0, "  %4d  %s  CRC %08X  %s\n", i + 1, when, versions[i].crc, what);
+        }
+        free(versions);
+        return FLASHMD_OK;
     }
 
-    emit_msg(config, 0, "Writing %ld bytes from %s to SRAM...\n", file_size, filename);
+    if (version == 0) version = count;
+    if (version < 1 || version > count) {
+        emit_msg(config, 1, "No version %d; this cart has versions 1-%d\n", version, count);
+        free(versions);
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+    free(versions);
 
-    uint8_t buffer[DATA_CHUNK_SIZE];
-    uint32_t written = 0;
-    uint8_t bank = 0;
-    uint8_t addj = 0;
+    uint8_t *image = malloc(FLASHMD_SRAM_SIZE);
+    if (!image) {
+        return FLASHMD_ERR_IO;
+    }
+    if (flashmd_sram_version(key, version, image) != 0) {
+        emit_msg(config, 1, "Version %d could not be rebuilt from the save history\n", version);
+        r = FLASHMD_ERR_VERIFY;
+    } else {
+        r = write_sram_file(filename, image, config);
+    }
+    if (r == FLASHMD_OK) {
+        emit_msg(config, 0, "Version %d of %d written to %s\n", version, count, filename);
+    }
+    free(image);
+    return r;
+}
 
-    while (written < (uint32_t)file_size && !interrupted) {
-        size_t to_read = DATA_CHUNK_SIZE;
-        if (written + to_read > (uint32_t)file_size) {
-            to_read = file_size - written;
-            memset(buffer, 0x00, DATA_CHUNK_SIZE);
-        }
-        size_t _unused = fread(buffer, 1, to_read, fp);
-        (void)_unused;
+/*
+ * Program one 1K block at a byte offset through the 0x0B command. The
+ * firmware verifies the block and answers "WRITE OK", "WRITE OK RETRIED
+ * <n>" or "WRITE FAIL AT 0x<word> <expected>/<read>".
+ */
+static flashmd_result_t write_block(uint32_t offset, const uint8_t *data, uint32_t *retried,
+                                    const flashmd_config_t *config) {
+    uint32_t block = offset / DATA_CHUNK_SIZE;
+    if (usb_write(data, DATA_CHUNK_SIZE) < 0) {
+        return FLASHMD_ERR_IO;
+    }
 
-        if (usb_write(buffer, DATA_CHUNK_SIZE) < 0) {
-            fclose(fp);
-            return FLASHMD_ERR_IO;
-        }
+    usleep(WRITE_DELAY_US);
 
-        usleep(WRITE_DELAY_US);
+    uint8_t params[2] = {block % 64, block / 64};
+    if (send_command(CMD_WRITE_ROM, params, 2) < 0) {
+        return FLASHMD_ERR_IO;
+    }
 
-        uint8_t params[2] = {addj, bank};
-        if (send_command(CMD_WRITE_SRAM, params, 2) < 0) {
+    char response[256];
+    int n = read_response(response, sizeof(response), 5000);
+    if (n <= 0) {
+        emit_msg(config, 1, "\nNo response at offset %u\n", offset);
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    const char *fail = strstr(response, "WRITE FAIL");
+    if (fail) {
+        unsigned int word_addr = 0, expect = 0, got = 0;
+        if (sscanf(fail, "WRITE FAIL AT 0x%x %x/%x", &word_addr, &expect, &got) == 3) {
+            emit_msg(config, 1, "\nVerify failed at 0x%06X: wrote %04X, read %04X\n",
+                     word_addr * 2, expect, got);
+        } else {
+            emit_msg(config, 1, "\nFlash program failed at offset %u\n", offset);
+        }
+        return FLASHMD_ERR_IO;
+    }
+    const char *retry = strstr(response, "RETRIED ");
+    if (retry && retried) {
+        *retried += (uint32_t)strtoul(retry + 8, NULL, 10);
+    }
+    return FLASHMD_OK;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* The manifest lives in the chip's last sector */
+static uint32_t manifest_location(const flashmd_chip_info_t *info) {
+    if (info->size == 0) return 0;
+    return info->size - flashmd_chip_sector_size(info, info->size - 1);
+}
+
+/*
+ * Hash an image the way it will sit on the cart: each sector's CRC covers
+ * the image bytes in it plus the 0xFF padding up to the sector end.
+ */
+int flashmd_hash_image(FILE *fp, uint32_t len, const flashmd_chip_info_t *info,
+                       const char *filename, flashmd_manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+    m->image_len = len;
+    m->timestamp = (uint64_t)time(NULL);
+    const char *base = strrchr(filename, '/');
+#ifdef _WIN32
+    const char *base2 = strrchr(filename, '\\');
+    if (base2 && (!base || base2 > base)) base = base2;
+#endif
+    snprintf(m->name, sizeof(m->name), "%s", base ? base + 1 : filename);
+
+    uint8_t buffer[DATA_CHUNK_SIZE];
+    uint32_t pos = 0;
+    uint32_t image_crc = 0;
+    fseek(fp, 0, SEEK_SET);
+    while (pos < len) {
+        uint32_t sector = flashmd_chip_sector_size(info, pos);
+        if (sector == 0 || m->nsectors >= FLASHMD_MANIFEST_MAX_SECTORS) return -1;
+        uint32_t crc = 0;
+        for (uint32_t off = 0; off < sector; off += DATA_CHUNK_SIZE) {
+            uint32_t n = 0;
+            if (pos + off < len) {
+                n = len - (pos + off);
+                if (n > DATA_CHUNK_SIZE) n = DATA_CHUNK_SIZE;
+                if (fread(buffer, 1, n, fp) != n) return -1;
+                image_crc = flashmd_crc32(image_crc, buffer, n);
+            }
+            memset(buffer + n, 0xFF, DATA_CHUNK_SIZE - n);
+            crc = flashmd_crc32(crc, buffer, DATA_CHUNK_SIZE);
+        }
+        m->sector_crc[m->nsectors++] = crc;
+        pos += sector;
+    }
+    m->image_crc = image_crc;
+    return 0;
+}
+
+/*
+ * Serialized manifest (little endian):
+ *   0  "FMDMANI1"          8  header size
+ *   12 image length        16 image CRC32
+ *   20 sector count        24 timestamp (64-bit unix time)
+ *   32 image name (28)     60 CRC32 of bytes 0-59 and the sector table
+ *   64 sector CRC32s
+ */
+static uint32_t manifest_serialize(const flashmd_manifest_t *m, uint8_t *out) {
+    uint32_t len = MANIFEST_HEADER_SIZE + 4 * m->nsectors;
+    memset(out, 0xFF, MANIFEST_MAX_BYTES);
+    memset(out, 0, MANIFEST_HEADER_SIZE);
+    memcpy(out, MANIFEST_MAGIC, 8);
+    put_le32(out + 8, MANIFEST_HEADER_SIZE);
+    put_le32(out + 12, m->image_len);
+    put_le32(out + 16, m->image_crc);
+    put_le32(out + 20, m->nsectors);
+    put_le32(out + 24, (uint32_t)m->timestamp);
+    put_le32(out + 28, (uint32_t)(m->timestamp >> 32));
+    memcpy(out + 32, m->name, 27);
+    for (uint32_t i = 0; i < m->nsectors; i++) {
+        put_le32(out + MANIFEST_HEADER_SIZE + 4 * i, m->sector_crc[i]);
+    }
+    uint32_t crc = flashmd_crc32(0, out, 60);
+    crc = flashmd_crc32(crc, out + MANIFEST_HEADER_SIZE, 4 * m->nsectors);
+    put_le32(out + 60, crc);
+    return len;
+}
+
+static int manifest_parse(const uint8_t *in, flashmd_manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+    if (memcmp(in, MANIFEST_MAGIC, 8) != 0) return -1;
+    if (get_le32(in + 8) != MANIFEST_HEADER_SIZE) return -1;
+    m->nsectors = get_le32(in + 20);
+    if (m->nsectors > FLASHMD_MANIFEST_MAX_SECTORS) return -1;
+    uint32_t crc = flashmd_crc32(0, in, 60);
+    crc = flashmd_crc32(crc, in + MANIFEST_HEADER_SIZE, 4 * m->nsectors);
+    if (crc != get_le32(in + 60)) return -1;
+    m->image_len = get_le32(in + 12);
+    m->image_crc = get_le32(in + 16);
+    m->timestamp = get_le32(in + 24) | ((uint64_t)get_le32(in + 28) << 32);
+    memcpy(m->name, in + 32, 27);
+    m->name[27] = '\0';
+    for (uint32_t i = 0; i < m->nsectors; i++) {
+        m->sector_crc[i] = get_le32(in + MANIFEST_HEADER_SIZE + 4 * i);
+    }
+    return 0;
+}
+
+static flashmd_result_t manifest_read(uint32_t addr, flashmd_manifest_t *m,
+                                      const flashmd_config_t *config) {
+    uint8_t raw[MANIFEST_MAX_BYTES];
+    flashmd_result_t r = flashmd_read_range(addr, raw, sizeof(raw), config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    return manifest_parse(raw, m) == 0 ? FLASHMD_OK : FLASHMD_ERR_NO_MANIFEST;
+}
+
+/* Manifest sector must already be erased */
+static flashmd_result_t manifest_write(uint32_t addr, const flashmd_manifest_t *m, uint32_t *retried,
+                                       const flashmd_config_t *config) {
+    uint8_t raw[MANIFEST_MAX_BYTES + DATA_CHUNK_SIZE];
+    uint32_t len = manifest_serialize(m, raw);
+    memset(raw + MANIFEST_MAX_BYTES, 0xFF, DATA_CHUNK_SIZE);
+    for (uint32_t off = 0; off < len; off += DATA_CHUNK_SIZE) {
+        flashmd_result_t r = write_block(addr + off, raw + off, retried, config);
+        if (r != FLASHMD_OK) {
+            return r;
+        }
+    }
+    return FLASHMD_OK;
+}
+
+/* Ask for len bytes of ROM from addr (both even); the data follows raw */
+static int send_read_range(uint32_t addr, uint32_t len) {
+    uint32_t start_words = addr / 2;
+    uint32_t words = len / 2;
+    uint8_t params[6] = {
+        (start_words >> 16) & 0xFF, (start_words >> 8) & 0xFF, start_words & 0xFF,
+        (words >> 16) & 0xFF, (words >> 8) & 0xFF, words & 0xFF
+    };
+    return send_command(CMD_READ_RANGE, params, sizeof(params));
+}
+
+flashmd_result_t flashmd_read_range(uint32_t addr, uint8_t *buf, uint32_t len,
+                                    const flashmd_config_t *config) {
+    if ((addr | len) & 1) {
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+    if (send_read_range(addr, len) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+    if (read_binary(buf, len, 5000) < 0) {
+        emit_msg(config, 1, "Ranged read of 0x%06X+%u timed out\n", addr, len);
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    return FLASHMD_OK;
+}
+
+/*
+ * Bus micro-programs. The upload is a burst of 0x6E packets with no
+ * replies; the run answers with 4-byte frames: a data frame (type, 0,
+ * length) before each EMIT's bytes, a keep-alive (type, 0, offset of the
+ * current op) every second the program runs on, then an end frame (type,
+ * status, offset of the failing op). A program may run as long as it
+ * likes; only a flasher that stops sending frames times out.
+ */
+#define PROG_LOAD_CHUNK     48
+#define PROG_FRAME_DATA     0xD0
+#define PROG_FRAME_END      0xE0
+#define PROG_FRAME_ALIVE    0xA0
+#define PROG_FRAME_TIMEOUT  5000    /* Keep-alives come every 1000ms */
+
+flashmd_result_t flashmd_run_program(const flashmd_prog_t *p, uint8_t *out, uint32_t out_max,
+                                     uint32_t *out_len, const flashmd_config_t *config) {
+    *out_len = 0;
+    if (p->overflow || p->len == 0) {
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+    for (uint32_t off = 0; off < p->len; off += PROG_LOAD_CHUNK) {
+        uint32_t n = (p->len - off > PROG_LOAD_CHUNK) ? PROG_LOAD_CHUNK : p->len - off;
+        uint8_t params[3 + PROG_LOAD_CHUNK] = {off >> 8, off & 0xFF, n};
+        memcpy(params + 3, p->code + off, n);
+        if (send_command(CMD_PROG_LOAD, params, 3 + n) < 0) {
+            return FLASHMD_ERR_IO;
+        }
+    }
+    uint8_t run[2] = {p->len >> 8, p->len & 0xFF};
+    if (send_command(CMD_PROG_RUN, run, sizeof(run)) < 0) {
+        return FLASHMD_ERR_IO;
+    }
+
+    uint32_t dropped = 0;
+    uint8_t frame[4];
+    while (1) {
+        if (read_binary(frame, sizeof(frame), PROG_FRAME_TIMEOUT) < 0) {
+            emit_msg(config, 1, "No reply from the micro-program; the firmware may predate them\n");
+            return FLASHMD_ERR_TIMEOUT;
+        }
+        uint32_t value = frame[2] | (frame[3] << 8);
+        if (frame[0] == PROG_FRAME_END) {
+            if (dropped) {
+                emit_msg(config, 1, "Program emitted %u bytes more than the %u kept\n", dropped, out_max);
+            }
+            if (frame[1] != 0) {
+                emit_msg(config, 1, "Program stopped at byte %u: %s\n", value, flashmd_prog_status(frame[1]));
+                return FLASHMD_ERR_PROGRAM;
+            }
+            return FLASHMD_OK;
+        }
+        if (frame[0] == PROG_FRAME_ALIVE) {
+            if (config && config->verbose) {
+                emit_msg(config, 0, "Program still running at byte %u\n", value);
+            }
+            continue;
+        }
+        if (frame[0] != PROG_FRAME_DATA || value > FLASHMD_PROG_BUFFER) {
+            emit_msg(config, 1, "Unexpected micro-program frame %02X %02X %02X %02X\n",
+                     frame[0], frame[1], frame[2], frame[3]);
+            return FLASHMD_ERR_IO;
+        }
+        uint8_t data[FLASHMD_PROG_BUFFER];
+        if (read_binary(data, value, PROG_FRAME_TIMEOUT) < 0) {
+            return FLASHMD_ERR_TIMEOUT;
+        }
+        uint32_t keep = (out_max - *out_len < value) ? out_max - *out_len : value;
+        memcpy(out + *out_len, data, keep);
+        *out_len += keep;
+        dropped += value - keep;
+    }
+}
+
+#define PROG_SOURCE_MAX     (64 * 1024)
+#define PROG_OUTPUT_MAX     (64 * 1024)
+
+flashmd_result_t flashmd_run_program_file(const char *filename, const flashmd_config_t *config) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening program file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+    char *text = malloc(PROG_SOURCE_MAX + 1);
+    if (!text) {
+        fclose(fp);
+        return FLASHMD_ERR_IO;
+    }
+    size_t len = fread(text, 1, PROG_SOURCE_MAX, fp);
+    text[len] = '\0';
+    fclose(fp);
+
+    flashmd_prog_t prog;
+    char err[128];
+    int line = flashmd_prog_assemble(text, &prog, err, sizeof(err));
+    free(text);
+    if (line != 0) {
+        emit_msg(config, 1, "%s:%d: %s\n", filename, line, err);
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    uint8_t *out = malloc(PROG_OUTPUT_MAX);
+    if (!out) {
+        return FLASHMD_ERR_IO;
+    }
+    uint32_t out_len = 0;
+    uint32_t start_ms = flashmd_now_ms();
+    r = flashmd_run_program(&prog, out, PROG_OUTPUT_MAX, &out_len, config);
+    uint32_t elapsed = flashmd_now_ms() - start_ms;
+
+    /* Hex dump of what was emitted, even when the program failed part way */
+    for (uint32_t off = 0; off < out_len; off += 16) {
+        char hex[16 * 3 + 1] = "";
+        uint32_t n = (out_len - off > 16) ? 16 : out_len - off;
+        for (uint32_t i = 0; i < n; i++) {
+            snprintf(hex + 3 * i, sizeof(hex) - 3 * i, " %02X", out[off + i]);
+        }
+        emit_msg(config, 0, "%06X:%s\n", off, hex);
+    }
+    free(out);
+    if (r == FLASHMD_OK) {
+        emit_msg(config, 0, "Program of %u bytes ran in %u ms and emitted %u bytes\n",
+                 prog.len, elapsed, out_len);
+    }
+    return r;
+}
+
+flashmd_result_t flashmd_read_manifest(flashmd_manifest_t *manifest, const flashmd_config_t *config) {
+    flashmd_chip_info_t info;
+    flashmd_result_t r = flashmd_get_chip_info(&info, config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    return manifest_read(manifest_location(&info), manifest, config);
+}
+
+/*
+ * Compare the cart with a ROM file through ranged reads
+ */
+#define VERIFY_CHUNK_SIZE (32 * 1024)
+#define VERIFY_MAP_UNIT   (64 * 1024)     /* Mismatch map unit without chip info */
+
+/*
+ * Verify a pack by its sector CRCs: whole sectors are read back and
+ * hashed, with no file data read at all.
+ */
+static flashmd_result_t verify_pack(const char *filename, const flashmd_pack_t *pack,
+                                    const flashmd_config_t *config) {
+    flashmd_chip_info_t info;
+    flashmd_result_t r = flashmd_get_chip_info(&info, config);
+    if (r != FLASHMD_OK || strcmp(pack->chip_id, info.id) != 0) {
+        emit_msg(config, 1, "Pack was made for chip %s, cart has %s\n", pack->chip_id,
+                 (r == FLASHMD_OK) ? info.id : "an unknown chip");
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    uint32_t span = pack->sectors[pack->nsectors - 1].addr + pack->sectors[pack->nsectors - 1].size;
+    emit_msg(config, 0, "Verifying %u sectors of %s against the cart...\n", pack->nsectors, filename);
+
+    uint8_t *cart_buf = malloc(VERIFY_CHUNK_SIZE);
+    if (!cart_buf) {
+        return FLASHMD_ERR_IO;
+    }
+    uint32_t differ = 0;
+    for (uint32_t i = 0; i < pack->nsectors && !interrupted && r == FLASHMD_OK; i++) {
+        const flashmd_pack_sector_t *sector = &pack->sectors[i];
+        uint32_t crc = 0;
+        for (uint32_t off = 0; off < sector->size && r == FLASHMD_OK; off += VERIFY_CHUNK_SIZE) {
+            uint32_t n = sector->size - off;
+            if (n > VERIFY_CHUNK_SIZE) n = VERIFY_CHUNK_SIZE;
+            r = flashmd_read_range(sector->addr + off, cart_buf, n, config);
+            crc = flashmd_crc32(crc, cart_buf, n);
+            emit_progress(config, sector->addr + off + n, span);
+        }
+        if (r == FLASHMD_OK && crc != sector->crc) {
+            if (differ++ == 0) {
+                emit_msg(config, 0, "\nFirst differing sector at 0x%06X\n", sector->addr);
+            }
+        }
+    }
+    free(cart_buf);
+
+    if (interrupted) {
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    emit_msg(config, 0, "\n");
+    if (differ > 0) {
+        emit_msg(config, 1, "Verify failed: %u of %u sectors differ\n", differ, pack->nsectors);
+        return FLASHMD_ERR_VERIFY;
+    }
+    emit_msg(config, 0, "Verify OK: cart matches %s\n", filename);
+    return FLASHMD_OK;
+}
+
+/* Advance to the next chunk to read at or after *addr, skipping sectors
+ * mapped '-'. Returns its length, 0 when nothing is left */
+static uint32_t verify_next_chunk(const uint32_t *sector_addr, const char *map, uint32_t nsectors,
+                                  uint32_t *s, uint32_t *addr) {
+    while (*s < nsectors && (map[*s] == '-' || *addr >= sector_addr[*s + 1])) {
+        (*s)++;
+        if (*s < nsectors) *addr = sector_addr[*s];
+    }
+    if (*s >= nsectors) {
+        return 0;
+    }
+    uint32_t len = sector_addr[*s + 1] - *addr;
+    return (len > VERIFY_CHUNK_SIZE) ? VERIFY_CHUNK_SIZE : len;
+}
+
+/*
+ * Verify a ROM file as the cart streams in, stopping after the first
+ * sector that differs unless config->keep_going. Sectors that are all
+ * 0xFF in the file are not read when a blank check finds them erased.
+ */
+flashmd_result_t flashmd_verify_rom(const char *filename, uint32_t size_kb,
+                                     const flashmd_config_t *config) {
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    flashmd_pack_t pack;
+    int packed = flashmd_pack_open(filename, &pack);
+    if (packed == 0) {
+        r = (pack.nsectors > 0) ? verify_pack(filename, &pack, config) : FLASHMD_ERR_FILE;
+        flashmd_pack_close(&pack);
+        return r;
+    }
+    if (packed < 0) {
+        emit_msg(config, 1, "%s is a damaged pack\n", filename);
+        return FLASHMD_ERR_FILE;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (file_size <= 0) {
+        emit_msg(config, 1, "Invalid file size\n");
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+    uint32_t verify_size = (uint32_t)file_size;
+    if (size_kb > 0 && size_kb * 1024 < verify_size) {
+        verify_size = size_kb * 1024;
+    }
+    if (verify_size > FLASHMD_MANIFEST_MAX_SECTORS * VERIFY_MAP_UNIT) {
+        emit_msg(config, 1, "%s is larger than any cart\n", filename);
+        fclose(fp);
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    /* The whole image in memory, 0xFF past an odd end to fill the last word */
+    uint8_t *image = malloc(verify_size + 1);
+    uint8_t *cart_buf = malloc(VERIFY_CHUNK_SIZE);
+    if (!image || !cart_buf || fread(image, 1, verify_size, fp) != verify_size) {
+        free(image);
+        free(cart_buf);
+        fclose(fp);
+        return (image && cart_buf) ? FLASHMD_ERR_FILE : FLASHMD_ERR_IO;
+    }
+    fclose(fp);
+    image[verify_size] = 0xFF;
+
+    /* Map by chip sector, or by fixed units when the chip is unknown */
+    flashmd_chip_info_t info;
+    int have_info = (flashmd_get_chip_info(&info, config) == FLASHMD_OK);
+    uint32_t sector_addr[FLASHMD_MANIFEST_MAX_SECTORS + 1];
+    uint32_t nsectors = 0, pos = 0;
+    while (pos < verify_size && nsectors < FLASHMD_MANIFEST_MAX_SECTORS) {
+        uint32_t sector = have_info ? flashmd_chip_sector_size(&info, pos) : 0;
+        if (sector == 0) {
+            break;
+        }
+        sector_addr[nsectors++] = pos;
+        pos += sector;
+    }
+    if (pos < verify_size) {
+        nsectors = 0;
+        for (pos = 0; pos < verify_size; pos += VERIFY_MAP_UNIT) {
+            sector_addr[nsectors++] = pos;
+        }
+        have_info = 0;
+    }
+    sector_addr[nsectors] = verify_size;
+
+    /* Padding in the file need not be read where the cart is erased */
+    char map[FLASHMD_MANIFEST_MAX_SECTORS + 1];
+    uint32_t skipped = 0, skipped_bytes = 0;
+    memset(map, '?', nsectors);
+    map[nsectors] = '\0';
+    uint8_t padding[FLASHMD_MANIFEST_MAX_SECTORS];
+    uint32_t npadding = 0;
+    for (uint32_t s = 0; s < nsectors; s++) {
+        uint32_t end = (sector_addr[s + 1] < verify_size) ? sector_addr[s + 1] : verify_size;
+        padding[s] = 1;
+        for (uint32_t i = sector_addr[s]; i < end && padding[s]; i++) {
+            padding[s] = (image[i] == 0xFF);
+        }
+        npadding += padding[s];
+    }
+    if (have_info && npadding > 0) {
+        uint8_t dirty[FLASHMD_MANIFEST_MAX_SECTORS];
+        uint32_t first = 0, count = 0;
+        r = flashmd_blank_check(0, verify_size, dirty, nsectors, &first, &count, config);
+        if (r != FLASHMD_OK) {
+            free(image);
+            free(cart_buf);
+            return r;
+        }
+        for (uint32_t s = 0; s < nsectors && first == 0; s++) {
+            if (padding[s] && s < count && !dirty[s]) {
+                map[s] = '-';
+                skipped++;
+                skipped_bytes += sector_addr[s + 1] - sector_addr[s];
+            }
+        }
+    }
+
+    emit_msg(config, 0, "Verifying %u bytes of %s against the cart...\n", verify_size, filename);
+    if (skipped > 0) {
+        emit_msg(config, 0, "%u padding sector%s blank on the cart, not read\n",
+                 skipped, (skipped == 1) ? "" : "s");
+    }
+
+    /* Each chunk's read is requested before the one ahead of it is
+     * compared, so the firmware is always reading ahead */
+    uint32_t s = 0, addr = 0, len = 0;
+    uint32_t next_s = 0, next_addr = 0;
+    uint32_t next_len = verify_next_chunk(sector_addr, map, nsectors, &next_s, &next_addr);
+    uint32_t differ = 0, bad_sectors = 0, first_bad = 0, done = skipped_bytes;
+    int stop = 0;
+    while ((len > 0 || next_len > 0) && r == FLASHMD_OK && !interrupted) {
+        if (stop) {
+            next_len = 0;
+        } else if (next_len > 0 && send_read_range(next_addr, (next_len + 1) & ~1u) < 0) {
+            r = FLASHMD_ERR_IO;
+            break;
+        }
+        if (len > 0) {
+            if (read_binary(cart_buf, (len + 1) & ~1u, 5000) < 0) {
+                emit_msg(config, 1, "Ranged read of 0x%06X+%u timed out\n", addr, len);
+                r = FLASHMD_ERR_TIMEOUT;
+                break;
+            }
+            /* After a stop this only drains the read already requested */
+            if (!stop) {
+                uint32_t bad = 0;
+                for (uint32_t i = 0; i < len; i++) {
+                    if (image[addr + i] != cart_buf[i] && differ + bad++ == 0) {
+                        emit_msg(config, 0, "\nFirst difference at 0x%06X: file %02X, cart %02X\n",
+                                 addr + i, image[addr + i], cart_buf[i]);
+                    }
+                }
+                differ += bad;
+                if (bad > 0 && map[s] != 'X') {
+                    if (bad_sectors++ == 0) first_bad = sector_addr[s];
+                    map[s] = 'X';
+                } else if (map[s] == '?') {
+                    map[s] = '.';
+                }
+                done += len;
+                emit_progress(config, done, verify_size);
+                /* Stop once the first bad sector has been compared to its end */
+                stop = bad_sectors > 0 && !(config && config->keep_going) &&
+                       (next_len == 0 || next_s != s);
+            }
+        }
+        s = next_s;
+        addr = next_addr;
+        len = next_len;
+        if (len > 0) {
+            next_addr += len;
+            next_len = verify_next_chunk(sector_addr, map, nsectors, &next_s, &next_addr);
+        }
+    }
+    free(image);
+    free(cart_buf);
+
+    if (interrupted) {
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    emit_msg(config, 0, "\n");
+    if (differ > 0 || (config && config->verbose)) {
+        /* . match  X differs  - padding, blank on the cart  ? not read */
+        emit_msg(config, 0, "%s map: %s\n", have_info ? "Sector" : "64K", map);
+    }
+    if (differ > 0) {
+        if (stop) {
+            emit_msg(config, 1, "Verify failed: %u bytes differ in the sector at 0x%06X, stopped there\n",
+                     differ, first_bad);
+        } else {
+            emit_msg(config, 1, "Verify failed: %u bytes differ in %u sector%s\n",
+                     differ, bad_sectors, (bad_sectors == 1) ? "" : "s");
+        }
+        return FLASHMD_ERR_VERIFY;
+    }
+    emit_msg(config, 0, "Verify OK: cart matches %s\n", filename);
+    return FLASHMD_OK;
+}
+
+flashmd_result_t flashmd_show_manifest(const char *compare_file, const flashmd_config_t *config) {
+    flashmd_chip_info_t info;
+    flashmd_manifest_t m;
+    flashmd_result_t r = flashmd_get_chip_info(&info, config);
+    if (r == FLASHMD_OK) {
+        r = manifest_read(manifest_location(&info), &m, config);
+    }
+    if (r == FLASHMD_ERR_NO_MANIFEST) {
+        emit_msg(config, 0, "No manifest on this cart\n");
+        return r;
+    }
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    time_t when = (time_t)m.timestamp;
+    char date[64] = "unknown";
+    struct tm *tm = localtime(&when);
+    if (tm) {
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", tm);
+    }
+    emit_msg(config, 0, "Image:    %s\n", m.name);
+    emit_msg(config, 0, "Length:   %u bytes\n", m.image_len);
+    emit_msg(config, 0, "CRC32:    %08X\n", m.image_crc);
+    emit_msg(config, 0, "Written:  %s\n", date);
+    emit_msg(config, 0, "Sectors:  %u\n", m.nsectors);
+
+    if (!compare_file) {
+        return FLASHMD_OK;
+    }
+
+    /* A pack already carries its hashes */
+    flashmd_manifest_t f;
+    flashmd_pack_t pack;
+    if (flashmd_pack_open(compare_file, &pack) == 0) {
+        flashmd_pack_manifest(&pack, &f);
+        flashmd_pack_close(&pack);
+    } else {
+        FILE *fp = fopen(compare_file, "rb");
+        if (!fp) {
+            emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
+            return FLASHMD_ERR_FILE;
+        }
+        fseek(fp, 0, SEEK_END);
+        long file_size = ftell(fp);
+        int built = (file_size > 0) ? flashmd_hash_image(fp, (uint32_t)file_size, &info, compare_file, &f) : -1;
+        fclose(fp);
+        if (built != 0) {
+            emit_msg(config, 1, "Could not hash %s against this chip's sectors\n", compare_file);
+            return FLASHMD_ERR_FILE;
+        }
+    }
+
+    if (f.image_len == m.image_len && f.image_crc == m.image_crc) {
+        emit_msg(config, 0, "Cart holds %s\n", compare_file);
+        return FLASHMD_OK;
+    }
+    uint32_t differ = 0;
+    for (uint32_t i = 0; i < f.nsectors; i++) {
+        if (i >= m.nsectors || f.sector_crc[i] != m.sector_crc[i]) differ++;
+    }
+    emit_msg(config, 0, "Cart differs from %s in %u of %u sectors\n", compare_file, differ, f.nsectors);
+    return FLASHMD_OK;
+}
+
+/* Sector hashes from the pack, else from hashing the file */
+static int hash_source(FILE *fp, const flashmd_pack_t *pack, uint32_t len,
+                       const flashmd_chip_info_t *info, const char *filename, flashmd_manifest_t *m) {
+    if (pack) {
+        flashmd_pack_manifest(pack, m);
+        return 0;
+    }
+    return flashmd_hash_image(fp, len, info, filename, m);
+}
+
+/*
+ * Write a ROM file, or a pack (pack != NULL) made from one. A pack brings
+ * its sector hashes and only the blocks that are not blank, so nothing
+ * is read or hashed beyond what gets sent.
+ */
+static flashmd_result_t write_image(const char *filename, const flashmd_pack_t *pack, uint32_t size_kb,
+                                    const flashmd_config_t *config) {
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = pack ? (long)pack->image_len : ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (file_size <= 0) {
+        emit_msg(config, 1, "Invalid file size\n");
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+
+    uint32_t write_size = (size_kb > 0) ? (size_kb * 1024) : (uint32_t)file_size;
+    if (write_size > (uint32_t)file_size) {
+        write_size = (uint32_t)file_size;
+    }
+    if (pack && write_size != pack->image_len) {
+        emit_msg(config, 0, "Packs are written whole, ignoring the size\n");
+        write_size = pack->image_len;
+    }
+
+    /* Plan the write against what the cart holds: its manifest, the
+     * cache, a blank check, or nothing (cart assumed erased) */
+    flashmd_chip_info_t info;
+    flashmd_manifest_t old_manifest, new_manifest;
+    flashmd_plan_t plan;
+    int have_info = 0, hashed = 0, use_manifest = 0, known = 0;
+    char cache_key[FLASHMD_CACHE_KEY_LEN] = "";
+    memset(&plan, 0, sizeof(plan));
+    plan.write_size = write_size;
+    plan.source = "nothing, cart assumed erased";
+
+    if (flashmd_get_chip_info(&info, config) == FLASHMD_OK) {
+        have_info = 1;
+        for (uint32_t pos = 0; pos < write_size && plan.nsectors < FLASHMD_MANIFEST_MAX_SECTORS;
+             plan.nsectors++) {
+            pos += flashmd_chip_sector_size(&info, pos);
+        }
+    }
+
+    /* A pack's blocks and hashes follow the sector map it was made for */
+    if (pack && (!have_info || strcmp(pack->chip_id, info.id) != 0 || plan.nsectors != pack->nsectors)) {
+        emit_msg(config, 1, "Pack was made for chip %s, cart has %s\n", pack->chip_id,
+                 have_info ? info.id : "an unknown chip");
+        fclose(fp);
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    if (config && (config->manifest || config->cache)) {
+        if (!have_info) {
+            emit_msg(config, 1, "No chip geometry, writing without a manifest\n");
+        } else if (hash_source(fp, pack, write_size, &info, filename, &new_manifest) != 0) {
+            emit_msg(config, 1, "Too many sectors for a manifest, writing without one\n");
+        } else {
+            hashed = 1;
+            if (config->manifest && (plan.manifest_addr = manifest_location(&info)) < write_size) {
+                emit_msg(config, 1, "Image reaches the manifest sector, writing without a manifest\n");
+            } else if (config->manifest) {
+                use_manifest = 1;
+            }
+        }
+        fseek(fp, 0, SEEK_SET);
+    }
+    plan.manifest = use_manifest;
+
+    /* The cart's own manifest, else the last image cached for this cart */
+    if (use_manifest && manifest_read(plan.manifest_addr, &old_manifest, config) == FLASHMD_OK) {
+        known = 1;
+    } else if (hashed && config->cache && flashmd_cache_identity(cache_key, &info, config) == 0) {
+        char object[FLASHMD_CACHE_PATH_LEN];
+        if (flashmd_cache_lookup(cache_key, &old_manifest, object) == 0 &&
+            flashmd_cache_spot_check(object, old_manifest.image_len, config) == 0) {
+            known = 2;
+        }
+    }
+
+    if (known) {
+        plan.source = (known == 1) ? "cart manifest" : "cached image";
+        int same_image = old_manifest.image_len == new_manifest.image_len &&
+            old_manifest.image_crc == new_manifest.image_crc &&
+            old_manifest.nsectors == new_manifest.nsectors &&
+            memcmp(old_manifest.sector_crc, new_manifest.sector_crc, 4 * new_manifest.nsectors) == 0;
+        /* A cached match still needs its manifest written when one was asked for */
+        plan.skip = same_image && !(use_manifest && known == 2);
+
+        /* Differential re-flash: only sectors whose stored hash differs */
+        uint32_t same = 0;
+        for (uint32_t i = 0; i < plan.nsectors; i++) {
+            int unchanged = i < old_manifest.nsectors &&
+                old_manifest.sector_crc[i] == new_manifest.sector_crc[i];
+            plan.sector[i] = unchanged ? 0 : FLASHMD_PLAN_ERASE | FLASHMD_PLAN_WRITE;
+            same += unchanged;
+        }
+        if (!plan.skip) {
+            emit_msg(config, 0, "%s: %s, %u of %u sectors unchanged\n",
+                     (known == 1) ? "Cart manifest" : "Cached image",
+                     old_manifest.name, same, new_manifest.nsectors);
+        }
+    } else if (have_info && config && config->skip_blank) {
+        /* Erase planner: only the sectors that are not already 0xFF */
+        uint8_t dirty[FLASHMD_MANIFEST_MAX_SECTORS];
+        uint32_t first = 0, count = 0;
+        emit_msg(config, 0, "Blank checking %u KB...\n", write_size / 1024);
+        r = flashmd_blank_check(0, write_size, dirty, plan.nsectors, &first, &count, config);
+        if (r != FLASHMD_OK) {
+            fclose(fp);
+            return r;
+        }
+        plan.source = "blank check";
+        uint32_t blank = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            blank += !dirty[i];
+        }
+        emit_msg(config, 0, "%u of %u sectors already blank\n", blank, count);
+        for (uint32_t i = 0; i < plan.nsectors; i++) {
+            plan.sector[i] = FLASHMD_PLAN_WRITE | ((i >= count || dirty[i]) ? FLASHMD_PLAN_ERASE : 0);
+        }
+    } else {
+        for (uint32_t i = 0; i < plan.nsectors; i++) {
+            plan.sector[i] = FLASHMD_PLAN_WRITE;
+        }
+    }
+
+    /* Blocks a pack left out are blank and never sent */
+    if (pack) {
+        uint32_t stored = 0, s = 0;
+        for (uint32_t e = 0; e < pack->nextents; e++) {
+            while (s + 1 < pack->nsectors && pack->extents[e].addr >= pack->sectors[s + 1].addr) s++;
+            if (plan.sector[s] & FLASHMD_PLAN_WRITE) stored += pack->extents[e].len / DATA_CHUNK_SIZE;
+        }
+        uint32_t total = 0, pos = 0;
+        for (uint32_t i = 0; i < plan.nsectors; i++) {
+            uint32_t end = (pos + pack->sectors[i].size < write_size) ? pos + pack->sectors[i].size : write_size;
+            if (plan.sector[i] & FLASHMD_PLAN_WRITE) total += (end - pos + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+            pos += pack->sectors[i].size;
+        }
+        plan.blank_blocks = total - stored;
+        if (!known) {
+            plan.source = (config && config->skip_blank) ? "pack and blank check" : "pack";
+        }
+    }
+
+    flashmd_cost_load(&plan.cost, have_info ? &info : NULL);
+    flashmd_plan_estimate(&plan, have_info ? &info : NULL);
+
+    if (config && config->dry_run) {
+        flashmd_plan_print(&plan, have_info ? &info : NULL, filename, config);
+        fclose(fp);
+        return FLASHMD_OK;
+    }
+    if (plan.skip) {
+        emit_msg(config, 0, "Cart already holds this image (%s), skipping write\n", old_manifest.name);
+        fclose(fp);
+        return FLASHMD_OK;
+    }
+
+    uint32_t actual_ms[FLASHMD_PHASE_COUNT] = {0};
+    uint32_t t0 = flashmd_now_ms();
+
+    /* Drop the old manifest first so an interrupted write never
+     * leaves a manifest describing a half-written cart */
+    if (use_manifest) {
+        uint32_t sector = flashmd_chip_sector_size(&info, plan.manifest_addr);
+        r = known ? erase_range(&info, plan.manifest_addr, sector, config)
+                  : erase_dirty(&info, plan.manifest_addr, sector, config);
+        actual_ms[FLASHMD_PHASE_MANIFEST] = flashmd_now_ms() - t0;
+    }
+
+    /* Erase the planned sectors, merging neighbours into one range */
+    t0 = flashmd_now_ms();
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < plan.nsectors && r == FLASHMD_OK; ) {
+        if (!(plan.sector[i] & FLASHMD_PLAN_ERASE)) {
+            pos += flashmd_chip_sector_size(&info, pos);
+            i++;
+            continue;
+        }
+        uint32_t run_start = pos;
+        while (i < plan.nsectors && (plan.sector[i] & FLASHMD_PLAN_ERASE)) {
+            pos += flashmd_chip_sector_size(&info, pos);
+            i++;
+        }
+        r = erase_range(&info, run_start, pos - run_start, config);
+    }
+    actual_ms[FLASHMD_PHASE_ERASE] = flashmd_now_ms() - t0;
+    if (r != FLASHMD_OK) {
+        fclose(fp);
+        return r;
+    }
+
+    emit_msg(config, 0, "Writing %u bytes from %s to flash...\n", write_size, filename);
+
+    uint8_t buffer[DATA_CHUNK_SIZE];
+    uint32_t written = 0;
+    uint32_t retried = 0;
+    uint32_t sector_start = 0, sector_index = 0;
+    t0 = flashmd_now_ms();
+
+    /* Pack: send the stored blocks of each planned sector as they are */
+    for (uint32_t e = 0; pack && e < pack->nextents && !interrupted; e++) {
+        const flashmd_pack_extent_t *ext = &pack->extents[e];
+        while (sector_index + 1 < pack->nsectors && ext->addr >= pack->sectors[sector_index + 1].addr) {
+            sector_index++;
+        }
+        if (!(plan.sector[sector_index] & FLASHMD_PLAN_WRITE)) {
+            continue;
+        }
+        fseek(fp, ext->offset, SEEK_SET);
+        for (uint32_t off = 0; off < ext->len && !interrupted; off += DATA_CHUNK_SIZE) {
+            if (fread(buffer, 1, DATA_CHUNK_SIZE, fp) != DATA_CHUNK_SIZE) {
+                emit_msg(config, 1, "Error reading pack\n");
+                fclose(fp);
+                return FLASHMD_ERR_FILE;
+            }
+            r = write_block(ext->addr + off, buffer, &retried, config);
+            if (r != FLASHMD_OK) {
+                fclose(fp);
+                return r;
+            }
+            written += DATA_CHUNK_SIZE;
+            emit_progress(config, ext->addr + off + DATA_CHUNK_SIZE, write_size);
+        }
+    }
+
+    while (!pack && written < write_size && !interrupted) {
+        size_t to_read = DATA_CHUNK_SIZE;
+        if (written + to_read > write_size) {
+            to_read = write_size - written;
+            memset(buffer, 0xFF, DATA_CHUNK_SIZE);
+        }
+        if (fread(buffer, 1, to_read, fp) != to_read) {
+            emit_msg(config, 1, "Error reading file\n");
             fclose(fp);
-            return FLASHMD_ERR_IO;
+            return FLASHMD_ERR_FILE;
         }
 
-        char response[256];
-        read_response(response, sizeof(response), 5000);
+        if (have_info) {
+            while (written >= sector_start + flashmd_chip_sector_size(&info, sector_start)) {
+                sector_start += flashmd_chip_sector_size(&info, sector_start);
+                sector_index++;
+            }
+        }
 
-        written += DATA_CHUNK_SIZE;
-        addj++;
-        if (addj >= 64) {
-            addj = 0;
-            bank++;
+        if (sector_index >= plan.nsectors || (plan.sector[sector_index] & FLASHMD_PLAN_WRITE)) {
+            r = write_block(written, buffer, &retried, config);
+            if (r != FLASHMD_OK) {
+                fclose(fp);
+                return r;
+            }
         }
 
-        emit_progress(config, written, (uint32_t)file_size);
+        written += DATA_CHUNK_SIZE;
+        emit_progress(config, written, write_size);
     }
+    actual_ms[FLASHMD_PHASE_PROGRAM] = flashmd_now_ms() - t0;
 
     if (interrupted) {
         fclose(fp);
@@ -1060,6 +3214,325 @@ flashmd_result_t flashmd_write_sram(const char *filename, const flashmd_config_t
     emit_msg(config, 0, "\n");
     fclose(fp);
 
+    if (use_manifest) {
+        t0 = flashmd_now_ms();
+        r = manifest_write(plan.manifest_addr, &new_manifest, &retried, config);
+        if (r != FLASHMD_OK) {
+            emit_msg(config, 1, "Failed to write the cart manifest\n");
+            return r;
+        }
+        actual_ms[FLASHMD_PHASE_MANIFEST] += flashmd_now_ms() - t0;
+        emit_msg(config, 0, "Manifest written at 0x%06X\n", plan.manifest_addr);
+    }
+
+    send_command(CMD_CLEAR_BUFFER, NULL, 0);
+    read_all_responses(config, 1000);
+
+    if (retried > 0) {
+        emit_msg(config, 0, "%u words needed a second program pulse\n", retried);
+    }
+    emit_msg(config, 0, "ROM write complete: %u bytes written and verified\n", written);
+
+    flashmd_plan_report(&plan, actual_ms, config);
+    if (have_info) {
+        flashmd_cost_update(&plan, &info, actual_ms);
+    }
+
+    /* The cart's identity changed with its contents; record the new image.
+     * A pack is not the image itself, so it is not cached */
+    if (hashed && !pack && config->cache && flashmd_cache_identity(cache_key, &info, config) == 0 &&
+        flashmd_cache_store(cache_key, filename, &new_manifest) == 0) {
+        emit_msg(config, 0, "Stored in cache as %s\n", cache_key);
+    }
+    return FLASHMD_OK;
+}
+
+flashmd_result_t flashmd_write_rom(const char *filename, uint32_t size_kb,
+                                    const flashmd_config_t *config) {
+    flashmd_pack_t pack;
+    int packed = flashmd_pack_open(filename, &pack);
+    if (packed < 0) {
+        emit_msg(config, 1, "%s is a damaged pack\n", filename);
+        return FLASHMD_ERR_FILE;
+    }
+    flashmd_result_t r = write_image(filename, (packed == 0) ? &pack : NULL, size_kb, config);
+    if (packed == 0) {
+        flashmd_pack_close(&pack);
+    }
+    return r;
+}
+
+flashmd_result_t flashmd_pack_rom(const char *filename, uint32_t size_kb, const char *pack_file,
+                                  const flashmd_config_t *config) {
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+    flashmd_chip_info_t info;
+    r = flashmd_get_chip_info(&info, config);
+    if (r != FLASHMD_OK) {
+        emit_msg(config, 1, "Packing needs the chip's sector map\n");
+        return r;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    if (file_size <= 0) {
+        emit_msg(config, 1, "Invalid file size\n");
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+    uint32_t len = (uint32_t)file_size;
+    if (size_kb > 0 && size_kb * 1024 < len) {
+        len = size_kb * 1024;
+    }
+
+    const char *base = strrchr(filename, '/');
+    int failed = flashmd_pack_create(fp, len, &info, base ? base + 1 : filename, pack_file);
+    fclose(fp);
+    if (failed) {
+        emit_msg(config, 1, "Could not write pack %s\n", pack_file);
+        return FLASHMD_ERR_FILE;
+    }
+
+    flashmd_pack_t pack;
+    if (flashmd_pack_open(pack_file, &pack) != 0) {
+        return FLASHMD_ERR_FILE;
+    }
+    emit_msg(config, 0, "Packed %s for %s (ID %s): %u of %u blocks stored in %u extents, %u sectors\n",
+             filename, info.name, info.id, pack.data_blocks, (len + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE,
+             pack.nextents, pack.nsectors);
+    flashmd_pack_close(&pack);
+    return FLASHMD_OK;
+}
+
+/*
+ * Erase and write in one pass. The firmware erases sectors in address
+ * order and programs each 1K block once its sector is erased; while it
+ * erases, the endpoint NAKs, so block writes get the chip's worst-case
+ * sector erase time as their timeout.
+ */
+flashmd_result_t flashmd_flash_image(const char *filename, uint32_t size_kb,
+                                      const flashmd_config_t *config) {
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    /* The one-pass stream is the whole image, blanks included */
+    flashmd_pack_t pack;
+    if (flashmd_pack_open(filename, &pack) == 0) {
+        flashmd_pack_close(&pack);
+        emit_msg(config, 1, "%s is a pack; write it with -w (and -b to erase)\n", filename);
+        return FLASHMD_ERR_INVALID_PARAM;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening ROM file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (file_size <= 0) {
+        emit_msg(config, 1, "Invalid file size\n");
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+
+    uint32_t write_size = (size_kb > 0) ? (size_kb * 1024) : (uint32_t)file_size;
+    if (write_size > (uint32_t)file_size) {
+        write_size = (uint32_t)file_size;
+    }
+    uint32_t blocks = (write_size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+
+    int block_timeout = 10000;
+    int have_info = 0;
+    flashmd_chip_info_t info;
+    if (flashmd_get_chip_info(&info, config) == FLASHMD_OK) {
+        have_info = 1;
+        block_timeout = (int)info.erase_timeout_ms + 2000;
+        if (!(info.flags & FLASHMD_CHIP_ERASE_SUSPEND)) {
+            emit_msg(config, 0, "%s has no erase suspend, erasing and programming sector by sector\n", info.name);
+        }
+    }
+
+    /* Every covered sector is erased and written */
+    flashmd_plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.write_size = write_size;
+    plan.source = "one pass, erasing as the image streams in";
+    for (uint32_t pos = 0; have_info && pos < write_size && plan.nsectors < FLASHMD_MANIFEST_MAX_SECTORS;
+         plan.nsectors++) {
+        plan.sector[plan.nsectors] = FLASHMD_PLAN_ERASE | FLASHMD_PLAN_WRITE;
+        pos += flashmd_chip_sector_size(&info, pos);
+    }
+    flashmd_cost_load(&plan.cost, have_info ? &info : NULL);
+    flashmd_plan_estimate(&plan, have_info ? &info : NULL);
+    if (config && config->dry_run) {
+        flashmd_plan_print(&plan, have_info ? &info : NULL, filename, config);
+        fclose(fp);
+        return FLASHMD_OK;
+    }
+    uint32_t t0 = flashmd_now_ms();
+
+    emit_msg(config, 0, "Erasing and writing %u bytes from %s...\n", write_size, filename);
+
+    uint8_t params[5] = {0x00, 0x00, 0x00, (blocks >> 8) & 0xFF, blocks & 0xFF};
+    if (send_command(CMD_FLASH_IMAGE, params, sizeof(params)) < 0) {
+        fclose(fp);
+        return FLASHMD_ERR_IO;
+    }
+
+    uint8_t buffer[DATA_CHUNK_SIZE];
+    uint32_t written = 0;
+    char response[256];
+
+    while (written < write_size && !interrupted) {
+        size_t to_read = DATA_CHUNK_SIZE;
+        if (written + to_read > write_size) {
+            to_read = write_size - written;
+            memset(buffer, 0xFF, DATA_CHUNK_SIZE);
+        }
+        if (fread(buffer, 1, to_read, fp) != to_read) {
+            emit_msg(config, 1, "Error reading file\n");
+            fclose(fp);
+            return FLASHMD_ERR_FILE;
+        }
+
+        if (usb_write_timeout(buffer, DATA_CHUNK_SIZE, block_timeout) < 0) {
+            emit_msg(config, 1, "\nDevice stopped accepting data at offset %u\n", written);
+            fclose(fp);
+            return FLASHMD_ERR_TIMEOUT;
+        }
+
+        written += DATA_CHUNK_SIZE;
+        emit_progress(config, written, write_size);
+
+        /* The firmware only talks mid-stream when it gives up */
+        if (written < write_size && (written / DATA_CHUNK_SIZE) % 64 == 0) {
+            int n = usb_read((uint8_t *)response, sizeof(response) - 1, 1);
+            if (n > 0) {
+                response[n] = '\0';
+                emit_msg(config, 1, "\n%s", response);
+                fclose(fp);
+                return FLASHMD_ERR_IO;
+            }
+        }
+    }
+
+    emit_msg(config, 0, "\n");
+    fclose(fp);
+
+    if (interrupted) {
+        /* The firmware gives up on the stream after its block timeout */
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+
+    if (read_response(response, sizeof(response), block_timeout) <= 0) {
+        emit_msg(config, 1, "Flash image was not acknowledged\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    if (!strstr(response, "FLASH IMAGE OK")) {
+        emit_msg(config, 1, "%s", response);
+        return FLASHMD_ERR_IO;
+    }
+
+    const char *retry = strstr(response, "RETRIED ");
+    if (retry && strtoul(retry + 8, NULL, 10) > 0) {
+        emit_msg(config, 0, "%lu words needed a second program pulse\n", strtoul(retry + 8, NULL, 10));
+    }
+    emit_msg(config, 0, "Flash image complete: %u bytes written and verified\n", written);
+    emit_msg(config, 0, "Estimated %.1f s, took %.1f s\n",
+             (plan.est_ms[FLASHMD_PHASE_ERASE] + plan.est_ms[FLASHMD_PHASE_PROGRAM]) / 1000.0,
+             (flashmd_now_ms() - t0) / 1000.0);
+    return FLASHMD_OK;
+}
+
+flashmd_result_t flashmd_write_sram(const char *filename, const flashmd_config_t *config) {
+    flashmd_result_t r = operation_init(config);
+    if (r != FLASHMD_OK) {
+        return r;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        emit_msg(config, 1, "Error opening SRAM file: %s\n", strerror(errno));
+        return FLASHMD_ERR_FILE;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (file_size <= 0) {
+        emit_msg(config, 1, "Invalid file size\n");
+        fclose(fp);
+        return FLASHMD_ERR_FILE;
+    }
+
+    if (file_size > 32 * 1024) {
+        file_size = 32 * 1024;
+        emit_msg(config, 0, "Warning: File truncated to 32K\n");
+    }
+
+    emit_msg(config, 0, "Writing %ld bytes from %s to SRAM...\n", file_size, filename);
+
+    /* One stream command, then every 1K block back to back; the firmware
+     * NAKs the endpoint while it writes each block to SRAM. */
+    uint8_t chunks = (uint8_t)((file_size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE);
+    uint8_t params[4] = {0x00, 0x00, 0x00, chunks};
+    if (send_command(CMD_STREAM_SRAM, params, 4) < 0) {
+        fclose(fp);
+        return FLASHMD_ERR_IO;
+    }
+
+    uint8_t buffer[DATA_CHUNK_SIZE];
+    uint32_t written = 0;
+
+    while (written < (uint32_t)file_size && !interrupted) {
+        size_t to_read = DATA_CHUNK_SIZE;
+        if (written + to_read > (uint32_t)file_size) {
+            to_read = file_size - written;
+            memset(buffer, 0x00, DATA_CHUNK_SIZE);
+        }
+        size_t _unused = fread(buffer, 1, to_read, fp);
+        (void)_unused;
+
+        if (usb_write(buffer, DATA_CHUNK_SIZE) < 0) {
+            fclose(fp);
+            return FLASHMD_ERR_IO;
+        }
+
+        written += DATA_CHUNK_SIZE;
+        emit_progress(config, written, (uint32_t)file_size);
+    }
+
+    emit_msg(config, 0, "\n");
+    fclose(fp);
+
+    if (interrupted) {
+        /* The firmware gives up on the stream after its block timeout */
+        return FLASHMD_ERR_INTERRUPTED;
+    }
+
+    char response[256];
+    if (read_response(response, sizeof(response), 5000) <= 0 || !strstr(response, "WRITE OK")) {
+        emit_msg(config, 1, "SRAM write was not acknowledged\n");
+        return FLASHMD_ERR_TIMEOUT;
+    }
+    if (!should_filter_message(config, response)) {
+        emit_msg(config, 0, "%s", response);
+    }
+
     send_command(CMD_CLEAR_BUFFER, NULL, 0);
     read_all_responses(config, 1000);
 
@@ -30,9 +30,78 @@ typedef enum {
     FLASHMD_ERR_IO = -5,
     FLASHMD_ERR_FILE = -6,
     FLASHMD_ERR_INTERRUPTED = -7,
-    FLASHMD_ERR_INVALID_PARAM = -8
+    FLASHMD_ERR_INVALID_PARAM = -8,
+    FLASHMD_ERR_NO_MANIFEST = -9,
+    FLASHMD_ERR_VERIFY = -10,
+    FLASHMD_ERR_CART = -11,
+    FLASHMD_ERR_PROGRAM = -12
 } flashmd_result_t;
 
+/* Flash chip feature flags (as reported by the firmware) */
+#define FLASHMD_CHIP_UNLOCK_BYPASS  0x01
+#define FLASHMD_CHIP_WRITE_BUFFER   0x02
+#define FLASHMD_CHIP_PAGE_READ      0x04
+#define FLASHMD_CHIP_ERASE_SUSPEND  0x08
+
+#define FLASHMD_CHIP_MAX_REGIONS    4
+
+/* Erase block region: count sectors of size bytes each */
+typedef struct {
+    uint32_t count;
+    uint32_t size;
+} flashmd_region_t;
+
+/*
+ * Flash chip geometry and timings, from the table entry or CFI query
+ */
+typedef struct {
+    char name[24];                  /* Part name, "CFI" or "UNKNOWN" */
+    char id[12];                    /* Manufacturer + device ID bytes, hex */
+    uint32_t size;                  /* Chip size in bytes */
+    uint32_t flags;                 /* FLASHMD_CHIP_* */
+    uint32_t wbuf_words;            /* Write buffer size (0 = none) */
+    uint32_t page_words;            /* Page-mode read size (0 = none) */
+    uint32_t tprog_us;              /* Typical word program time */
+    uint32_t tbuf_us;               /* Typical buffer program time */
+    uint32_t terase_ms;             /* Typical sector erase time */
+    uint32_t erase_timeout_ms;      /* Worst-case sector erase time */
+    int nregions;
+    flashmd_region_t regions[FLASHMD_CHIP_MAX_REGIONS];
+} flashmd_chip_info_t;
+
+/*
+ * Cartridge self-test, run by the firmware in a few milliseconds before
+ * every operation on the cart
+ */
+typedef struct {
+    int pass;
+    uint32_t ms;                    /* Time the firmware took */
+    char header[8];                 /* SEGA, BLANK (all 0xFF) or OTHER */
+    uint32_t floating;              /* Data lines nothing drives (bit n = Dn) */
+    uint32_t unstable;              /* Data bits that change with read timing */
+    uint32_t shorted;               /* Data lines that do not follow the pull resistors */
+    uint32_t bad_addr;              /* Address lines that alias (bit n = A(n+1)) */
+    uint32_t size;                  /* ROM size from where the header mirrors (0 = unknown) */
+    char id[8];                     /* Flash manufacturer + device ID, hex */
+    char chip[24];                  /* Flash part name, NONE without a known chip */
+} flashmd_selftest_t;
+
+#define FLASHMD_MANIFEST_MAX_SECTORS 256
+
+/*
+ * On-cart manifest describing the image last written with a manifest.
+ * Sector CRCs follow the chip's sector map from address 0 and cover the
+ * image padded with 0xFF to the end of each sector.
+ */
+typedef struct {
+    uint32_t image_len;             /* Image length in bytes */
+    uint32_t image_crc;             /* CRC-32 of the image */
+    uint64_t timestamp;             /* Unix time of the write */
+    char name[28];                  /* Image file name */
+    uint32_t nsectors;
+    uint32_t sector_crc[FLASHMD_MANIFEST_MAX_SECTORS];
+} flashmd_manifest_t;
+
 /*
  * Progress callback - called during read/write operations
  * Parameters:
@@ -57,6 +126,13 @@ typedef void (*flashmd_message_cb)(const char *msg, int is_error, void *user_dat
 typedef struct {
     int verbose;                    /* Show filtered messages (1) or filter them (0) */
     int no_trim;                    /* Don't trim 0xFF bytes from read files */
+    int skip_blank;                 /* Blank check first, erase only dirty sectors */
+    int manifest;                   /* Keep an image manifest in the last sector (write) */
+    int cache;                      /* Serve reads from / record writes to the local cache */
+    int dry_run;                    /* Plan and estimate a write without touching the cart */
+    int consensus;                  /* Re-check a dump on the cart and re-read unstable blocks (read) */
+    int keep_going;                 /* Verify every sector instead of stopping at the first bad one */
+    int no_selftest;                /* Skip the cart self-test before each operation */
     flashmd_progress_cb progress;   /* Progress callback (NULL = no progress) */
     flashmd_message_cb message;     /* Message callback (NULL = use printf) */
     void *user_data;                /* User data passed to callbacks */
@@ -74,12 +150,41 @@ void flashmd_config_init(flashmd_config_t *config);
 /* Open USB connection to device */
 flashmd_result_t flashmd_open(void);
 
-/* Close USB connection */
+/* Open the flasher at a USB path from flashmd_list_devices (NULL = first found).
+ * The connection belongs to the calling thread; other threads can each
+ * open a different flasher */
+flashmd_result_t flashmd_open_device(const char *path);
+
+/* List attached flashers by USB path ("bus-port.port"). Returns the count */
+#define FLASHMD_DEVICE_PATH_LEN 32
+int flashmd_list_devices(char paths[][FLASHMD_DEVICE_PATH_LEN], int max);
+
+/* Close the calling thread's USB connection */
 void flashmd_close(void);
 
 /* Check if device is open */
 int flashmd_is_open(void);
 
+/*
+ * Hotplug
+ */
+
+/* Called with arrived = 1 when a flasher is plugged in, 0 when one is removed */
+typedef void (*flashmd_hotplug_cb)(int arrived, void *user_data);
+
+/* Watch for flashers coming and going. Devices already attached are
+ * reported as arrivals: from inside this call where libusb has native
+ * hotplug, otherwise on the first poll. Either way the callback runs on
+ * the calling thread */
+flashmd_result_t flashmd_hotplug_start(flashmd_hotplug_cb cb, void *user_data);
+
+/* Wait up to timeout_ms for hotplug events and run the callback for
+ * them on the calling thread. Do not open devices from the callback */
+void flashmd_hotplug_poll(int timeout_ms);
+
+/* Stop watching */
+void flashmd_hotplug_stop(void);
+
 /*
  * Interrupt Handling
  */
@@ -103,30 +208,108 @@ flashmd_result_t flashmd_check_id(const flashmd_config_t *config);
 /* Clear device buffer */
 flashmd_result_t flashmd_clear_buffer(const flashmd_config_t *config);
 
+/* Query flash chip geometry and timings */
+flashmd_result_t flashmd_get_chip_info(flashmd_chip_info_t *info, const flashmd_config_t *config);
+
+/* Print chip geometry and timings */
+flashmd_result_t flashmd_print_chip_info(const flashmd_config_t *config);
+
 /* Initialize device (connect + check_id + clear_buffer) */
 flashmd_result_t flashmd_device_init(const flashmd_config_t *config);
 
+/* Run the cart self-test (FLASHMD_ERR_TIMEOUT if the firmware predates it) */
+flashmd_result_t flashmd_selftest(flashmd_selftest_t *test, const flashmd_config_t *config);
+
+/* Run and print the cart self-test. Returns FLASHMD_ERR_CART if it fails */
+flashmd_result_t flashmd_print_selftest(const flashmd_config_t *config);
+
+/* Measure the flasher: command round trip, USB IN and OUT throughput with
+ * per-transfer latency and jitter, and cartridge bus reads timed on the
+ * device without USB. size_kb per throughput test (0 = 1024) */
+flashmd_result_t flashmd_bench(uint32_t size_kb, const flashmd_config_t *config);
+
 /*
  * Flash Operations
  */
 
 /* Erase flash memory
- * size_kb = 0 for full erase, or specify KB to erase */
+ * size_kb = 0 for full erase, or specify KB to erase
+ * Only the sectors covering size_kb are erased, and with
+ * config->skip_blank only those that are not already blank */
 flashmd_result_t flashmd_erase(uint32_t size_kb, const flashmd_config_t *config);
 
+/* Blank check the sectors covering [addr, addr + len) bytes.
+ * dirty[i] is set to 1 for each sector that is not all 0xFF; *first is the
+ * byte address of the first covered sector and *count the sectors checked */
+flashmd_result_t flashmd_blank_check(uint32_t addr, uint32_t len, uint8_t *dirty,
+                                      uint32_t max_sectors, uint32_t *first, uint32_t *count,
+                                      const flashmd_config_t *config);
+
 /* Read ROM to file
- * size_kb = 0 for auto-detect (read 4MB and trim) */
+ * size_kb = 0 for auto-detect (read 4MB and trim). With config->consensus
+ * the dump is hashed again on the cart and blocks that disagree are re-read
+ * until they agree; FLASHMD_ERR_VERIFY if some never do */
 flashmd_result_t flashmd_read_rom(const char *filename, uint32_t size_kb,
                                    const flashmd_config_t *config);
 
 /* Write ROM from file
- * size_kb = 0 to use file size */
+ * size_kb = 0 to use file size
+ * With config->skip_blank, non-blank sectors are erased first
+ * With config->manifest, a manifest is kept in the chip's last sector:
+ * an image the cart already holds is skipped, and a changed image only
+ * erases and writes the sectors whose stored hash differs
+ * With config->dry_run, the plan and its estimated time are printed and
+ * nothing is erased or written; otherwise the estimate is compared with
+ * the actual time per phase at the end */
 flashmd_result_t flashmd_write_rom(const char *filename, uint32_t size_kb,
                                     const flashmd_config_t *config);
 
+/* Pack a ROM (size_kb = 0 for the whole file) for repeated writes: the
+ * blocks that are not blank, laid out on the connected chip's sector map
+ * with per-sector CRCs. flashmd_write_rom and flashmd_verify_rom take the
+ * pack in place of the ROM; a write sends only the stored blocks and a
+ * verify compares sector CRCs */
+flashmd_result_t flashmd_pack_rom(const char *filename, uint32_t size_kb, const char *pack_file,
+                                  const flashmd_config_t *config);
+
+/* Erase and write ROM from file in one pass, erasing only the sectors
+ * the image covers. size_kb = 0 to use file size */
+flashmd_result_t flashmd_flash_image(const char *filename, uint32_t size_kb,
+                                      const flashmd_config_t *config);
+
+/* Compare the cart with a ROM file (size_kb = 0 to use file size) as it
+ * streams in, ending with a map of the sectors that differ. Stops after the
+ * first bad sector unless config->keep_going; file padding is skipped where
+ * the cart is blank. Returns FLASHMD_ERR_VERIFY if any byte differs */
+flashmd_result_t flashmd_verify_rom(const char *filename, uint32_t size_kb,
+                                     const flashmd_config_t *config);
+
+/* Assemble a bus micro-program from a text file (see flashmd_prog.h),
+ * run it and print a hex dump of what it emits */
+flashmd_result_t flashmd_run_program_file(const char *filename, const flashmd_config_t *config);
+
+/* Read len bytes of ROM from byte address addr (both even) */
+flashmd_result_t flashmd_read_range(uint32_t addr, uint8_t *buf, uint32_t len,
+                                    const flashmd_config_t *config);
+
+/* Read the on-cart manifest (FLASHMD_ERR_NO_MANIFEST if there is none) */
+flashmd_result_t flashmd_read_manifest(flashmd_manifest_t *manifest, const flashmd_config_t *config);
+
+/* Print the on-cart manifest, and compare it with compare_file if not NULL */
+flashmd_result_t flashmd_show_manifest(const char *compare_file, const flashmd_config_t *config);
+
 /* Read SRAM (32KB) to file */
 flashmd_result_t flashmd_read_sram(const char *filename, const flashmd_config_t *config);
 
+/* Back up SRAM (32KB) to file, reading only the 1K blocks whose hashes
+ * differ from the cart's last backup, and add a version to the cart's save
+ * history in the cache directory when anything changed */
+flashmd_result_t flashmd_backup_sram(const char *filename, const flashmd_config_t *config);
+
+/* List the cart's save versions, or with a filename write version
+ * (1 = oldest, 0 = latest) to it */
+flashmd_result_t flashmd_sram_history(const char *filename, int version, const flashmd_config_t *config);
+
 /* Write SRAM from file */
 flashmd_result_t flashmd_write_sram(const char *filename, const flashmd_config_t *config);
 
@@ -134,6 +317,9 @@ flashmd_result_t flashmd_write_sram(const char *filename, const flashmd_config_t
  * Utility Functions
  */
 
+/* CRC-32 (IEEE), continued from crc; pass 0 to start */
+uint32_t flashmd_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
 /* Get error string for result code */
 const char *flashmd_error_string(flashmd_result_t result);
 
@@ -143,6 +329,12 @@ uint32_t flashmd_size_to_bytes(flashmd_size_t size);
 /* Convert KB to size code */
 flashmd_size_t flashmd_kb_to_size(uint32_t kb);
 
+/* Sector size in bytes at a byte address */
+uint32_t flashmd_chip_sector_size(const flashmd_chip_info_t *info, uint32_t addr);
+
+/* Bytes actually erased when erasing [addr, addr + len) */
+uint32_t flashmd_chip_erase_span(const flashmd_chip_info_t *info, uint32_t addr, uint32_t len);
+
 /*
  * File Ownership (for sudo compatibility)
  */
@@ -0,0 +1,678 @@
+/*
+ * FlashMD Daemon
+ * Owns every attached flasher and runs jobs for local clients.
+ *
+ * One worker thread per flasher takes jobs from a shared queue, first
+ * come first served; a job names a flasher by USB path or takes any free
+ * one. Clients connect over a Unix-domain socket (see flashmd_client.h)
+ * and get progress and messages streamed back while their job runs.
+ *
+ * Linux only: job files arrive as descriptors and are handed to the
+ * core library through /proc/self/fd. Reopening through /proc uses the
+ * daemon's rights, so a descriptor is only accepted if it was opened
+ * the way its job uses the file.
+ */
+
+#define _GNU_SOURCE     /* SO_PEERCRED, O_PATH */
+
+#include "flashmd_core.h"
+#include "flashmd_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_DEVICES     16
+#define MAX_CLIENTS     64
+#define RESCAN_MS       2000
+#define JOB_NAME_LEN    128
+#define DAEMON_GROUP    "plugdev"
+
+typedef struct client {
+    int fd;
+    int refs;                       /* Connection + jobs still holding it */
+    int gone;                       /* Socket closed, drop output */
+    pthread_mutex_t write_lock;
+    char buf[FLASHMD_LINE_MAX * 2];
+    size_t len;
+    int pending_fd;                 /* Descriptor received with the next JOB line */
+} client_t;
+
+typedef struct job {
+    unsigned int id;
+    char op[16];
+    char device[FLASHMD_DEVICE_PATH_LEN];
+    uint32_t size_kb;
+    unsigned int flags;
+    int file_fd;
+    char name[JOB_NAME_LEN];
+    client_t *client;
+    struct job *next;
+} job_t;
+
+typedef struct {
+    char path[FLASHMD_DEVICE_PATH_LEN];
+    int present;
+    unsigned int running;           /* Job id, 0 when idle */
+    pthread_t thread;
+} device_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static job_t *queue_head = NULL;
+static unsigned int next_job_id = 1;
+static device_t devices[MAX_DEVICES];
+static int device_count = 0;
+static volatile int stopping = 0;
+static char job_dir[64];
+static gid_t socket_gid = (gid_t)-1;
+static mode_t socket_mode = 0660;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+    flashmd_set_interrupted(1);
+}
+
+/*
+ * Client output: lines go out under the client's lock; a client that
+ * has gone away is skipped but kept alive until its jobs finish.
+ * send() may block on a slow client, so never call these with
+ * queue_lock held
+ */
+static void client_send(client_t *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void client_send(client_t *c, const char *fmt, ...) {
+    char line[FLASHMD_LINE_MAX * 2];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+
+    pthread_mutex_lock(&c->write_lock);
+    if (!c->gone) {
+        ssize_t w = send(c->fd, line, n, MSG_NOSIGNAL);
+        (void)w;
+    }
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+/* Caller holds queue_lock */
+static void client_release(client_t *c) {
+    if (--c->refs == 0) {
+        close(c->fd);
+        if (c->pending_fd >= 0) close(c->pending_fd);
+        pthread_mutex_destroy(&c->write_lock);
+        free(c);
+    }
+}
+
+/*
+ * Core callbacks, routed to the job's client
+ */
+static void job_progress(uint32_t current, uint32_t total, void *user_data) {
+    job_t *job = user_data;
+    client_send(job->client, "PROGRESS %u %u %u\n", job->id, current, total);
+}
+
+static void job_message(const char *msg, int is_error, void *user_data) {
+    job_t *job = user_data;
+    char text[FLASHMD_LINE_MAX];
+    flashmd_line_escape(text, sizeof(text), msg);
+    client_send(job->client, "LOG %u %d %s\n", job->id, is_error, text);
+}
+
+/* What a job does with its file: 'w' dumps into it, 'r' reads it, 0 takes none */
+static int op_file_access(const char *op) {
+    if (strcmp(op, "read") == 0 || strcmp(op, "read-sram") == 0 || strcmp(op, "backup-sram") == 0 ||
+        strcmp(op, "save-version") == 0) {
+        return 'w';
+    }
+    if (strcmp(op, "write") == 0 || strcmp(op, "flash") == 0 || strcmp(op, "verify") == 0 ||
+        strcmp(op, "sync") == 0 || strcmp(op, "compare") == 0 || strcmp(op, "write-sram") == 0 ||
+        strcmp(op, "program") == 0) {
+        return 'r';
+    }
+    return 0;
+}
+
+/*
+ * The core reopens the job file through /proc/self/fd, which checks the
+ * daemon's rights rather than the descriptor's mode. Only take a regular
+ * file opened for what the job does with it, so a client cannot have the
+ * daemon overwrite a file it could only read, or read one it could only
+ * write. O_PATH descriptors carry no access at all
+ */
+static int job_fd_allowed(int fd, int access) {
+    struct stat st;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_PATH) || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    int mode = flags & O_ACCMODE;
+    if (access == 'w') return mode == O_WRONLY || mode == O_RDWR;
+    if (access == 'r') return mode == O_RDONLY || mode == O_RDWR;
+    return 0;
+}
+
+/*
+ * The core works on file names: give it a link named like the client's
+ * file that resolves to the descriptor the client sent
+ */
+static int job_file(const job_t *job, char *path, size_t len) {
+    char dir[128], target[64];
+    snprintf(dir, sizeof(dir), "%s/%u", job_dir, job->id);
+    if (mkdir(dir, 0700) < 0) return -1;
+    snprintf(path, len, "%s/%s", dir, job->name);
+    snprintf(target, sizeof(target), "/proc/self/fd/%d", job->file_fd);
+    return symlink(target, path);
+}
+
+static void job_file_remove(const job_t *job, const char *path) {
+    char dir[128];
+    unlink(path);
+    snprintf(dir, sizeof(dir), "%s/%u", job_dir, job->id);
+    rmdir(dir);
+}
+
+static flashmd_result_t run_job(job_t *job, const char *device) {
+    flashmd_config_t config;
+    flashmd_config_init(&config);
+    config.verbose = !!(job->flags & FLASHMD_JOB_VERBOSE);
+    config.no_trim = !!(job->flags & FLASHMD_JOB_NO_TRIM);
+    config.skip_blank = !!(job->flags & FLASHMD_JOB_SKIP_BLANK);
+    config.manifest = !!(job->flags & FLASHMD_JOB_MANIFEST);
+    config.cache = !!(job->flags & FLASHMD_JOB_CACHE);
+    config.dry_run = !!(job->flags & FLASHMD_JOB_DRY_RUN);
+    config.consensus = !!(job->flags & FLASHMD_JOB_CONSENSUS);
+    config.keep_going = !!(job->flags & FLASHMD_JOB_KEEP_GOING);
+    config.no_selftest = !!(job->flags & FLASHMD_JOB_NO_SELFTEST);
+    config.progress = job_progress;
+    config.message = job_message;
+    config.user_data = job;
+
+    char path[256] = "";
+    if (job->file_fd >= 0 && job_file(job, path, sizeof(path)) < 0) {
+        job_message("Daemon could not stage the job file\n", 1, job);
+        return FLASHMD_ERR_FILE;
+    }
+
+    flashmd_result_t result = flashmd_open_device(device);
+    if (result == FLASHMD_OK) {
+        const char *op = job->op;
+        if (strcmp(op, "read") == 0) {
+            result = flashmd_read_rom(path, job->size_kb, &config);
+        } else if (strcmp(op, "write") == 0) {
+            result = flashmd_write_rom(path, job->size_kb, &config);
+        } else if (strcmp(op, "sync") == 0) {
+            /* Rewrite only what differs and leave a manifest for next time */
+            config.manifest = 1;
+            config.skip_blank = 1;
+            result = flashmd_write_rom(path, job->size_kb, &config);
+        } else if (strcmp(op, "flash") == 0) {
+            result = flashmd_flash_image(path, job->size_kb, &config);
+        } else if (strcmp(op, "verify") == 0) {
+            result = flashmd_verify_rom(path, job->size_kb, &config);
+        } else if (strcmp(op, "erase") == 0) {
+            result = flashmd_erase(job->size_kb, &config);
+        } else if (strcmp(op, "read-sram") == 0) {
+            result = flashmd_read_sram(path, &config);
+        } else if (strcmp(op, "backup-sram") == 0) {
+            result = flashmd_backup_sram(path, &config);
+        } else if (strcmp(op, "save-version") == 0) {
+            /* The size field carries the version */
+            result = flashmd_sram_history(path, (int)job->size_kb, &config);
+        } else if (strcmp(op, "saves") == 0) {
+            result = flashmd_sram_history(NULL, 0, &config);
+        } else if (strcmp(op, "write-sram") == 0) {
+            result = flashmd_write_sram(path, &config);
+        } else if (strcmp(op, "id") == 0) {
+            result = flashmd_check_id(&config);
+        } else if (strcmp(op, "info") == 0) {
+            result = flashmd_print_chip_info(&config);
+        } else if (strcmp(op, "compare") == 0) {
+            result = flashmd_show_manifest(path, &config);
+        } else if (strcmp(op, "manifest") == 0) {
+            result = flashmd_show_manifest(NULL, &config);
+        } else if (strcmp(op, "clear") == 0) {
+            result = flashmd_clear_buffer(&config);
+        } else if (strcmp(op, "program") == 0) {
+            result = flashmd_run_program_file(path, &config);
+        } else if (strcmp(op, "selftest") == 0) {
+            result = flashmd_print_selftest(&config);
+        } else if (strcmp(op, "bench") == 0) {
+            result = flashmd_bench(job->size_kb, &config);
+        } else {
+            result = flashmd_connect(&config);
+        }
+        flashmd_close();
+    } else {
+        char text[128];
+        snprintf(text, sizeof(text), "Could not open flasher %s: %s\n",
+                 device, flashmd_error_string(result));
+        job_message(text, 1, job);
+    }
+
+    if (path[0]) job_file_remove(job, path);
+    return result;
+}
+
+/* Caller holds queue_lock. First queued job this device may take */
+static job_t *take_job(const device_t *dev) {
+    for (job_t **pp = &queue_head; *pp; pp = &(*pp)->next) {
+        job_t *job = *pp;
+        if (strcmp(job->device, "any") == 0 || strcmp(job->device, dev->path) == 0) {
+            *pp = job->next;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void *device_worker(void *arg) {
+    device_t *dev = arg;
+    pthread_mutex_lock(&queue_lock);
+    while (!stopping) {
+        job_t *job = dev->present ? take_job(dev) : NULL;
+        if (!job) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+            continue;
+        }
+        dev->running = job->id;
+        pthread_mutex_unlock(&queue_lock);
+
+        client_send(job->client, "START %u %s\n", job->id, dev->path);
+        flashmd_result_t result = run_job(job, dev->path);
+        client_send(job->client, "DONE %u %d\n", job->id, (int)result);
+        if (job->file_fd >= 0) close(job->file_fd);
+
+        pthread_mutex_lock(&queue_lock);
+        dev->running = 0;
+        client_release(job->client);
+        free(job);
+        /* Jobs pinned to a busy device may be waiting on this one */
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/* Start workers for new flashers; mark unplugged ones so they stop taking jobs */
+static void rescan_devices(void) {
+    char paths[MAX_DEVICES][FLASHMD_DEVICE_PATH_LEN];
+    int n = flashmd_list_devices(paths, MAX_DEVICES);
+    if (n < 0) return;
+
+    pthread_mutex_lock(&queue_lock);
+    for (int d = 0; d < device_count; d++) {
+        int seen = 0;
+        for (int i = 0; i < n; i++) {
+            if (strcmp(paths[i], devices[d].path) == 0) seen = 1;
+        }
+        /* A flasher mid-job keeps its USB handle; leave it be */
+        if (!devices[d].running) devices[d].present = seen;
+    }
+    for (int i = 0; i < n; i++) {
+        int known = 0;
+        for (int d = 0; d < device_count; d++) {
+            if (strcmp(paths[i], devices[d].path) == 0) known = 1;
+        }
+        if (!known && device_count < MAX_DEVICES) {
+            device_t *dev = &devices[device_count];
+            if (snprintf(dev->path, sizeof(dev->path), "%s", paths[i]) >= (int)sizeof(dev->path)) {
+                continue;
+            }
+            dev->present = 1;
+            dev->running = 0;
+            if (pthread_create(&dev->thread, NULL, device_worker, dev) == 0) {
+                device_count++;
+                printf("flasher %s attached\n", dev->path);
+            }
+        }
+    }
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void handle_line(client_t *c, char *line) {
+    if (strcmp(line, "LIST") == 0) {
+        /* Snapshot under the lock, send once it is released */
+        char reply[MAX_DEVICES * (FLASHMD_DEVICE_PATH_LEN + 32)];
+        size_t len = 0;
+        pthread_mutex_lock(&queue_lock);
+        for (int d = 0; d < device_count; d++) {
+            const device_t *dev = &devices[d];
+            if (dev->running) {
+                len += snprintf(reply + len, sizeof(reply) - len, "DEVICE %s busy %u\n",
+                                dev->path, dev->running);
+            } else {
+                len += snprintf(reply + len, sizeof(reply) - len, "DEVICE %s %s -\n",
+                                dev->path, dev->present ? "idle" : "gone");
+            }
+        }
+        pthread_mutex_unlock(&queue_lock);
+        client_send(c, "%sEND\n", reply);
+        return;
+    }
+
+    job_t *job = calloc(1, sizeof(*job));
+    int pos = 0;
+    if (!job) return;
+    if (sscanf(line, "JOB %15s %31s %u %u %n", job->op, job->device,
+               &job->size_kb, &job->flags, &pos) != 4 || pos == 0) {
+        client_send(c, "ERROR bad request\n");
+        free(job);
+        return;
+    }
+    /* Only the base name is kept; the link lives in the job's own directory */
+    const char *name = line + pos;
+    if (strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || !name[0]) {
+        name = "image.bin";
+    }
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->file_fd = c->pending_fd;
+    c->pending_fd = -1;
+
+    int access = op_file_access(job->op);
+    if (job->file_fd >= 0 && !access) {
+        close(job->file_fd);
+        job->file_fd = -1;
+    } else if (job->file_fd >= 0 && !job_fd_allowed(job->file_fd, access)) {
+        client_send(c, "ERROR %s needs a regular file open for %s\n", job->op,
+                    (access == 'w') ? "writing" : "reading");
+        close(job->file_fd);
+        free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    int found = (strcmp(job->device, "any") == 0);
+    for (int d = 0; d < device_count && !found; d++) {
+        found = (strcmp(devices[d].path, job->device) == 0);
+    }
+    if (!found) {
+        pthread_mutex_unlock(&queue_lock);
+        client_send(c, "ERROR no flasher at %s\n", job->device);
+        if (job->file_fd >= 0) close(job->file_fd);
+        free(job);
+        return;
+    }
+    job->id = next_job_id++;
+    job->client = c;
+    c->refs++;
+    unsigned int ahead = 0;
+    job_t **pp = &queue_head;
+    while (*pp) {
+        ahead++;
+        pp = &(*pp)->next;
+    }
+    *pp = job;
+    for (int d = 0; d < device_count; d++) {
+        if (devices[d].running) ahead++;
+    }
+    unsigned int id = job->id;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    client_send(c, "QUEUED %u %u\n", id, ahead);
+}
+
+/* Read from a client, picking up a passed descriptor. Returns -1 on EOF */
+static int client_read(client_t *c) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {c->buf + c->len, sizeof(c->buf) - c->len - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(c->fd, &msg, 0);
+    if (n <= 0) return -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (c->pending_fd >= 0) close(c->pending_fd);
+            c->pending_fd = fd;
+        }
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    char *start = c->buf, *nl;
+    while ((nl = strchr(start, '\n')) != NULL) {
+        *nl = '\0';
+        handle_line(c, start);
+        start = nl + 1;
+    }
+    c->len -= start - c->buf;
+    memmove(c->buf, start, c->len);
+    if (c->len >= sizeof(c->buf) - 1) c->len = 0;   /* overlong line */
+    return 0;
+}
+
+/* A closed connection drops its queued jobs; a running one finishes */
+static void client_gone(client_t *c) {
+    pthread_mutex_lock(&queue_lock);
+    pthread_mutex_lock(&c->write_lock);
+    c->gone = 1;
+    pthread_mutex_unlock(&c->write_lock);
+    for (job_t **pp = &queue_head; *pp;) {
+        job_t *job = *pp;
+        if (job->client == c) {
+            *pp = job->next;
+            if (job->file_fd >= 0) close(job->file_fd);
+            free(job);
+            c->refs--;
+        } else {
+            pp = &job->next;
+        }
+    }
+    client_release(c);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * The socket's mode and group are the first gate; SO_PEERCRED checks
+ * every connection again, so only root, the daemon's own user and the
+ * socket group get in even if the socket file's rights are loosened
+ * later. A socket opened to others on purpose (-m 666) serves anyone
+ */
+static int peer_allowed(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+    if ((socket_mode & 0006) == 0006 || cred.uid == 0 || cred.uid == geteuid()) return 1;
+    if (socket_gid == (gid_t)-1) return 0;
+    if (cred.gid == socket_gid) return 1;
+
+    /* Supplementary groups of the peer's user */
+    struct passwd pw, *found = NULL;
+    char pwbuf[1024];
+    if (getpwuid_r(cred.uid, &pw, pwbuf, sizeof(pwbuf), &found) != 0 || !found) return 0;
+    int ngroups = 0;
+    getgrouplist(pw.pw_name, pw.pw_gid, NULL, &ngroups);
+    gid_t *groups = (ngroups > 0) ? malloc(ngroups * sizeof(gid_t)) : NULL;
+    int member = 0;
+    if (groups && getgrouplist(pw.pw_name, pw.pw_gid, groups, &ngroups) >= 0) {
+        for (int i = 0; i < ngroups && !member; i++) {
+            member = (groups[i] == socket_gid);
+        }
+    }
+    free(groups);
+    return member;
+}
+
+static int listen_socket(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* Replace a stale socket, but not a running daemon's */
+    int probe = flashmd_client_connect(path);
+    if (probe >= 0) {
+        close(probe);
+        fprintf(stderr, "A daemon is already listening on %s\n", path);
+        return -1;
+    }
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (socket_gid != (gid_t)-1 && chown(path, (uid_t)-1, socket_gid) < 0) {
+        fprintf(stderr, "Could not give %s to its group: %s\n", path, strerror(errno));
+    }
+    chmod(path, mode);
+    return fd;
+}
+
+static void print_usage(const char *progname) {
+    printf("flashmd daemon\n\n");
+    printf("Usage:\n");
+    printf("  %s [options]\n\n", progname);
+    printf("Options:\n");
+    printf("  -s, --socket <path>      Socket path (default %s)\n", FLASHMD_DAEMON_SOCKET);
+    printf("  -m, --mode <octal>       Socket permissions (default 660)\n");
+    printf("  -g, --group <name>       Group allowed to use the socket (default %s)\n", DAEMON_GROUP);
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = flashmd_client_socket_path();
+    const char *group = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--socket") == 0) && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) && i + 1 < argc) {
+            socket_mode = (mode_t)strtoul(argv[++i], NULL, 8);
+        } else if ((strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--group") == 0) && i + 1 < argc) {
+            group = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) ? 0 : 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Without the group the socket stays root's alone */
+    struct group *gr = getgrnam(group ? group : DAEMON_GROUP);
+    if (gr) {
+        socket_gid = gr->gr_gid;
+    } else if (group) {
+        fprintf(stderr, "No such group: %s\n", group);
+        return 1;
+    } else {
+        fprintf(stderr, "Group %s not found; only root can use the socket\n", DAEMON_GROUP);
+    }
+
+    snprintf(job_dir, sizeof(job_dir), "/tmp/flashmd-daemon.XXXXXX");
+    if (!mkdtemp(job_dir)) {
+        fprintf(stderr, "Could not create job directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int listen_fd = listen_socket(socket_path, socket_mode);
+    if (listen_fd < 0) {
+        rmdir(job_dir);
+        return 1;
+    }
+    printf("flashmd daemon listening on %s\n", socket_path);
+    fflush(stdout);
+
+    client_t *clients[MAX_CLIENTS];
+    int nclients = 0;
+    rescan_devices();
+
+    while (!stopping) {
+        struct pollfd fds[MAX_CLIENTS + 1];
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < nclients; i++) {
+            fds[i + 1].fd = clients[i]->fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        int r = poll(fds, nclients + 1, RESCAN_MS);
+        if (r < 0 && errno != EINTR) break;
+        if (r <= 0) {
+            rescan_devices();
+            continue;
+        }
+
+        for (int i = nclients - 1; i >= 0; i--) {
+            if (fds[i + 1].revents && client_read(clients[i]) < 0) {
+                client_gone(clients[i]);
+                clients[i] = clients[--nclients];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && !peer_allowed(fd)) {
+                printf("refused a client outside the socket's group\n");
+                fflush(stdout);
+                close(fd);
+                continue;
+            }
+            client_t *c = (fd >= 0 && nclients < MAX_CLIENTS) ? calloc(1, sizeof(*c)) : NULL;
+            if (!c) {
+                if (fd >= 0) close(fd);
+                continue;
+            }
+            c->fd = fd;
+            c->refs = 1;
+            c->pending_fd = -1;
+            pthread_mutex_init(&c->write_lock, NULL);
+            clients[nclients++] = c;
+            /* New clients usually mean new work; pick up freshly plugged flashers */
+            rescan_devices();
+        }
+    }
+
+    /* Running jobs see the interrupt flag and stop at the next block */
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    for (int d = 0; d < device_count; d++) {
+        pthread_join(devices[d].thread, NULL);
+    }
+    for (int i = 0; i < nclients; i++) {
+        client_gone(clients[i]);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    rmdir(job_dir);
+    printf("flashmd daemon stopped\n");
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * FlashMD Image Packs
+ *
+ * File layout (little endian):
+ *   0  "FMDPACK1"          8  header size (96)
+ *   12 image length        16 image CRC32
+ *   20 sector count        24 extent count
+ *   28 data block count    32 chip ID (12)
+ *   44 image name (28)     92 CRC32 of bytes 0-91 and both tables
+ *   96 sectors: address, size, CRC32
+ *      extents: address, length, data offset
+ *      data, from the next 1K boundary: each extent's blocks in order
+ *
+ * The data offsets are block aligned so the file can be mapped and each
+ * stored block sent as it is.
+ */
+
+#include "flashmd_pack.h"
+#include "flashmd_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PACK_MAGIC          "FMDPACK1"
+#define PACK_HEADER_SIZE    96
+#define PACK_ENTRY_SIZE     12
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int block_blank(const uint8_t *block) {
+    for (uint32_t i = 0; i < FLASHMD_PACK_BLOCK; i++) {
+        if (block[i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+int flashmd_pack_create(FILE *rom, uint32_t len, const flashmd_chip_info_t *info,
+                        const char *name, const char *path) {
+    /* Whole sectors, padded with 0xFF past the image */
+    uint32_t nsectors = 0, span = 0;
+    while (span < len) {
+        uint32_t sector = flashmd_chip_sector_size(info, span);
+        if (sector == 0 || nsectors >= FLASHMD_MANIFEST_MAX_SECTORS) return -1;
+        span += sector;
+        nsectors++;
+    }
+
+    uint8_t *image = malloc(span);
+    uint32_t max_extents = span / FLASHMD_PACK_BLOCK;
+    uint8_t *tables = malloc(PACK_HEADER_SIZE + PACK_ENTRY_SIZE * (nsectors + max_extents));
+    if (!image || !tables) {
+        free(image);
+        free(tables);
+        return -1;
+    }
+    memset(image, 0xFF, span);
+    fseek(rom, 0, SEEK_SET);
+    if (fread(image, 1, len, rom) != len) {
+        free(image);
+        free(tables);
+        return -1;
+    }
+
+    /* Sector table, and extents of non-blank blocks split at sector ends */
+    uint8_t *sectors = tables + PACK_HEADER_SIZE;
+    uint8_t *extents = sectors + PACK_ENTRY_SIZE * nsectors;
+    uint32_t nextents = 0, data_blocks = 0;
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < nsectors; i++) {
+        uint32_t sector = flashmd_chip_sector_size(info, pos);
+        put_le32(sectors + PACK_ENTRY_SIZE * i, pos);
+        put_le32(sectors + PACK_ENTRY_SIZE * i + 4, sector);
+        put_le32(sectors + PACK_ENTRY_SIZE * i + 8, flashmd_crc32(0, image + pos, sector));
+
+        uint32_t end = (pos + sector < len) ? pos + sector : len;
+        uint32_t addr = pos;
+        while (addr < end) {
+            if (block_blank(image + addr)) {
+                addr += FLASHMD_PACK_BLOCK;
+                continue;
+            }
+            uint32_t run = addr;
+            while (addr < end && !block_blank(image + addr)) {
+                addr += FLASHMD_PACK_BLOCK;
+            }
+            uint8_t *e = extents + PACK_ENTRY_SIZE * nextents++;
+            put_le32(e, run);
+            put_le32(e + 4, addr - run);
+        }
+        pos += sector;
+    }
+
+    /* Data follows the tables, from the next block boundary */
+    uint32_t tables_len = PACK_ENTRY_SIZE * (nsectors + nextents);
+    uint32_t data_start = (PACK_HEADER_SIZE + tables_len + FLASHMD_PACK_BLOCK - 1) &
+                          ~(uint32_t)(FLASHMD_PACK_BLOCK - 1);
+    for (uint32_t i = 0; i < nextents; i++) {
+        uint8_t *e = extents + PACK_ENTRY_SIZE * i;
+        put_le32(e + 8, data_start + data_blocks * FLASHMD_PACK_BLOCK);
+        data_blocks += get_le32(e + 4) / FLASHMD_PACK_BLOCK;
+    }
+    memset(tables, 0, PACK_HEADER_SIZE);
+    memcpy(tables, PACK_MAGIC, 8);
+    put_le32(tables + 8, PACK_HEADER_SIZE);
+    put_le32(tables + 12, len);
+    put_le32(tables + 16, flashmd_crc32(0, image, len));
+    put_le32(tables + 20, nsectors);
+    put_le32(tables + 24, nextents);
+    put_le32(tables + 28, data_blocks);
+    memcpy(tables + 32, info->id, 11);
+    memcpy(tables + 44, name, strnlen(name, 27));
+    uint32_t crc = flashmd_crc32(0, tables, 92);
+    crc = flashmd_crc32(crc, tables + PACK_HEADER_SIZE, tables_len);
+    put_le32(tables + 92, crc);
+
+    FILE *out = fopen(path, "wb");
+    int ok = out != NULL;
+    if (ok) {
+        ok = fwrite(tables, 1, PACK_HEADER_SIZE + tables_len, out) == PACK_HEADER_SIZE + tables_len;
+        uint8_t pad[FLASHMD_PACK_BLOCK];
+        memset(pad, 0, sizeof(pad));
+        uint32_t pad_len = data_start - PACK_HEADER_SIZE - tables_len;
+        while (ok && pad_len > 0) {
+            uint32_t n = (pad_len < sizeof(pad)) ? pad_len : sizeof(pad);
+            ok = fwrite(pad, 1, n, out) == n;
+            pad_len -= n;
+        }
+        for (uint32_t i = 0; ok && i < nextents; i++) {
+            const uint8_t *e = extents + PACK_ENTRY_SIZE * i;
+            ok = fwrite(image + get_le32(e), 1, get_le32(e + 4), out) == get_le32(e + 4);
+        }
+        ok = (fclose(out) == 0) && ok;
+        flashmd_fix_ownership(path);
+    }
+    free(image);
+    free(tables);
+    return ok ? 0 : -1;
+}
+
+int flashmd_pack_open(const char *path, flashmd_pack_t *pack) {
+    memset(pack, 0, sizeof(*pack));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 1;
+
+    uint8_t header[PACK_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, PACK_MAGIC, 8) != 0) {
+        fclose(fp);
+        return 1;
+    }
+    pack->nsectors = get_le32(header + 20);
+    pack->nextents = get_le32(header + 24);
+    if (get_le32(header + 8) != PACK_HEADER_SIZE || pack->nsectors > FLASHMD_MANIFEST_MAX_SECTORS ||
+        pack->nextents > (FLASHMD_MANIFEST_MAX_SECTORS << 6)) {
+        fclose(fp);
+        return -1;
+    }
+
+    uint32_t tables_len = PACK_ENTRY_SIZE * (pack->nsectors + pack->nextents);
+    uint8_t *tables = malloc(tables_len + 1);
+    pack->extents = malloc(sizeof(flashmd_pack_extent_t) * (pack->nextents + 1));
+    if (!tables || !pack->extents || fread(tables, 1, tables_len, fp) != tables_len) {
+        free(tables);
+        flashmd_pack_close(pack);
+        fclose(fp);
+        return -1;
+    }
+    uint32_t crc = flashmd_crc32(0, header, 92);
+    crc = flashmd_crc32(crc, tables, tables_len);
+    if (crc != get_le32(header + 92)) {
+        free(tables);
+        flashmd_pack_close(pack);
+        fclose(fp);
+        return -1;
+    }
+
+    pack->image_len = get_le32(header + 12);
+    pack->image_crc = get_le32(header + 16);
+    pack->data_blocks = get_le32(header + 28);
+    memcpy(pack->chip_id, header + 32, 11);
+    memcpy(pack->name, header + 44, 27);
+    for (uint32_t i = 0; i < pack->nsectors; i++) {
+        const uint8_t *s = tables + PACK_ENTRY_SIZE * i;
+        pack->sectors[i].addr = get_le32(s);
+        pack->sectors[i].size = get_le32(s + 4);
+        pack->sectors[i].crc = get_le32(s + 8);
+    }
+    for (uint32_t i = 0; i < pack->nextents; i++) {
+        const uint8_t *e = tables + PACK_ENTRY_SIZE * (pack->nsectors + i);
+        pack->extents[i].addr = get_le32(e);
+        pack->extents[i].len = get_le32(e + 4);
+        pack->extents[i].offset = get_le32(e + 8);
+    }
+    free(tables);
+    pack->fp = fp;
+    return 0;
+}
+
+void flashmd_pack_close(flashmd_pack_t *pack) {
+    if (pack->fp) fclose(pack->fp);
+    free(pack->extents);
+    pack->fp = NULL;
+    pack->extents = NULL;
+}
+
+void flashmd_pack_manifest(const flashmd_pack_t *pack, flashmd_manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+    m->image_len = pack->image_len;
+    m->image_crc = pack->image_crc;
+    m->timestamp = (uint64_t)time(NULL);
+    memcpy(m->name, pack->name, sizeof(m->name) - 1);
+    m->nsectors = pack->nsectors;
+    for (uint32_t i = 0; i < pack->nsectors; i++) {
+        m->sector_crc[i] = pack->sectors[i].crc;
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * FlashMD Image Packs
+ * A ROM preprocessed for repeated writes: only the 1K blocks that are
+ * not all 0xFF, grouped per chip sector, with the sector CRCs a manifest
+ * would hold. Writing a pack sends its blocks as stored; verifying one
+ * compares sector CRCs.
+ *
+ * Internal to the core library; frontends create packs with
+ * flashmd_pack_rom and pass them to write/verify like any ROM file.
+ */
+
+#ifndef FLASHMD_PACK_H
+#define FLASHMD_PACK_H
+
+#include <stdio.h>
+#include "flashmd_core.h"
+
+#define FLASHMD_PACK_BLOCK  1024
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t crc;                   /* Image bytes padded with 0xFF to the sector end */
+} flashmd_pack_sector_t;
+
+/* A run of stored blocks; never crosses a sector boundary */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;                   /* Whole blocks */
+    uint32_t offset;                /* Of the data in the pack file, block aligned */
+} flashmd_pack_extent_t;
+
+typedef struct {
+    FILE *fp;
+    uint32_t image_len;
+    uint32_t image_crc;
+    char chip_id[12];               /* Chip whose sector map the pack follows */
+    char name[28];                  /* Name of the packed ROM */
+    uint32_t nsectors;
+    flashmd_pack_sector_t sectors[FLASHMD_MANIFEST_MAX_SECTORS];
+    uint32_t nextents;
+    flashmd_pack_extent_t *extents;
+    uint32_t data_blocks;
+} flashmd_pack_t;
+
+/* Build a pack from the first len bytes of rom for a chip. Returns 0 on success */
+int flashmd_pack_create(FILE *rom, uint32_t len, const flashmd_chip_info_t *info,
+                        const char *name, const char *path);
+
+/* Open a pack. Returns 0 if path is a pack, 1 if it is not, -1 if it is damaged */
+int flashmd_pack_open(const char *path, flashmd_pack_t *pack);
+
+void flashmd_pack_close(flashmd_pack_t *pack);
+
+/* The manifest a write of the pack records */
+void flashmd_pack_manifest(const flashmd_pack_t *pack, flashmd_manifest_t *m);
+
+#endif /* FLASHMD_PACK_H */
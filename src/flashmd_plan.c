@@ -0,0 +1,232 @@
+/*
+ * FlashMD Write Planner
+ *
+ * Cost model files live under the cache directory:
+ *   costs/<chip id>.txt     erase_ms, block_us and samples, one per line
+ */
+
+#include "flashmd_plan.h"
+#include "flashmd_cache.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#endif
+
+#define BLOCK_SIZE          1024
+#define BLOCK_WORDS         (BLOCK_SIZE / 2)
+#define MANIFEST_BLOCKS     2       /* Header plus 256 sector hashes */
+
+/* Per-block cost beyond programming: the USB transfer, the firmware's
+ * write delay and its read-back verify */
+#define BLOCK_OVERHEAD_US   3000
+
+/* Without chip info */
+#define DEFAULT_ERASE_MS    700
+#define DEFAULT_TPROG_US    20
+
+/* Weight of a new measurement in the running average */
+#define COST_WEIGHT         0.25
+/* Writes shorter than this say more about overhead than throughput */
+#define MIN_MEASURED_BLOCKS 16
+
+static void plan_msg(const flashmd_config_t *config, const char *fmt, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (config && config->message) {
+        config->message(buf, 0, config->user_data);
+    } else {
+        printf("%s", buf);
+        fflush(stdout);
+    }
+}
+
+uint32_t flashmd_now_ms(void) {
+#ifdef _WIN32
+    return (uint32_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+static int cost_path(char *out, size_t len, const flashmd_chip_info_t *info) {
+    char dir[FLASHMD_CACHE_PATH_LEN];
+    if (!info || !info->id[0] || flashmd_cache_dir(dir, sizeof(dir), "costs") != 0) return -1;
+    snprintf(out, len, "%s/%s.txt", dir, info->id);
+    return 0;
+}
+
+void flashmd_cost_load(flashmd_cost_t *cost, const flashmd_chip_info_t *info) {
+    cost->erase_ms = (info && info->terase_ms) ? info->terase_ms : DEFAULT_ERASE_MS;
+    if (info && info->wbuf_words && info->tbuf_us) {
+        uint32_t buffers = (BLOCK_WORDS + info->wbuf_words - 1) / info->wbuf_words;
+        cost->block_us = buffers * info->tbuf_us + BLOCK_OVERHEAD_US;
+    } else {
+        uint32_t tprog = (info && info->tprog_us) ? info->tprog_us : DEFAULT_TPROG_US;
+        cost->block_us = BLOCK_WORDS * tprog + BLOCK_OVERHEAD_US;
+    }
+    cost->samples = 0;
+
+    char path[FLASHMD_CACHE_PATH_LEN + 32];
+    if (cost_path(path, sizeof(path), info) != 0) return;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    double erase_ms, block_us;
+    unsigned int samples;
+    if (fscanf(fp, "erase_ms %lf\n", &erase_ms) == 1 &&
+        fscanf(fp, "block_us %lf\n", &block_us) == 1 &&
+        fscanf(fp, "samples %u\n", &samples) == 1 &&
+        erase_ms > 0 && block_us > 0) {
+        cost->erase_ms = erase_ms;
+        cost->block_us = block_us;
+        cost->samples = samples;
+    }
+    fclose(fp);
+}
+
+void flashmd_cost_update(const flashmd_plan_t *plan, const flashmd_chip_info_t *info,
+                         const uint32_t actual_ms[FLASHMD_PHASE_COUNT]) {
+    flashmd_cost_t cost = plan->cost;
+    int changed = 0;
+    double w = cost.samples ? COST_WEIGHT : 1.0;
+
+    if (plan->erase_sectors > 0 && actual_ms[FLASHMD_PHASE_ERASE] > 0) {
+        double measured = (double)actual_ms[FLASHMD_PHASE_ERASE] / plan->erase_sectors;
+        cost.erase_ms += w * (measured - cost.erase_ms);
+        changed = 1;
+    }
+    if (plan->send_blocks >= MIN_MEASURED_BLOCKS) {
+        double measured = 1000.0 * actual_ms[FLASHMD_PHASE_PROGRAM] / plan->send_blocks;
+        cost.block_us += w * (measured - cost.block_us);
+        changed = 1;
+    }
+    if (!changed) return;
+
+    char path[FLASHMD_CACHE_PATH_LEN + 32];
+    if (cost_path(path, sizeof(path), info) != 0) return;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return;
+    fprintf(fp, "erase_ms %.1f\nblock_us %.1f\nsamples %u\n",
+            cost.erase_ms, cost.block_us, cost.samples + 1);
+    fclose(fp);
+    flashmd_fix_ownership(path);
+}
+
+void flashmd_plan_estimate(flashmd_plan_t *plan, const flashmd_chip_info_t *info) {
+    uint32_t blocks = (plan->write_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    plan->erase_sectors = 0;
+    plan->erase_bytes = 0;
+    plan->erase_runs = 0;
+    plan->send_blocks = blocks;
+    plan->skip_blocks = 0;
+
+    /* Walk the sectors once for erase runs and skipped blocks */
+    uint32_t pos = 0;
+    for (uint32_t i = 0; info && i < plan->nsectors; i++) {
+        uint32_t sector = flashmd_chip_sector_size(info, pos);
+        if (plan->sector[i] & FLASHMD_PLAN_ERASE) {
+            if (i == 0 || !(plan->sector[i - 1] & FLASHMD_PLAN_ERASE)) {
+                plan->erase_runs++;
+            }
+            plan->erase_sectors++;
+            plan->erase_bytes += sector;
+        }
+        if (!(plan->sector[i] & FLASHMD_PLAN_WRITE)) {
+            uint32_t end = (pos + sector < plan->write_size) ? pos + sector : plan->write_size;
+            plan->skip_blocks += (end - pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+        pos += sector;
+    }
+    plan->skip_blocks += plan->blank_blocks;
+    plan->send_blocks -= plan->skip_blocks;
+    if (plan->skip) {
+        plan->erase_sectors = plan->erase_bytes = plan->erase_runs = 0;
+        plan->skip_blocks = blocks;
+        plan->send_blocks = 0;
+    }
+
+    plan->est_ms[FLASHMD_PHASE_ERASE] = (uint32_t)(plan->erase_sectors * plan->cost.erase_ms);
+    plan->est_ms[FLASHMD_PHASE_PROGRAM] = (uint32_t)(plan->send_blocks * plan->cost.block_us / 1000);
+    plan->est_ms[FLASHMD_PHASE_MANIFEST] = (plan->manifest && !plan->skip)
+        ? (uint32_t)(plan->cost.erase_ms + MANIFEST_BLOCKS * plan->cost.block_us / 1000) : 0;
+}
+
+static uint32_t plan_total(const uint32_t ms[FLASHMD_PHASE_COUNT]) {
+    uint32_t total = 0;
+    for (int i = 0; i < FLASHMD_PHASE_COUNT; i++) {
+        total += ms[i];
+    }
+    return total;
+}
+
+void flashmd_plan_print(const flashmd_plan_t *plan, const flashmd_chip_info_t *info,
+                        const char *filename, const flashmd_config_t *config) {
+    char chip[64] = "";
+    if (info) {
+        snprintf(chip, sizeof(chip), " on %s (ID %s)", info->name, info->id);
+    }
+    plan_msg(config, "Plan for %s (%u KB)%s\n", filename, plan->write_size / 1024, chip);
+    plan_msg(config, "  Based on:  %s\n", plan->source);
+
+    if (plan->skip) {
+        plan_msg(config, "  Nothing to do: the cart already holds this image\n");
+        return;
+    }
+
+    plan_msg(config, "  Erase:     %u sectors, %u KB in %u run%s   ~%.1f s\n",
+             plan->erase_sectors, plan->erase_bytes / 1024, plan->erase_runs,
+             (plan->erase_runs == 1) ? "" : "s", plan->est_ms[FLASHMD_PHASE_ERASE] / 1000.0);
+    char mode[32] = "word by word";
+    if (info && info->wbuf_words) {
+        snprintf(mode, sizeof(mode), "buffered (%u words)", info->wbuf_words);
+    }
+    plan_msg(config, "  Program:   %u blocks sent, %u skipped, %s   ~%.1f s\n",
+             plan->send_blocks, plan->skip_blocks, mode, plan->est_ms[FLASHMD_PHASE_PROGRAM] / 1000.0);
+    if (plan->manifest) {
+        plan_msg(config, "  Manifest:  rewritten at 0x%06X   ~%.1f s\n", plan->manifest_addr,
+                 plan->est_ms[FLASHMD_PHASE_MANIFEST] / 1000.0);
+    }
+    plan_msg(config, "  Verify:    read back per block by the firmware (in program time)\n");
+
+    /* Sector map: E erase and write, W write only, . untouched */
+    if (config && config->verbose && plan->nsectors > 0) {
+        char map[FLASHMD_MANIFEST_MAX_SECTORS + 1];
+        for (uint32_t i = 0; i < plan->nsectors; i++) {
+            map[i] = (plan->sector[i] & FLASHMD_PLAN_ERASE) ? 'E' :
+                     (plan->sector[i] & FLASHMD_PLAN_WRITE) ? 'W' : '.';
+        }
+        map[plan->nsectors] = '\0';
+        plan_msg(config, "  Sectors:   %s\n", map);
+    }
+
+    if (plan->cost.samples) {
+        plan_msg(config, "  Estimate:  %.1f s (from %u measured write%s)\n",
+                 plan_total(plan->est_ms) / 1000.0, plan->cost.samples,
+                 (plan->cost.samples == 1) ? "" : "s");
+    } else {
+        plan_msg(config, "  Estimate:  %.1f s (from datasheet timings)\n",
+                 plan_total(plan->est_ms) / 1000.0);
+    }
+}
+
+void flashmd_plan_report(const flashmd_plan_t *plan, const uint32_t actual_ms[FLASHMD_PHASE_COUNT],
+                         const flashmd_config_t *config) {
+    static const char *names[FLASHMD_PHASE_COUNT] = {"erase", "program", "manifest"};
+    plan_msg(config, "Phase       estimated    actual\n");
+    for (int i = 0; i < FLASHMD_PHASE_COUNT; i++) {
+        if (plan->est_ms[i] == 0 && actual_ms[i] == 0) continue;
+        plan_msg(config, "%-10s %8.1f s %8.1f s\n", names[i],
+                 plan->est_ms[i] / 1000.0, actual_ms[i] / 1000.0);
+    }
+    plan_msg(config, "%-10s %8.1f s %8.1f s\n", "total",
+             plan_total(plan->est_ms) / 1000.0, plan_total(actual_ms) / 1000.0);
+}
@@ -0,0 +1,79 @@
+/*
+ * FlashMD Write Planner
+ * What a ROM write will erase and send, decided before the cart is
+ * touched, with a time estimate per phase from a per-chip cost model.
+ *
+ * Internal to the core library; frontends see the plan with
+ * config->dry_run and the estimate against the actual time after a write.
+ */
+
+#ifndef FLASHMD_PLAN_H
+#define FLASHMD_PLAN_H
+
+#include "flashmd_core.h"
+
+/* Per-sector actions */
+#define FLASHMD_PLAN_ERASE  0x01        /* Erased before programming */
+#define FLASHMD_PLAN_WRITE  0x02        /* Its blocks are sent */
+
+/* Phases, in the order a write runs them */
+typedef enum {
+    FLASHMD_PHASE_ERASE = 0,
+    FLASHMD_PHASE_PROGRAM,
+    FLASHMD_PHASE_MANIFEST,
+    FLASHMD_PHASE_COUNT
+} flashmd_phase_t;
+
+/*
+ * Cost model. Starts from the chip's datasheet timings and is replaced by
+ * a running average of measured writes, kept per chip ID in the cache
+ * directory.
+ */
+typedef struct {
+    double erase_ms;                /* Per sector erased */
+    double block_us;                /* Per 1K block programmed and verified */
+    uint32_t samples;               /* Writes measured (0 = datasheet only) */
+} flashmd_cost_t;
+
+typedef struct {
+    const char *source;             /* What the sector choices are based on */
+    uint32_t write_size;            /* Bytes of image written */
+    uint32_t nsectors;              /* Sectors covering write_size (0 = no map) */
+    uint8_t sector[FLASHMD_MANIFEST_MAX_SECTORS];  /* FLASHMD_PLAN_* */
+    int skip;                       /* The cart already holds the image */
+    int manifest;                   /* The manifest sector is rewritten */
+    uint32_t manifest_addr;
+    uint32_t blank_blocks;          /* All 0xFF in written sectors, not sent */
+
+    /* Filled in by flashmd_plan_estimate */
+    uint32_t erase_sectors;
+    uint32_t erase_bytes;
+    uint32_t erase_runs;
+    uint32_t send_blocks;
+    uint32_t skip_blocks;
+    flashmd_cost_t cost;
+    uint32_t est_ms[FLASHMD_PHASE_COUNT];
+} flashmd_plan_t;
+
+/* Milliseconds from a monotonic clock */
+uint32_t flashmd_now_ms(void);
+
+/* Cost model for a chip (NULL = no chip info) */
+void flashmd_cost_load(flashmd_cost_t *cost, const flashmd_chip_info_t *info);
+
+/* Fold a measured write into the chip's cost model */
+void flashmd_cost_update(const flashmd_plan_t *plan, const flashmd_chip_info_t *info,
+                         const uint32_t actual_ms[FLASHMD_PHASE_COUNT]);
+
+/* Count the plan's work and estimate each phase (info may be NULL) */
+void flashmd_plan_estimate(flashmd_plan_t *plan, const flashmd_chip_info_t *info);
+
+/* Print the plan and its estimate */
+void flashmd_plan_print(const flashmd_plan_t *plan, const flashmd_chip_info_t *info,
+                        const char *filename, const flashmd_config_t *config);
+
+/* Print estimated against actual time per phase */
+void flashmd_plan_report(const flashmd_plan_t *plan, const uint32_t actual_ms[FLASHMD_PHASE_COUNT],
+                         const flashmd_config_t *config);
+
+#endif /* FLASHMD_PLAN_H */
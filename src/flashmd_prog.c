@@ -0,0 +1,197 @@
+/*
+ * FlashMD Bus Micro-Programs
+ */
+
+#include "flashmd_prog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static void emit_op(flashmd_prog_t *p, uint8_t op, const uint8_t *args, uint32_t nargs) {
+    if (p->len + 1 + nargs > FLASHMD_PROG_MAX) {
+        p->overflow = 1;
+        return;
+    }
+    p->code[p->len++] = op;
+    memcpy(p->code + p->len, args, nargs);
+    p->len += nargs;
+}
+
+static void emit_op16(flashmd_prog_t *p, uint8_t op, uint16_t v) {
+    uint8_t args[2] = {v & 0xFF, v >> 8};
+    emit_op(p, op, args, 2);
+}
+
+void flashmd_prog_init(flashmd_prog_t *p) {
+    p->len = 0;
+    p->overflow = 0;
+}
+
+void flashmd_prog_addr(flashmd_prog_t *p, uint32_t word_addr) {
+    uint8_t args[3] = {word_addr & 0xFF, (word_addr >> 8) & 0xFF, (word_addr >> 16) & 0xFF};
+    emit_op(p, FLASHMD_PROG_ADDR, args, 3);
+}
+
+void flashmd_prog_add(flashmd_prog_t *p, int16_t words) {
+    emit_op16(p, FLASHMD_PROG_ADD, (uint16_t)words);
+}
+
+void flashmd_prog_write(flashmd_prog_t *p, uint16_t data) {
+    emit_op16(p, FLASHMD_PROG_WRITE, data);
+}
+
+void flashmd_prog_write_time(flashmd_prog_t *p, uint8_t data) {
+    emit_op(p, FLASHMD_PROG_WRITET, &data, 1);
+}
+
+void flashmd_prog_read(flashmd_prog_t *p, uint16_t words) {
+    emit_op16(p, FLASHMD_PROG_READ, words);
+}
+
+void flashmd_prog_poll(flashmd_prog_t *p, uint16_t mask, uint16_t value, uint16_t timeout_ms) {
+    uint8_t args[6] = {
+        mask & 0xFF, mask >> 8, value & 0xFF, value >> 8, timeout_ms & 0xFF, timeout_ms >> 8
+    };
+    emit_op(p, FLASHMD_PROG_POLL, args, 6);
+}
+
+void flashmd_prog_loop(flashmd_prog_t *p, uint16_t count) {
+    emit_op16(p, FLASHMD_PROG_LOOP, count);
+}
+
+void flashmd_prog_next(flashmd_prog_t *p) {
+    emit_op(p, FLASHMD_PROG_NEXT, NULL, 0);
+}
+
+void flashmd_prog_delay(flashmd_prog_t *p, uint16_t us) {
+    emit_op16(p, FLASHMD_PROG_DELAY, us);
+}
+
+void flashmd_prog_emit(flashmd_prog_t *p) {
+    emit_op(p, FLASHMD_PROG_EMIT, NULL, 0);
+}
+
+/* Parse up to max numbers after the op name. Returns how many were found,
+ * or -1 on a malformed or out of range one */
+static int parse_args(const char *s, long *args, int max, long lo, long hi) {
+    int n = 0;
+    while (*s) {
+        while (isspace((unsigned char)*s)) s++;
+        if (!*s) break;
+        if (n == max) return -1;
+        char *end;
+        long v = strtol(s, &end, 0);
+        if (end == s || (*end && !isspace((unsigned char)*end)) || v < lo || v > hi) return -1;
+        args[n++] = v;
+        s = end;
+    }
+    return n;
+}
+
+int flashmd_prog_assemble(const char *text, flashmd_prog_t *p, char *err, size_t err_len) {
+    /* In opcode order */
+    static const struct {
+        const char *name;
+        int nargs;
+        long lo, hi;                /* Range of every argument */
+    } ops[] = {
+        {"end",    0, 0, 0},
+        {"addr",   1, 0, 0xFFFFFF},
+        {"add",    1, -32768, 32767},
+        {"write",  1, 0, 0xFFFF},
+        {"writet", 1, 0, 0xFF},
+        {"read",   1, 1, FLASHMD_PROG_BUFFER / 2},
+        {"poll",   3, 0, 0xFFFF},
+        {"loop",   1, 1, 0xFFFF},
+        {"next",   0, 0, 0},
+        {"delay",  1, 0, 0xFFFF},
+        {"emit",   0, 0, 0},
+    };
+
+    flashmd_prog_init(p);
+    int depth = 0, line_no = 0;
+    const char *line = text;
+    while (line && *line) {
+        line_no++;
+        const char *eol = strchr(line, '\n');
+        size_t len = eol ? (size_t)(eol - line) : strlen(line);
+        char buf[256];
+        if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        line = eol ? eol + 1 : NULL;
+
+        char *hash = strchr(buf, '#');
+        if (hash) *hash = '\0';
+        char name[16];
+        int consumed = 0;
+        if (sscanf(buf, " %15s%n", name, &consumed) != 1) continue;
+
+        int op = -1;
+        for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+            if (strcmp(name, ops[i].name) == 0) op = i;
+        }
+        if (op < 0) {
+            snprintf(err, err_len, "unknown op '%s'", name);
+            return line_no;
+        }
+        long args[3];
+        if (parse_args(buf + consumed, args, 3, ops[op].lo, ops[op].hi) != ops[op].nargs) {
+            snprintf(err, err_len, "'%s' takes %d argument%s in %ld..%ld", name, ops[op].nargs,
+                     (ops[op].nargs == 1) ? "" : "s", ops[op].lo, ops[op].hi);
+            return line_no;
+        }
+
+        switch (op) {
+            case FLASHMD_PROG_END:    emit_op(p, FLASHMD_PROG_END, NULL, 0); break;
+            case FLASHMD_PROG_ADDR:   flashmd_prog_addr(p, (uint32_t)args[0]); break;
+            case FLASHMD_PROG_ADD:    flashmd_prog_add(p, (int16_t)args[0]); break;
+            case FLASHMD_PROG_WRITE:  flashmd_prog_write(p, (uint16_t)args[0]); break;
+            case FLASHMD_PROG_WRITET: flashmd_prog_write_time(p, (uint8_t)args[0]); break;
+            case FLASHMD_PROG_READ:   flashmd_prog_read(p, (uint16_t)args[0]); break;
+            case FLASHMD_PROG_POLL:
+                flashmd_prog_poll(p, (uint16_t)args[0], (uint16_t)args[1], (uint16_t)args[2]);
+                break;
+            case FLASHMD_PROG_LOOP:
+                if (++depth > FLASHMD_PROG_LOOP_DEPTH) {
+                    snprintf(err, err_len, "loops nest %d deep at most", FLASHMD_PROG_LOOP_DEPTH);
+                    return line_no;
+                }
+                flashmd_prog_loop(p, (uint16_t)args[0]);
+                break;
+            case FLASHMD_PROG_NEXT:
+                if (--depth < 0) {
+                    snprintf(err, err_len, "'next' without a loop");
+                    return line_no;
+                }
+                flashmd_prog_next(p);
+                break;
+            case FLASHMD_PROG_DELAY:  flashmd_prog_delay(p, (uint16_t)args[0]); break;
+            case FLASHMD_PROG_EMIT:   flashmd_prog_emit(p); break;
+        }
+        if (p->overflow) {
+            snprintf(err, err_len, "program is over %d bytes", FLASHMD_PROG_MAX);
+            return line_no;
+        }
+    }
+    if (depth != 0) {
+        snprintf(err, err_len, "%d loop%s not closed with 'next'", depth, (depth == 1) ? "" : "s");
+        return line_no;
+    }
+    return 0;
+}
+
+const char *flashmd_prog_status(int status) {
+    switch (status) {
+        case 0: return "ok";
+        case 1: return "unknown op";
+        case 2: return "operands run past the end of the program";
+        case 3: return "read past the end of the buffer";
+        case 4: return "poll timed out";
+        case 5: return "bad loop (zero count, nested too deep or unbalanced)";
+        case 6: return "program too long for the flasher";
+        default: return "unknown status";
+    }
+}
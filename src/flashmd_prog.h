@@ -0,0 +1,75 @@
+/*
+ * FlashMD Bus Micro-Programs
+ * Bytecode the firmware runs against the cartridge bus at bus speed: one
+ * upload and one run per program, however many accesses it makes. New
+ * chip command sets, mapper writes and bus tests can be tried without
+ * reflashing the flasher.
+ *
+ * The program works on one word address, A, and a 1K buffer that READ
+ * fills and EMIT sends back. Build programs with the flashmd_prog_*
+ * calls or from text with flashmd_prog_assemble, and run them with
+ * flashmd_run_program.
+ */
+
+#ifndef FLASHMD_PROG_H
+#define FLASHMD_PROG_H
+
+#include <stddef.h>
+#include "flashmd_core.h"
+
+/* Ops, operands little endian (as in the firmware's MD.h) */
+#define FLASHMD_PROG_END        0x00    /* Stop */
+#define FLASHMD_PROG_ADDR       0x01    /* a24: A = a (word address) */
+#define FLASHMD_PROG_ADD        0x02    /* s16: A += s */
+#define FLASHMD_PROG_WRITE      0x03    /* w16: write w at A on /CS */
+#define FLASHMD_PROG_WRITET     0x04    /* b8: write b on /TIME at A1-A7 of A (mapper
+                                         * registers): 0x509879 or 0x79 for 0xA130F3 */
+#define FLASHMD_PROG_READ       0x05    /* n16: read n words from A into the buffer, A += n */
+#define FLASHMD_PROG_POLL       0x06    /* mask16 value16 ms16: read A until (word & mask) == value (D15 = bit 15) */
+#define FLASHMD_PROG_LOOP       0x07    /* n16: run up to the matching NEXT n times */
+#define FLASHMD_PROG_NEXT       0x08
+#define FLASHMD_PROG_DELAY      0x09    /* us16 */
+#define FLASHMD_PROG_EMIT       0x0A    /* Send the buffer and empty it */
+
+#define FLASHMD_PROG_MAX        512     /* Program bytes the firmware holds */
+#define FLASHMD_PROG_BUFFER     1024    /* Bytes READ can fill between EMITs */
+#define FLASHMD_PROG_LOOP_DEPTH 4
+
+typedef struct {
+    uint8_t code[FLASHMD_PROG_MAX];
+    uint32_t len;
+    int overflow;                   /* An op did not fit; the program will not run */
+} flashmd_prog_t;
+
+void flashmd_prog_init(flashmd_prog_t *p);
+void flashmd_prog_addr(flashmd_prog_t *p, uint32_t word_addr);
+void flashmd_prog_add(flashmd_prog_t *p, int16_t words);
+void flashmd_prog_write(flashmd_prog_t *p, uint16_t data);
+void flashmd_prog_write_time(flashmd_prog_t *p, uint8_t data);
+void flashmd_prog_read(flashmd_prog_t *p, uint16_t words);
+void flashmd_prog_poll(flashmd_prog_t *p, uint16_t mask, uint16_t value, uint16_t timeout_ms);
+void flashmd_prog_loop(flashmd_prog_t *p, uint16_t count);
+void flashmd_prog_next(flashmd_prog_t *p);
+void flashmd_prog_delay(flashmd_prog_t *p, uint16_t us);
+void flashmd_prog_emit(flashmd_prog_t *p);
+
+/*
+ * Build a program from text, one op per line:
+ *   addr <a>  add <s>  write <w>  writet <b>  read <n>
+ *   poll <mask> <value> <ms>  loop <n>  next  delay <us>  emit  end
+ * Numbers are C style (0x for hex); # starts a comment.
+ * Returns 0 on success, otherwise the failing line number, with the
+ * reason in err.
+ */
+int flashmd_prog_assemble(const char *text, flashmd_prog_t *p, char *err, size_t err_len);
+
+/* Name of a run status from the firmware */
+const char *flashmd_prog_status(int status);
+
+/* Upload a program and run it (in flashmd_core.c). What it emits goes to
+ * out, up to out_max bytes; *out_len is the number of bytes kept.
+ * Returns FLASHMD_ERR_PROGRAM if the firmware stopped it on an error */
+flashmd_result_t flashmd_run_program(const flashmd_prog_t *p, uint8_t *out, uint32_t out_max,
+                                     uint32_t *out_len, const flashmd_config_t *config);
+
+#endif /* FLASHMD_PROG_H */
@@ -25,14 +25,29 @@
 #include <QThread>
 #include <QMutex>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QStyle>
 #include <QStyleFactory>
 #include <QSettings>
+#include <QHash>
+#include <QSet>
 #include <QStandardPaths>
 #include <QDir>
 #include <QFileInfo>
 #include <QFontDatabase>
 #include <QListView>
+#include <QListWidget>
+#include <QDialog>
+#include <QTableView>
+#include <QHeaderView>
+#include <QStandardItemModel>
+#include <QSortFilterProxyModel>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QDirIterator>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QSaveFile>
 
 #include "theme.h"
 
@@ -45,14 +60,17 @@
 #include <pwd.h>
 #endif
 #include <cstring>
+#include <atomic>
+#include <functional>
 
 extern "C" {
 #include "flashmd_core.h"
+#include "flashmd_client.h"
 }
 
 /* Size options */
-static const uint32_t SIZE_VALUES[] = {0, 128, 256, 512, 1024, 2048, 4096};
-static const char* SIZE_LABELS[] = {"Auto", "128 KB", "256 KB", "512 KB", "1 MB", "2 MB", "4 MB"};
+static const uint32_t SIZE_VALUES[] = {0, 128, 256, 512, 1024, 2048, 4096, 8192};
+static const char* SIZE_LABELS[] = {"Auto", "128 KB", "256 KB", "512 KB", "1 MB", "2 MB", "4 MB", "8 MB"};
 
 /*
  * Configuration file management
@@ -216,7 +234,8 @@ static void usbHandlerLoop(int readFd, int writeFd) {
         config.progress = ipcProgressCb;
         config.message = ipcMessageCb;
 
-        flashmd_result_t result = flashmd_open();
+        /* The device stays open between commands and is reopened after errors */
+        flashmd_result_t result = flashmd_is_open() ? FLASHMD_OK : flashmd_open();
         if (result != FLASHMD_OK) {
             IpcLog logMsg = {IPC_LOG, 1, {}};
             snprintf(logMsg.message, sizeof(logMsg.message),
@@ -241,13 +260,18 @@ static void usbHandlerLoop(int readFd, int writeFd) {
             case 5: result = flashmd_write_rom(cmd.filepath, cmd.sizeKb, &config); break;
             case 6: result = flashmd_read_sram(cmd.filepath, &config); break;
             case 7: result = flashmd_write_sram(cmd.filepath, &config); break;
+            case 8: result = flashmd_flash_image(cmd.filepath, cmd.sizeKb, &config); break;
+            case 9: result = flashmd_verify_rom(cmd.filepath, cmd.sizeKb, &config); break;
+        }
+        if (result == FLASHMD_ERR_IO || result == FLASHMD_ERR_TIMEOUT) {
+            flashmd_close();
         }
-        flashmd_close();
 
         IpcResult resMsg = {IPC_RESULT, (int)result};
         ssize_t _unused = write(writeFd, &resMsg, sizeof(resMsg));
         (void)_unused;
     }
+    flashmd_close();
     g_ipcWriteFd = -1;
 }
 
@@ -268,11 +292,32 @@ public:
         OP_READ_ROM,
         OP_WRITE_ROM,
         OP_READ_SRAM,
-        OP_WRITE_SRAM
+        OP_WRITE_SRAM,
+        OP_FLASH_IMAGE,
+        OP_VERIFY_ROM
     };
 
     UsbWorker(QObject *parent = nullptr) : QThread(parent) {}
 
+    /* Hand the operation set with setOperation to the session thread */
+    void submit() {
+        QMutexLocker lock(&m_mutex);
+        m_pending = true;
+        m_busy = true;
+    }
+
+    /* True from submit() until operationFinished */
+    bool isBusy() {
+        QMutexLocker lock(&m_mutex);
+        return m_busy;
+    }
+
+    /* Re-read the cart on the session thread's next pass */
+    void requestRefresh() {
+        QMutexLocker lock(&m_mutex);
+        m_refresh = true;
+    }
+
     void setOperation(Operation op, const QString &filepath = QString(),
                       uint32_t sizeKb = 0, bool noTrim = false,
                       bool verbose = false, bool fullErase = false) {
@@ -288,19 +333,94 @@ signals:
     void progressChanged(int current, int total);
     void logMessage(const QString &message, bool isError);
     void operationFinished(bool success, const QString &errorMsg);
+    void deviceStatusChanged(bool connected, const QString &status);
 
 protected:
+    /*
+     * Session loop, running for the life of the window. The flasher is
+     * opened and handshaken once when it shows up, operations run on the
+     * open handle, and unplugging closes it until the next arrival. When
+     * the daemon or the root helper owns USB, jobs are passed through.
+     * The cart is only read on arrival, after a job, or when asked to,
+     * never while idle: a cart may be half out of the slot.
+     */
     void run() override {
 #ifdef __linux__
         if (g_usingIpc) {
-            runViaIpc();
+            setStatus(true, "Flasher via root helper");
+            while (!isInterruptionRequested()) {
+                if (takeJob()) {
+                    runViaIpc();
+                    finishJob();
+                } else {
+                    msleep(SESSION_POLL_MS);
+                }
+            }
             return;
         }
 #endif
-        runLocal();
+        m_found = true;
+        flashmd_hotplug_start(hotplugCallback, this);
+        QElapsedTimer idle;
+        idle.start();
+
+        while (!isInterruptionRequested()) {
+            flashmd_hotplug_poll(SESSION_POLL_MS);
+
+            if (m_lost) {
+                m_lost = false;
+                if (flashmd_is_open()) {
+                    closeSession();
+                }
+                m_found = true;     /* another flasher may still be attached */
+            }
+            if (m_found && !flashmd_is_open()) {
+                m_found = false;
+                openSession();
+                idle.restart();
+            }
+
+            if (takeJob()) {
+                /* A running flashmd-daemon owns the flashers; hand it the job */
+                int daemonFd = flashmd_client_connect(flashmd_client_socket_path());
+                if (daemonFd >= 0) {
+                    closeSession();
+                    runViaDaemon(daemonFd);
+                    flashmd_client_close(daemonFd);
+                } else {
+                    if (!flashmd_is_open()) {
+                        openSession();
+                    }
+                    runLocal();
+                }
+                finishJob();
+                idle.restart();
+            } else if (takeRefresh()) {
+                if (flashmd_is_open()) {
+                    refreshStatus();
+                }
+            } else if (flashmd_is_open() && idle.elapsed() >= DAEMON_CHECK_MS) {
+                /* Catch a daemon starting up; this touches the socket, not the bus */
+                int daemonFd = flashmd_client_connect(flashmd_client_socket_path());
+                if (daemonFd >= 0) {
+                    flashmd_client_close(daemonFd);
+                    closeSession();
+                    setStatus(false, "Flasher owned by flashmd-daemon");
+                }
+                idle.restart();
+            }
+        }
+
+        closeSession();
+        flashmd_hotplug_stop();
     }
 
     void runLocal() {
+        if (!flashmd_is_open()) {
+            emit operationFinished(false, "Could not open USB device: no flasher connected");
+            return;
+        }
+
         flashmd_config_t config;
         flashmd_config_init(&config);
         config.verbose = m_verbose;
@@ -309,13 +429,7 @@ protected:
         config.message = messageCallback;
         config.user_data = this;
 
-        flashmd_result_t result = flashmd_open();
-        if (result != FLASHMD_OK) {
-            emit operationFinished(false, QString("Could not open USB device: %1")
-                                   .arg(flashmd_error_string(result)));
-            return;
-        }
-
+        flashmd_result_t result = FLASHMD_OK;
         switch (m_operation) {
             case OP_CONNECT:
                 result = flashmd_connect(&config);
@@ -345,12 +459,64 @@ protected:
             case OP_WRITE_SRAM:
                 result = flashmd_write_sram(m_filepath.toUtf8().constData(), &config);
                 break;
+            case OP_FLASH_IMAGE:
+                result = flashmd_flash_image(m_filepath.toUtf8().constData(), m_sizeKb, &config);
+                break;
+            case OP_VERIFY_ROM:
+                result = flashmd_verify_rom(m_filepath.toUtf8().constData(), m_sizeKb, &config);
+                break;
             default:
                 break;
         }
 
-        flashmd_close();
+        /* A failed transfer leaves the pipe in an unknown state: start over */
+        if (result == FLASHMD_ERR_IO || result == FLASHMD_ERR_TIMEOUT) {
+            closeSession();
+            m_found = true;
+        } else {
+            refreshStatus();
+        }
+
+        if (result == FLASHMD_OK) {
+            emit operationFinished(true, QString());
+        } else {
+            emit operationFinished(false, QString(flashmd_error_string(result)));
+        }
+    }
+
+    void runViaDaemon(int daemonFd) {
+        flashmd_config_t config;
+        flashmd_config_init(&config);
+        config.verbose = m_verbose;
+        config.no_trim = m_noTrim;
+        config.progress = progressCallback;
+        config.message = messageCallback;
+        config.user_data = this;
+
+        const char *op = "connect";
+        uint32_t sizeKb = m_sizeKb;
+        switch (m_operation) {
+            case OP_CHECK_ID: op = "id"; break;
+            case OP_ERASE:
+                op = "erase";
+                if (m_fullErase) {
+                    sizeKb = 0;
+                } else if (sizeKb == 0) {
+                    sizeKb = 4096;
+                }
+                break;
+            case OP_READ_ROM: op = "read"; break;
+            case OP_WRITE_ROM: op = "write"; break;
+            case OP_READ_SRAM: op = "read-sram"; break;
+            case OP_WRITE_SRAM: op = "write-sram"; break;
+            case OP_FLASH_IMAGE: op = "flash"; break;
+            case OP_VERIFY_ROM: op = "verify"; break;
+            default: break;
+        }
 
+        QByteArray path = m_filepath.toUtf8();
+        flashmd_result_t result = flashmd_client_run(daemonFd, op, path.constData(), sizeKb,
+                                                     NULL, &config);
         if (result == FLASHMD_OK) {
             emit operationFinished(true, QString());
         } else {
@@ -414,6 +580,87 @@ protected:
 #endif
 
 private:
+    static const int SESSION_POLL_MS = 100;
+    static const int DAEMON_CHECK_MS = 3000;
+
+    bool takeJob() {
+        QMutexLocker lock(&m_mutex);
+        bool pending = m_pending;
+        m_pending = false;
+        return pending;
+    }
+
+    bool takeRefresh() {
+        QMutexLocker lock(&m_mutex);
+        bool refresh = m_refresh;
+        m_refresh = false;
+        return refresh;
+    }
+
+    void finishJob() {
+        QMutexLocker lock(&m_mutex);
+        m_busy = false;
+    }
+
+    /* Open and handshake; failures only show in the status line */
+    void openSession() {
+        if (flashmd_open() != FLASHMD_OK) {
+            setStatus(false, "No flasher connected");
+            return;
+        }
+        flashmd_config_t config;
+        flashmd_config_init(&config);
+        config.message = quietCallback;
+        if (flashmd_device_init(&config) != FLASHMD_OK) {
+            closeSession();
+            return;
+        }
+        refreshStatus();
+    }
+
+    void closeSession() {
+        if (flashmd_is_open()) {
+            flashmd_close();
+        }
+        setStatus(false, "No flasher connected");
+    }
+
+    void refreshStatus() {
+        flashmd_config_t config;
+        flashmd_config_init(&config);
+        config.message = quietCallback;
+        flashmd_chip_info_t info;
+        flashmd_result_t result = flashmd_get_chip_info(&info, &config);
+        if (result == FLASHMD_ERR_IO) {
+            closeSession();
+            m_found = true;
+        } else if (result != FLASHMD_OK || strcmp(info.name, "UNKNOWN") == 0) {
+            setStatus(true, "Flasher connected, no cart detected");
+        } else {
+            setStatus(true, QString("Flasher connected: %1 (ID %2), %3 KB")
+                      .arg(info.name).arg(info.id).arg(info.size / 1024));
+        }
+    }
+
+    void setStatus(bool connected, const QString &status) {
+        if (connected == m_connected && status == m_status) return;
+        m_connected = connected;
+        m_status = status;
+        emit deviceStatusChanged(connected, status);
+    }
+
+    /* Runs inside flashmd_hotplug_poll on the session thread */
+    static void hotplugCallback(int arrived, void *userData) {
+        UsbWorker *worker = static_cast<UsbWorker*>(userData);
+        if (arrived) {
+            worker->m_found = true;
+        } else {
+            worker->m_lost = true;
+        }
+    }
+
+    static void quietCallback(const char *, int, void *) {}
+
     static void progressCallback(uint32_t current, uint32_t total, void *userData) {
         UsbWorker *worker = static_cast<UsbWorker*>(userData);
         emit worker->progressChanged(current, total);
@@ -430,6 +677,510 @@ private:
     bool m_noTrim = false;
     bool m_verbose = false;
     bool m_fullErase = false;
+
+    QMutex m_mutex;
+    bool m_pending = false;
+    bool m_busy = false;
+    bool m_refresh = false;
+
+    /* Session thread only */
+    bool m_found = false;
+    bool m_lost = false;
+    bool m_connected = false;
+    QString m_status;
+};
+
+/*
+ * ROM library
+ * Folders of ROMs indexed in the background: each file is hashed on a
+ * thread pool and its Sega header parsed. Results are kept in
+ * ~/.config/flashmd/library.tsv and reused while a file's size and
+ * modification time are unchanged, so only new or edited ROMs are read.
+ */
+struct RomEntry {
+    QString path;
+    qint64 size = 0;
+    qint64 mtime = 0;           /* ms since the epoch */
+    quint32 crc = 0;            /* flashmd_crc32 of the whole file */
+    QString sha1;
+    bool sega = false;          /* "SEGA" at 0x100 */
+    int checksum = -1;          /* Header checksum: 1 matches, 0 does not, -1 no header */
+    QString title;
+    QString serial;
+    QString region;
+};
+
+static uint32_t romSizeKb(const RomEntry &entry) {
+    return (uint32_t)((entry.size + 1023) / 1024);
+}
+
+static QString romCrcText(const RomEntry &entry) {
+    return QString("%1").arg(entry.crc, 8, 16, QChar('0')).toUpper();
+}
+
+/* Printable text of a fixed-width header field, spaces collapsed */
+static QString headerField(const QByteArray &head, int offset, int len) {
+    QString text = QString::fromLatin1(head.constData() + offset, len);
+    for (int i = 0; i < text.size(); i++) {
+        if (text[i].unicode() < 0x20 || text[i].unicode() > 0x7E) text[i] = ' ';
+    }
+    return text.simplified();
+}
+
+/* Sega header at 0x100: overseas title, domestic title as a fallback */
+static void parseSegaHeader(const QByteArray &head, RomEntry *entry) {
+    entry->sega = head.size() >= 0x200 && head.mid(0x100, 16).contains("SEGA");
+    if (!entry->sega) return;
+    entry->title = headerField(head, 0x150, 48);
+    if (entry->title.isEmpty()) {
+        entry->title = headerField(head, 0x120, 48);
+    }
+    entry->serial = headerField(head, 0x180, 14);
+    entry->region = headerField(head, 0x1F0, 3);
+}
+
+class LibraryJob : public QRunnable {
+public:
+    explicit LibraryJob(std::function<void()> fn) : m_fn(std::move(fn)) {}
+    void run() override { m_fn(); }
+
+private:
+    std::function<void()> m_fn;
+};
+
+class RomLibrary : public QObject {
+    Q_OBJECT
+
+public:
+    enum Column { COL_TITLE = 0, COL_SERIAL, COL_REGION, COL_SIZE, COL_CRC, COL_FILE, COL_COUNT };
+    static const int SortRole = Qt::UserRole;
+    static const int PathRole = Qt::UserRole + 1;
+
+    RomLibrary(QObject *parent = nullptr) : QObject(parent) {
+        m_model = new QStandardItemModel(0, COL_COUNT, this);
+        m_model->setHorizontalHeaderLabels({"Title", "Serial", "Region", "Size", "CRC32", "File"});
+        m_pool.setMaxThreadCount(QThread::idealThreadCount());
+        loadIndex();
+    }
+
+    ~RomLibrary() {
+        m_cancel = true;
+        m_pool.clear();
+        m_pool.waitForDone();
+    }
+
+    QStandardItemModel *model() { return m_model; }
+    bool isScanning() const { return m_scanning; }
+    int count() const { return m_entries.size(); }
+
+    QStringList dirs() const {
+        QSettings settings(getConfigPath(), QSettings::IniFormat);
+        return settings.value("libraryDirs").toStringList();
+    }
+
+    void setDirs(const QStringList &dirs) {
+        QSettings settings(getConfigPath(), QSettings::IniFormat);
+        settings.setValue("libraryDirs", dirs);
+        settings.sync();
+    }
+
+    bool entry(const QString &path, RomEntry *out) const {
+        auto it = m_entries.constFind(path);
+        if (it == m_entries.constEnd()) return false;
+        *out = *it;
+        return true;
+    }
+
+    /* Walk the folders on the pool; unchanged files come from the index */
+    void rescan() {
+        if (m_scanning) {
+            m_rescanQueued = true;      /* Folders changed mid-scan */
+            return;
+        }
+        m_scanning = true;
+        m_seen.clear();
+        m_done = 0;
+        m_found = 0;
+        m_pending = 1;
+        emit scanProgress(0, 0);
+
+        QStringList folders = dirs();
+        QHash<QString, RomEntry> known = m_entries;
+        m_pool.start(new LibraryJob([this, folders, known]() {
+            walk(folders, known);
+        }));
+    }
+
+signals:
+    void scanProgress(int done, int total);
+    void scanFinished();
+
+private:
+    static const int HASH_CHUNK = 256 * 1024;
+
+    static QString indexPath() {
+        return QFileInfo(getConfigPath()).absolutePath() + "/library.tsv";
+    }
+
+    void walk(const QStringList &folders, const QHash<QString, RomEntry> &known) {
+        const QStringList filters = {"*.bin", "*.md", "*.gen", "*.smd"};
+        for (const QString &folder : folders) {
+            QDirIterator it(folder, filters, QDir::Files | QDir::Readable, QDirIterator::Subdirectories);
+            while (it.hasNext() && !m_cancel) {
+                QString path = it.next();
+                QFileInfo info = it.fileInfo();
+                qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+                m_found++;
+
+                auto k = known.constFind(path);
+                if (k != known.constEnd() && k->size == info.size() && k->mtime == mtime) {
+                    deliver(*k);
+                } else {
+                    qint64 size = info.size();
+                    m_pending++;
+                    m_pool.start(new LibraryJob([this, path, size, mtime]() {
+                        hashFile(path, size, mtime);
+                    }));
+                }
+            }
+        }
+        jobDone();
+    }
+
+    /* CRC32, SHA-1 and the header checksum (16-bit sum of the words after
+     * the header) in one pass over the file */
+    void hashFile(const QString &path, qint64 size, qint64 mtime) {
+        RomEntry entry;
+        entry.path = path;
+        entry.size = size;
+        entry.mtime = mtime;
+
+        QFile file(path);
+        if (file.open(QIODevice::ReadOnly)) {
+            QCryptographicHash sha1(QCryptographicHash::Sha1);
+            QByteArray head;
+            quint32 crc = 0;
+            quint16 sum = 0;
+            qint64 pos = 0;
+            while (!m_cancel) {
+                QByteArray chunk = file.read(HASH_CHUNK);
+                if (chunk.isEmpty()) break;
+                if (head.size() < 0x200) {
+                    head += chunk.left(0x200 - head.size());
+                }
+                crc = flashmd_crc32(crc, (const uint8_t *)chunk.constData(), chunk.size());
+                sha1.addData(chunk);
+                const uchar *p = (const uchar *)chunk.constData();
+                for (int i = 0; i < chunk.size(); i++, pos++) {
+                    if (pos >= 0x200) sum += (pos & 1) ? p[i] : (p[i] << 8);
+                }
+            }
+            if (!m_cancel && pos == size) {
+                entry.crc = crc;
+                entry.sha1 = QString::fromLatin1(sha1.result().toHex());
+                parseSegaHeader(head, &entry);
+                if (entry.sega) {
+                    quint16 expected = ((uchar)head.at(0x18E) << 8) | (uchar)head.at(0x18F);
+                    entry.checksum = (sum == expected) ? 1 : 0;
+                }
+                if (entry.title.isEmpty()) {
+                    entry.title = QFileInfo(path).completeBaseName();
+                }
+                deliver(entry);
+            }
+        }
+        jobDone();
+    }
+
+    /* Pool threads hand results to the GUI thread */
+    void deliver(const RomEntry &entry) {
+        QMetaObject::invokeMethod(this, [this, entry]() { addEntry(entry); }, Qt::QueuedConnection);
+    }
+
+    void jobDone() {
+        if (--m_pending == 0) {
+            QMetaObject::invokeMethod(this, [this]() { finishScan(); }, Qt::QueuedConnection);
+        }
+    }
+
+    static QStandardItem *makeItem(const QString &text, const QVariant &sortKey) {
+        QStandardItem *item = new QStandardItem(text);
+        item->setData(sortKey, SortRole);
+        item->setEditable(false);
+        return item;
+    }
+
+    QList<QStandardItem *> makeRow(const RomEntry &entry) {
+        QString file = QFileInfo(entry.path).fileName();
+        QList<QStandardItem *> row;
+        row << makeItem(entry.title, entry.title.toLower())
+            << makeItem(entry.serial, entry.serial)
+            << makeItem(entry.region, entry.region)
+            << makeItem(QString("%1 KB").arg(romSizeKb(entry)), entry.size)
+            << makeItem(romCrcText(entry), entry.crc)
+            << makeItem(file, file.toLower());
+        row[COL_TITLE]->setData(entry.path, PathRole);
+        QString tip = entry.path + "\nSHA-1 " + entry.sha1;
+        if (entry.checksum == 0) tip += "\nHeader checksum does not match";
+        for (QStandardItem *item : row) {
+            item->setToolTip(tip);
+        }
+        return row;
+    }
+
+    void addEntry(const RomEntry &entry) {
+        m_seen.insert(entry.path);
+        m_done++;
+        auto it = m_entries.constFind(entry.path);
+        bool same = it != m_entries.constEnd() && it->size == entry.size &&
+                    it->mtime == entry.mtime && m_rows.contains(entry.path);
+        if (!same) {
+            m_entries.insert(entry.path, entry);
+            QList<QStandardItem *> row = makeRow(entry);
+            QStandardItem *old = m_rows.value(entry.path);
+            if (old) {
+                int r = old->row();
+                for (int c = 0; c < COL_COUNT; c++) {
+                    m_model->setItem(r, c, row[c]);
+                }
+            } else {
+                m_model->appendRow(row);
+            }
+            m_rows.insert(entry.path, row[COL_TITLE]);
+        }
+        emit scanProgress(m_done, m_found);
+    }
+
+    void finishScan() {
+        /* Files that were not found again are gone */
+        if (!m_cancel) {
+            const QStringList paths = m_entries.keys();
+            for (const QString &path : paths) {
+                if (m_seen.contains(path)) continue;
+                QStandardItem *item = m_rows.take(path);
+                if (item) m_model->removeRow(item->row());
+                m_entries.remove(path);
+            }
+            saveIndex();
+        }
+        m_scanning = false;
+        emit scanFinished();
+        if (m_rescanQueued && !m_cancel) {
+            m_rescanQueued = false;
+            rescan();
+        }
+    }
+
+    /* One file per line: path, size, mtime, crc32, sha1, sega, checksum,
+     * serial, region, title, separated by tabs */
+    void loadIndex() {
+        QFile file(indexPath());
+        if (!file.open(QIODevice::ReadOnly)) return;
+        while (!file.atEnd()) {
+            QString line = QString::fromUtf8(file.readLine()).trimmed();
+            if (line.isEmpty() || line.startsWith('#')) continue;
+            QStringList f = line.split('\t');
+            if (f.size() != 10) continue;
+            RomEntry entry;
+            entry.path = f[0];
+            entry.size = f[1].toLongLong();
+            entry.mtime = f[2].toLongLong();
+            entry.crc = f[3].toUInt(nullptr, 16);
+            entry.sha1 = f[4];
+            entry.sega = f[5] == "1";
+            entry.checksum = f[6].toInt();
+            entry.serial = f[7];
+            entry.region = f[8];
+            entry.title = f[9];
+            m_entries.insert(entry.path, entry);
+            QList<QStandardItem *> row = makeRow(entry);
+            m_model->appendRow(row);
+            m_rows.insert(entry.path, row[COL_TITLE]);
+        }
+    }
+
+    void saveIndex() {
+        QSaveFile file(indexPath());
+        if (!file.open(QIODevice::WriteOnly)) return;
+        file.write("# flashmd ROM library\n");
+        for (const RomEntry &e : m_entries) {
+            if (e.path.contains('\t') || e.path.contains('\n')) continue;
+            QStringList f;
+            f << e.path << QString::number(e.size) << QString::number(e.mtime) << romCrcText(e)
+              << e.sha1 << (e.sega ? "1" : "0") << QString::number(e.checksum)
+              << e.serial << e.region << e.title;
+            file.write((f.join('\t') + '\n').toUtf8());
+        }
+        file.commit();
+    }
+
+    QStandardItemModel *m_model;
+    QHash<QString, RomEntry> m_entries;
+    QHash<QString, QStandardItem *> m_rows;     /* Title item of each file's row */
+    QSet<QString> m_seen;
+    bool m_scanning = false;
+    bool m_rescanQueued = false;
+    int m_done = 0;
+
+    /* Shared with the pool */
+    QThreadPool m_pool;
+    std::atomic<bool> m_cancel{false};
+    std::atomic<int> m_pending{0};
+    std::atomic<int> m_found{0};
+};
+
+/*
+ * Library dialog: folders, instant search over the index, and a pick
+ * that goes straight to the write path
+ */
+class LibraryDialog : public QDialog {
+    Q_OBJECT
+
+public:
+    LibraryDialog(RomLibrary *library, QWidget *parent = nullptr)
+        : QDialog(parent), m_library(library) {
+        setWindowTitle("ROM Library");
+        resize(LIBRARY_WIDTH, LIBRARY_HEIGHT);
+
+        QVBoxLayout *layout = new QVBoxLayout(this);
+        layout->setSpacing(12);
+
+        /* Folders */
+        QHBoxLayout *dirLayout = new QHBoxLayout();
+        m_dirList = new QListWidget();
+        m_dirList->addItems(m_library->dirs());
+        m_dirList->setMaximumHeight(72);
+        dirLayout->addWidget(m_dirList, 1);
+        QVBoxLayout *dirButtons = new QVBoxLayout();
+        QPushButton *addBtn = new QPushButton("Add Folder...");
+        QPushButton *removeBtn = new QPushButton("Remove");
+        m_rescanBtn = new QPushButton("Rescan");
+        connect(addBtn, &QPushButton::clicked, this, &LibraryDialog::onAddFolder);
+        connect(removeBtn, &QPushButton::clicked, this, &LibraryDialog::onRemoveFolder);
+        connect(m_rescanBtn, &QPushButton::clicked, m_library, &RomLibrary::rescan);
+        dirButtons->addWidget(addBtn);
+        dirButtons->addWidget(removeBtn);
+        dirButtons->addWidget(m_rescanBtn);
+        dirLayout->addLayout(dirButtons);
+        layout->addLayout(dirLayout);
+
+        /* Search and table */
+        m_search = new QLineEdit();
+        m_search->setPlaceholderText("Search title, serial, region, CRC32 or file name");
+        m_search->setClearButtonEnabled(true);
+        layout->addWidget(m_search);
+
+        m_proxy = new QSortFilterProxyModel(this);
+        m_proxy->setSourceModel(m_library->model());
+        m_proxy->setFilterKeyColumn(-1);
+        m_proxy->setFilterCaseSensitivity(Qt::CaseInsensitive);
+        m_proxy->setSortRole(RomLibrary::SortRole);
+        connect(m_search, &QLineEdit::textChanged, m_proxy, &QSortFilterProxyModel::setFilterFixedString);
+
+        m_table = new QTableView();
+        m_table->setModel(m_proxy);
+        m_table->setSortingEnabled(true);
+        m_table->sortByColumn(RomLibrary::COL_TITLE, Qt::AscendingOrder);
+        m_table->setSelectionBehavior(QAbstractItemView::SelectRows);
+        m_table->setSelectionMode(QAbstractItemView::SingleSelection);
+        m_table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        m_table->verticalHeader()->hide();
+        m_table->horizontalHeader()->setSectionResizeMode(RomLibrary::COL_TITLE, QHeaderView::Stretch);
+        m_table->horizontalHeader()->setSectionResizeMode(RomLibrary::COL_FILE, QHeaderView::Stretch);
+        connect(m_table, &QTableView::doubleClicked, this, &LibraryDialog::onPick);
+        connect(m_table->selectionModel(), &QItemSelectionModel::selectionChanged,
+                this, &LibraryDialog::updateButtons);
+        layout->addWidget(m_table, 1);
+
+        /* Status and actions */
+        QHBoxLayout *bottomLayout = new QHBoxLayout();
+        m_statusLabel = new QLabel();
+        bottomLayout->addWidget(m_statusLabel, 1);
+        m_verifyCheck = new QCheckBox("Verify after writing");
+        m_verifyCheck->setToolTip("Read the cart back and compare it with the file");
+        m_verifyCheck->setChecked(getSavedPath("libraryVerify", "true") == "true");
+        bottomLayout->addWidget(m_verifyCheck);
+        m_writeBtn = new QPushButton("Write");
+        QPushButton *closeBtn = new QPushButton("Close");
+        connect(m_writeBtn, &QPushButton::clicked, this, &LibraryDialog::onPick);
+        connect(closeBtn, &QPushButton::clicked, this, &QDialog::reject);
+        bottomLayout->addWidget(m_writeBtn);
+        bottomLayout->addWidget(closeBtn);
+        layout->addLayout(bottomLayout);
+
+        connect(m_library, &RomLibrary::scanProgress, this, &LibraryDialog::onScanProgress);
+        connect(m_library, &RomLibrary::scanFinished, this, &LibraryDialog::updateStatus);
+        updateStatus();
+        updateButtons();
+        m_search->setFocus();
+    }
+
+    QString selectedPath() const { return m_selected; }
+    bool verifyAfterWrite() const { return m_verifyCheck->isChecked(); }
+
+private slots:
+    void onAddFolder() {
+        QString dir = QFileDialog::getExistingDirectory(this, "Add ROM Folder", getRealUserHome());
+        if (dir.isEmpty()) return;
+        QStringList dirs = m_library->dirs();
+        if (dirs.contains(dir)) return;
+        dirs << dir;
+        m_library->setDirs(dirs);
+        m_dirList->addItem(dir);
+        m_library->rescan();
+    }
+
+    void onRemoveFolder() {
+        QListWidgetItem *item = m_dirList->currentItem();
+        if (!item) return;
+        QStringList dirs = m_library->dirs();
+        dirs.removeAll(item->text());
+        m_library->setDirs(dirs);
+        delete item;
+        m_library->rescan();
+    }
+
+    void onPick() {
+        QModelIndexList rows = m_table->selectionModel()->selectedRows(RomLibrary::COL_TITLE);
+        if (rows.isEmpty()) return;
+        m_selected = rows.first().data(RomLibrary::PathRole).toString();
+        savePath("libraryVerify", m_verifyCheck->isChecked() ? "true" : "false");
+        accept();
+    }
+
+    void onScanProgress(int done, int total) {
+        m_statusLabel->setText(QString("%1 ROMs, indexing %2 of %3 files...")
+                               .arg(m_library->count()).arg(done).arg(total));
+        m_rescanBtn->setEnabled(false);
+    }
+
+    void updateStatus() {
+        if (m_library->isScanning()) {
+            m_statusLabel->setText(QString("%1 ROMs, indexing...").arg(m_library->count()));
+        } else {
+            m_statusLabel->setText(QString("%1 ROMs").arg(m_library->count()));
+        }
+        m_rescanBtn->setEnabled(!m_library->isScanning());
+    }
+
+    void updateButtons() {
+        m_writeBtn->setEnabled(m_table->selectionModel()->hasSelection());
+    }
+
+private:
+    static const int LIBRARY_WIDTH = 760;
+    static const int LIBRARY_HEIGHT = 480;
+
+    RomLibrary *m_library;
+    QListWidget *m_dirList;
+    QPushButton *m_rescanBtn;
+    QLineEdit *m_search;
+    QSortFilterProxyModel *m_proxy;
+    QTableView *m_table;
+    QLabel *m_statusLabel;
+    QCheckBox *m_verifyCheck;
+    QPushButton *m_writeBtn;
+    QString m_selected;
 };
 
 /*
@@ -447,6 +1198,10 @@ public:
         setupWorker();
         applyTheme(m_currentTheme);
 
+        /* Bring the library index up to date in the background */
+        m_library = new RomLibrary(this);
+        QTimer::singleShot(0, m_library, &RomLibrary::rescan);
+
         setMinimumSize(WINDOW_WIDTH, WINDOW_HEIGHT);
         setMaximumSize(WINDOW_WIDTH, WINDOW_HEIGHT);
         resize(WINDOW_WIDTH, WINDOW_HEIGHT);
@@ -459,9 +1214,26 @@ public:
         });
     }
 
+    ~MainWindow() {
+        /* Let the session thread finish its job and release the flasher */
+        m_worker->requestInterruption();
+        m_worker->wait();
+    }
+
+protected:
+    /* Clicking the flasher status re-reads the cart, e.g. after a swap */
+    bool eventFilter(QObject *watched, QEvent *event) override {
+        if (watched == m_deviceLabel && event->type() == QEvent::MouseButtonRelease &&
+            m_worker && !m_worker->isBusy()) {
+            m_worker->requestRefresh();
+            return true;
+        }
+        return QMainWindow::eventFilter(watched, event);
+    }
+
 private slots:
     void onWriteRom() {
-        if (m_worker->isRunning()) return;
+        if (m_worker->isBusy()) return;
 
         QString savedPath = getSavedPath("writeRomPath");
         QString defaultPath;
@@ -483,15 +1255,54 @@ private slots:
             "Are you sure you want to write this ROM?") != QMessageBox::Yes) return;
 
         log("");
-        m_worker->setOperation(UsbWorker::OP_WRITE_ROM, filepath,
+        m_worker->setOperation(m_eraseWriteCheck->isChecked() ? UsbWorker::OP_FLASH_IMAGE
+                                                              : UsbWorker::OP_WRITE_ROM, filepath,
                                SIZE_VALUES[m_sizeCombo->currentIndex()],
                                m_noTrimCheck->isChecked(),
                                false);
         startOperation();
     }
 
+    void onLibrary() {
+        if (m_worker->isBusy()) return;
+
+        LibraryDialog dialog(m_library, this);
+        if (dialog.exec() != QDialog::Accepted) return;
+        RomEntry entry;
+        if (!m_library->entry(dialog.selectedPath(), &entry)) return;
+
+        /* The indexed size and hashes only hold while the file is unchanged */
+        QFileInfo info(entry.path);
+        if (!info.exists() || info.size() != entry.size ||
+            info.lastModified().toMSecsSinceEpoch() != entry.mtime) {
+            QMessageBox::warning(this, "ROM Library",
+                entry.path + " has changed since it was indexed. Rescanning the library.");
+            m_library->rescan();
+            return;
+        }
+
+        if (QMessageBox::question(this, "Confirm Write",
+            QString("Are you sure you want to write %1 (%2 KB, CRC32 %3)?")
+                .arg(entry.title).arg(romSizeKb(entry)).arg(romCrcText(entry))) != QMessageBox::Yes) return;
+
+        log("");
+        log(QString("%1: %2 KB, CRC32 %3, SHA-1 %4")
+            .arg(entry.title).arg(romSizeKb(entry)).arg(romCrcText(entry)).arg(entry.sha1));
+        if (entry.checksum == 0) {
+            log("Warning: the header checksum does not match the ROM");
+        }
+        m_worker->setOperation(m_eraseWriteCheck->isChecked() ? UsbWorker::OP_FLASH_IMAGE
+                                                              : UsbWorker::OP_WRITE_ROM, entry.path,
+                               romSizeKb(entry),
+                               m_noTrimCheck->isChecked(),
+                               false);
+        m_verifyEntry = entry;
+        m_verifyPending = dialog.verifyAfterWrite();
+        startOperation();
+    }
+
     void onReadRom() {
-        if (m_worker->isRunning()) return;
+        if (m_worker->isBusy()) return;
 
         QString savedPath = getSavedPath("readRomPath", "dump.bin");
         QString defaultPath;
@@ -522,7 +1333,7 @@ private slots:
     }
 
     void onErase() {
-        if (m_worker->isRunning()) return;
+        if (m_worker->isBusy()) return;
 
         if (QMessageBox::question(this, "Confirm Erase",
             "Are you sure you want to erase the flash memory?") != QMessageBox::Yes) return;
@@ -536,7 +1347,7 @@ private slots:
     }
 
     void onReadSram() {
-        if (m_worker->isRunning()) return;
+        if (m_worker->isBusy()) return;
 
         QString savedPath = getSavedPath("readSramPath", "save.srm");
         QString defaultPath;
@@ -564,7 +1375,7 @@ private slots:
     }
 
     void onWriteSram() {
-        if (m_worker->isRunning()) return;
+        if (m_worker->isBusy()) return;
 
         QString savedPath = getSavedPath("writeSramPath");
         QString defaultPath;
@@ -625,12 +1436,39 @@ private slots:
         }
     }
 
-    void onOperationFinished(bool success, const QString &errorMsg) {
-        setUiEnabled(true);
+    void onDeviceStatusChanged(bool connected, const QString &status) {
+        m_deviceLabel->setText(status);
+        if (connected != m_deviceConnected) {
+            m_deviceConnected = connected;
+            log(status);
+        }
+    }
 
+    void onOperationFinished(bool success, const QString &errorMsg) {
         if (!success && !errorMsg.isEmpty()) {
             log("Error: " + errorMsg);
         }
+
+        /* A write picked from the library is read back against its file */
+        if (m_verifyPending) {
+            m_verifyPending = false;
+            if (success) {
+                log("");
+                m_worker->setOperation(UsbWorker::OP_VERIFY_ROM, m_verifyEntry.path,
+                                       romSizeKb(m_verifyEntry));
+                m_verifying = true;
+                startOperation();
+                return;
+            }
+        } else if (m_verifying) {
+            m_verifying = false;
+            if (success) {
+                log(QString("Cart matches %1 (CRC32 %2)")
+                    .arg(m_verifyEntry.title).arg(romCrcText(m_verifyEntry)));
+            }
+        }
+
+        setUiEnabled(true);
     }
 
 private:
@@ -663,10 +1501,14 @@ private:
         m_sizeCombo->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
         m_sizeListView = new QListView(m_sizeCombo);
         m_sizeCombo->setView(m_sizeListView);
-        for (int i = 0; i < 7; i++) {
+        for (int i = 0; i < 8; i++) {
             m_sizeCombo->addItem(SIZE_LABELS[i]);
         }
         sizeLayout->addWidget(m_sizeCombo, 1);
+        m_libraryBtn = new QPushButton("Library...");
+        m_libraryBtn->setToolTip("Pick a ROM to write from the indexed folders");
+        connect(m_libraryBtn, &QPushButton::clicked, this, &MainWindow::onLibrary);
+        sizeLayout->addWidget(m_libraryBtn);
         romMainLayout->addLayout(sizeLayout);
 
         /* Buttons in a grid layout */
@@ -678,6 +1520,8 @@ private:
         m_noTrimCheck = new QCheckBox("No trim");
         m_eraseBtn = new QPushButton("Erase");
         m_fullEraseCheck = new QCheckBox("Full Erase");
+        m_eraseWriteCheck = new QCheckBox("Erase on write");
+        m_eraseWriteCheck->setToolTip("Erase only the sectors the ROM covers while writing it");
 
         connect(m_writeRomBtn, &QPushButton::clicked, this, &MainWindow::onWriteRom);
         connect(m_readRomBtn, &QPushButton::clicked, this, &MainWindow::onReadRom);
@@ -688,6 +1532,7 @@ private:
         romLayout->addWidget(m_noTrimCheck, 0, 2);
         romLayout->addWidget(m_eraseBtn, 1, 0);
         romLayout->addWidget(m_fullEraseCheck, 1, 1);
+        romLayout->addWidget(m_eraseWriteCheck, 1, 2);
         romMainLayout->addLayout(romLayout);
 
         mainLayout->addWidget(romGroup);
@@ -740,6 +1585,12 @@ private:
         m_clearBtn = new QPushButton("Clear");
         connect(m_clearBtn, &QPushButton::clicked, this, &MainWindow::onClearLog);
         bottomLayout->addWidget(m_clearBtn);
+        m_deviceLabel = new QLabel("No flasher connected");
+        m_deviceLabel->setStyleSheet("color: " LIGHT_TEXT_SUBTLE "; font-size: " FONT_SIZE_SMALL "; font-weight: 500;");
+        m_deviceLabel->setToolTip("Click to re-read the cart");
+        m_deviceLabel->setCursor(Qt::PointingHandCursor);
+        m_deviceLabel->installEventFilter(this);
+        bottomLayout->addWidget(m_deviceLabel);
         bottomLayout->addStretch();
 
         // Theme toggle button
@@ -770,13 +1621,15 @@ private:
         connect(m_worker, &UsbWorker::progressChanged, this, &MainWindow::onProgressChanged);
         connect(m_worker, &UsbWorker::logMessage, this, &MainWindow::onLogMessage);
         connect(m_worker, &UsbWorker::operationFinished, this, &MainWindow::onOperationFinished);
+        connect(m_worker, &UsbWorker::deviceStatusChanged, this, &MainWindow::onDeviceStatusChanged);
+        m_worker->start();
     }
 
     void startOperation() {
         m_progressBar->setValue(0);
         m_progressLabel->setText("Starting...");
         setUiEnabled(false);
-        m_worker->start();
+        m_worker->submit();
     }
 
     void setUiEnabled(bool enabled) {
@@ -854,6 +1707,10 @@ private:
             m_progressLabel->setStyleSheet(
                 QString("color: %1; font-size: " FONT_SIZE_SMALL "; font-weight: 500;").arg(gray));
         }
+        if (m_deviceLabel) {
+            m_deviceLabel->setStyleSheet(
+                QString("color: %1; font-size: " FONT_SIZE_SMALL "; font-weight: 500;").arg(gray));
+        }
 
         if (m_themeBtn) {
             m_themeBtn->setStyleSheet(QString(R"(
@@ -881,6 +1738,7 @@ private:
         if (m_writeSramBtn) m_writeSramBtn->setStyleSheet(grayBtnStyle);
         if (m_readSramBtn) m_readSramBtn->setStyleSheet(grayBtnStyle);
         if (m_clearBtn) m_clearBtn->setStyleSheet(grayBtnStyle);
+        if (m_libraryBtn) m_libraryBtn->setStyleSheet(grayBtnStyle);
 
         if (m_sizeListView) {
             m_sizeListView->setStyleSheet(QString(R"(
@@ -977,6 +1835,12 @@ private:
                 QString("color: %1; font-size: " FONT_SIZE_SMALL "; font-weight: 500;").arg(textSubtle));
         }
 
+        // device status label
+        if (m_deviceLabel) {
+            m_deviceLabel->setStyleSheet(
+                QString("color: %1; font-size: " FONT_SIZE_SMALL "; font-weight: 500;").arg(textSubtle));
+        }
+
         // theme button
         if (m_themeBtn) {
             m_themeBtn->setStyleSheet(QString(R"(
@@ -1052,9 +1916,16 @@ private:
         if (m_clearBtn) {
             m_clearBtn->setStyleSheet(makeButtonStyle(clearColor));
         }
+        if (m_libraryBtn) {
+            m_libraryBtn->setStyleSheet(makeButtonStyle(writeColor));
+        }
     }
 
-    UsbWorker *m_worker;
+    UsbWorker *m_worker = nullptr;
+    RomLibrary *m_library;
+    RomEntry m_verifyEntry;
+    bool m_verifyPending = false;
+    bool m_verifying = false;
     QLabel *m_logoLabel;
     QPushButton *m_themeBtn;
     QPushButton *m_writeRomBtn;
@@ -1063,12 +1934,16 @@ private:
     QPushButton *m_writeSramBtn;
     QPushButton *m_readSramBtn;
     QPushButton *m_clearBtn;
+    QPushButton *m_libraryBtn;
     QComboBox *m_sizeCombo;
     QListView *m_sizeListView;
     QCheckBox *m_noTrimCheck;
     QCheckBox *m_fullEraseCheck;
+    QCheckBox *m_eraseWriteCheck;
     QProgressBar *m_progressBar;
     QLabel *m_progressLabel;
+    QLabel *m_deviceLabel = nullptr;
+    bool m_deviceConnected = false;
     QTextEdit *m_console;
     QString m_currentTheme;
 };
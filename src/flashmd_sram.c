@@ -0,0 +1,324 @@
+/*
+ * FlashMD SRAM History
+ *
+ * Files live under the cache directory:
+ *   sram/<cart key>.srm     the latest image
+ *   sram/<cart key>.log     one record per version, oldest first
+ *
+ * Record layout (little endian):
+ *   0  "FMDSAVE1"          8  timestamp (8)
+ *   16 changed block mask  20 image CRC32
+ *   24 CRC32 of bytes 0-23 and the stored blocks
+ *   28 the version before's copy of each changed block, in block order
+ *
+ * The record is appended before the latest image is replaced, so records
+ * past the last one matching the image are from a backup that never
+ * finished; they are ignored, and cut off before the next append. The
+ * image itself is replaced by renaming a finished copy over it, never
+ * rewritten in place. Once the log reaches FLASHMD_SRAM_MAX_VERSIONS it
+ * is rewritten with only the newest half, the oldest of them as the base.
+ */
+
+#include "flashmd_sram.h"
+#include "flashmd_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#define RECORD_MAGIC        "FMDSAVE1"
+#define RECORD_HEADER_SIZE  28
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t count_blocks(uint32_t mask) {
+    uint32_t n = 0;
+    for (; mask; mask &= mask - 1) {
+        n++;
+    }
+    return n;
+}
+
+static int sram_path(char *out, size_t len, const char *key, const char *ext) {
+    char dir[FLASHMD_CACHE_PATH_LEN];
+    if (flashmd_cache_dir(dir, sizeof(dir), "sram") != 0) return -1;
+    snprintf(out, len, "%s/%s.%s", dir, key, ext);
+    return 0;
+}
+
+/* Read the next record and its blocks. Returns 0 on success, -1 at the
+ * end of the log or on a damaged record */
+static int read_record(FILE *fp, flashmd_sram_version_t *v, uint8_t *blocks) {
+    uint8_t header[RECORD_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, RECORD_MAGIC, 8) != 0) {
+        return -1;
+    }
+    v->timestamp = get_le32(header + 8) | ((uint64_t)get_le32(header + 12) << 32);
+    v->changed = get_le32(header + 16);
+    v->crc = get_le32(header + 20);
+    size_t len = count_blocks(v->changed) * FLASHMD_SRAM_BLOCK;
+    if (fread(blocks, 1, len, fp) != len) return -1;
+    uint32_t crc = flashmd_crc32(0, header, 24);
+    crc = flashmd_crc32(crc, blocks, len);
+    return (crc == get_le32(header + 24)) ? 0 : -1;
+}
+
+/* Good records up to the last one matching the latest image, with the
+ * file offset of each and, in *end, where the last of them ends. Returns
+ * the count, -1 with no history */
+static int scan_log(const char *key, uint8_t *latest, flashmd_sram_version_t *versions, long *offsets,
+                    long *end) {
+    char path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    if (flashmd_sram_latest(key, latest) != 0 || sram_path(path, sizeof(path), key, "log") != 0) {
+        return -1;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    uint8_t *blocks = malloc(FLASHMD_SRAM_SIZE);
+    uint32_t latest_crc = flashmd_crc32(0, latest, FLASHMD_SRAM_SIZE);
+    int n = 0, count = 0;
+    long offset = 0;
+    while (blocks && n < FLASHMD_SRAM_MAX_VERSIONS && read_record(fp, &versions[n], blocks) == 0) {
+        offsets[n++] = offset;
+        offset = ftell(fp);
+        if (versions[n - 1].crc == latest_crc) {
+            count = n;
+            if (end) *end = offset;
+        }
+    }
+    free(blocks);
+    fclose(fp);
+    return count ? count : -1;
+}
+
+/* Append a record; blocks holds the changed blocks in block order */
+static int write_record(FILE *fp, const flashmd_sram_version_t *v, const uint8_t *blocks) {
+    uint8_t header[RECORD_HEADER_SIZE];
+    size_t len = count_blocks(v->changed) * FLASHMD_SRAM_BLOCK;
+    memcpy(header, RECORD_MAGIC, 8);
+    put_le32(header + 8, (uint32_t)v->timestamp);
+    put_le32(header + 12, (uint32_t)(v->timestamp >> 32));
+    put_le32(header + 16, v->changed);
+    put_le32(header + 20, v->crc);
+    uint32_t crc = flashmd_crc32(0, header, 24);
+    crc = flashmd_crc32(crc, blocks, len);
+    put_le32(header + 24, crc);
+    return (fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+            fwrite(blocks, 1, len, fp) == len) ? 0 : -1;
+}
+
+/* Flush and sync a file written to tmp_path, close it and move it over path */
+static int replace_file(FILE *fp, const char *tmp_path, const char *path) {
+    int ok = fflush(fp) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(fp)) == 0;
+#else
+    ok = ok && fsync(fileno(fp)) == 0;
+#endif
+    ok = (fclose(fp) == 0) && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+    if (!ok) {
+        remove(tmp_path);
+        return -1;
+    }
+    flashmd_fix_ownership(path);
+    return 0;
+}
+
+/* Rewrite the log with only its newest keep records. The first one kept
+ * becomes the base: the blocks it held lead to versions no longer kept */
+static int compact_log(const char *log_path, const long *offsets, int count, int keep) {
+    char tmp_path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log_path);
+    uint8_t *blocks = malloc(FLASHMD_SRAM_SIZE);
+    FILE *in = fopen(log_path, "rb");
+    FILE *out = (blocks && in) ? fopen(tmp_path, "wb") : NULL;
+    int ok = out != NULL;
+    for (int k = count - keep; ok && k < count; k++) {
+        flashmd_sram_version_t v;
+        ok = fseek(in, offsets[k], SEEK_SET) == 0 && read_record(in, &v, blocks) == 0;
+        if (k == count - keep) v.changed = 0;
+        ok = ok && write_record(out, &v, blocks) == 0;
+    }
+    if (in) fclose(in);
+    free(blocks);
+    if (!out) return -1;
+    if (!ok) {
+        fclose(out);
+        remove(tmp_path);
+        return -1;
+    }
+    return replace_file(out, tmp_path, log_path);
+}
+
+/* Truncate the log to len bytes, dropping a record a crashed backup left */
+static int truncate_log(const char *log_path, long len) {
+    FILE *fp = fopen(log_path, "r+b");
+    if (!fp) return -1;
+#ifdef _WIN32
+    int ok = _chsize_s(_fileno(fp), len) == 0;
+#else
+    int ok = ftruncate(fileno(fp), len) == 0;
+#endif
+    ok = (fclose(fp) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+int flashmd_sram_latest(const char *key, uint8_t *image) {
+    char path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    if (sram_path(path, sizeof(path), key, "srm") != 0) return -1;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    int ok = fread(image, 1, FLASHMD_SRAM_SIZE, fp) == FLASHMD_SRAM_SIZE;
+    fclose(fp);
+    return ok ? 0 : -1;
+}
+
+int flashmd_sram_commit(const char *key, const uint8_t *old, const uint8_t *image) {
+    char log_path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    char srm_path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    if (sram_path(log_path, sizeof(log_path), key, "log") != 0 ||
+        sram_path(srm_path, sizeof(srm_path), key, "srm") != 0) {
+        return -1;
+    }
+
+    /* Append right after the last record matching the stored image, and
+     * keep the log short enough to scan whole. With no usable history
+     * the log starts over as if this were the first backup */
+    flashmd_sram_version_t *versions = malloc(sizeof(*versions) * FLASHMD_SRAM_MAX_VERSIONS);
+    long *offsets = malloc(sizeof(*offsets) * FLASHMD_SRAM_MAX_VERSIONS);
+    uint8_t *record = malloc(FLASHMD_SRAM_SIZE);
+    int ok = versions && offsets && record;
+    long end = 0;
+    int count = (ok && old) ? scan_log(key, record, versions, offsets, &end) : -1;
+    if (count < 0) {
+        old = NULL;
+    }
+
+    uint32_t changed = 0;
+    for (uint32_t b = 0; old && b < FLASHMD_SRAM_BLOCKS; b++) {
+        if (memcmp(old + b * FLASHMD_SRAM_BLOCK, image + b * FLASHMD_SRAM_BLOCK, FLASHMD_SRAM_BLOCK) != 0) {
+            changed |= 1u << b;
+        }
+    }
+    if (ok && old && !changed) {
+        free(versions);
+        free(offsets);
+        free(record);
+        return 0;
+    }
+
+    if (ok && old) {
+        if (count >= FLASHMD_SRAM_MAX_VERSIONS - 1) {
+            ok = compact_log(log_path, offsets, count, FLASHMD_SRAM_MAX_VERSIONS / 2) == 0;
+        } else {
+            ok = truncate_log(log_path, end) == 0;
+        }
+    }
+
+    /* The record holds old's copy of each block the new image changed */
+    flashmd_sram_version_t v;
+    v.timestamp = (uint64_t)time(NULL);
+    v.changed = changed;
+    v.crc = flashmd_crc32(0, image, FLASHMD_SRAM_SIZE);
+    size_t len = 0;
+    for (uint32_t b = 0; ok && b < FLASHMD_SRAM_BLOCKS; b++) {
+        if (changed & (1u << b)) {
+            memcpy(record + len, old + b * FLASHMD_SRAM_BLOCK, FLASHMD_SRAM_BLOCK);
+            len += FLASHMD_SRAM_BLOCK;
+        }
+    }
+
+    /* A first backup starts the history over */
+    FILE *fp = ok ? fopen(log_path, old ? "ab" : "wb") : NULL;
+    ok = fp != NULL;
+    if (ok) {
+        ok = write_record(fp, &v, record) == 0;
+        ok = (fclose(fp) == 0) && ok;
+        flashmd_fix_ownership(log_path);
+    }
+    free(versions);
+    free(offsets);
+    free(record);
+    if (!ok) return -1;
+
+    /* A short image would cut off the whole history, so write a copy and
+     * swap it in once it is on disk */
+    char tmp_path[sizeof(srm_path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", srm_path);
+    fp = fopen(tmp_path, "wb");
+    if (!fp) return -1;
+    if (fwrite(image, 1, FLASHMD_SRAM_SIZE, fp) != FLASHMD_SRAM_SIZE) {
+        fclose(fp);
+        remove(tmp_path);
+        return -1;
+    }
+    return replace_file(fp, tmp_path, srm_path);
+}
+
+int flashmd_sram_versions(const char *key, flashmd_sram_version_t *versions, int max) {
+    flashmd_sram_version_t *all = malloc(sizeof(*all) * FLASHMD_SRAM_MAX_VERSIONS);
+    long *offsets = malloc(sizeof(*offsets) * FLASHMD_SRAM_MAX_VERSIONS);
+    uint8_t *latest = malloc(FLASHMD_SRAM_SIZE);
+    int count = -1;
+    if (all && offsets && latest) {
+        count = scan_log(key, latest, all, offsets, NULL);
+        for (int i = 0; versions && i < count && i < max; i++) {
+            versions[i] = all[i];
+        }
+    }
+    free(all);
+    free(offsets);
+    free(latest);
+    return count;
+}
+
+int flashmd_sram_version(const char *key, int n, uint8_t *image) {
+    flashmd_sram_version_t *versions = malloc(sizeof(*versions) * FLASHMD_SRAM_MAX_VERSIONS);
+    long *offsets = malloc(sizeof(*offsets) * FLASHMD_SRAM_MAX_VERSIONS);
+    uint8_t *blocks = malloc(FLASHMD_SRAM_SIZE);
+    char path[FLASHMD_CACHE_PATH_LEN + FLASHMD_CACHE_KEY_LEN + 8];
+    FILE *fp = NULL;
+    int ok = versions && offsets && blocks && sram_path(path, sizeof(path), key, "log") == 0;
+    int count = ok ? scan_log(key, image, versions, offsets, NULL) : -1;
+    ok = ok && n >= 1 && n <= count && (fp = fopen(path, "rb")) != NULL;
+
+    /* Each record holds what the one before it had in the blocks it changed */
+    for (int k = count - 1; ok && k >= n; k--) {
+        flashmd_sram_version_t v;
+        ok = fseek(fp, offsets[k], SEEK_SET) == 0 && read_record(fp, &v, blocks) == 0;
+        uint32_t j = 0;
+        for (uint32_t b = 0; ok && b < FLASHMD_SRAM_BLOCKS; b++) {
+            if (v.changed & (1u << b)) {
+                memcpy(image + b * FLASHMD_SRAM_BLOCK, blocks + FLASHMD_SRAM_BLOCK * j++, FLASHMD_SRAM_BLOCK);
+            }
+        }
+    }
+    ok = ok && flashmd_crc32(0, image, FLASHMD_SRAM_SIZE) == versions[n - 1].crc;
+
+    if (fp) fclose(fp);
+    free(versions);
+    free(offsets);
+    free(blocks);
+    return ok ? 0 : -1;
+}
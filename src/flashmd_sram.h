@@ -0,0 +1,44 @@
+/*
+ * FlashMD SRAM History
+ * Save versions per cart, kept in the cache directory: the latest image,
+ * and for each backup that changed it the 1K blocks it replaced. Earlier
+ * versions are rebuilt by putting those blocks back, newest first, so a
+ * nightly backup that changed nothing adds nothing.
+ *
+ * Internal to the core library; frontends take backups with
+ * flashmd_backup_sram and read old versions with flashmd_sram_history.
+ */
+
+#ifndef FLASHMD_SRAM_H
+#define FLASHMD_SRAM_H
+
+#include "flashmd_core.h"
+
+#define FLASHMD_SRAM_SIZE       (32 * 1024)
+#define FLASHMD_SRAM_BLOCK      1024
+#define FLASHMD_SRAM_BLOCKS     (FLASHMD_SRAM_SIZE / FLASHMD_SRAM_BLOCK)
+#define FLASHMD_SRAM_MAX_VERSIONS 4096
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t changed;               /* Blocks that differ from the version before (0 = first) */
+    uint32_t crc;                   /* CRC32 of the whole image */
+} flashmd_sram_version_t;
+
+/* The latest image stored for a cart. Returns 0 if there is one */
+int flashmd_sram_latest(const char *key, uint8_t *image);
+
+/* Record image as a cart's latest version; old is the latest stored
+ * before it, NULL for the first backup. Nothing is added when the two
+ * are the same. Past FLASHMD_SRAM_MAX_VERSIONS the oldest half of the
+ * history is dropped. Returns 0 on success */
+int flashmd_sram_commit(const char *key, const uint8_t *old, const uint8_t *image);
+
+/* A cart's versions, oldest first, up to max of them.
+ * Returns the number stored, -1 if there are none */
+int flashmd_sram_versions(const char *key, flashmd_sram_version_t *versions, int max);
+
+/* Rebuild version n (1 = oldest) of a cart's save. Returns 0 on success */
+int flashmd_sram_version(const char *key, int n, uint8_t *image);
+
+#endif /* FLASHMD_SRAM_H */